@@ -0,0 +1,92 @@
+#ifndef _LDD_LAYOUT_H
+#define _LDD_LAYOUT_H
+
+/*
+ * Print how a structure falls on cache lines, to catch false sharing.
+ *
+ * Every field in the table is tagged with the side that writes it, or
+ * LDD_RO when it is set up once and only read after that. A line that
+ * holds fields of different writers, or read-mostly fields next to
+ * written ones, ping-pongs between the cores running each side: those
+ * lines are printed with a '!' in front.
+ *
+ *	static const struct ldd_field foo_fields[] = {
+ *		LDD_FIELD(struct foo, size, LDD_RO),
+ *		LDD_FIELD(struct foo, head, LDD_PROD),
+ *		LDD_FIELD(struct foo, tail, LDD_CONS),
+ *	};
+ *	LDD_LAYOUT_SHOW(struct foo, foo_fields);
+ */
+
+#include <linux/kernel.h>
+#include <linux/stddef.h>
+#include <linux/cache.h>
+#include <linux/bitops.h>
+#include <linux/printk.h>
+#include <linux/string.h>
+
+enum ldd_role {
+	LDD_RO,		/* config: written at setup, read on every operation */
+	LDD_LOCK,	/* a lock, and what only its holders write */
+	LDD_PROD,	/* producer side: writers, transmit */
+	LDD_CONS,	/* consumer side: readers, receive, completion */
+	LDD_SHARED,	/* written by every side: counters, refcounts */
+	LDD_ROLES
+};
+
+struct ldd_field {
+	const char *name;
+	size_t offset, size;
+	enum ldd_role role;
+};
+
+#define LDD_FIELD(type, member, role)						\
+	{ #member, offsetof(type, member), sizeof_field(type, member), role }
+
+#define LDD_LAYOUT_SHOW(type, fields)						\
+	ldd_layout_show(#type, sizeof(type), fields, ARRAY_SIZE(fields))
+
+static inline void ldd_layout_show(const char *name, size_t size,
+		const struct ldd_field *f, int n)
+{
+	static const char * const roles[LDD_ROLES] = {
+		"ro", "lock", "prod", "cons", "shared"
+	};
+	size_t line, lines = DIV_ROUND_UP(size, SMP_CACHE_BYTES);
+	unsigned int mask;
+	int i, r;
+	char buf[32];
+
+	printk(KERN_INFO "%s: %zu bytes, %zu lines of %d\n", name, size, lines,
+			SMP_CACHE_BYTES);
+	for (line = 0; line < lines; line++) {
+		size_t lo = line * SMP_CACHE_BYTES, hi = lo + SMP_CACHE_BYTES;
+		size_t used = 0;
+
+		mask = 0;
+		for (i = 0; i < n; i++) {
+			size_t b = max(f[i].offset, lo);
+			size_t e = min(f[i].offset + f[i].size, hi);
+
+			if (b >= e)
+				continue;
+			used += e - b;
+			mask |= BIT(f[i].role);
+		}
+		buf[0] = '\0';
+		for (r = 0; r < LDD_ROLES; r++)
+			if (mask & BIT(r))
+				snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+						"%s%s", buf[0] ? "+" : "", roles[r]);
+		printk(KERN_INFO "%c line %2zu: %2zu/%d bytes  %s\n",
+				hweight32(mask) > 1 ? '!' : ' ', line,
+				min(used, (size_t)SMP_CACHE_BYTES), SMP_CACHE_BYTES,
+				buf[0] ? buf : "-");
+		for (i = 0; i < n; i++)
+			if (f[i].offset >= lo && f[i].offset < hi)
+				printk(KERN_INFO "    %-20s %5zu %5zu  %s\n", f[i].name,
+						f[i].offset, f[i].size, roles[f[i].role]);
+	}
+}
+
+#endif /* _LDD_LAYOUT_H */
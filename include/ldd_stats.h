@@ -0,0 +1,199 @@
+#ifndef _LDD_STATS_H
+#define _LDD_STATS_H
+
+/*
+ * Per-CPU counters and log2 latency histograms for the sample drivers,
+ * exported in debugfs as <driver>/stats, or <driver>/<device>/stats when
+ * each device keeps its own, so they can all be scraped the same way:
+ *
+ *	counter reads 1234
+ *	hist read_ns count 1234 sum 5678900
+ *	hist read_ns le 4095 1200
+ *	hist read_ns le 8191 34
+ *
+ * A counter or histogram is a slot in a per-CPU array, bumped with
+ * this_cpu ops: no lock, no shared cache line, interrupts and all.
+ * Bucket "le N" counts the samples from (N+1)/2 to N nanoseconds; empty
+ * ones are left out. Reading the file sums every CPU, so the numbers
+ * are a near-instant snapshot, not an atomic one.
+ *
+ * Built without LDD_STATS (STATS=n in the Makefile), every call below
+ * compiles to nothing, and so does the clock read of ldd_stats_now().
+ *
+ *	enum { FOO_READS, FOO_NCOUNTERS };
+ *	static const char * const foo_counters[] = { "reads" };
+ *	enum { FOO_READ_NS, FOO_NHISTS };
+ *	static const char * const foo_hists[] = { "read_ns" };
+ *
+ *	ldd_stats_init(&foo_stats, "foo", NULL, foo_counters, FOO_NCOUNTERS,
+ *			foo_hists, FOO_NHISTS);
+ *	...
+ *	u64 t = ldd_stats_now();
+ *	ldd_stats_inc(&foo_stats, FOO_READS);
+ *	...
+ *	ldd_stats_time(&foo_stats, FOO_READ_NS, t);
+ */
+
+#include <linux/types.h>
+#include <linux/errno.h>
+
+#define LDD_STATS_BUCKETS	40	/* up to 2^39 ns, about nine minutes */
+
+#ifdef LDD_STATS
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fs.h>
+#include <linux/string.h>
+
+struct ldd_stats {
+	u64 __percpu *pcpu;		/* counters, then each histogram */
+	const char * const *counters;
+	const char * const *hists;
+	int ncounters, nhists;
+	struct dentry *dir;		/* holds the "stats" file */
+};
+
+/* Per histogram: count, sum, then the buckets */
+#define LDD_STATS_HIST_SLOTS	(2 + LDD_STATS_BUCKETS)
+
+static inline u64 *ldd_stats_hist(struct ldd_stats *s, int cpu, int hist)
+{
+	return per_cpu_ptr(s->pcpu, cpu) + s->ncounters + hist * LDD_STATS_HIST_SLOTS;
+}
+
+static inline u64 ldd_stats_now(void)
+{
+	return ktime_get_ns();
+}
+
+static inline void ldd_stats_add(struct ldd_stats *s, int counter, u64 v)
+{
+	if (s->pcpu)
+		this_cpu_add(s->pcpu[counter], v);
+}
+
+static inline void ldd_stats_inc(struct ldd_stats *s, int counter)
+{
+	ldd_stats_add(s, counter, 1);
+}
+
+/* Record "ns" in histogram "hist": bucket fls64(ns), so 0 has its own */
+static inline void ldd_stats_record(struct ldd_stats *s, int hist, u64 ns)
+{
+	int i;
+
+	if (!s->pcpu)
+		return;
+	i = s->ncounters + hist * LDD_STATS_HIST_SLOTS;
+	this_cpu_inc(s->pcpu[i]);
+	this_cpu_add(s->pcpu[i + 1], ns);
+	this_cpu_inc(s->pcpu[i + 2 + min(fls64(ns), LDD_STATS_BUCKETS - 1)]);
+}
+
+/* Record the time since "start", a value of ldd_stats_now() */
+static inline void ldd_stats_time(struct ldd_stats *s, int hist, u64 start)
+{
+	ldd_stats_record(s, hist, ktime_get_ns() - start);
+}
+
+static inline int ldd_stats_show(struct seq_file *m, void *v)
+{
+	struct ldd_stats *s = m->private;
+	u64 sum[LDD_STATS_HIST_SLOTS];
+	int i, j, cpu;
+
+	for (i = 0; i < s->ncounters; i++) {
+		u64 c = 0;
+
+		for_each_possible_cpu(cpu)
+			c += *(per_cpu_ptr(s->pcpu, cpu) + i);
+		seq_printf(m, "counter %s %llu\n", s->counters[i], c);
+	}
+	for (i = 0; i < s->nhists; i++) {
+		memset(sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			u64 *h = ldd_stats_hist(s, cpu, i);
+
+			for (j = 0; j < LDD_STATS_HIST_SLOTS; j++)
+				sum[j] += h[j];
+		}
+		seq_printf(m, "hist %s count %llu sum %llu\n", s->hists[i],
+				sum[0], sum[1]);
+		for (j = 0; j < LDD_STATS_BUCKETS; j++)
+			if (sum[2 + j])
+				seq_printf(m, "hist %s le %llu %llu\n", s->hists[i],
+						j == LDD_STATS_BUCKETS - 1 ? U64_MAX :
+						(1ULL << j) - 1, sum[2 + j]);
+	}
+	return 0;
+}
+
+static inline int ldd_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ldd_stats_show, inode->i_private);
+}
+
+static const struct file_operations ldd_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ldd_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Allocate the per-CPU slots and create <name>/stats under "parent", the
+ * top of debugfs if NULL. The name tables must outlive the stats. If
+ * this fails, the driver runs uncounted.
+ */
+static inline int ldd_stats_init(struct ldd_stats *s, const char *name,
+		struct dentry *parent, const char * const *counters, int ncounters,
+		const char * const *hists, int nhists)
+{
+	s->counters = counters;
+	s->ncounters = ncounters;
+	s->hists = hists;
+	s->nhists = nhists;
+	s->dir = NULL;
+	s->pcpu = __alloc_percpu((ncounters + nhists * LDD_STATS_HIST_SLOTS) *
+			sizeof(u64), sizeof(u64));
+	if (!s->pcpu)
+		return -ENOMEM;
+	s->dir = debugfs_create_dir(name, parent);
+	debugfs_create_file("stats", 0444, s->dir, s, &ldd_stats_fops);
+	return 0;
+}
+
+static inline void ldd_stats_exit(struct ldd_stats *s)
+{
+	debugfs_remove_recursive(s->dir);
+	free_percpu(s->pcpu);
+	s->pcpu = NULL;
+}
+
+#else /* LDD_STATS */
+
+struct dentry;
+struct ldd_stats { };
+
+static inline u64 ldd_stats_now(void) { return 0; }
+static inline void ldd_stats_add(struct ldd_stats *s, int counter, u64 v) { }
+static inline void ldd_stats_inc(struct ldd_stats *s, int counter) { }
+static inline void ldd_stats_record(struct ldd_stats *s, int hist, u64 ns) { }
+static inline void ldd_stats_time(struct ldd_stats *s, int hist, u64 start) { }
+static inline int ldd_stats_init(struct ldd_stats *s, const char *name,
+		struct dentry *parent, const char * const *counters, int ncounters,
+		const char * const *hists, int nhists)
+{
+	return 0;
+}
+static inline void ldd_stats_exit(struct ldd_stats *s) { }
+
+#endif /* LDD_STATS */
+
+#endif /* _LDD_STATS_H */
@@ -8,6 +8,18 @@
 extern struct bus_type ldd_bus_type;
 
 
+#define LDD_NAME_SIZE 20
+
+/**
+ * What a driver binds to: devices whose name, less the instance
+ * number at the end ("sculld" for "sculld3"), is "name".
+*/
+
+struct ldd_device_id {
+    char name[LDD_NAME_SIZE];
+    unsigned long driver_data;
+};
+
 /**
  * The LDD driver type.
 */
@@ -15,11 +27,12 @@ extern struct bus_type ldd_bus_type;
 struct ldd_driver {
     char *version;
     struct module *module;
+    const struct ldd_device_id *id_table; /* NULL: match driver.name */
     struct device_driver driver;
     struct driver_attribute version_attr;
 };
 
-#define to_ldd_driver(drv) container_of(drv, struct ldd_driver, driver);
+#define to_ldd_driver(drv) container_of(drv, struct ldd_driver, driver)
 
 /**
  * A device type for things "plugged" into the LDD bus
@@ -28,13 +41,19 @@ struct ldd_driver {
 struct  ldd_device {
     char *name;
     struct ldd_driver *driver;
+    const struct ldd_device_id *id;     /* matched, NULL without a table */
+    unsigned int id_len;                /* of the name less the instance */
+    u32 id_hash;                        /* and its hash */
     struct device dev;
 };
 
-#define to_ladd_device(dev) container_of(dev, struct ldd_device, dev);
+#define to_ldd_device(dev) container_of(dev, struct ldd_device, dev)
+#define to_ladd_device(dev) to_ldd_device(dev)
 
 extern int register_ldd_device(struct ldd_device *);
 extern void unregister_ldd_device(struct ldd_device *);
+extern int register_ldd_devices(struct ldd_device **, int);
+extern void unregister_ldd_devices(struct ldd_device **, int);
 extern int register_ldd_driver(struct ldd_driver *);
 extern void unregister_ldd_driver(struct ldd_driver *);
 
@@ -0,0 +1,24 @@
+#ifndef _VM_FLAGS_VERSION_H
+#define _VM_FLAGS_VERSION_H
+
+#include <linux/version.h>
+#include <linux/mm.h>
+
+/* From 6.3 vma->vm_flags is read-only, and changed through helpers */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+#define vm_flags_set_wrapper(vma, flags)	((vma)->vm_flags |= (flags))
+#define vm_flags_clear_wrapper(vma, flags)	((vma)->vm_flags &= ~(flags))
+#else
+#define vm_flags_set_wrapper(vma, flags)	vm_flags_set(vma, flags)
+#define vm_flags_clear_wrapper(vma, flags)	vm_flags_clear(vma, flags)
+#endif
+
+/* is_cow_mapping() moved to mm.h in 5.9 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+#define is_cow_mapping_wrapper(flags) \
+	(((flags) & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE)
+#else
+#define is_cow_mapping_wrapper(flags)	is_cow_mapping(flags)
+#endif
+
+#endif /* _VM_FLAGS_VERSION_H */
@@ -21,6 +21,12 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/stringhash.h>
 
 #include "lddbus.h"
 
@@ -40,11 +46,84 @@ static int ldd_uevent(struct device *dev, struct kobj_uevent_env *env)
 }
 
 /*
- * Match LDD device to drivers, Just do a simple name test
+ * Every name a driver answers to goes into this table when the driver
+ * registers, with its hash; a device's name is hashed once, when it
+ * registers.  Matching a pair is then a hash lookup, with a string
+ * compare only for a name that really is in the bucket.
+ */
+struct ldd_id_entry {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	u32 hash;
+	const char *name;
+	struct ldd_driver *driver;
+	const struct ldd_device_id *id;
+};
+
+#define LDD_ID_HASH_BITS 8
+static DEFINE_HASHTABLE(ldd_ids, LDD_ID_HASH_BITS);
+static DEFINE_MUTEX(ldd_ids_mutex); /* for changes; lookups use RCU */
+
+static u32 ldd_name_hash(const char *name, unsigned int len)
+{
+	return full_name_hash(NULL, name, len);
+}
+
+static int ldd_add_id(struct ldd_driver *driver, const char *name,
+		const struct ldd_device_id *id)
+{
+	struct ldd_id_entry *e = kmalloc(sizeof(*e), GFP_KERNEL);
+
+	if (!e)
+		return -ENOMEM;
+	e->name = name;
+	e->driver = driver;
+	e->id = id;
+	e->hash = ldd_name_hash(name, strlen(name));
+	mutex_lock(&ldd_ids_mutex);
+	hash_add_rcu(ldd_ids, &e->node, e->hash);
+	mutex_unlock(&ldd_ids_mutex);
+	return 0;
+}
+
+static void ldd_del_ids(struct ldd_driver *driver)
+{
+	struct ldd_id_entry *e;
+	struct hlist_node *tmp;
+	int bkt;
+
+	mutex_lock(&ldd_ids_mutex);
+	hash_for_each_safe(ldd_ids, bkt, tmp, e, node) {
+		if (e->driver != driver)
+			continue;
+		hash_del_rcu(&e->node);
+		kfree_rcu(e, rcu);
+	}
+	mutex_unlock(&ldd_ids_mutex);
+}
+
+/*
+ * Match LDD device to drivers, by their names less the instance number
 */
 static int ldd_match(struct device *dev, struct device_driver *driver)
 {
-	return !strncmp(dev_name(dev), driver->name, strlen(driver->name));
+	struct ldd_device *ldddev = to_ldd_device(dev);
+	struct ldd_driver *ldriver = to_ldd_driver(driver);
+	struct ldd_id_entry *e;
+	int found = 0;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(ldd_ids, e, node, ldddev->id_hash) {
+		if (e->driver != ldriver || e->hash != ldddev->id_hash ||
+				strncmp(e->name, ldddev->name, ldddev->id_len) ||
+				e->name[ldddev->id_len])
+			continue;
+		ldddev->id = e->id;
+		found = 1;
+		break;
+	}
+	rcu_read_unlock();
+	return found;
 }
 
 /*
@@ -85,12 +164,26 @@ static BUS_ATTR_RO(version);
 static void ldd_dev_release(struct device *dev)
 { }
 
-int register_ldd_device(struct ldd_device *ldddev)
+static void ldd_device_setup(struct ldd_device *ldddev)
 {
+	unsigned int len = strlen(ldddev->name);
+
+	/* what we match on: the name up to the instance number */
+	while (len && isdigit(ldddev->name[len - 1]))
+		len--;
+	ldddev->id_len = len;
+	ldddev->id_hash = ldd_name_hash(ldddev->name, len);
+	ldddev->id = NULL;
+
 	ldddev->dev.bus = &ldd_bus_type;
 	ldddev->dev.parent = &ldd_bus;
 	ldddev->dev.release = ldd_dev_release;
 	dev_set_name(&ldddev->dev, ldddev->name);
+}
+
+int register_ldd_device(struct ldd_device *ldddev)
+{
+	ldd_device_setup(ldddev);
 	return device_register(&ldddev->dev);
 }
 EXPORT_SYMBOL(register_ldd_device);
@@ -101,6 +194,44 @@ void unregister_ldd_device(struct ldd_device *ldddev)
 }
 EXPORT_SYMBOL(unregister_ldd_device);
 
+/*
+ * Register "count" devices at once.  Their "add" uevents are held back
+ * until all of them are in, so udev sees one burst at the end rather
+ * than being woken for each device in turn; attributes should be in
+ * dev.groups, so that they exist by then.  On failure, none of the
+ * devices is left registered.
+ */
+int register_ldd_devices(struct ldd_device **ldddevs, int count)
+{
+	int i, ret;
+
+	for (i = 0; i < count; i++) {
+		ldd_device_setup(ldddevs[i]);
+		dev_set_uevent_suppress(&ldddevs[i]->dev, 1);
+		ret = device_register(&ldddevs[i]->dev);
+		if (ret) {
+			put_device(&ldddevs[i]->dev);
+			while (i--)
+				device_unregister(&ldddevs[i]->dev);
+			return ret;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		dev_set_uevent_suppress(&ldddevs[i]->dev, 0);
+		kobject_uevent(&ldddevs[i]->dev.kobj, KOBJ_ADD);
+	}
+	return 0;
+}
+EXPORT_SYMBOL(register_ldd_devices);
+
+void unregister_ldd_devices(struct ldd_device **ldddevs, int count)
+{
+	while (count--)
+		device_unregister(&ldddevs[count]->dev);
+}
+EXPORT_SYMBOL(unregister_ldd_devices);
+
 /*
  * Crude driver interface.
 */
@@ -114,12 +245,27 @@ static ssize_t show_version(struct device_driver *driver, char *buf)
 
 int register_ldd_driver(struct ldd_driver *driver)
 {
-	int ret;
+	const struct ldd_device_id *id;
+	int ret = 0;
 
 	driver->driver.bus = &ldd_bus_type;
-	ret = driver_register(&driver->driver);
-	if (ret)
+	/* our devices don't depend on each other, so let them probe in parallel */
+	if (driver->driver.probe_type == PROBE_DEFAULT_STRATEGY)
+		driver->driver.probe_type = PROBE_PREFER_ASYNCHRONOUS;
+
+	/* the names must be in the table before driver_register() matches */
+	if (driver->id_table) {
+		for (id = driver->id_table; id->name[0] && !ret; id++)
+			ret = ldd_add_id(driver, id->name, id);
+	} else {
+		ret = ldd_add_id(driver, driver->driver.name, NULL);
+	}
+	if (!ret)
+		ret = driver_register(&driver->driver);
+	if (ret) {
+		ldd_del_ids(driver);
 		return ret;
+	}
 
 	driver->version_attr.attr.name = "version";
 	driver->version_attr.attr.mode = S_IRUGO;
@@ -131,6 +277,7 @@ int register_ldd_driver(struct ldd_driver *driver)
 void unregister_ldd_driver(struct ldd_driver *driver)
 {
 	driver_unregister(&driver->driver);
+	ldd_del_ids(driver);
 }
 EXPORT_SYMBOL(register_ldd_driver);
 EXPORT_SYMBOL(unregister_ldd_driver);
@@ -165,6 +312,7 @@ static void ldd_bus_exit(void)
 {
 	device_unregister(&ldd_bus);
 	bus_unregister(&ldd_bus_type);
+	rcu_barrier(); /* for the last kfree_rcu() of an id */
 }
 
 module_init(ldd_bus_init);
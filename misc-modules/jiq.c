@@ -28,8 +28,15 @@
 #include <linux/workqueue.h>
 #include <linux/preempt.h>
 #include <linux/interrupt.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/slab.h>
+#include <linux/sched/signal.h>
 
 #include "proc_ops_version.h"
+#include "lathist.h"
 MODULE_LICENSE("Dual BSD/GPL");
 
 /*
@@ -257,6 +264,272 @@ static const struct file_operations jiq_read_run_timer_fops = {
     .release    = single_release,
 };
 
+/*
+ * /proc/jiqbench: how long each way of deferring work takes to get
+ * going.  Each mechanism first runs a request "bench_samples" times, one
+ * at a time, measuring enqueue-to-execution latency; then a request
+ * that requeues itself "bench_chain" times, for throughput.  All of it
+ * with "bench_load" CPU hogs running, to see who keeps up under load.
+ * The threaded irq is modelled by a SCHED_FIFO thread that gets woken,
+ * as the irq core does for one: we have no interrupt of our own.
+ */
+static int bench_samples = 10000;
+module_param(bench_samples, int, 0);
+static int bench_chain = 100000;
+module_param(bench_chain, int, 0);
+static int bench_load = 0;
+module_param(bench_load, int, 0);
+
+static struct workqueue_struct *jiq_cpu_wq;     /* WQ_CPU_INTENSIVE */
+static struct workqueue_struct *jiq_percpu_wq;  /* our own, bound */
+
+struct jiq_mech;
+
+struct jiq_item {
+    const struct jiq_mech *mech;
+    struct work_struct work;
+    struct tasklet_struct tlet;
+    struct hrtimer timer;
+    struct task_struct *thread;
+    int pending;                /* for the thread */
+    int cpu;                    /* for queue_work_on() */
+    u64 queued;                 /* ns, when last enqueued */
+    int chain;                  /* requeues left; 0 when measuring latency */
+    struct completion done;
+    struct lathist hist;
+};
+
+struct jiq_mech {
+    const char *name;
+    struct workqueue_struct **wq;
+    void (*queue)(struct jiq_item *it);
+};
+
+/* Whatever ran it, the request ends up here */
+static void jiq_item_ran(struct jiq_item *it)
+{
+    u64 now = ktime_get_ns();
+
+    if (!it->chain) {
+        lathist_add(&it->hist, now - it->queued);
+        complete(&it->done);
+    } else if (--it->chain) {
+        it->queued = now;
+        it->mech->queue(it);
+    } else {
+        complete(&it->done);
+    }
+}
+
+static void jiq_item_work(struct work_struct *work)
+{
+    jiq_item_ran(container_of(work, struct jiq_item, work));
+}
+
+static void jiq_item_tasklet(unsigned long ptr)
+{
+    jiq_item_ran((struct jiq_item *)ptr);
+}
+
+static enum hrtimer_restart jiq_item_timer(struct hrtimer *t)
+{
+    jiq_item_ran(container_of(t, struct jiq_item, timer));
+    return HRTIMER_NORESTART;
+}
+
+static int jiq_item_thread(void *arg)
+{
+    struct jiq_item *it = arg;
+
+    sched_set_fifo(current); /* what irq threads get */
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (xchg(&it->pending, 0)) {
+            __set_current_state(TASK_RUNNING);
+            jiq_item_ran(it);
+            continue;
+        }
+        if (kthread_should_stop())
+            break;
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+static void jiq_queue_wq(struct jiq_item *it)
+{
+    queue_work(*it->mech->wq, &it->work);
+}
+
+static void jiq_queue_on(struct jiq_item *it)
+{
+    queue_work_on(it->cpu, *it->mech->wq, &it->work);
+}
+
+static void jiq_queue_tasklet(struct jiq_item *it)
+{
+    tasklet_schedule(&it->tlet);
+}
+
+static void jiq_queue_tasklet_hi(struct jiq_item *it)
+{
+    tasklet_hi_schedule(&it->tlet);
+}
+
+static void jiq_queue_thread(struct jiq_item *it)
+{
+    WRITE_ONCE(it->pending, 1);
+    wake_up_process(it->thread);
+}
+
+static void jiq_queue_hrtimer(struct jiq_item *it)
+{
+    hrtimer_start(&it->timer, 0, HRTIMER_MODE_REL_HARD);
+}
+
+static const struct jiq_mech jiq_mechs[] = {
+    { "system_wq",  &system_wq,             jiq_queue_wq },
+    { "highpri_wq", &system_highpri_wq,     jiq_queue_wq },
+    { "unbound_wq", &system_unbound_wq,     jiq_queue_wq },
+    { "cpu_int_wq", &jiq_cpu_wq,            jiq_queue_wq },
+    { "percpu_wq",  &jiq_percpu_wq,         jiq_queue_on },
+    { "tasklet",    NULL,                   jiq_queue_tasklet },
+    { "tasklet_hi", NULL,                   jiq_queue_tasklet_hi },
+    { "irq_thread", NULL,                   jiq_queue_thread },
+    { "hrtimer",    NULL,                   jiq_queue_hrtimer },
+};
+#define JIQ_NR_MECHS ARRAY_SIZE(jiq_mechs)
+
+static int jiq_hog(void *arg)
+{
+    while (!kthread_should_stop()) {
+        u64 end = ktime_get_ns() + NSEC_PER_MSEC;
+
+        while (ktime_get_ns() < end)
+            cpu_relax();
+        cond_resched();
+    }
+    return 0;
+}
+
+/*
+ * One mechanism, both passes.  Returns the runs per second of the
+ * throughput pass, or a negative error if a signal came first.
+ */
+static long jiq_bench_one(struct jiq_item *it)
+{
+    u64 t0;
+    int i;
+
+    /* latency: one at a time, waiting for each */
+    for (i = 0; i < bench_samples; i++) {
+        reinit_completion(&it->done);
+        it->chain = 0;
+        it->queued = ktime_get_ns();
+        it->mech->queue(it);
+        wait_for_completion(&it->done);
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+    }
+
+    /* throughput: it requeues itself as soon as it runs */
+    if (bench_chain <= 0)
+        return 0;
+    reinit_completion(&it->done);
+    it->chain = bench_chain;
+    t0 = it->queued = ktime_get_ns();
+    it->mech->queue(it);
+    wait_for_completion(&it->done);
+    return div64_u64((u64)bench_chain * NSEC_PER_SEC, max_t(u64, ktime_get_ns() - t0, 1));
+}
+
+static int jiq_bench_show(struct seq_file *m, void *v)
+{
+    struct task_struct **hogs;
+    struct jiq_item *items;
+    long rate[JIQ_NR_MECHS];
+    int i, ret = 0;
+
+    items = kcalloc(JIQ_NR_MECHS, sizeof(*items), GFP_KERNEL);
+    hogs = kcalloc(max(bench_load, 1), sizeof(*hogs), GFP_KERNEL);
+    if (!items || !hogs) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < bench_load; i++) {
+        hogs[i] = kthread_run(jiq_hog, NULL, "jiqhog/%i", i);
+        if (IS_ERR(hogs[i])) {
+            hogs[i] = NULL;
+            break;
+        }
+    }
+
+    for (i = 0; i < JIQ_NR_MECHS && !ret; i++) {
+        struct jiq_item *it = items + i;
+
+        it->mech = jiq_mechs + i;
+        it->cpu = raw_smp_processor_id();
+        init_completion(&it->done);
+        lathist_init(&it->hist);
+        INIT_WORK(&it->work, jiq_item_work);
+        tasklet_init(&it->tlet, jiq_item_tasklet, (unsigned long)it);
+        hrtimer_init(&it->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+        it->timer.function = jiq_item_timer;
+        if (it->mech->queue == jiq_queue_thread) {
+            it->thread = kthread_run(jiq_item_thread, it, "jiqirq");
+            if (IS_ERR(it->thread)) {
+                ret = PTR_ERR(it->thread);
+                it->thread = NULL;
+                break;
+            }
+        }
+
+        rate[i] = jiq_bench_one(it);
+        if (rate[i] < 0)
+            ret = rate[i];
+
+        /* nothing may be left running on it */
+        cancel_work_sync(&it->work);
+        tasklet_kill(&it->tlet);
+        hrtimer_cancel(&it->timer);
+        if (it->thread)
+            kthread_stop(it->thread);
+    }
+
+    for (i = 0; i < bench_load; i++)
+        if (hogs[i])
+            kthread_stop(hogs[i]);
+    if (ret)
+        goto out;
+
+    seq_printf(m, "%i samples and a chain of %i, %i hogs; latency in ns\n",
+            bench_samples, bench_chain, bench_load);
+    seq_printf(m, LATHIST_HEADER);
+    for (i = 0; i < JIQ_NR_MECHS; i++)
+        lathist_show(m, jiq_mechs[i].name, &items[i].hist);
+    seq_printf(m, "\n%-12s %9s\n", "", "runs/s");
+    for (i = 0; i < JIQ_NR_MECHS; i++)
+        seq_printf(m, "%-12s %9li\n", jiq_mechs[i].name, rate[i]);
+
+out:
+    kfree(hogs);
+    kfree(items);
+    return ret;
+}
+
+static int jiq_bench_open(struct inode *node, struct file *file)
+{
+    return single_open_size(file, jiq_bench_show, NULL, 2 * PAGE_SIZE);
+}
+
+static const struct file_operations jiq_bench_fops = {
+    .open       = jiq_bench_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
 /*
  * the init/clean material
  */
@@ -277,6 +550,14 @@ static int jiq_init(void)
     proc_create("jiqtasklet", 0, NULL,
         proc_ops_wrapper(&jiq_read_tasklet_fops, jiq_read_tasklet_pops));
 
+    jiq_cpu_wq = alloc_workqueue("jiq_cpu", WQ_CPU_INTENSIVE, 0);
+    jiq_percpu_wq = alloc_workqueue("jiq_percpu", 0, 0);
+    if (jiq_cpu_wq && jiq_percpu_wq)
+        proc_create("jiqbench", 0400, NULL,
+            proc_ops_wrapper(&jiq_bench_fops, jiq_bench_pops));
+    else
+        printk(KERN_NOTICE "jiq: no workqueues, no /proc/jiqbench\n");
+
     return 0;
 }
 
@@ -286,6 +567,11 @@ static void jiq_cleanup(void)
     remove_proc_entry("jiqwqdelay", NULL);
     remove_proc_entry("jitimer", NULL);
     remove_proc_entry("jiqtasklet", NULL);
+    remove_proc_entry("jiqbench", NULL);
+    if (jiq_cpu_wq)
+        destroy_workqueue(jiq_cpu_wq);
+    if (jiq_percpu_wq)
+        destroy_workqueue(jiq_percpu_wq);
 }
 
 module_init(jiq_init);
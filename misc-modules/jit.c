@@ -30,10 +30,17 @@
 #include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
 
 #include <asm/hardirq.h>
 
 #include "proc_ops_version.h"
+#include "lathist.h"
 /*
  * This module is a silly one: it only embeds short code fragments
  * that show how time delays can be handled in the kernel.
@@ -309,6 +316,172 @@ static const struct file_operations jit_tasklet_fops = {
 	.release	= single_release,
 };
 
+/*
+ * The high resolution examples: on every online CPU, something is due
+ * every "hrdelay" microseconds, "hrloops" times, and we record how late
+ * it really came, in ns.  /proc/jithrtimer measures hrtimer callbacks,
+ * in hard interrupt context; /proc/jitnsleep a SCHED_FIFO thread that
+ * sleeps until an absolute time and checks ktime_get_ns() on waking,
+ * like cyclictest does.  Both print a latency distribution per CPU.
+ */
+int hrdelay = 1000;
+module_param(hrdelay, int, 0);
+int hrloops = 1000;
+module_param(hrloops, int, 0);
+
+struct jit_hr_data {
+    struct hrtimer timer;
+    struct task_struct *thread;
+    struct completion done;
+    ktime_t interval;
+    int loops;
+    int stop;
+    struct lathist hist;
+};
+
+enum hrtimer_restart jit_hrtimer_fn(struct hrtimer *t)
+{
+    struct jit_hr_data *data = container_of(t, struct jit_hr_data, timer);
+    ktime_t now = ktime_get();
+
+    lathist_add(&data->hist, ktime_to_ns(ktime_sub(now, hrtimer_get_expires(t))));
+    if (--data->loops > 0 && !READ_ONCE(data->stop)) {
+        hrtimer_forward(t, now, data->interval);
+        return HRTIMER_RESTART;
+    }
+    complete(&data->done);
+    return HRTIMER_NORESTART;
+}
+
+/* Runs on the CPU to measure, so that the timer stays there */
+static void jit_hrtimer_start(void *arg)
+{
+    struct jit_hr_data *data = arg;
+
+    hrtimer_start(&data->timer, ktime_add(ktime_get(), data->interval),
+            HRTIMER_MODE_ABS_PINNED_HARD);
+}
+
+int jit_nsleep_fn(void *arg)
+{
+    struct jit_hr_data *data = arg;
+    ktime_t next = ktime_get();
+
+    sched_set_fifo(current);
+    while (data->loops-- > 0 && !READ_ONCE(data->stop)) {
+        next = ktime_add(next, data->interval);
+        set_current_state(TASK_UNINTERRUPTIBLE);
+        schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+        lathist_add(&data->hist, ktime_get_ns() - ktime_to_ns(next));
+    }
+    complete(&data->done);
+    return 0;
+}
+
+/* the /proc function: one measurement per CPU, all at once */
+int jit_hr_show(struct seq_file *m, void *v)
+{
+    struct jit_hr_data **data, *all;
+    long sleeper = (long)m->private;
+    char label[16];
+    int cpu, ret = 0;
+
+    data = kcalloc(nr_cpu_ids, sizeof(*data), GFP_KERNEL);
+    all = kmalloc(sizeof(*all), GFP_KERNEL);
+    if (!data || !all) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    cpus_read_lock();
+    for_each_online_cpu(cpu) {
+        struct jit_hr_data *d = kzalloc_node(sizeof(*d), GFP_KERNEL, cpu_to_node(cpu));
+
+        if (!d)
+            break;
+        data[cpu] = d;
+        init_completion(&d->done);
+        d->interval = us_to_ktime(hrdelay);
+        d->loops = hrloops;
+        lathist_init(&d->hist);
+        if (sleeper) {
+            d->thread = kthread_create_on_node(jit_nsleep_fn, d, cpu_to_node(cpu),
+                    "jitnsleep/%i", cpu);
+            if (IS_ERR(d->thread)) {
+                data[cpu] = NULL;
+                kfree(d);
+                break;
+            }
+            kthread_bind(d->thread, cpu);
+            wake_up_process(d->thread);
+        } else {
+            hrtimer_init(&d->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED_HARD);
+            d->timer.function = jit_hrtimer_fn;
+            smp_call_function_single(cpu, jit_hrtimer_start, d, 1);
+        }
+    }
+    cpus_read_unlock();
+
+    /* wait for them all; on a signal, stop them and wait anyway */
+    for_each_possible_cpu(cpu) {
+        if (!data[cpu])
+            continue;
+        if (wait_for_completion_interruptible(&data[cpu]->done)) {
+            ret = -ERESTARTSYS;
+            for_each_possible_cpu(cpu)
+                if (data[cpu])
+                    WRITE_ONCE(data[cpu]->stop, 1);
+            break;
+        }
+    }
+    for_each_possible_cpu(cpu) {
+        if (!data[cpu])
+            continue;
+        /* a timer cancelled early never completes, but is done with */
+        if (sleeper)
+            wait_for_completion(&data[cpu]->done);
+        else
+            hrtimer_cancel(&data[cpu]->timer);
+    }
+    if (ret)
+        goto out;
+
+    seq_printf(m, "%s every %ius, %i times; latency in ns\n",
+            sleeper ? "sleeper" : "hrtimer", hrdelay, hrloops);
+    seq_printf(m, LATHIST_HEADER);
+    lathist_init(&all->hist);
+    for_each_possible_cpu(cpu) {
+        if (!data[cpu])
+            continue;
+        snprintf(label, sizeof(label), "cpu%i", cpu);
+        lathist_show(m, label, &data[cpu]->hist);
+        lathist_merge(&all->hist, &data[cpu]->hist);
+    }
+    lathist_show(m, "all", &all->hist);
+
+out:
+    if (data)
+        for_each_possible_cpu(cpu)
+            kfree(data[cpu]);
+    kfree(data);
+    kfree(all);
+    return ret;
+}
+
+static int jit_hr_open(struct inode *node, struct file *file)
+{
+    /* room enough for one go: seq_read would run us again to grow it */
+    return single_open_size(file, jit_hr_show, PDE_DATA(node),
+            (num_possible_cpus() + 3) * 96);
+}
+
+static const struct file_operations jit_hr_fops = {
+    .open		= jit_hr_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 
 int __init jit_init(void)
 {
@@ -330,6 +503,11 @@ int __init jit_init(void)
     proc_create_data("jitasklethi", 0, NULL,
         proc_ops_wrapper(&jit_tasklet_fops, jit_tasklet_pops), (void *)1);
 
+    proc_create_data("jithrtimer", 0, NULL,
+        proc_ops_wrapper(&jit_hr_fops, jit_hr_pops), NULL);
+    proc_create_data("jitnsleep", 0, NULL,
+        proc_ops_wrapper(&jit_hr_fops, jit_hr_pops), (void *)1);
+
     return 0;
 }
 
@@ -344,6 +522,8 @@ void __exit jit_cleanup(void)
 	remove_proc_entry("jitimer", NULL);
 	remove_proc_entry("jitasklet", NULL);
 	remove_proc_entry("jitasklethi", NULL);
+	remove_proc_entry("jithrtimer", NULL);
+	remove_proc_entry("jitnsleep", NULL);
 }
 
 module_init(jit_init);
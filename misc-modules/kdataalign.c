@@ -19,6 +19,13 @@
 #include <linux/types.h>
 #include <linux/utsname.h>
 #include <linux/errno.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+#include <linux/xarray.h>
+#include <linux/atomic.h>
+
+#include "ldd_layout.h"
+#include "../scull/scull.h"
 
 /*
  * Define several data structures, all of them start with a lone char
@@ -35,6 +42,27 @@ struct u2b {char c;  __u16     t;} u2b;
 struct u4b {char c;  __u32     t;} u4b;
 struct u8b {char c;  __u64     t;} u8b;
 
+/*
+ * Then see where the fields of a real device structure land: who
+ * writes each of them, and which cache lines end up shared.
+ */
+static const struct ldd_field scull_dev_fields[] = {
+	LDD_FIELD(struct scull_dev, quantum,      LDD_RO),
+	LDD_FIELD(struct scull_dev, qset,         LDD_RO),
+	LDD_FIELD(struct scull_dev, indexed,      LDD_RO),
+	LDD_FIELD(struct scull_dev, access_key,   LDD_RO),
+	LDD_FIELD(struct scull_dev, rwsem,        LDD_LOCK),
+	LDD_FIELD(struct scull_dev, data,         LDD_PROD),
+	LDD_FIELD(struct scull_dev, index,        LDD_PROD),
+	LDD_FIELD(struct scull_dev, size,         LDD_PROD),
+	LDD_FIELD(struct scull_dev, stats.quanta, LDD_PROD),
+	LDD_FIELD(struct scull_dev, stats.wbytes, LDD_PROD),
+	LDD_FIELD(struct scull_dev, stats.wwait,  LDD_PROD),
+	LDD_FIELD(struct scull_dev, stats.rbytes, LDD_CONS),
+	LDD_FIELD(struct scull_dev, stats.rwait,  LDD_CONS),
+	LDD_FIELD(struct scull_dev, cdev,         LDD_SHARED),
+};
+
 static void data_cleanup(void)
 {
 	/* never called */
@@ -59,6 +87,7 @@ static int data_init(void)
 		(int)((void *)(&u2b.t) - (void *)&u2b),
 		(int)((void *)(&u4b.t) - (void *)&u4b),
 		(int)((void *)(&u8b.t) - (void *)&u8b));
+	LDD_LAYOUT_SHOW(struct scull_dev, scull_dev_fields);
 	return -ENODEV;
 }
 
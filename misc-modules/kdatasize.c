@@ -19,12 +19,53 @@
 #include <linux/types.h>
 #include <linux/utsname.h>
 #include <linux/errno.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/cdev.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/skbuff.h>
+
+/* What driver structures are built from, and how many lines each takes */
+#define KDATA_TYPE(t) { #t, sizeof(t) }
+static const struct {
+    const char *name;
+    size_t size;
+} kdata_types[] = {
+    KDATA_TYPE(spinlock_t),
+    KDATA_TYPE(struct mutex),
+    KDATA_TYPE(struct rw_semaphore),
+    KDATA_TYPE(wait_queue_head_t),
+    KDATA_TYPE(struct cdev),
+    KDATA_TYPE(struct timer_list),
+    KDATA_TYPE(struct hrtimer),
+    KDATA_TYPE(struct work_struct),
+    KDATA_TYPE(struct xarray),
+    KDATA_TYPE(struct sk_buff_head),
+};
 
 static void data_cleanup(void)
 {
     /* empty never called */
 }
 
+static void kdata_lines(void)
+{
+    int i;
+
+    printk(KERN_INFO "cache line: L1 %i, SMP %i\n", L1_CACHE_BYTES,
+	    SMP_CACHE_BYTES);
+    for (i = 0; i < ARRAY_SIZE(kdata_types); i++)
+	printk(KERN_INFO "  %-22s %5zu bytes %3zu lines\n", kdata_types[i].name,
+		kdata_types[i].size,
+		DIV_ROUND_UP(kdata_types[i].size, SMP_CACHE_BYTES));
+}
+
 int data_init(void)
 {
     printk(KERN_INFO "arch   Size:  char  short  int  long   ptr long-long "
@@ -36,6 +77,7 @@ int data_init(void)
 	    (int)sizeof(long),
 	    (int)sizeof(void *), (int)sizeof(long long), (int)sizeof(__u8),
 	    (int)sizeof(__u16), (int)sizeof(__u32), (int)sizeof(__u64));
+    kdata_lines();
     return -ENODEV;
 }
 
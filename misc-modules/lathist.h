@@ -0,0 +1,127 @@
+/*
+ * lathist.h -- latency histograms for the jit and jiq modules
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef _LATHIST_H_
+#define _LATHIST_H_
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/limits.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+
+/*
+ * Log-linear buckets: values below 2^LATHIST_SUB_BITS get one bucket
+ * each, and every power of two above that is split in 2^LATHIST_SUB_BITS,
+ * so a percentile is good to about 6%.  Values are nanoseconds, and
+ * anything over 2^40 (18 minutes) lands in the last bucket.
+ */
+#define LATHIST_SUB_BITS    4
+#define LATHIST_MAX_BITS    40
+#define LATHIST_BUCKETS     ((LATHIST_MAX_BITS - LATHIST_SUB_BITS + 1) << LATHIST_SUB_BITS)
+
+struct lathist {
+    u64 count, sum, min, max;
+    u32 bucket[LATHIST_BUCKETS];
+};
+
+static inline void lathist_init(struct lathist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = U64_MAX;
+}
+
+static inline unsigned int lathist_index(u64 v)
+{
+    unsigned int shift, idx;
+
+    if (v < (1 << LATHIST_SUB_BITS))
+        return v;
+    shift = fls64(v) - 1 - LATHIST_SUB_BITS;
+    idx = ((shift + 1) << LATHIST_SUB_BITS) +
+        ((v >> shift) & ((1 << LATHIST_SUB_BITS) - 1));
+    return min_t(unsigned int, idx, LATHIST_BUCKETS - 1);
+}
+
+/* The smallest value that goes in bucket "idx" */
+static inline u64 lathist_value(unsigned int idx)
+{
+    unsigned int shift;
+
+    if (idx < (1 << LATHIST_SUB_BITS))
+        return idx;
+    shift = (idx >> LATHIST_SUB_BITS) - 1;
+    return (u64)((idx & ((1 << LATHIST_SUB_BITS) - 1)) |
+            (1 << LATHIST_SUB_BITS)) << shift;
+}
+
+/* Not locked: one writer per histogram, or the caller's lock */
+static inline void lathist_add(struct lathist *h, u64 v)
+{
+    h->count++;
+    h->sum += v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->bucket[lathist_index(v)]++;
+}
+
+static inline void lathist_merge(struct lathist *dst, const struct lathist *src)
+{
+    int i;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->min = min(dst->min, src->min);
+    dst->max = max(dst->max, src->max);
+    for (i = 0; i < LATHIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+}
+
+/* The value below which "per10k" ten-thousandths of the samples fall */
+static inline u64 lathist_pct(const struct lathist *h, unsigned int per10k)
+{
+    u64 want = div_u64(h->count * per10k + 9999, 10000), seen = 0;
+    int i;
+
+    for (i = 0; i < LATHIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= want && seen)
+            return min(lathist_value(i), h->max);
+    }
+    return h->max;
+}
+
+#define LATHIST_HEADER "%-12s %9s %9s %9s %9s %9s %9s %9s\n", \
+    "", "samples", "min", "avg", "p50", "p99", "p99.9", "max"
+
+/* One line: "label samples min avg p50 p99 p99.9 max", in ns */
+static inline void lathist_show(struct seq_file *m, const char *label,
+        const struct lathist *h)
+{
+    if (!h->count) {
+        seq_printf(m, "%-12s %9d\n", label, 0);
+        return;
+    }
+    seq_printf(m, "%-12s %9llu %9llu %9llu %9llu %9llu %9llu %9llu\n", label,
+            h->count, h->min, div64_u64(h->sum, h->count),
+            lathist_pct(h, 5000), lathist_pct(h, 9900), lathist_pct(h, 9990),
+            h->max);
+}
+
+#endif /* _LATHIST_H_ */
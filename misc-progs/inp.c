@@ -1,5 +1,6 @@
 /*
- * inp.c -- read all the ports specified in hex on the command line.
+ * inp.c -- read all the ports specified in hex on the command line,
+ *     or run a batch of accesses with "-f file".
  *     The program uses the faster ioperm/iopl calls on x86, /dev/port
  *     on other platforms. The program acts as inb/inw/inl according
  *     to its own name
@@ -32,6 +33,8 @@
 
 #include <sys/io.h> /* linux specific */
 
+#include "portbatch.h"
+
 #ifdef __GLIBC__
 #include <sys/perm.h>
 #endif
@@ -119,6 +122,10 @@ int main(int argc , char *argv[])
         break;
     }
 
+    /* "-f file": a whole script of accesses, see portbatch.h */
+    if (argc == 3 && !strcmp(argv[1], "-f"))
+        exit(port_batch(prgname, argv[2]) ? 1 : 0);
+
     setuid(0); /* if we're setuid, force it on */
     for (i = 1; i < argc; i++) {
         if (sscanf(argv[i], "%x%n", &port, &n) < 1 || n != strlen(argv[i])) {
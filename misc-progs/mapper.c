@@ -1,6 +1,13 @@
 /*
  * mapper.c -- simple file that mmap()s a file region and prints it
  *
+ * Big regions are mapped one window at a time ("-w"), so they need not
+ * fit in the address space, and can be spread over several threads
+ * ("-t") that pwrite() each window in place to an output file ("-o").
+ * "-s", "-p" and "-H" ask for MADV_SEQUENTIAL, MAP_POPULATE and
+ * MADV_HUGEPAGE, the last with a shared mapping; "-v" reports
+ * throughput and page faults on stderr.
+ *
  * Copyright (C) 1998,2000,2001 Alessandro Rubini
  * 
  *   This program is free software; you can redistribute it and/or modify
@@ -18,27 +25,135 @@
  *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+static char *prgname, *fname;
+static int infd, outfd = 1;
+static unsigned long offset, len, window = 64 << 20;
+static int mflags = MAP_FILE | MAP_PRIVATE, sequential, hugepage, verbose;
+static unsigned long nwindows, next_window;
+static int failed;
+
+/* Map window "i", write it where it belongs, unmap it */
+static int copy_window(unsigned long i, int ordered)
+{
+	unsigned long start = i * window, n = len - start, done = 0;
+	char *address;
+	ssize_t ret;
+
+	if (n > window)
+		n = window;
+	address = mmap(0, n, PROT_READ, mflags, infd, offset + start);
+	if (address == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(%lu): %s\n", prgname, offset + start,
+				strerror(errno));
+		return 1;
+	}
+	if (sequential)
+		madvise(address, n, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	if (hugepage)
+		madvise(address, n, MADV_HUGEPAGE);
+#endif
+
+	while (done < n) {
+		if (ordered)
+			ret = write(outfd, address + done, n - done);
+		else
+			ret = pwrite(outfd, address + done, n - done, start + done);
+		if (ret <= 0) {
+			fprintf(stderr, "%s: write: %s\n", prgname,
+					ret ? strerror(errno) : "short write");
+			break;
+		}
+		done += ret;
+	}
+	munmap(address, n);
+	return done < n;
+}
+
+static void *reader(void *unused)
+{
+	unsigned long i;
+
+	while (!__atomic_load_n(&failed, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&next_window, 1, __ATOMIC_RELAXED);
+		if (i >= nwindows)
+			break;
+		if (copy_window(i, 0))
+			__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* A count, with an optional k, M or G */
+static unsigned long size_arg(const char *s)
+{
+	char *end;
+	unsigned long n = strtoul(s, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g': n <<= 10; /* fall through */
+	case 'M': case 'm': n <<= 10; /* fall through */
+	case 'K': case 'k': n <<= 10;
+	}
+	return n;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "%s: Usage \"%s [-spHv] [-w window] [-t threads] "
+			"[-o outfile] <file> <offset> <len>\"\n", prgname, prgname);
+	exit(1);
+}
 
 int main(int argc, char *argv[])
 {
-	char *fname;
-	FILE *f;
-	unsigned long offset, len;
-	void *address;
+	unsigned long i, nthreads = 1, pagesize = sysconf(_SC_PAGESIZE);
+	char *outname = NULL;
+	pthread_t *threads;
+	struct rusage ru0, ru1;
+	struct timespec t0, t1;
+	double secs;
+	int c;
+
+	prgname = argv[0];
+	while ((c = getopt(argc, argv, "spHvw:t:o:")) != -1) {
+		switch (c) {
+		case 's': sequential = 1; break;
+		case 'p': mflags |= MAP_POPULATE; break;
+		case 'H': hugepage = 1; break;
+		case 'v': verbose = 1; break;
+		case 'w': window = size_arg(optarg); break;
+		case 't': nthreads = strtoul(optarg, NULL, 0); break;
+		case 'o': outname = optarg; break;
+		default: usage();
+		}
+	}
+	argv += optind - 1;
+	argc -= optind - 1;
+
+	/* Private mappings are copy-on-write: scullp won't map those huge */
+	if (hugepage)
+		mflags = (mflags & ~MAP_PRIVATE) | MAP_SHARED;
 
 	if (argc !=4
 		|| sscanf(argv[2], "%li", &offset) != 1
-		|| sscanf(argv[3], "%li", &len) != 1) {
-		fprintf(stderr, "%s: Usage \"%s <file> <offset> <len>\"\n", argv[0],
-                argv[0]);
-        exit(1);
-	}
+		|| sscanf(argv[3], "%li", &len) != 1)
+		usage();
 
 	/* the offset might be big (e.g, PCI devices), but converstion trims it */
 	if (offset == INT_MAX) {
@@ -48,24 +163,68 @@ int main(int argc, char *argv[])
 			sscanf(argv[2], "%lu", &offset);
 	}
 
-	fname = argv[1];
-
-	if (!(f = fopen(fname, "r"))) {
-		fprintf(stderr, "%s: %s: %s\n", argv[0], fname, strerror(errno));
+	/* windows are mapped at offset + n * window: keep them page aligned */
+	window = (window + pagesize - 1) & ~(pagesize - 1);
+	if (!window || !nthreads)
+		usage();
+	if (nthreads > 1 && !outname) {
+		fprintf(stderr, "%s: more threads need an output file (-o)\n",
+				prgname);
 		exit(1);
 	}
+	nwindows = (len + window - 1) / window;
 
-	address = mmap(0, len, PROT_READ, MAP_FILE | MAP_PRIVATE, fileno(f), offset);
+	fname = argv[1];
 
-	if (address == (void *)-1) {
-		fprintf(stderr, "%s: mmap(): %s\n", argv[0], strerror(errno));
+	if ((infd = open(fname, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prgname, fname, strerror(errno));
+		exit(1);
+	}
+	if (outname && (outfd = open(outname, O_WRONLY | O_CREAT, 0644)) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prgname, outname, strerror(errno));
+		exit(1);
+	}
+	if (outname && ftruncate(outfd, len) && errno != EINVAL) {
+		fprintf(stderr, "%s: %s: %s\n", prgname, outname, strerror(errno));
 		exit(1);
 	}
 
-	fclose(f);
-	fprintf(stderr, "mapped \"%s\" from %lu (0x%08lx) to %lu (0x%08lx)\n",
+	fprintf(stderr, "mapping \"%s\" from %lu (0x%08lx) to %lu (0x%08lx)\n",
 			fname, offset, offset, offset + len, offset + len);
 
-	fwrite(address, 1, len, stdout);
-	return 0;
-}
\ No newline at end of file
+	getrusage(RUSAGE_SELF, &ru0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (nthreads == 1) {
+		for (i = 0; i < nwindows && !failed; i++)
+			failed = copy_window(i, !outname);
+	} else {
+		threads = calloc(nthreads, sizeof(*threads));
+		if (!threads)
+			exit(1);
+		for (i = 0; i < nthreads; i++)
+			if (pthread_create(threads + i, NULL, reader, NULL))
+				break;
+		if (i < nthreads)
+			fprintf(stderr, "%s: only %lu threads\n", prgname, i);
+		if (!i)
+			reader(NULL);
+		while (i--)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	getrusage(RUSAGE_SELF, &ru1);
+
+	if (verbose) {
+		secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		fprintf(stderr, "%lu bytes in %.3f s, %.1f MB/s, %lu windows, "
+				"%lu threads, %li minor and %li major faults\n",
+				len, secs, secs > 0 ? len / secs / 1e6 : 0.0, nwindows,
+				nthreads, ru1.ru_minflt - ru0.ru_minflt,
+				ru1.ru_majflt - ru0.ru_majflt);
+	}
+	close(infd);
+	if (outname)
+		close(outfd);
+	return failed;
+}
@@ -32,6 +32,8 @@
 
 #include <sys/io.h> /* linux specific */
 
+#include "portbatch.h"
+
 #ifdef __GLIBC__
 #include <sys/perm.h>
 #endif
@@ -117,6 +119,10 @@ int main(int argc , char *argv[])
         break;
     }
 
+    /* "-f file": a whole script of accesses, see portbatch.h */
+    if (argc == 3 && !strcmp(argv[1], "-f"))
+        exit(port_batch(prgname, argv[2]) ? 1 : 0);
+
     setuid(0); /* if we're setuid, force it on */
     for (i = 1; i < argc - 1; i++) {
         if (sscanf(argv[i], "%x%n", &port, &n) < 1 || n != strlen(argv[i])) {
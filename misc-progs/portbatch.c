@@ -0,0 +1,228 @@
+/*
+ * portbatch.c -- run a stream of port accesses in one process
+ *     Permission is asked once, with iopl() on x86, and everything
+ *     else goes through /dev/port with pread/pwrite. Used by inp
+ *     and outp when called with "-f".
+ *
+ * Copyright (C) 1998,2000,2001 Alessandro Rubini
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <sys/io.h> /* linux specific */
+
+#include "portbatch.h"
+
+#define PORT_FILE "/dev/port"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_IOPL 1
+#else
+#define HAVE_IOPL 0
+#endif
+
+static const char *prgname;
+static int portfd = -1;
+
+static int batch_setup(void)
+{
+#if HAVE_IOPL
+    /* all 64k ports at once, instead of an ioperm() per access */
+    if (iopl(3) == 0)
+        return 0;
+    fprintf(stderr, "%s: iopl(): %s, trying %s\n", prgname, strerror(errno),
+        PORT_FILE);
+#endif
+    portfd = open(PORT_FILE, O_RDWR);
+    if (portfd < 0) {
+        fprintf(stderr, "%s: %s: %s\n", prgname, PORT_FILE, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int batch_in(unsigned int port, int size, unsigned int *val)
+{
+    unsigned char b;
+    unsigned short w;
+    unsigned int l;
+
+#if HAVE_IOPL
+    if (portfd < 0) {
+        if (size == 4)
+            *val = inl(port);
+        else if (size == 2)
+            *val = inw(port);
+        else
+            *val = inb(port);
+        return 0;
+    }
+#endif
+    if (size == 4) {
+        if (pread(portfd, &l, 4, port) != 4)
+            return 1;
+        *val = l;
+    } else if (size == 2) {
+        if (pread(portfd, &w, 2, port) != 2)
+            return 1;
+        *val = w;
+    } else {
+        if (pread(portfd, &b, 1, port) != 1)
+            return 1;
+        *val = b;
+    }
+    return 0;
+}
+
+static int batch_out(unsigned int port, int size, unsigned int val)
+{
+    unsigned char b = val;
+    unsigned short w = val;
+
+#if HAVE_IOPL
+    if (portfd < 0) {
+        if (size == 4)
+            outl(val, port);
+        else if (size == 2)
+            outw(w, port);
+        else
+            outb(b, port);
+        return 0;
+    }
+#endif
+    if (size == 4)
+        return pwrite(portfd, &val, 4, port) != 4;
+    if (size == 2)
+        return pwrite(portfd, &w, 2, port) != 2;
+    return pwrite(portfd, &b, 1, port) != 1;
+}
+
+static int batch_size(const char *s)
+{
+    if (!strcmp(s, "b") || !strcmp(s, "1"))
+        return 1;
+    if (!strcmp(s, "w") || !strcmp(s, "2"))
+        return 2;
+    if (!strcmp(s, "l") || !strcmp(s, "4"))
+        return 4;
+    return 0;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* One command; returns nonzero on error, after saying what it was */
+static int batch_one(char *line, int lineno)
+{
+    char op[4], width[4];
+    unsigned int port, val = 0, repeat = 1, delay = 0, i;
+    long long t0, t, total = 0, max = 0;
+    struct timespec ts;
+    int n, size, err = 0;
+    char *s;
+
+    if ((s = strchr(line, '#')))
+        *s = '\0';
+    if (sscanf(line, " %3s", op) < 1)
+        return 0; /* blank */
+
+    if (!strcmp(op, "r"))
+        n = sscanf(line, " %*s %x %3s %u %u", &port, width, &repeat, &delay);
+    else if (!strcmp(op, "w"))
+        n = sscanf(line, " %*s %x %3s %x %u %u", &port, width, &val,
+            &repeat, &delay) - 1;
+    else
+        n = 0;
+    if (n < 2 || !(size = batch_size(width))) {
+        fprintf(stderr, "%s: line %i: can't parse \"%s\"\n", prgname, lineno,
+            strtok(line, "\n"));
+        return 1;
+    }
+    if (port & (size - 1)) {
+        fprintf(stderr, "%s: line %i: port %x is not properly aligned\n",
+            prgname, lineno, port);
+        return 1;
+    }
+    if (size < 4 && val > (size == 1 ? 0xff : 0xffff)) {
+        fprintf(stderr, "%s: line %i: value %x out of range\n",
+            prgname, lineno, val);
+        return 1;
+    }
+
+    ts.tv_sec = delay / 1000000;
+    ts.tv_nsec = (delay % 1000000) * 1000;
+    for (i = 0; i < repeat && !err; i++) {
+        t0 = now_ns();
+        if (op[0] == 'r')
+            err = batch_in(port, size, &val);
+        else
+            err = batch_out(port, size, val);
+        t = now_ns() - t0;
+        total += t;
+        if (t > max)
+            max = t;
+        if (delay)
+            nanosleep(&ts, NULL);
+    }
+    if (err) {
+        fprintf(stderr, "%s: line %i: %s %04x: %s\n", prgname, lineno,
+            PORT_FILE, port, strerror(errno));
+        return 1;
+    }
+
+    printf("%s %04x: %0*x  x%u  %lli ns/op, max %lli\n", op, port, size * 2,
+        val, repeat, repeat ? total / repeat : 0, max);
+    return 0;
+}
+
+int port_batch(const char *name, const char *file)
+{
+    FILE *f = stdin;
+    char line[256];
+    int lineno = 0, error = 0;
+
+    prgname = name;
+    if (strcmp(file, "-") && !(f = fopen(file, "r"))) {
+        fprintf(stderr, "%s: %s: %s\n", prgname, file, strerror(errno));
+        return 1;
+    }
+    setuid(0); /* if we're setuid, force it on */
+    if (batch_setup())
+        return 1;
+
+    while (fgets(line, sizeof(line), f))
+        error += batch_one(line, ++lineno);
+
+    if (f != stdin)
+        fclose(f);
+    if (portfd >= 0)
+        close(portfd);
+    return error;
+}
@@ -0,0 +1,39 @@
+/*
+ * portbatch.h -- run a stream of port accesses in one process
+ *
+ * Copyright (C) 1998,2000,2001 Alessandro Rubini
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _PORTBATCH_H_
+#define _PORTBATCH_H_
+
+/*
+ * "inp -f file" and "outp -f file" ("-" is stdin) read commands, one
+ * per line, instead of taking ports on the command line:
+ *
+ *     r <port> <width>         [<repeat> [<delay>]]
+ *     w <port> <width> <value> [<repeat> [<delay>]]
+ *
+ * port and value are hex, width is b, w or l (or 1, 2, 4), repeat is
+ * a count (default 1) and delay the microseconds to sleep after each
+ * access (default 0). Blank lines and '#' comments are skipped. Every
+ * command prints one line: the last value read or written, and how
+ * long the accesses took, delays not counted.
+ */
+int port_batch(const char *prgname, const char *file);
+
+#endif /* _PORTBATCH_H_ */
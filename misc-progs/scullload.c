@@ -0,0 +1,528 @@
+/*
+ * scullload.c -- multi-threaded load generator for the scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ * Every thread opens the device on its own and issues a mix of reads
+ * and writes for a while, through plain read/write, readv/writev or
+ * io_uring. At the end, one JSON object on stdout gives throughput
+ * and a log-linear latency histogram (HDR style, ~3% resolution) for
+ * reads and writes.
+ *
+ * Seekable devices (scull, scullc, scullp...) get positioned I/O over
+ * a span, prefilled first so reads find data; scullpipe and friends
+ * are streamed. Blocked threads are woken by a signal at the end.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+
+#define SUB_BITS	5	/* 32 buckets per power of two below, 16 above */
+#define NBUCKETS	1024
+#define MAXDEPTH	256
+
+enum mode { M_SYNC, M_VEC, M_URING };
+static const char *mode_names[] = { "sync", "vec", "uring" };
+
+/* The configuration, set once by main() */
+static const char *device;
+static int nthreads = 1, blocksize = 4096, readpct = 50, depth = 1;
+static int duration = 5, randomio = 1, nonblock, histogram = 1;
+static enum mode mode = M_SYNC;
+static off_t span = 1 << 20;
+static int stream;		/* no positioned I/O on this device */
+
+static volatile int stop;
+
+struct stats {
+	unsigned long ops, bytes, errors, eof, again;
+	uint64_t sum, min, max;
+	unsigned long hist[NBUCKETS];
+};
+
+struct worker {
+	pthread_t thread;
+	int fd, index;
+	unsigned int seed;
+	off_t next;		/* sequential position */
+	char *buf;		/* depth * blocksize */
+	struct stats st[2];	/* reads, writes */
+};
+
+static int hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v < (1 << SUB_BITS))
+		return v;
+	shift = 63 - __builtin_clzll(v) - SUB_BITS + 1;
+	return (shift << (SUB_BITS - 1)) + (v >> shift);
+}
+
+static uint64_t hist_value(int idx)
+{
+	int shift;
+
+	if (idx < (1 << SUB_BITS))
+		return idx;
+	shift = (idx >> (SUB_BITS - 1)) - 1;
+	return (uint64_t)(idx - (shift << (SUB_BITS - 1))) << shift;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account(struct stats *st, uint64_t ns, ssize_t ret)
+{
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			st->again++;
+		else if (errno != EINTR)
+			st->errors++;
+		return;
+	}
+	if (ret == 0)
+		st->eof++;
+	st->ops++;
+	st->bytes += ret;
+	st->sum += ns;
+	if (!st->min || ns < st->min)
+		st->min = ns;
+	if (ns > st->max)
+		st->max = ns;
+	st->hist[hist_index(ns)]++;
+}
+
+/* Pick the next op: read or write, and where */
+static int next_op(struct worker *w, off_t *off)
+{
+	int rd = (int)(rand_r(&w->seed) % 100) < readpct;
+	off_t slots = span / blocksize;
+
+	if (stream)
+		*off = -1;
+	else if (randomio)
+		*off = (off_t)(((uint64_t)rand_r(&w->seed) << 31 |
+				rand_r(&w->seed)) % slots) * blocksize;
+	else {
+		*off = w->next;
+		w->next = (w->next + blocksize) % (slots * blocksize);
+	}
+	return rd;
+}
+
+static ssize_t do_sync(struct worker *w, int rd, off_t off)
+{
+	if (stream)
+		return rd ? read(w->fd, w->buf, blocksize)
+			  : write(w->fd, w->buf, blocksize);
+	return rd ? pread(w->fd, w->buf, blocksize, off)
+		  : pwrite(w->fd, w->buf, blocksize, off);
+}
+
+/* readv/writev: the block goes in "depth" pieces */
+static ssize_t do_vec(struct worker *w, int rd, off_t off)
+{
+	struct iovec iov[MAXDEPTH];
+	int i, piece = blocksize / depth;
+
+	for (i = 0; i < depth; i++) {
+		iov[i].iov_base = w->buf + i * piece;
+		iov[i].iov_len = i == depth - 1 ? blocksize - i * piece : piece;
+	}
+	if (stream)
+		return rd ? readv(w->fd, iov, depth) : writev(w->fd, iov, depth);
+	return rd ? preadv(w->fd, iov, depth, off)
+		  : pwritev(w->fd, iov, depth, off);
+}
+
+static void *sync_worker(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t t0;
+	ssize_t ret;
+	off_t off;
+	int rd;
+
+	while (!stop) {
+		rd = next_op(w, &off);
+		t0 = now_ns();
+		ret = mode == M_VEC ? do_vec(w, rd, off) : do_sync(w, rd, off);
+		account(&w->st[!rd], now_ns() - t0, ret);
+	}
+	return NULL;
+}
+
+#ifdef HAVE_URING
+/*
+ * io_uring without liburing: just the rings and the two syscalls.
+ * "depth" requests stay in flight, each one's submit time kept by slot.
+ */
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+static int uring_setup(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	size_t sq_sz, cq_sz;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_sz = cq_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	sq = mmap(0, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(0, cq_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -1;
+	}
+	r->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		return -1;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void uring_queue(struct uring *r, struct worker *w, int slot,
+		struct iovec *iov, int rd, off_t off)
+{
+	unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = r->sqes + idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = rd ? IORING_OP_READV : IORING_OP_WRITEV;
+	sqe->fd = w->fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = 1;
+	sqe->off = off;	/* -1: the file position, for streams */
+	sqe->user_data = slot | (uint64_t)rd << 32;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *uring_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct uring r;
+	struct iovec iov[MAXDEPTH];
+	uint64_t start[MAXDEPTH];
+	int free_slots[MAXDEPTH], nfree = depth, inflight = 0, i;
+	unsigned head, tail;
+	off_t off;
+	int rd;
+
+	if (uring_setup(&r, depth) < 0) {
+		perror("io_uring_setup");
+		w->st[0].errors++;
+		return NULL;
+	}
+	for (i = 0; i < depth; i++) {
+		iov[i].iov_base = w->buf + i * blocksize;
+		iov[i].iov_len = blocksize;
+		free_slots[i] = i;
+	}
+	while (!stop || inflight) {
+		int submit = 0;
+
+		while (!stop && nfree) {
+			int slot = free_slots[--nfree];
+
+			rd = next_op(w, &off);
+			start[slot] = now_ns();
+			uring_queue(&r, w, slot, iov + slot, rd, off);
+			submit++;
+		}
+		if (syscall(__NR_io_uring_enter, r.fd, submit,
+				inflight + submit ? 1 : 0,
+				IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+				errno != EINTR) {
+			perror("io_uring_enter");
+			break;
+		}
+		inflight += submit;
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = r.cqes + (head & *r.cq_mask);
+			int slot = cqe->user_data & 0xffffffff;
+			ssize_t ret = cqe->res;
+
+			if (ret < 0) {
+				errno = -ret;
+				ret = -1;
+			}
+			account(&w->st[!(cqe->user_data >> 32)],
+					now_ns() - start[slot], ret);
+			free_slots[nfree++] = slot;
+			inflight--;
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	close(r.fd);
+	return NULL;
+}
+#endif /* HAVE_URING */
+
+static void nothing(int sig)
+{
+}
+
+/* Fill the span once, so reads have something to find */
+static int prefill(int fd)
+{
+	char *buf = calloc(1, blocksize);
+	off_t off;
+
+	if (!buf)
+		return -1;
+	for (off = 0; off + blocksize <= span; off += blocksize)
+		if (pwrite(fd, buf, blocksize, off) != blocksize) {
+			free(buf);
+			return -1;
+		}
+	free(buf);
+	return 0;
+}
+
+static void print_stats(const char *name, struct stats *st, double secs)
+{
+	unsigned long seen = 0, want[5];
+	static const char *pname[5] = { "p50", "p90", "p99", "p999", "p9999" };
+	static const double pct[5] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+	int i, p = 0, first = 1;
+
+	printf("  \"%s\": {\"ops\": %lu, \"bytes\": %lu, \"errors\": %lu, "
+			"\"eof\": %lu, \"again\": %lu,\n", name, st->ops, st->bytes,
+			st->errors, st->eof, st->again);
+	printf("    \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f,\n",
+			st->ops / secs, st->bytes / secs / (1 << 20));
+	printf("    \"lat_ns\": {\"min\": %llu, \"mean\": %llu",
+			(unsigned long long)st->min, (unsigned long long)
+			(st->ops ? st->sum / st->ops : 0));
+	for (i = 0; i < 5; i++)
+		want[i] = (unsigned long)(st->ops * pct[i]);
+	for (i = 0; i < NBUCKETS && p < 5 && st->ops; i++) {
+		seen += st->hist[i];
+		while (p < 5 && seen > want[p])
+			printf(", \"%s\": %llu", pname[p++],
+					(unsigned long long)hist_value(i));
+	}
+	printf(", \"max\": %llu}", (unsigned long long)st->max);
+	if (histogram) {
+		/* [lowest value in the bucket, count], nonzero buckets only */
+		printf(",\n    \"hist\": [");
+		for (i = 0; i < NBUCKETS; i++) {
+			if (!st->hist[i])
+				continue;
+			printf("%s[%llu, %lu]", first ? "" : ", ",
+					(unsigned long long)hist_value(i), st->hist[i]);
+			first = 0;
+		}
+		printf("]");
+	}
+	printf("}");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "%s: Usage \"%s [options] <device>\"\n"
+		"  -t threads     (1)\n"
+		"  -b blocksize   (4096)\n"
+		"  -r read%%       (50)\n"
+		"  -m mode        sync|vec|uring (sync)\n"
+		"  -q depth       iovecs for vec, requests in flight for uring (1)\n"
+		"  -d seconds     (5)\n"
+		"  -s span        bytes covered on seekable devices (1048576)\n"
+		"  -S             sequential rather than random offsets\n"
+		"  -N             open non-blocking\n"
+		"  -H             leave the histograms out\n", prog, prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	struct stats total[2];
+	struct sigaction sa;
+	uint64_t t0;
+	double secs;
+	int i, j, k, c;
+
+	while ((c = getopt(argc, argv, "t:b:r:m:q:d:s:SNH")) != -1) {
+		switch (c) {
+		case 't': nthreads = atoi(optarg); break;
+		case 'b': blocksize = atoi(optarg); break;
+		case 'r': readpct = atoi(optarg); break;
+		case 'q': depth = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 's': span = strtoll(optarg, NULL, 0); break;
+		case 'S': randomio = 0; break;
+		case 'N': nonblock = 1; break;
+		case 'H': histogram = 0; break;
+		case 'm':
+			for (mode = 0; mode <= M_URING; mode++)
+				if (!strcmp(optarg, mode_names[mode]))
+					break;
+			if (mode > M_URING)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nthreads < 1 || blocksize < 1 ||
+			depth < 1 || depth > MAXDEPTH || span < blocksize)
+		usage(argv[0]);
+	device = argv[optind];
+#ifndef HAVE_URING
+	if (mode == M_URING) {
+		fprintf(stderr, "%s: built without io_uring\n", argv[0]);
+		exit(1);
+	}
+#endif
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = workers + i;
+
+		w->fd = open(device, O_RDWR | (nonblock ? O_NONBLOCK : 0));
+		if (w->fd < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], device,
+					strerror(errno));
+			exit(1);
+		}
+		w->index = i;
+		w->seed = i * 7919 + 1;
+		w->next = (off_t)i * (span / nthreads / blocksize) * blocksize;
+		w->buf = aligned_alloc(4096, ((size_t)depth * blocksize + 4095) &
+				~4095UL);
+		if (!w->buf) {
+			perror("aligned_alloc");
+			exit(1);
+		}
+		memset(w->buf, 'a' + i % 26, (size_t)depth * blocksize);
+	}
+	/* scullpipe and the like don't do positioned I/O */
+	stream = lseek(workers[0].fd, 0, SEEK_CUR) < 0 && errno == ESPIPE;
+	if (!stream && readpct && prefill(workers[0].fd) < 0) {
+		fprintf(stderr, "%s: prefill: %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+
+	/* No SA_RESTART: this gets blocked threads out at the end */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = nothing;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	t0 = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		void *(*fn)(void *) = sync_worker;
+#ifdef HAVE_URING
+		if (mode == M_URING)
+			fn = uring_worker;
+#endif
+		if (pthread_create(&workers[i].thread, NULL, fn, workers + i)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_kill(workers[i].thread, SIGUSR1);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+	secs = (now_ns() - t0) / 1e9;
+
+	memset(total, 0, sizeof(total));
+	for (i = 0; i < nthreads; i++) {
+		for (j = 0; j < 2; j++) {
+			struct stats *s = workers[i].st + j, *t = total + j;
+
+			t->ops += s->ops;
+			t->bytes += s->bytes;
+			t->errors += s->errors;
+			t->eof += s->eof;
+			t->again += s->again;
+			t->sum += s->sum;
+			if (s->min && (!t->min || s->min < t->min))
+				t->min = s->min;
+			if (s->max > t->max)
+				t->max = s->max;
+			for (k = 0; k < NBUCKETS; k++)
+				t->hist[k] += s->hist[k];
+		}
+		close(workers[i].fd);
+	}
+
+	printf("{\"device\": \"%s\", \"mode\": \"%s\", \"threads\": %d, "
+			"\"block\": %d, \"read_pct\": %d, \"depth\": %d,\n",
+			device, mode_names[mode], nthreads, blocksize, readpct, depth);
+	printf("  \"access\": \"%s\", \"span\": %lld, \"seconds\": %.3f,\n",
+			stream ? "stream" : randomio ? "random" : "sequential",
+			(long long)span, secs);
+	print_stats("read", total, secs);
+	printf(",\n");
+	print_stats("write", total + 1, secs);
+	printf("\n}\n");
+	return 0;
+}
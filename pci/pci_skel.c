@@ -2,6 +2,14 @@
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmapool.h>
+#include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
 
 static struct pci_device_id ids[] = {
     {PCI_DEVICE(PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_INTEL_82801AA_3), },
@@ -10,6 +18,84 @@ static struct pci_device_id ids[] = {
 
 MODULE_DEVICE_TABLE(pci, ids);
 
+/*
+ * One interrupt vector per queue, and by default one queue per CPU;
+ * "nr_queues" asks for fewer.  We take MSI-X if the device has it, then
+ * MSI, then the legacy line, and have as many queues as we got vectors.
+ * The vectors are spread over the CPUs (and nodes) by the IRQ core.
+ */
+static int nr_queues = 0;
+module_param(nr_queues, int, 0);
+
+/*
+ * Each queue has a TX and an RX ring of "ring_size" descriptors (a power
+ * of two).  The device hears about new descriptors once every
+ * "doorbell_batch" of them, or when the driver flushes: a doorbell is an
+ * uncached MMIO write, which costs more than the descriptor itself.
+ */
+static int ring_size = 256;
+module_param(ring_size, int, 0);
+static int doorbell_batch = 16;
+module_param(doorbell_batch, int, 0);
+
+/*
+ * What the device reads and writes, and where its doorbells are in
+ * BAR 0: placeholders, to be replaced by your hardware's.
+ */
+struct skel_desc {
+    __le64 addr;
+    __le32 len;
+    __le32 flags;
+};
+#define SKEL_DESC_OWN       0x1     /* the device's, until it clears it */
+#define SKEL_DESC_EOP       0x2     /* last descriptor of a packet */
+#define SKEL_RING_ALIGN     128
+#define SKEL_TX_DOORBELL(q) (0x1000 + 8 * (q))
+#define SKEL_RX_DOORBELL(q) (0x1004 + 8 * (q))
+
+struct skel_buf {
+    struct page *page;
+    dma_addr_t dma;
+    unsigned int len;
+};
+
+struct skel_ring {
+    struct skel_desc *desc;         /* from the descriptor pool */
+    dma_addr_t desc_dma;
+    struct skel_buf *bufs;
+    unsigned int size;              /* 0 until the ring is ready */
+    unsigned int head;              /* next slot the driver fills */
+    unsigned int tail;              /* next slot the device completes */
+    unsigned int pending;           /* filled since the last doorbell */
+    void __iomem *doorbell;         /* NULL if BAR 0 doesn't have it */
+    spinlock_t lock;                /* TX: submitters against cleaning */
+};
+
+struct skel_dev;
+
+struct skel_queue {
+    struct skel_dev *skel;
+    int index;
+    struct skel_ring tx, rx;
+    /* only this vector's handler writes these, so give them their own line */
+    unsigned long irqs ____cacheline_aligned_in_smp;
+    unsigned long spurious;
+    unsigned long tx_done, rx_done;
+    int last_cpu;
+};
+
+struct skel_dev {
+    struct pci_dev *pdev;
+    void __iomem *regs;             /* BAR 0 */
+    resource_size_t regs_len;
+    struct dma_pool *desc_pool;     /* one block per ring */
+    int nr_queues;
+    struct skel_queue *queues;
+};
+
+static void skel_rx_clean(struct skel_queue *q, int budget);
+static void skel_tx_clean(struct skel_queue *q);
+
 static unsigned char skel_get_revision(struct pci_dev *dev)
 {
     u8 revision;
@@ -18,8 +104,369 @@ static unsigned char skel_get_revision(struct pci_dev *dev)
     return revision;
 }
 
+/*
+ * Did the device interrupt?  Read its status register here.  With MSI
+ * and MSI-X the vector says it all, but the legacy line may be shared.
+ */
+static bool skel_irq_pending(struct skel_queue *q)
+{
+    return true;
+}
+
+static irqreturn_t skel_interrupt(int irq, void *data)
+{
+    struct skel_queue *q = data;
+    struct pci_dev *pdev = q->skel->pdev;
+
+    if (!pdev->msix_enabled && !pdev->msi_enabled && !skel_irq_pending(q)) {
+        q->spurious++;
+        return IRQ_NONE;
+    }
+    q->irqs++;
+    q->last_cpu = smp_processor_id();
+
+    if (q->rx.size)
+        skel_rx_clean(q, q->rx.size);
+    if (q->tx.size)
+        skel_tx_clean(q);
+    return IRQ_HANDLED;
+}
+
+static int skel_setup_irqs(struct skel_dev *skel)
+{
+    struct pci_dev *pdev = skel->pdev;
+    int want = num_online_cpus();
+    int nvec, i, err;
+
+    if (nr_queues > 0 && nr_queues < want)
+        want = nr_queues;
+    nvec = pci_alloc_irq_vectors(pdev, 1, want, PCI_IRQ_ALL_TYPES | PCI_IRQ_AFFINITY);
+    if (nvec < 0)
+        return nvec;
+
+    skel->queues = kcalloc(nvec, sizeof(*skel->queues), GFP_KERNEL);
+    if (!skel->queues) {
+        err = -ENOMEM;
+        goto out_vectors;
+    }
+    for (i = 0; i < nvec; i++) {
+        struct skel_queue *q = skel->queues + i;
+
+        q->skel = skel;
+        q->index = i;
+        q->last_cpu = -1;
+        err = pci_request_irq(pdev, i, skel_interrupt, NULL, q,
+                "pci_skel:%s:%d", pci_name(pdev), i);
+        if (err)
+            goto out_irqs;
+    }
+    skel->nr_queues = nvec;
+
+    dev_info(&pdev->dev, "%d queue%s on %s\n", nvec, nvec > 1 ? "s" : "",
+            pdev->msix_enabled ? "MSI-X" : pdev->msi_enabled ? "MSI" : "INTx");
+    return 0;
+
+out_irqs:
+    while (--i >= 0)
+        pci_free_irq(pdev, i, skel->queues + i);
+    kfree(skel->queues);
+out_vectors:
+    pci_free_irq_vectors(pdev);
+    return err;
+}
+
+/* The queues themselves outlive their vectors, for the rings to go */
+static void skel_free_irqs(struct skel_dev *skel)
+{
+    int i;
+
+    for (i = 0; i < skel->nr_queues; i++)
+        pci_free_irq(skel->pdev, i, skel->queues + i);
+    pci_free_irq_vectors(skel->pdev);
+}
+
+/*
+ * The DMA rings.  A slot is filled by writing its address and length,
+ * then, after a barrier, handing it over with SKEL_DESC_OWN; the
+ * device clears that when it's done.  head and tail run free and are
+ * masked to get a slot.
+ */
+static void skel_ring_post(struct skel_ring *ring, unsigned int slot,
+        dma_addr_t dma, unsigned int len, u32 flags)
+{
+    struct skel_desc *d = ring->desc + slot;
+
+    d->addr = cpu_to_le64(dma);
+    d->len = cpu_to_le32(len);
+    dma_wmb(); /* the device mustn't see OWN before the rest */
+    d->flags = cpu_to_le32(flags | SKEL_DESC_OWN);
+}
+
+static bool skel_ring_done(struct skel_ring *ring, unsigned int slot)
+{
+    if (le32_to_cpu(READ_ONCE(ring->desc[slot].flags)) & SKEL_DESC_OWN)
+        return false;
+    dma_rmb(); /* and nothing of the descriptor before we've seen that */
+    return true;
+}
+
+/* Tell the device how far we've filled; iowrite32 orders after the descriptors */
+static void skel_ring_doorbell(struct skel_ring *ring)
+{
+    if (ring->doorbell)
+        iowrite32(ring->head, ring->doorbell);
+    ring->pending = 0;
+}
+
+static int skel_ring_alloc(struct skel_dev *skel, struct skel_ring *ring,
+        unsigned long doorbell)
+{
+    ring->desc = dma_pool_zalloc(skel->desc_pool, GFP_KERNEL, &ring->desc_dma);
+    if (!ring->desc)
+        return -ENOMEM;
+    ring->bufs = kcalloc_node(ring_size, sizeof(*ring->bufs), GFP_KERNEL,
+            dev_to_node(&skel->pdev->dev));
+    if (!ring->bufs)
+        return -ENOMEM;
+    ring->head = ring->tail = ring->pending = 0;
+    ring->doorbell = (skel->regs && doorbell + 4 <= skel->regs_len) ?
+            skel->regs + doorbell : NULL;
+    spin_lock_init(&ring->lock);
+    return 0;
+}
+
+/*
+ * RX buffers are pages mapped once, here, on the device's node, and
+ * recycled in place: the streaming mapping is only synced as a page
+ * goes to the CPU and back, never torn down until the ring is.
+ */
+static int skel_rx_fill(struct skel_dev *skel, struct skel_ring *ring)
+{
+    struct device *dev = &skel->pdev->dev;
+    struct skel_buf *buf;
+    int i;
+
+    for (i = 0; i < ring_size; i++) {
+        buf = ring->bufs + i;
+        buf->page = alloc_pages_node(dev_to_node(dev), GFP_KERNEL, 0);
+        if (!buf->page)
+            return -ENOMEM;
+        buf->dma = dma_map_page(dev, buf->page, 0, PAGE_SIZE, DMA_FROM_DEVICE);
+        if (dma_mapping_error(dev, buf->dma)) {
+            __free_page(buf->page);
+            buf->page = NULL;
+            return -ENOMEM;
+        }
+        buf->len = PAGE_SIZE;
+        skel_ring_post(ring, i, buf->dma, PAGE_SIZE, 0);
+    }
+    ring->head = ring_size; /* all of them the device's */
+    skel_ring_doorbell(ring);
+    return 0;
+}
+
+/* Received data: copy it out, or build an skb around the page, here */
+static void skel_rx_deliver(struct skel_queue *q, void *data, unsigned int len)
+{
+}
+
+static void skel_rx_clean(struct skel_queue *q, int budget)
+{
+    struct skel_ring *ring = &q->rx;
+    struct device *dev = &q->skel->pdev->dev;
+    unsigned int slot, len;
+    struct skel_buf *buf;
+    int done = 0;
+
+    while (done < budget) {
+        slot = ring->tail & (ring->size - 1);
+        if (!skel_ring_done(ring, slot))
+            break;
+        buf = ring->bufs + slot;
+        len = min_t(unsigned int, le32_to_cpu(ring->desc[slot].len), PAGE_SIZE);
+
+        dma_sync_single_for_cpu(dev, buf->dma, len, DMA_FROM_DEVICE);
+        skel_rx_deliver(q, page_address(buf->page), len);
+        dma_sync_single_for_device(dev, buf->dma, len, DMA_FROM_DEVICE);
+
+        /* the same page, still mapped, goes straight back */
+        skel_ring_post(ring, slot, buf->dma, PAGE_SIZE, 0);
+        ring->tail++;
+        ring->head++;
+        if (++ring->pending >= doorbell_batch)
+            skel_ring_doorbell(ring);
+        done++;
+    }
+    if (ring->pending)
+        skel_ring_doorbell(ring);
+    q->rx_done += done;
+}
+
+/*
+ * Queue "len" bytes at "offset" in "page" for the device, which holds a
+ * reference to the page until they're sent.  Returns -EBUSY when the
+ * ring is full.  The doorbell rings every doorbell_batch descriptors;
+ * call skel_tx_flush() at the end of a burst for the rest.
+ */
+static int __maybe_unused skel_tx_queue(struct skel_queue *q, struct page *page,
+        unsigned int offset, unsigned int len)
+{
+    struct skel_ring *ring = &q->tx;
+    struct device *dev = &q->skel->pdev->dev;
+    unsigned long flags;
+    unsigned int slot;
+    dma_addr_t dma;
+
+    dma = dma_map_page(dev, page, offset, len, DMA_TO_DEVICE);
+    if (dma_mapping_error(dev, dma))
+        return -ENOMEM;
+
+    spin_lock_irqsave(&ring->lock, flags);
+    if (ring->head - ring->tail >= ring->size) {
+        spin_unlock_irqrestore(&ring->lock, flags);
+        dma_unmap_page(dev, dma, len, DMA_TO_DEVICE);
+        return -EBUSY;
+    }
+    slot = ring->head & (ring->size - 1);
+    get_page(page);
+    ring->bufs[slot].page = page;
+    ring->bufs[slot].dma = dma;
+    ring->bufs[slot].len = len;
+    skel_ring_post(ring, slot, dma, len, SKEL_DESC_EOP);
+    ring->head++;
+    if (++ring->pending >= doorbell_batch)
+        skel_ring_doorbell(ring);
+    spin_unlock_irqrestore(&ring->lock, flags);
+    return 0;
+}
+
+static void __maybe_unused skel_tx_flush(struct skel_queue *q)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&q->tx.lock, flags);
+    if (q->tx.pending)
+        skel_ring_doorbell(&q->tx);
+    spin_unlock_irqrestore(&q->tx.lock, flags);
+}
+
+/* Unmap and release what the device has sent, or everything if "all" */
+static int skel_tx_reap(struct skel_queue *q, bool all)
+{
+    struct skel_ring *ring = &q->tx;
+    struct device *dev = &q->skel->pdev->dev;
+    struct skel_buf *buf;
+    unsigned int slot;
+    int done = 0;
+
+    while (ring->tail != ring->head) {
+        slot = ring->tail & (ring->size - 1);
+        if (!all && !skel_ring_done(ring, slot))
+            break;
+        buf = ring->bufs + slot;
+        dma_unmap_page(dev, buf->dma, buf->len, DMA_TO_DEVICE);
+        put_page(buf->page);
+        buf->page = NULL;
+        ring->tail++;
+        done++;
+    }
+    return done;
+}
+
+static void skel_tx_clean(struct skel_queue *q)
+{
+    int done;
+
+    spin_lock(&q->tx.lock);
+    done = skel_tx_reap(q, false);
+    spin_unlock(&q->tx.lock);
+    q->tx_done += done;
+}
+
+/* After the interrupts are gone, and the device quiet */
+static void skel_free_rings(struct skel_dev *skel)
+{
+    struct device *dev = &skel->pdev->dev;
+    struct skel_queue *q;
+    struct skel_buf *buf;
+    int i, j;
+
+    for (i = 0; i < skel->nr_queues; i++) {
+        q = skel->queues + i;
+        if (q->tx.bufs)
+            skel_tx_reap(q, true);
+        for (j = 0; q->rx.bufs && j < ring_size; j++) {
+            buf = q->rx.bufs + j;
+            if (!buf->page)
+                continue;
+            dma_unmap_page(dev, buf->dma, PAGE_SIZE, DMA_FROM_DEVICE);
+            __free_page(buf->page);
+        }
+        if (q->tx.desc)
+            dma_pool_free(skel->desc_pool, q->tx.desc, q->tx.desc_dma);
+        if (q->rx.desc)
+            dma_pool_free(skel->desc_pool, q->rx.desc, q->rx.desc_dma);
+        kfree(q->tx.bufs);
+        kfree(q->rx.bufs);
+    }
+    dma_pool_destroy(skel->desc_pool);
+}
+
+static int skel_setup_rings(struct skel_dev *skel)
+{
+    struct skel_queue *q;
+    int i, err;
+
+    skel->desc_pool = dma_pool_create("pci_skel", &skel->pdev->dev,
+            ring_size * sizeof(struct skel_desc), SKEL_RING_ALIGN, 0);
+    if (!skel->desc_pool)
+        return -ENOMEM;
+    for (i = 0; i < skel->nr_queues; i++) {
+        q = skel->queues + i;
+        err = skel_ring_alloc(skel, &q->tx, SKEL_TX_DOORBELL(i));
+        if (!err)
+            err = skel_ring_alloc(skel, &q->rx, SKEL_RX_DOORBELL(i));
+        if (!err)
+            err = skel_rx_fill(skel, &q->rx);
+        if (err)
+            return err; /* the caller frees what there is */
+        /* program the device with q->tx.desc_dma and q->rx.desc_dma here */
+
+        /* and only now may the interrupt handler look at them */
+        WRITE_ONCE(q->tx.size, ring_size);
+        WRITE_ONCE(q->rx.size, ring_size);
+    }
+    return 0;
+}
+
+/* Per-vector counts, and where each vector may and did land */
+static ssize_t irq_stats_show(struct device *dev, struct device_attribute *attr,
+        char *buf)
+{
+    struct skel_dev *skel = dev_get_drvdata(dev);
+    const struct cpumask *mask;
+    int i, len = 0;
+
+    for (i = 0; i < skel->nr_queues; i++) {
+        struct skel_queue *q = skel->queues + i;
+
+        mask = pci_irq_get_affinity(skel->pdev, i);
+        if (!mask)
+            mask = cpu_possible_mask;
+        len += sysfs_emit_at(buf, len, "%d irq %d cpus %*pbl irqs %lu spurious %lu last %d"
+                " tx %lu rx %lu\n",
+                i, pci_irq_vector(skel->pdev, i), cpumask_pr_args(mask),
+                READ_ONCE(q->irqs), READ_ONCE(q->spurious), READ_ONCE(q->last_cpu),
+                READ_ONCE(q->tx_done), READ_ONCE(q->rx_done));
+    }
+    return len;
+}
+static DEVICE_ATTR_RO(irq_stats);
+
 static int prove(struct pci_dev *dev, const struct pci_device_id *id)
 {
+    struct skel_dev *skel;
+    int err;
 
     /*
      * Do probing type stuff here.
@@ -30,17 +477,83 @@ static int prove(struct pci_dev *dev, const struct pci_device_id *id)
         return -ENODEV;
     }
 
-    if (skel_get_revision(dev) == 0x42)
-        return -ENODEV;
+    if (skel_get_revision(dev) == 0x42) {
+        err = -ENODEV;
+        goto out_disable;
+    }
+
+    /* MSI messages are memory writes, so the device must be a bus master */
+    pci_set_master(dev);
+
+    /* all the address bits the device can drive, or the 32 every one can */
+    err = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(64));
+    if (err)
+        err = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(32));
+    if (err) {
+        dev_err(&dev->dev, "no usable DMA configuration\n");
+        goto out_disable;
+    }
+
+    err = pci_request_regions(dev, "pci_skel");
+    if (err)
+        goto out_disable;
 
+    skel = kzalloc(sizeof(*skel), GFP_KERNEL);
+    if (!skel) {
+        err = -ENOMEM;
+        goto out_regions;
+    }
+    skel->pdev = dev;
+    skel->regs = pci_iomap(dev, 0, 0);
+    skel->regs_len = pci_resource_len(dev, 0);
+    pci_set_drvdata(dev, skel);
+
+    err = skel_setup_irqs(skel);
+    if (err) {
+        dev_err(&dev->dev, "can't get interrupts: %d\n", err);
+        goto out_free;
+    }
+    err = skel_setup_rings(skel);
+    if (err) {
+        dev_err(&dev->dev, "can't set up the DMA rings: %d\n", err);
+        goto out_irqs;
+    }
+    if (device_create_file(&dev->dev, &dev_attr_irq_stats))
+        dev_warn(&dev->dev, "no irq_stats attribute\n");
     return 0;
+
+out_irqs:
+    skel_free_irqs(skel);
+    skel_free_rings(skel);
+    kfree(skel->queues);
+out_free:
+    if (skel->regs)
+        pci_iounmap(dev, skel->regs);
+    kfree(skel);
+out_regions:
+    pci_release_regions(dev);
+out_disable:
+    pci_disable_device(dev);
+    return err;
 }
 
 static void remove(struct pci_dev *dev)
 {
+    struct skel_dev *skel = pci_get_drvdata(dev);
+
     /* clean up any allocated resources and stuff here.
 	 * like call release_region();
 	 */
+    device_remove_file(&dev->dev, &dev_attr_irq_stats);
+    /* stop the device's DMA here, before its buffers go */
+    skel_free_irqs(skel);
+    skel_free_rings(skel);
+    kfree(skel->queues);
+    if (skel->regs)
+        pci_iounmap(dev, skel->regs);
+    kfree(skel);
+    pci_release_regions(dev);
+    pci_disable_device(dev);
 }
 
 static struct pci_driver pci_driver = {
@@ -52,6 +565,10 @@ static struct pci_driver pci_driver = {
 
 static int __init pci_skel_init(void)
 {
+    if (ring_size < 2 || !is_power_of_2(ring_size) || doorbell_batch < 1) {
+        pr_err("pci_skel: ring_size must be a power of two, doorbell_batch positive\n");
+        return -EINVAL;
+    }
     return pci_register_driver(&pci_driver);
 }
 
@@ -23,6 +23,22 @@
 
 #include <linux/version.h>
 #include <linux/blk-mq.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <linux/dax.h>
+#include <linux/memremap.h>
+#include <linux/pfn_t.h>
+#include <linux/uio.h>
+#include <linux/log2.h>
+
+#include "../include/ldd_layout.h"
+#include "../include/ldd_stats.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -34,6 +50,32 @@ static int nsectors = 1024; /* How big the drive is */
 module_param(nsectors, int, 0);
 static int ndevices = 4;
 module_param(ndevices, int, 0);
+static int sparse = 0; /* Allocate pages on first write, not at load */
+module_param(sparse, int, 0);
+/*
+ * For DAX, the disks live in physical memory the kernel was told to keep
+ * away from (memmap=nn!ss); this is where that region starts. Each
+ * device takes the next nsectors * hardsect_size bytes of it, which had
+ * better be a multiple of 2MB.
+*/
+static unsigned long dax_phys = 0;
+module_param(dax_phys, ulong, 0);
+
+/*
+ * Queue limits, the way a real disk advertises them; zero leaves the
+ * block layer's default. io_opt is in bytes, hardsect_size (above) is
+ * the logical block size. With write_cache we claim a volatile cache
+ * and FUA, so flushes and FUA writes come down to us; they complete
+ * right away, as RAM has nothing to flush.
+*/
+static int max_hw_sectors = 0;
+module_param(max_hw_sectors, int, 0);
+static int max_segments = 0;
+module_param(max_segments, int, 0);
+static int io_opt = 0;
+module_param(io_opt, int, 0);
+static int write_cache = 0;
+module_param(write_cache, int, 0);
 
 /*
  * The different "request modes" we can use
@@ -46,6 +88,38 @@ enum {
 static int request_mode = RM_SIMPLE;
 module_param(request_mode, int, 0);
 
+/*
+ * How the blk-mq modes spread the submitting CPUs over hardware queues.
+*/
+enum {
+	QM_SINGLE	= 0, /* One hardware queue for everybody */
+	QM_PER_CPU	= 1, /* One hardware queue per CPU */
+	QM_PER_NODE	= 2, /* One per NUMA node, shared by its CPUs */
+};
+static int queue_mode = QM_SINGLE;
+module_param(queue_mode, int, 0);
+static int queue_depth = 128; /* Tags per hardware queue */
+module_param(queue_depth, int, 0);
+static int poll_queues = 0; /* Extra queues for polled (IOPOLL/hipri) I/O */
+module_param(poll_queues, int, 0);
+
+/*
+ * When the blk-mq modes tell the block layer that a request is done.
+ * Timed completions simulate media latency: completion_nsec plus a
+ * uniformly distributed extra of up to completion_jitter. Requests on
+ * a poll queue wait for the same delay, but are found by ->poll.
+*/
+enum {
+	CM_INLINE	= 0, /* Right away, in ->queue_rq */
+	CM_TIMER	= 1, /* From a per-request hrtimer */
+};
+static int completion_mode = CM_INLINE;
+module_param(completion_mode, int, 0);
+static int completion_nsec = 10000;
+module_param(completion_nsec, int, 0);
+static int completion_jitter = 0;
+module_param(completion_jitter, int, 0);
+
 /*
  * Minor number and partition management. 
 */
@@ -65,20 +139,82 @@ module_param(request_mode, int, 0);
 #define INVALIDATE_DELAY 30 * HZ
 
 /*
- * The internal representation of our device.
+ * I/O statistics, kept per CPU so that they cost nothing but a few
+ * increments on the hot path, and summed up when debugfs is read, as
+ * sbull/<disk>/stats. See ldd_stats.h.
+*/
+enum {
+	SBULL_READS, SBULL_WRITES, SBULL_RBYTES, SBULL_WBYTES,
+	SBULL_FLUSHES, SBULL_DISCARDS, SBULL_ERRORS, SBULL_NCOUNTERS
+};
+static const char * const sbull_counters[] = {
+	"reads", "writes", "read_bytes", "write_bytes",
+	"flushes", "discards", "errors"	/* discards: and write-zeroes */
+};
+enum { SBULL_READ_NS, SBULL_WRITE_NS, SBULL_OTHER_NS, SBULL_NHISTS };
+static const char * const sbull_hists[] = { "read_ns", "write_ns", "other_ns" };
+
+static struct dentry *sbull_debugfs;	/* Our directory in debugfs */
+
+/*
+ * What we keep for each request (the blk-mq "pdu"), and for each
+ * hardware queue.
+*/
+struct sbull_cmd {
+	u64 start;						/* When ->queue_rq saw it */
+	u64 deadline;					/* When a poller may complete it */
+	blk_status_t status;			/* What to complete it with */
+	struct hrtimer timer;			/* For CM_TIMER */
+};
+
+struct sbull_queue {
+	spinlock_t lock;				/* Protects poll_list */
+	struct list_head poll_list;		/* Waiting for ->poll */
+} ____cacheline_aligned_in_smp;		/* Hardware queues run on different CPUs */
+
+/*
+ * The internal representation of our device. What every request
+ * reads comes first; the sparse pages, written as they are first
+ * touched, and the open/release state each get their own cache lines.
 */
 struct sbull_dev {
-	int size;						/* Device size in sectors */
+	unsigned long size;				/* Device size in bytes */
 	u8 *data;						/* The data array */
-	short users;					/* How many users */
-	short media_change;				/* Flag a media change? */
-	spinlock_t lock;				/* For mutual exclusion */
-	struct blk_mq_tag_set tag_set;	/* tag_set added */
+	phys_addr_t phys;				/* Or, with DAX, where it is */
+	struct dax_device *dax_dev;		/* DAX: what filesystems map */
+	struct sbull_queue *queues;		/* One per hardware queue */
 	struct request_queue *queue;	/* The device request queue */
 	struct gendisk *gd;				/* The gendisk structure */
+	struct ldd_stats stats;			/* I/O counters */
+	struct blk_mq_tag_set tag_set;	/* tag_set added */
+	struct dev_pagemap pgmap;		/* DAX: struct pages for it */
+	struct xarray pages ____cacheline_aligned_in_smp; /* Or, if sparse, its pages */
+	spinlock_t lock ____cacheline_aligned_in_smp; /* For mutual exclusion */
+	short users;					/* How many users */
+	short media_change;				/* Flag a media change? */
 	struct timer_list timer;		/* For simulated media changes */
 };
 
+#ifdef SBULL_DEBUG
+static const struct ldd_field sbull_dev_fields[] = {
+	LDD_FIELD(struct sbull_dev, size,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, data,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, phys,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, dax_dev,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, queues,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, queue,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, gd,			LDD_RO),
+	LDD_FIELD(struct sbull_dev, stats,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, tag_set,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, pgmap,		LDD_RO),
+	LDD_FIELD(struct sbull_dev, pages,		LDD_PROD),
+	LDD_FIELD(struct sbull_dev, lock,		LDD_LOCK),
+	LDD_FIELD(struct sbull_dev, users,		LDD_LOCK),
+	LDD_FIELD(struct sbull_dev, media_change,	LDD_LOCK),
+	LDD_FIELD(struct sbull_dev, timer,		LDD_LOCK),
+};
+#endif
+
 static struct sbull_dev *Devices = NULL;
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0))
@@ -103,10 +239,282 @@ blk_generic_alloc_queue(int node_id)
 #endif
 }
 
+/*
+ * Account for a finished request of type "op". "start" comes from
+ * ldd_stats_now().
+*/
+static void sbull_account(struct sbull_dev *dev, unsigned int op,
+						unsigned int bytes, u64 start, int error)
+{
+	struct ldd_stats *st = &dev->stats;
+
+	if (error) {
+		ldd_stats_inc(st, SBULL_ERRORS);
+	} else if (op == REQ_OP_FLUSH) {
+		ldd_stats_inc(st, SBULL_FLUSHES);
+	} else if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES) {
+		ldd_stats_inc(st, SBULL_DISCARDS);
+	} else if (op_is_write(op)) {
+		ldd_stats_inc(st, SBULL_WRITES);
+		ldd_stats_add(st, SBULL_WBYTES, bytes);
+		ldd_stats_time(st, SBULL_WRITE_NS, start);
+		return;
+	} else {
+		ldd_stats_inc(st, SBULL_READS);
+		ldd_stats_add(st, SBULL_RBYTES, bytes);
+		ldd_stats_time(st, SBULL_READ_NS, start);
+		return;
+	}
+	ldd_stats_time(st, SBULL_OTHER_NS, start);
+}
+
+/*
+ * The sparse store: one page per PAGE_SIZE of disk, indexed by page
+ * number and only allocated when something is written there. Lookups
+ * and copies run under rcu_read_lock(), so that discard can take pages
+ * away without a lock on the I/O path; it waits for a grace period
+ * before actually freeing them. Pages are allocated outside of it,
+ * with GFP_NOIO, so callers must be able to sleep: the request modes
+ * that run in ->queue_rq are made BLK_MQ_F_BLOCKING in sparse mode, and
+ * sbull_xfer_bio() maps its segments with kmap_local_page().
+*/
+static struct page *sbull_insert_page(struct sbull_dev *dev, unsigned long idx)
+{
+	struct page *page, *old;
+
+	page = alloc_page(GFP_NOIO | __GFP_ZERO);
+	if (!page)
+		return NULL;
+	old = xa_cmpxchg(&dev->pages, idx, NULL, page, GFP_NOIO);
+	if (old) { /* Somebody beat us to it, or the store failed */
+		__free_page(page);
+		return xa_is_err(old) ? NULL : old;
+	}
+	return page;
+}
+
+static int sbull_transfer_sparse(struct sbull_dev *dev, unsigned long offset,
+				unsigned long nbytes, char *buffer, int write)
+{
+	while (nbytes) {
+		unsigned long idx = offset >> PAGE_SHIFT;
+		unsigned int off = offset & ~PAGE_MASK;
+		unsigned int len = min_t(unsigned long, nbytes, PAGE_SIZE - off);
+		struct page *page;
+
+		rcu_read_lock();
+		page = xa_load(&dev->pages, idx);
+		while (write && !page) {
+			/* Allocate where we can sleep; a discard may take it again */
+			rcu_read_unlock();
+			if (!sbull_insert_page(dev, idx))
+				return -ENOMEM;
+			rcu_read_lock();
+			page = xa_load(&dev->pages, idx);
+		}
+		if (write)
+			memcpy(page_address(page) + off, buffer, len);
+		else if (page)
+			memcpy(buffer, page_address(page) + off, len);
+		else /* Never written: a hole reads as zeroes */
+			memset(buffer, 0, len);
+		rcu_read_unlock();
+
+		offset += len;
+		buffer += len;
+		nbytes -= len;
+	}
+	return 0;
+}
+
+/*
+ * Discard and write-zeroes both leave zeroes behind. The dense store
+ * just clears the range; the sparse one drops whole pages, since a
+ * missing page reads as zeroes, and clears the partial pages at
+ * either end.
+*/
+static int sbull_discard(struct sbull_dev *dev, unsigned long sector,
+				unsigned long nsect)
+{
+	unsigned long offset = sector * KERNEL_SECTOR_SIZE;
+	unsigned long nbytes = nsect * KERNEL_SECTOR_SIZE;
+	struct page *page, *next;
+	LIST_HEAD(freed);
+
+	if ((offset + nbytes) > dev->size)
+		return -EIO;
+	if (!sparse) {
+		memset(dev->data + offset, 0, nbytes);
+		return 0;
+	}
+
+	while (nbytes) {
+		unsigned long idx = offset >> PAGE_SHIFT;
+		unsigned int off = offset & ~PAGE_MASK;
+		unsigned int len = min_t(unsigned long, nbytes, PAGE_SIZE - off);
+
+		if (len == PAGE_SIZE) {
+			page = xa_erase(&dev->pages, idx);
+			if (page)
+				list_add(&page->lru, &freed);
+		} else {
+			rcu_read_lock();
+			page = xa_load(&dev->pages, idx);
+			if (page)
+				memset(page_address(page) + off, 0, len);
+			rcu_read_unlock();
+		}
+		offset += len;
+		nbytes -= len;
+	}
+
+	if (!list_empty(&freed)) {
+		synchronize_rcu(); /* Nobody is copying from them anymore */
+		list_for_each_entry_safe(page, next, &freed, lru)
+			__free_page(page);
+	}
+	return 0;
+}
+
+/* Give back the whole sparse store */
+static void sbull_free_pages(struct sbull_dev *dev)
+{
+	struct page *page;
+	unsigned long idx;
+
+	xa_for_each(&dev->pages, idx, page)
+		__free_page(page);
+	xa_destroy(&dev->pages);
+}
+
+/*
+ * DAX support. The backing store comes from memremap_pages() over the
+ * reserved region, so it has the ZONE_DEVICE struct pages filesystem DAX
+ * wants and can be mapped straight into user space; the block path keeps
+ * memcpy'ing to and from dev->data as usual. The dax_operations below
+ * are those of 5.15, the kernel this driver targets; they change on
+ * nearly every release around it, so elsewhere the mode is left out.
+*/
+#if IS_ENABLED(CONFIG_FS_DAX) && (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)) \
+	&& (LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0))
+#define SBULL_DAX
+
+static long sbull_dax_direct_access(struct dax_device *dax_dev, pgoff_t pgoff,
+						long nr_pages, void **kaddr, pfn_t *pfn)
+{
+	struct sbull_dev *dev = dax_get_private(dax_dev);
+	unsigned long offset = PFN_PHYS(pgoff);
+
+	if (offset >= dev->size)
+		return -EFAULT;
+	if (kaddr)
+		*kaddr = dev->data + offset;
+	if (pfn)
+		*pfn = phys_to_pfn_t(dev->phys + offset, PFN_DEV | PFN_MAP);
+	return min_t(long, nr_pages, PHYS_PFN(dev->size - offset));
+}
+
+/* It's only RAM: no cache flushing needed, unlike real pmem */
+static size_t sbull_dax_copy_from_iter(struct dax_device *dax_dev, pgoff_t pgoff,
+						void *addr, size_t bytes, struct iov_iter *i)
+{
+	return copy_from_iter(addr, bytes, i);
+}
+
+static size_t sbull_dax_copy_to_iter(struct dax_device *dax_dev, pgoff_t pgoff,
+						void *addr, size_t bytes, struct iov_iter *i)
+{
+	return copy_to_iter(addr, bytes, i);
+}
+
+static int sbull_dax_zero_page_range(struct dax_device *dax_dev, pgoff_t pgoff,
+						size_t nr_pages)
+{
+	struct sbull_dev *dev = dax_get_private(dax_dev);
+
+	memset(dev->data + PFN_PHYS(pgoff), 0, nr_pages << PAGE_SHIFT);
+	return 0;
+}
+
+static const struct dax_operations sbull_dax_ops = {
+	.direct_access = sbull_dax_direct_access,
+	.dax_supported = generic_fsdax_supported,
+	.copy_from_iter = sbull_dax_copy_from_iter,
+	.copy_to_iter = sbull_dax_copy_to_iter,
+	.zero_page_range = sbull_dax_zero_page_range,
+};
+
+/* Map device "which"'s share of the reserved region */
+static int sbull_dax_map(struct sbull_dev *dev, int which)
+{
+	void *addr;
+
+	dev->phys = dax_phys + (phys_addr_t)which * dev->size;
+	dev->pgmap.type = MEMORY_DEVICE_FS_DAX;
+	dev->pgmap.range.start = dev->phys;
+	dev->pgmap.range.end = dev->phys + dev->size - 1;
+	dev->pgmap.nr_range = 1;
+	addr = memremap_pages(&dev->pgmap, NUMA_NO_NODE);
+	if (IS_ERR(addr))
+		return PTR_ERR(addr);
+	dev->data = addr;
+	return 0;
+}
+
+static void sbull_dax_unmap(struct sbull_dev *dev)
+{
+	memunmap_pages(&dev->pgmap);
+}
+
+/* The dax_device is found through the disk name, so call after naming it */
+static int sbull_dax_add(struct sbull_dev *dev)
+{
+	dev->dax_dev = alloc_dax(dev, dev->gd->disk_name, &sbull_dax_ops, 0);
+	if (IS_ERR_OR_NULL(dev->dax_dev)) {
+		dev->dax_dev = NULL;
+		return -ENOMEM;
+	}
+	blk_queue_flag_set(QUEUE_FLAG_DAX, dev->queue);
+	return 0;
+}
+
+static void sbull_dax_remove(struct sbull_dev *dev)
+{
+	if (!dev->dax_dev)
+		return;
+	kill_dax(dev->dax_dev);
+	put_dax(dev->dax_dev);
+	dev->dax_dev = NULL;
+}
+#else
+static int sbull_dax_map(struct sbull_dev *dev, int which)
+{
+	return -EOPNOTSUPP;
+}
+static void sbull_dax_unmap(struct sbull_dev *dev) { }
+static int sbull_dax_add(struct sbull_dev *dev)
+{
+	return -EOPNOTSUPP;
+}
+static void sbull_dax_remove(struct sbull_dev *dev) { }
+#endif /* SBULL_DAX */
+
+/* Release the dense backing store, whichever way it was obtained */
+static void sbull_free_data(struct sbull_dev *dev)
+{
+	if (!dev->data)
+		return;
+	if (dax_phys)
+		sbull_dax_unmap(dev);
+	else
+		vfree(dev->data);
+	dev->data = NULL;
+}
+
 /*
  * Handle an I/O request
 */
-static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
+static int sbull_transfer(struct sbull_dev *dev, unsigned long sector,
 							unsigned long nsect, char *buffer, int write)
 {
 	unsigned long offset = sector * KERNEL_SECTOR_SIZE;
@@ -114,14 +522,135 @@ static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
 
 	if ((offset + nbytes) > dev->size) {
 		printk(KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
-		return;
+		return -EIO;
 	}
 
+	if (sparse)
+		return sbull_transfer_sparse(dev, offset, nbytes, buffer, write);
+
 	if(write) {
 		memcpy(dev->data + offset, buffer, nbytes);
 	} else {
 		memcpy(buffer, dev->data + offset, nbytes);
 	}
+	return 0;
+}
+
+/* Is this a request that carries no data, just clears a range? */
+static inline int sbull_op_is_discard(unsigned int op)
+{
+	return op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES;
+}
+
+/*
+ * Completion of the blk-mq modes.
+*/
+static void sbull_end_request(struct request *req)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+	struct sbull_dev *dev = req->q->queuedata;
+
+	sbull_account(dev, req_op(req), blk_rq_bytes(req), cmd->start,
+			cmd->status != BLK_STS_OK);
+	blk_mq_end_request(req, cmd->status);
+}
+
+static enum hrtimer_restart sbull_cmd_timer(struct hrtimer *timer)
+{
+	struct sbull_cmd *cmd = container_of(timer, struct sbull_cmd, timer);
+
+	sbull_end_request(blk_mq_rq_from_pdu(cmd));
+	return HRTIMER_NORESTART;
+}
+
+static u64 sbull_delay(void)
+{
+	u64 ns = completion_nsec;
+
+	if (completion_jitter > 0)
+		ns += get_random_u32() % completion_jitter;
+	return ns;
+}
+
+/*
+ * The data has been moved (or not, as "status" says): hand the request
+ * back now, later, or to the poller, depending on the completion mode
+ * and on the queue it came through.
+*/
+static void sbull_complete(struct blk_mq_hw_ctx *hctx, struct request *req,
+						blk_status_t status)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+	struct sbull_queue *sq = hctx->driver_data;
+
+	cmd->status = status;
+	if (hctx->type == HCTX_TYPE_POLL) {
+		cmd->deadline = ktime_get_ns() +
+			(completion_mode == CM_TIMER ? sbull_delay() : 0);
+		spin_lock(&sq->lock);
+		list_add_tail(&req->queuelist, &sq->poll_list);
+		spin_unlock(&sq->lock);
+	} else if (completion_mode == CM_TIMER) {
+		hrtimer_start(&cmd->timer, ns_to_ktime(sbull_delay()),
+				HRTIMER_MODE_REL);
+	} else {
+		sbull_end_request(req);
+	}
+}
+
+/*
+ * Reap whatever is due on a poll queue; io_uring IOPOLL and hipri
+ * reads end up here instead of waiting for an interrupt.
+*/
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0))
+static int sbull_poll(struct blk_mq_hw_ctx *hctx)
+#else
+static int sbull_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+#endif
+{
+	struct sbull_queue *sq = hctx->driver_data;
+	struct request *req, *next;
+	u64 now = ktime_get_ns();
+	LIST_HEAD(done);
+	int nr = 0;
+
+	spin_lock(&sq->lock);
+	list_for_each_entry_safe(req, next, &sq->poll_list, queuelist) {
+		struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+		if (cmd->deadline <= now)
+			list_move_tail(&req->queuelist, &done);
+	}
+	spin_unlock(&sq->lock);
+
+	list_for_each_entry_safe(req, next, &done, queuelist) {
+		list_del_init(&req->queuelist);
+		sbull_end_request(req);
+		nr++;
+	}
+	return nr;
+}
+
+static int sbull_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+						unsigned int index)
+{
+	struct sbull_dev *dev = data;
+	struct sbull_queue *sq = &dev->queues[index];
+
+	spin_lock_init(&sq->lock);
+	INIT_LIST_HEAD(&sq->poll_list);
+	hctx->driver_data = sq;
+	return 0;
+}
+
+static int sbull_init_request(struct blk_mq_tag_set *set, struct request *req,
+						unsigned int hctx_idx, unsigned int numa_node)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	cmd->timer.function = sbull_cmd_timer;
+	return 0;
 }
 
 /*
@@ -132,12 +661,15 @@ static blk_status_t sbull_request(struct blk_mq_hw_ctx *hctx,
 {
 	struct request *req = bd->rq;
 	struct sbull_dev *dev = req->rq_disk->private_data;
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
 	struct bio_vec bvec;
 	struct req_iterator iter;
 	sector_t pos_sector = blk_rq_pos(req);
 	void *buffer;
 	blk_status_t ret;
+	int err;
 
+	cmd->start = ldd_stats_now();
 	blk_mq_start_request(req);
 
 	if(blk_rq_is_passthrough(req)) {
@@ -146,20 +678,28 @@ static blk_status_t sbull_request(struct blk_mq_hw_ctx *hctx,
 		goto done;
 	}
 
+	ret = BLK_STS_OK;
+	if (sbull_op_is_discard(req_op(req))) {
+		if (sbull_discard(dev, pos_sector, blk_rq_sectors(req)))
+			ret = BLK_STS_IOERR;
+		goto done;
+	}
+
+	/* Flushes have no segments: our writes are stable already */
 	rq_for_each_segment(bvec, req, iter) {
-		size_t num_sector = blk_rq_cur_sectors(req);
-		printk(KERN_NOTICE "Req dev %u dir %d sec %lld, nr %ld\n",
-				(unsigned)(dev - Devices), rq_data_dir(req),
-				pos_sector, num_sector);
+		size_t num_sector = bvec.bv_len / KERNEL_SECTOR_SIZE;
 		buffer = page_address(bvec.bv_page) + bvec.bv_offset;
-		sbull_transfer(dev, pos_sector, num_sector, buffer,
+		err = sbull_transfer(dev, pos_sector, num_sector, buffer,
 						rq_data_dir(req) == WRITE);
+		if (err) {
+			ret = errno_to_blk_status(err);
+			break;
+		}
 		pos_sector += num_sector;
 	}
-	ret = BLK_STS_OK;
 done:
-	blk_mq_end_request(req, ret);
-	return ret;
+	sbull_complete(hctx, req, ret);
+	return BLK_STS_OK; /* Ours to complete, even on error */
 }
 
 /*
@@ -170,14 +710,23 @@ static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
 	struct bio_vec bvec;
 	struct bvec_iter iter;
 	sector_t sector = bio->bi_iter.bi_sector;
+	int err;
 
-	/* Do each segment independently. */
+	if (sbull_op_is_discard(bio_op(bio)))
+		return sbull_discard(dev, sector, bio_sectors(bio));
+
+	/*
+	 * Do each segment independently. The mapping must not disable
+	 * preemption: a sparse write allocates pages, and can sleep.
+	 */
 	bio_for_each_segment(bvec, bio, iter) {
-		char *buffer = kmap_atomic(bvec.bv_page) + bvec.bv_offset;
-		sbull_transfer(dev, sector, (bio_cur_bytes(bio) / KERNEL_SECTOR_SIZE),
+		char *buffer = kmap_local_page(bvec.bv_page) + bvec.bv_offset;
+		err = sbull_transfer(dev, sector, (bvec.bv_len / KERNEL_SECTOR_SIZE),
 				buffer, bio_data_dir(bio) == WRITE);
-		sector += (bio_cur_bytes(bio) / KERNEL_SECTOR_SIZE);
-		kunmap_atomic(buffer);
+		sector += (bvec.bv_len / KERNEL_SECTOR_SIZE);
+		kunmap_local(buffer);
+		if (err)
+			return err;
 	}
 	return 0;
 }
@@ -186,9 +735,12 @@ static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 {
 	struct bio *bio;
 	int nsect = 0;
+	int err;
 
 	__rq_for_each_bio(bio, req) {
-		sbull_xfer_bio(dev, bio);
+		err = sbull_xfer_bio(dev, bio);
+		if (err)
+			return err;
 		nsect += bio->bi_iter.bi_size / KERNEL_SECTOR_SIZE;
 	}
 	return nsect;
@@ -202,8 +754,10 @@ static blk_status_t sbull_full_request(struct blk_mq_hw_ctx *hctx,
 	struct request *req = bd->rq;
 	int sectors_xferred;
 	struct sbull_dev *dev = req->q->queuedata;
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
 	blk_status_t ret;
 
+	cmd->start = ldd_stats_now();
 	blk_mq_start_request(req);
 
 	if (blk_rq_is_passthrough(req)) {
@@ -213,11 +767,11 @@ static blk_status_t sbull_full_request(struct blk_mq_hw_ctx *hctx,
 	}
 
 	sectors_xferred = sbull_xfer_request(dev, req);
-	ret = BLK_STS_OK;
+	ret = sectors_xferred < 0 ? errno_to_blk_status(sectors_xferred) : BLK_STS_OK;
 done:
-	blk_mq_end_request(req, ret);
+	sbull_complete(hctx, req, ret);
 
-	return ret;
+	return BLK_STS_OK; /* Ours to complete, even on error */
 }
 /*
  * The direct make request version.
@@ -229,10 +783,13 @@ static blk_qc_t sbull_make_request(struct bio *bio)
 #endif
 {
 	struct sbull_dev *dev = bio->bi_bdev->bd_disk->private_data;
+	unsigned int bytes = bio->bi_iter.bi_size;
+	u64 start = ldd_stats_now();
 	int status;
 
 	status = sbull_xfer_bio(dev, bio);
-	bio->bi_status = status;
+	sbull_account(dev, bio_op(bio), bytes, start, status);
+	bio->bi_status = errno_to_blk_status(status);
 	bio_endio(bio);
 
 	return BLK_QC_T_NONE;
@@ -306,7 +863,10 @@ static int sbull_revalidate(struct gendisk *gd)
 
 	if (dev->media_change) {
 		dev->media_change = 0;
-		memset(dev->data, 0, dev->size);
+		if (sparse)
+			sbull_free_pages(dev);
+		else
+			memset(dev->data, 0, dev->size);
 	}
 	return 0;
 }
@@ -326,7 +886,7 @@ void sbull_invalidate(struct timer_list * ldev)
 #endif
 
 	spin_lock(&dev->lock);
-	if (dev->users || !dev->data)
+	if (dev->users || (!dev->data && !sparse))
 		printk(KERN_WARNING "sbull: timer  sanity check failed\n");
 	else
 		dev->media_change = 1;
@@ -378,14 +938,131 @@ static struct block_device_operations sbull_ops = {
 	.ioctl 				= sbull_ioctl
 };
 
+/* How many queues the submitting CPUs are spread over */
+static int sbull_default_queues(void)
+{
+	switch (queue_mode) {
+	case QM_PER_CPU:
+		return nr_cpu_ids;
+	case QM_PER_NODE:
+		return nr_node_ids;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Lay out the queue maps: the default queues first, then the poll
+ * queues, if any. Per-node queues need their own CPU map: every CPU
+ * submits to the queue of its node. The rest is happy with the
+ * default spread.
+*/
+static int sbull_map_queues(struct blk_mq_tag_set *set)
+{
+	struct blk_mq_queue_map *qmap;
+	unsigned int cpu, offset = 0;
+	int i;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		qmap = &set->map[i];
+		switch (i) {
+		case HCTX_TYPE_DEFAULT:
+			qmap->nr_queues = sbull_default_queues();
+			break;
+		case HCTX_TYPE_POLL:
+			qmap->nr_queues = poll_queues;
+			break;
+		default: /* No separate read queues */
+			qmap->nr_queues = 0;
+			continue;
+		}
+		qmap->queue_offset = offset;
+		offset += qmap->nr_queues;
+
+		if (i != HCTX_TYPE_DEFAULT || queue_mode != QM_PER_NODE) {
+			blk_mq_map_queues(qmap);
+			continue;
+		}
+		for_each_possible_cpu(cpu)
+			qmap->mq_map[cpu] = qmap->queue_offset +
+				cpu_to_node(cpu) % qmap->nr_queues;
+	}
+	return 0;
+}
+
 static struct blk_mq_ops mq_ops_simple = {
 	.queue_rq = sbull_request,
+	.map_queues = sbull_map_queues,
+	.init_hctx = sbull_init_hctx,
+	.init_request = sbull_init_request,
+	.poll = sbull_poll,
 };
 
 static struct blk_mq_ops mq_ops_full = {
 	.queue_rq = sbull_full_request,
+	.map_queues = sbull_map_queues,
+	.init_hctx = sbull_init_hctx,
+	.init_request = sbull_init_request,
+	.poll = sbull_poll,
 };
 
+/*
+ * Fill in the tag set for one of the blk-mq request modes.
+*/
+static int sbull_alloc_tag_set(struct sbull_dev *dev, struct blk_mq_ops *ops)
+{
+	struct blk_mq_tag_set *set = &dev->tag_set;
+	int err;
+
+	set->ops = ops;
+	set->nr_hw_queues = sbull_default_queues() + max(poll_queues, 0);
+	set->nr_maps = poll_queues > 0 ? HCTX_MAX_TYPES : 1;
+	set->queue_depth = queue_depth;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct sbull_cmd);
+	set->flags = BLK_MQ_F_SHOULD_MERGE;
+	if (sparse) /* We may sleep allocating pages */
+		set->flags |= BLK_MQ_F_BLOCKING;
+	set->driver_data = dev;
+
+	dev->queues = kcalloc(set->nr_hw_queues, sizeof(struct sbull_queue),
+			GFP_KERNEL);
+	if (!dev->queues)
+		return -ENOMEM;
+	err = blk_mq_alloc_tag_set(set);
+	if (err) {
+		kfree(dev->queues);
+		dev->queues = NULL;
+	}
+	return err;
+}
+
+/*
+ * Tell the block layer what we can take. Discard and write-zeroes are
+ * cheap whatever the store, so any size goes; the sparse store only
+ * gives memory back a page at a time, though.
+*/
+static void sbull_set_limits(struct request_queue *q)
+{
+	blk_queue_logical_block_size(q, hardsect_size);
+	blk_queue_physical_block_size(q, hardsect_size);
+	blk_queue_io_min(q, hardsect_size);
+	if (io_opt > 0)
+		blk_queue_io_opt(q, io_opt);
+	if (max_hw_sectors > 0)
+		blk_queue_max_hw_sectors(q, max_hw_sectors);
+	if (max_segments > 0)
+		blk_queue_max_segments(q, max_segments);
+	blk_queue_write_cache(q, write_cache, write_cache);
+
+	q->limits.discard_granularity = sparse ? PAGE_SIZE : hardsect_size;
+	blk_queue_max_discard_sectors(q, UINT_MAX >> 9);
+	blk_queue_max_write_zeroes_sectors(q, UINT_MAX >> 9);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0))
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+#endif
+}
+
 /*
  * Set up our internal devices.
 */
@@ -396,11 +1073,20 @@ static void setup_device(struct sbull_dev *dev, int which)
 	 * Get some memory.
 	*/
 	memset(dev, 0, sizeof(struct sbull_dev));
-	dev->size = nsectors * hardsect_size;
-	dev->data = vmalloc(dev->size);
-	if(dev->data == NULL) {
-		printk(KERN_NOTICE "vmalloc failure.\n");
-		return;
+	xa_init(&dev->pages);
+	dev->size = (unsigned long)nsectors * hardsect_size;
+	if (dax_phys) {
+		err = sbull_dax_map(dev, which);
+		if (err) {
+			printk(KERN_NOTICE "sbull: can't map DAX memory, error %d\n", err);
+			return;
+		}
+	} else if (!sparse) {
+		dev->data = vmalloc(dev->size);
+		if(dev->data == NULL) {
+			printk(KERN_NOTICE "vmalloc failure.\n");
+			return;
+		}
 	}
 	spin_lock_init(&dev->lock);
 	
@@ -440,14 +1126,7 @@ static void setup_device(struct sbull_dev *dev, int which)
 		break;
 
 	case RM_FULL:
-		dev->tag_set.ops = &mq_ops_full;
-		dev->tag_set.nr_hw_queues = 1;
-		dev->tag_set.queue_depth = 128;
-		dev->tag_set.numa_node = NUMA_NO_NODE;
-		dev->tag_set.cmd_size = 0;
-		dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
-
-		err = blk_mq_alloc_tag_set(&dev->tag_set);
+		err = sbull_alloc_tag_set(dev, &mq_ops_full);
 		if(err) {
 			printk(KERN_WARNING "alloc tag set error, return\n");
 			return;
@@ -459,14 +1138,7 @@ static void setup_device(struct sbull_dev *dev, int which)
 		break;
 
 	case RM_SIMPLE:
-		dev->tag_set.ops = &mq_ops_simple;
-		dev->tag_set.nr_hw_queues = 1;
-		dev->tag_set.queue_depth = 128;
-		dev->tag_set.numa_node = NUMA_NO_NODE;
-		dev->tag_set.cmd_size = 0;
-		dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
-
-		err = blk_mq_alloc_tag_set(&dev->tag_set);
+		err = sbull_alloc_tag_set(dev, &mq_ops_simple);
 		if(err) {
 			printk(KERN_WARNING "alloc tag set error, return\n");
 			return;
@@ -480,7 +1152,7 @@ static void setup_device(struct sbull_dev *dev, int which)
 	default:
 		printk(KERN_NOTICE "Bad request mode %d, using simple", request_mode);
 	}
-	blk_queue_logical_block_size(dev->queue, hardsect_size);
+	sbull_set_limits(dev->queue);
 	dev->queue->queuedata = dev;
 
 	/*
@@ -500,6 +1172,10 @@ static void setup_device(struct sbull_dev *dev, int which)
 
 	snprintf(dev->gd->disk_name, 32, "sbull%c", which + 'a');
 	set_capacity(dev->gd, nsectors * (hardsect_size / KERNEL_SECTOR_SIZE));
+	if (dax_phys && sbull_dax_add(dev))
+		printk(KERN_NOTICE "sbull: %s works without DAX\n", dev->gd->disk_name);
+	ldd_stats_init(&dev->stats, dev->gd->disk_name, sbull_debugfs,
+			sbull_counters, SBULL_NCOUNTERS, sbull_hists, SBULL_NHISTS);
 	add_disk(dev->gd);
 return;
 
@@ -508,8 +1184,9 @@ out_vfree:
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(5, 15, 0))
 	blk_mq_free_tag_set(&dev->tag_set);
 #endif
-	if (dev->data)
-		vfree(dev->data);
+	sbull_free_data(dev);
+	kfree(dev->queues);
+	dev->queues = NULL;
 }
 
 static int __init sbull_init(void)
@@ -529,6 +1206,28 @@ static int __init sbull_init(void)
 	Devices = kmalloc(ndevices * sizeof(struct sbull_dev), GFP_KERNEL);
 	if (Devices == NULL)
 		goto out_unregister;
+	/*
+	 * Logical blocks beyond a page need a kernel that can do large
+	 * block sizes; those define how far they go.
+	 */
+#ifdef BLK_MAX_BLOCK_SIZE
+	if (hardsect_size < 512 || hardsect_size > BLK_MAX_BLOCK_SIZE ||
+#else
+	if (hardsect_size < 512 || hardsect_size > PAGE_SIZE ||
+#endif
+			!is_power_of_2(hardsect_size)) {
+		printk(KERN_NOTICE "sbull: bad hardsect_size %d, using 512\n",
+				hardsect_size);
+		hardsect_size = 512;
+	}
+	if (dax_phys && sparse) {
+		printk(KERN_NOTICE "sbull: DAX disks can't be sparse, ignoring sparse\n");
+		sparse = 0;
+	}
+#ifdef SBULL_DEBUG
+	LDD_LAYOUT_SHOW(struct sbull_dev, sbull_dev_fields);
+#endif
+	sbull_debugfs = debugfs_create_dir("sbull", NULL);
 	for (i = 0; i < ndevices; i++)
 		setup_device(Devices + i, i);
 	
@@ -548,6 +1247,7 @@ static void __exit sbull_exit(void)
 		del_timer_sync(&dev->timer);
 		if(dev->gd) {
 			del_gendisk(dev->gd);
+			sbull_dax_remove(dev);
 			put_disk(dev->gd);
 		}
 		if(dev->queue) {
@@ -559,9 +1259,12 @@ static void __exit sbull_exit(void)
 		}
 
 		blk_mq_free_tag_set(&dev->tag_set);
-		if (dev->data)
-			vfree(dev->data);
+		sbull_free_data(dev);
+		sbull_free_pages(dev);
+		kfree(dev->queues);
+		ldd_stats_exit(&dev->stats);
 	}
+	debugfs_remove_recursive(sbull_debugfs);
 	unregister_blkdev(sbull_major, "sbull");
 	kfree(Devices);
 }
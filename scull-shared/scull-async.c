@@ -28,56 +28,243 @@
 #include <linux/aio.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
+#include <linux/llist.h>
+#include <linux/mempool.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/sched/mm.h>
+#include <linux/kthread.h>
+#include <linux/version.h>
+
+#include "scull-async.h"
 
 /*
-* A simple asynchornous I/O impementation
+ * A simple asynchronous I/O implementation
+ *
+ * The data lives in memory, so most of the time it is ready when the
+ * request comes in: then we just do the transfer in the submitter's
+ * context and return the count, which the aio core turns into an
+ * immediate completion. Only when the device is busy do we queue the
+ * request, on a per-CPU list drained by a worker on that CPU; one
+ * wakeup handles however many requests piled up meanwhile.
  */
 
-struct async_work {
-    struct delayed_work work;
+#define SCULL_ASYNC_POOL 32 /* requests we can queue without kmalloc */
+
+struct scull_async_req {
+    struct llist_node node;
     struct kiocb *iocb;
-    struct iov_iter *tofrom;
+    struct iov_iter iter;
+    const void *iov;            /* our copy of the caller's iovec, if any */
+    struct mm_struct *mm;       /* whose user memory iter points at */
 };
 
-static void scull_do_deferred_op(struct work_struct *work)
+struct scull_async_cpu {
+    struct llist_head list;
+    struct work_struct work;
+};
+
+static const struct scull_async_ops *scull_async_ops;
+static mempool_t *scull_async_pool;
+static struct workqueue_struct *scull_async_wq;
+static DEFINE_PER_CPU(struct scull_async_cpu, scull_async_cpus);
+
+/*
+ * The user buffer the iterator is at, and how much of it is left.
+ * Since 6.0 a single-buffer read or write comes as ITER_UBUF rather
+ * than a one-entry iovec, and since 6.4 iov_iter_iovec() is gone.
+ */
+static struct iovec scull_async_segment(const struct iov_iter *iter)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+    return (struct iovec) {
+        .iov_base = iter_iov_addr(iter),
+        .iov_len = iter_iov_len(iter),
+    };
+#else
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+    if (iter_is_ubuf(iter))
+        return (struct iovec) {
+            .iov_base = iter->ubuf + iter->iov_offset,
+            .iov_len = iter->count,
+        };
+#endif
+    return iov_iter_iovec(iter);
+#endif
+}
+
+/*
+ * Move the data, one segment at a time: the device methods work on
+ * plain user buffers and may stop at a quantum boundary.
+ */
+static ssize_t scull_async_transfer(struct kiocb *iocb, struct iov_iter *iter)
+{
+    struct file *filp = iocb->ki_filp;
+    ssize_t ret = 0, done = 0;
+
+    while (iov_iter_count(iter)) {
+        struct iovec iov = scull_async_segment(iter);
+
+        if (iov_iter_rw(iter) == WRITE)
+            ret = scull_async_ops->write(filp, iov.iov_base, iov.iov_len,
+                    &iocb->ki_pos);
+        else
+            ret = scull_async_ops->read(filp, iov.iov_base, iov.iov_len,
+                    &iocb->ki_pos);
+        if (ret <= 0)
+            break;
+        iov_iter_advance(iter, ret);
+        done += ret;
+    }
+    return done ? done : ret;
+}
+
+static void scull_async_complete(struct kiocb *iocb, ssize_t ret)
 {
-    struct async_work *stuff = container_of(work, struct async_work, work.work);
-    if (iov_iter_rw(stuff->tofrom) == WRITE) {
-        generic_file_write_iter(stuff->iocb, stuff->tofrom);
-    } else {
-        generic_file_read_iter(stuff->iocb, stuff->tofrom);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
+    iocb->ki_complete(iocb, ret, 0);
+#else
+    iocb->ki_complete(iocb, ret);
+#endif
+}
+
+static void scull_async_run(struct scull_async_req *req)
+{
+    ssize_t ret = -EFAULT;
+
+    /* Borrow the submitter's address space, if it's still around */
+    if (mmget_not_zero(req->mm)) {
+        kthread_use_mm(req->mm);
+        ret = scull_async_transfer(req->iocb, &req->iter);
+        kthread_unuse_mm(req->mm);
+        mmput(req->mm);
     }
-    kfree(stuff);
+    mmdrop(req->mm);
+    kfree(req->iov);
+    scull_async_complete(req->iocb, ret);
+    mempool_free(req, scull_async_pool);
 }
 
-static int scull_defer_op(struct kiocb *iocb, struct iov_iter *tofrom)
+static void scull_async_worker(struct work_struct *work)
 {
-    struct async_work *stuff;
-    int result;
-    /* Otherwise defer the completeion for a few milliseconds. */
-    stuff = kmalloc(sizeof(*stuff), GFP_KERNEL);
-    if (stuff == NULL)
-        return result; /* No memory, just complete now */
-    stuff->iocb = iocb;
-    INIT_DELAYED_WORK(&stuff->work, scull_do_deferred_op);
-    schedule_delayed_work(&stuff->work, HZ/100);
+    struct scull_async_cpu *sac = container_of(work, struct scull_async_cpu,
+            work);
+    struct llist_node *list;
+    struct scull_async_req *req, *next;
+
+    /* Take everything queued so far, oldest first */
+    list = llist_reverse_order(llist_del_all(&sac->list));
+    llist_for_each_entry_safe(req, next, list, node)
+        scull_async_run(req);
+}
+
+/*
+ * The caller's iovec array goes away when it returns: keep a copy. A
+ * single user buffer lives in the iterator itself, which dup_iter()
+ * doesn't know about.
+ */
+static int scull_async_dup_iter(struct scull_async_req *req,
+        struct iov_iter *iter)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+    if (iter_is_ubuf(iter)) {
+        req->iter = *iter;
+        req->iov = NULL;
+        return 0;
+    }
+#endif
+    req->iov = dup_iter(&req->iter, iter, GFP_KERNEL);
+    return req->iov ? 0 : -ENOMEM;
+}
+
+static ssize_t scull_async_queue(struct kiocb *iocb, struct iov_iter *iter)
+{
+    struct scull_async_req *req;
+    struct scull_async_cpu *sac;
+
+    req = mempool_alloc(scull_async_pool, GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
+    if (scull_async_dup_iter(req, iter)) {
+        mempool_free(req, scull_async_pool);
+        return -ENOMEM;
+    }
+    req->iocb = iocb;
+    req->mm = current->mm;
+    mmgrab(req->mm);
+
+    sac = get_cpu_ptr(&scull_async_cpus);
+    if (llist_add(&req->node, &sac->list)) /* first one: wake the worker */
+        queue_work_on(smp_processor_id(), scull_async_wq, &sac->work);
+    put_cpu_ptr(&scull_async_cpus);
+    /* The caller's iter is consumed from its point of view */
+    iov_iter_advance(iter, iov_iter_count(iter));
     return -EIOCBQUEUED;
 }
 
+static ssize_t scull_async_submit(struct kiocb *iocb, struct iov_iter *iter)
+{
+    /* The device methods want user pointers */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+    if (!user_backed_iter(iter))
+#else
+    if (!iter_is_iovec(iter))
+#endif
+        return -EINVAL;
+
+    /*
+     * If this is a synchronous IOCB, or the device isn't busy, we
+     * return our status now
+     */
+    if (is_sync_kiocb(iocb) || !scull_async_ops->busy ||
+            !scull_async_ops->busy(iocb->ki_filp))
+        return scull_async_transfer(iocb, iter);
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return -EAGAIN;
+    return scull_async_queue(iocb, iter);
+}
+
 ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    /* If this is a synchronous IOCB, we return out status now */
-    if (is_sync_kiocb(iocb)) {
-        return generic_file_write_iter(iocb, from);
-    }
-    return scull_defer_op(iocb, from);
+    return scull_async_submit(iocb, from);
 }
 
 ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    /* If this is a synchronous IOCB, we return out status now */
-    if (is_sync_kiocb(iocb)) {
-        return generic_file_read_iter(iocb, to);
+    return scull_async_submit(iocb, to);
+}
+
+int scull_async_init(const struct scull_async_ops *ops)
+{
+    int cpu;
+
+    scull_async_pool = mempool_create_kmalloc_pool(SCULL_ASYNC_POOL,
+            sizeof(struct scull_async_req));
+    if (!scull_async_pool)
+        return -ENOMEM;
+    scull_async_wq = alloc_workqueue("scull_async", WQ_HIGHPRI, 0);
+    if (!scull_async_wq) {
+        mempool_destroy(scull_async_pool);
+        scull_async_pool = NULL;
+        return -ENOMEM;
     }
-    return scull_defer_op(iocb, to);
-}
\ No newline at end of file
+    for_each_possible_cpu(cpu) {
+        struct scull_async_cpu *sac = per_cpu_ptr(&scull_async_cpus, cpu);
+
+        init_llist_head(&sac->list);
+        INIT_WORK(&sac->work, scull_async_worker);
+    }
+    scull_async_ops = ops;
+    return 0;
+}
+
+void scull_async_exit(void)
+{
+    if (!scull_async_wq) /* never initialized */
+        return;
+    /* Every queued request holds a file reference: none left by now */
+    destroy_workqueue(scull_async_wq);
+    mempool_destroy(scull_async_pool);
+    scull_async_wq = NULL;
+    scull_async_pool = NULL;
+}
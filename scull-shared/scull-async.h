@@ -18,7 +18,24 @@
 #ifndef SCULL_SHARED_SCULL_ASYNC_H_
 #define SCULL_SHARED_SCULL_ASYNC_H_
 
+/*
+ * What a module tells the async engine: its plain read and write
+ * methods, and optionally how to tell whether the device is busy right
+ * now (a request for a busy device goes to a worker rather than
+ * sleeping in the submitter).
+ */
+struct scull_async_ops {
+    ssize_t (*read)(struct file *filp, char __user *buf, size_t count,
+            loff_t *f_pos);
+    ssize_t (*write)(struct file *filp, const char __user *buf,
+            size_t count, loff_t *f_pos);
+    bool (*busy)(struct file *filp);
+};
+
+int scull_async_init(const struct scull_async_ops *ops);
+void scull_async_exit(void);
+
 ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
 
-#endif /* SCULL_SHARED_SCULL_ASYNC_H_*/
\ No newline at end of file
+#endif /* SCULL_SHARED_SCULL_ASYNC_H_*/
@@ -0,0 +1,219 @@
+/*
+ * scull-backend.c -- allocators for the quanta of the scull* modules
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+
+#include "scull-backend.h"
+
+/* kmalloc: the general purpose allocator, any size */
+static void *scull_kmalloc_alloc(struct scull_store *st, gfp_t gfp, int node)
+{
+    return kmalloc_node(st->quantum, gfp, node);
+}
+
+static void scull_kmalloc_free(struct scull_store *st, void *q)
+{
+    kfree(q);
+}
+
+/* slab: a cache of our own, sized to the quantum */
+static int scull_slab_init(struct scull_store *st)
+{
+    st->cache = kmem_cache_create(st->name, st->quantum, 0,
+            SLAB_HWCACHE_ALIGN, NULL);
+    return st->cache ? 0 : -ENOMEM;
+}
+
+static void scull_slab_exit(struct scull_store *st)
+{
+    kmem_cache_destroy(st->cache);
+    st->cache = NULL;
+}
+
+static void *scull_slab_alloc(struct scull_store *st, gfp_t gfp, int node)
+{
+    return kmem_cache_alloc_node(st->cache, gfp, node);
+}
+
+static void scull_slab_free(struct scull_store *st, void *q)
+{
+    kmem_cache_free(st->cache, q);
+}
+
+/* pages: whole pages from the buddy allocator, the quantum rounded up */
+static int scull_pages_init(struct scull_store *st)
+{
+    st->order = get_order(st->quantum);
+    st->quantum = PAGE_SIZE << st->order;
+    return 0;
+}
+
+static void *scull_pages_alloc(struct scull_store *st, gfp_t gfp, int node)
+{
+    struct page *page;
+
+    /*
+     * A compound page keeps its tail pages' refcounts on the head, so
+     * the pages can be mapped one at a time and freed as a unit.
+     */
+    if (st->order)
+        gfp |= __GFP_COMP;
+    page = alloc_pages_node(node, gfp, st->order);
+    return page ? page_address(page) : NULL;
+}
+
+static void scull_pages_free(struct scull_store *st, void *q)
+{
+    free_pages((unsigned long)q, st->order);
+}
+
+static struct page *scull_pages_page(struct scull_store *st, void *q,
+        unsigned long pgoff)
+{
+    return virt_to_page(q) + pgoff;
+}
+
+/* vmalloc: virtually contiguous, physically anything */
+static int scull_vmalloc_init(struct scull_store *st)
+{
+    st->quantum = PAGE_ALIGN(st->quantum);
+    return 0;
+}
+
+static void *scull_vmalloc_alloc(struct scull_store *st, gfp_t gfp, int node)
+{
+    return vmalloc_node(st->quantum, node);
+}
+
+static void scull_vmalloc_free(struct scull_store *st, void *q)
+{
+    vfree(q);
+}
+
+static struct page *scull_vmalloc_page(struct scull_store *st, void *q,
+        unsigned long pgoff)
+{
+    return vmalloc_to_page(q + (pgoff << PAGE_SHIFT));
+}
+
+static const struct scull_backend scull_backends[] = {
+    {
+        .name = "kmalloc",
+        .alloc = scull_kmalloc_alloc,
+        .free = scull_kmalloc_free,
+    },
+    {
+        .name = "slab",
+        .init = scull_slab_init,
+        .exit = scull_slab_exit,
+        .alloc = scull_slab_alloc,
+        .free = scull_slab_free,
+    },
+    {
+        .name = "pages",
+        .init = scull_pages_init,
+        .alloc = scull_pages_alloc,
+        .free = scull_pages_free,
+        .page = scull_pages_page,
+        .contiguous = true,
+    },
+    {
+        .name = "vmalloc",
+        .init = scull_vmalloc_init,
+        .alloc = scull_vmalloc_alloc,
+        .free = scull_vmalloc_free,
+        .page = scull_vmalloc_page,
+    },
+};
+
+/*
+ * Set up a store of the named backend. The quantum may be rounded up
+ * to what the backend can do, so callers should read it back.
+ */
+int scull_store_init(struct scull_store *st, const char *backend,
+        const char *name, size_t quantum)
+{
+    int i, err;
+
+    memset(st, 0, sizeof(*st));
+    for (i = 0; i < ARRAY_SIZE(scull_backends); i++)
+        if (sysfs_streq(backend, scull_backends[i].name))
+            st->ops = &scull_backends[i];
+    if (!st->ops) {
+        printk(KERN_WARNING "scull: unknown backend \"%s\"\n", backend);
+        return -EINVAL;
+    }
+    st->quantum = quantum;
+    strscpy(st->name, name, sizeof(st->name));
+    if (st->ops->init && (err = st->ops->init(st)) < 0) {
+        st->ops = NULL;
+        return err;
+    }
+    return 0;
+}
+
+void scull_store_exit(struct scull_store *st)
+{
+    if (!st->ops) /* never initialized */
+        return;
+    if (st->ops->exit)
+        st->ops->exit(st);
+    st->ops = NULL;
+}
+
+/*
+ * Change the quantum of an empty store. On failure the store is left
+ * as it was.
+ */
+int scull_store_resize(struct scull_store *st, size_t quantum)
+{
+    struct scull_store new;
+    int err;
+
+    err = scull_store_init(&new, st->ops->name, st->name, quantum);
+    if (err)
+        return err;
+    if (new.quantum == st->quantum) {
+        scull_store_exit(&new); /* nothing changes */
+        return 0;
+    }
+    scull_store_exit(st);
+    *st = new;
+    return 0;
+}
+
+/*
+ * Backends are given per module as a comma separated list: device
+ * "index" gets entry "index", and the last entry goes on for the
+ * devices past the end of the list.
+ */
+const char *scull_backend_pick(const char *list, int index, char *buf,
+        size_t len)
+{
+    const char *end;
+
+    while (index-- > 0 && (end = strchr(list, ',')))
+        list = end + 1;
+    end = strchrnul(list, ',');
+    strscpy(buf, list, min_t(size_t, len, end - list + 1));
+    return buf;
+}
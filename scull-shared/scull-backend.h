@@ -0,0 +1,100 @@
+/*
+ * scull-backend.h -- where the quanta of the scull* modules come from
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef SCULL_SHARED_SCULL_BACKEND_H_
+#define SCULL_SHARED_SCULL_BACKEND_H_
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+#include <linux/atomic.h>
+
+/*
+ * scullc, scullp, scullv and sculld differ in how a quantum is
+ * allocated and mapped, and in nothing else that matters. That part
+ * lives here, behind a table of methods, so any module can use any
+ * allocator:
+ *
+ *   "kmalloc"  kmalloc_node()
+ *   "slab"     a kmem cache of the store's own
+ *   "pages"    __get_free_pages(), compound when order > 0
+ *   "vmalloc"  vmalloc_node()
+ *
+ * Only "pages" and "vmalloc" quanta can be mmap'd: slab memory can't
+ * be handed to user space a page at a time.
+ */
+struct scull_store;
+
+struct scull_backend {
+    const char *name;
+    int (*init)(struct scull_store *st);        /* optional */
+    void (*exit)(struct scull_store *st);       /* optional */
+    void *(*alloc)(struct scull_store *st, gfp_t gfp, int node);
+    void (*free)(struct scull_store *st, void *q);
+    /* page "pgoff" of quantum "q", or no method if it can't be mapped */
+    struct page *(*page)(struct scull_store *st, void *q, unsigned long pgoff);
+    bool contiguous;            /* each quantum is one naturally aligned block */
+};
+
+/* One allocator instance: a backend and a quantum size */
+struct scull_store {
+    const struct scull_backend *ops;
+    size_t quantum;             /* bytes in each quantum */
+    int order;                  /* "pages": quantum is PAGE_SIZE << order */
+    struct kmem_cache *cache;   /* "slab" */
+    char name[16];              /* for the cache */
+    atomic_long_t quanta;       /* allocated right now, for scull-bench */
+};
+
+int scull_store_init(struct scull_store *st, const char *backend,
+        const char *name, size_t quantum);
+void scull_store_exit(struct scull_store *st);
+int scull_store_resize(struct scull_store *st, size_t quantum);
+const char *scull_backend_pick(const char *list, int index, char *buf,
+        size_t len);
+
+static inline void *scull_store_alloc(struct scull_store *st, gfp_t gfp,
+        int node)
+{
+    void *q = st->ops->alloc(st, gfp, node);
+
+    if (q)
+        atomic_long_inc(&st->quanta);
+    return q;
+}
+
+static inline void scull_store_free(struct scull_store *st, void *q)
+{
+    st->ops->free(st, q);
+    atomic_long_dec(&st->quanta);
+}
+
+static inline int scull_store_mappable(struct scull_store *st)
+{
+    return st->ops->page != NULL;
+}
+
+static inline struct page *scull_store_page(struct scull_store *st, void *q,
+        unsigned long pgoff)
+{
+    return st->ops->page(st, q, pgoff);
+}
+
+/* Can a quantum be mapped by a single PFN range, as a huge page? */
+static inline int scull_store_contiguous(struct scull_store *st)
+{
+    return st->ops->page && st->ops->contiguous;
+}
+
+#endif /* SCULL_SHARED_SCULL_BACKEND_H_ */
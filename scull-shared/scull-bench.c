@@ -0,0 +1,393 @@
+/*
+ * scull-bench.c -- fixed workloads against the scull* devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/anon_inodes.h>
+#include <linux/sched/signal.h>
+#include <linux/version.h>
+
+#include "scull-backend.h"
+#include "scull-bench.h"
+#include "proc_ops_version.h"
+
+/*
+ * Writing a device number to /proc/<module>bench runs the suite on
+ * that device, in the writer's context; reading the file shows the
+ * last results. The suite goes through the module's own read, write,
+ * trim and mmap methods, so what it measures is what users get. It
+ * trims the device first and last: whatever the device held is lost.
+ *
+ * Loading a module with a list of backends (scullp_backend=pages,
+ * vmalloc for instance) and running the suite on each device compares
+ * the backends with everything else equal.
+ */
+
+#define SCULL_BENCH_SIZE    (1 << 20)   /* bytes in each sequential pass */
+#define SCULL_BENCH_RANDOM  1024        /* ops in each random pass */
+#define SCULL_BENCH_TRIMS   8           /* full devices to trim */
+#define SCULL_BENCH_BUF     65536       /* the user buffer, biggest block */
+#define SCULL_BENCH_MAX     16          /* results kept */
+
+static const size_t scull_bench_sizes[] = { 64, 4096, SCULL_BENCH_BUF };
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0)
+#define scull_bench_rand(n) prandom_u32_max(n)
+#else
+#define scull_bench_rand(n) get_random_u32_below(n)
+#endif
+
+struct scull_bench_result {
+    const char *what;
+    size_t bsize;
+    unsigned long ops;
+    u64 ns;                     /* all of them */
+    u64 p50, p99, max;          /* each one */
+};
+
+/* What a run works with */
+struct scull_bench_run {
+    void *dev;
+    struct file *filp;          /* an anonymous file on the device */
+    char __user *ubuf;          /* SCULL_BENCH_BUF of user memory */
+    u64 *samples;               /* ns for each op of a pass */
+};
+
+static const struct scull_bench_ops *scull_bench_ops;
+static char scull_bench_name[24];
+static struct proc_dir_entry *scull_bench_proc;
+
+/* The last results, protected by the mutex */
+static DEFINE_MUTEX(scull_bench_mutex);
+static struct scull_bench_result scull_bench_results[SCULL_BENCH_MAX];
+static int scull_bench_nresults;
+static int scull_bench_index = -1;
+static const char *scull_bench_backend;
+static size_t scull_bench_quantum;
+static long scull_bench_resident;   /* bytes in quanta for one full pass */
+static int scull_bench_mmap_err;
+static int scull_bench_err;
+
+static int scull_bench_cmp(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void scull_bench_record(const char *what, size_t bsize, u64 *samples,
+        unsigned long n)
+{
+    struct scull_bench_result *r;
+    unsigned long i;
+
+    if (!n || scull_bench_nresults == SCULL_BENCH_MAX)
+        return;
+    r = scull_bench_results + scull_bench_nresults++;
+    r->what = what;
+    r->bsize = bsize;
+    r->ops = n;
+    r->ns = 0;
+    for (i = 0; i < n; i++)
+        r->ns += samples[i];
+    sort(samples, n, sizeof(*samples), scull_bench_cmp, NULL);
+    r->p50 = samples[n / 2];
+    r->p99 = samples[n * 99 / 100];
+    r->max = samples[n - 1];
+}
+
+/* One op: "count" bytes at "pos", however many calls that takes */
+static ssize_t scull_bench_io(struct scull_bench_run *run, int rw, loff_t pos,
+        size_t count)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < count) {
+        if (rw == WRITE)
+            ret = scull_bench_ops->write(run->filp, run->ubuf + done,
+                    count - done, &pos);
+        else
+            ret = scull_bench_ops->read(run->filp, run->ubuf + done,
+                    count - done, &pos);
+        if (ret <= 0)
+            return ret ? ret : -EIO;
+        done += ret;
+    }
+    return done;
+}
+
+static int scull_bench_fill(struct scull_bench_run *run)
+{
+    loff_t pos;
+    ssize_t ret;
+
+    for (pos = 0; pos < SCULL_BENCH_SIZE; pos += SCULL_BENCH_BUF) {
+        ret = scull_bench_io(run, WRITE, pos, SCULL_BENCH_BUF);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* A sequential or random pass of reads or writes of "bsize" bytes */
+static int scull_bench_rw(struct scull_bench_run *run, const char *what,
+        int rw, int random, size_t bsize)
+{
+    unsigned long slots = SCULL_BENCH_SIZE / bsize;
+    unsigned long i, n = random ? SCULL_BENCH_RANDOM : slots;
+    ssize_t ret;
+    loff_t pos;
+    u64 t0;
+
+    for (i = 0; i < n; i++) {
+        pos = (loff_t)(random ? scull_bench_rand(slots) : i) * bsize;
+        t0 = ktime_get_ns();
+        ret = scull_bench_io(run, rw, pos, bsize);
+        run->samples[i] = ktime_get_ns() - t0;
+        if (ret < 0)
+            return ret;
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+    }
+    scull_bench_record(what, bsize, run->samples, n);
+    return 0;
+}
+
+/* Emptying a full device */
+static int scull_bench_trims(struct scull_bench_run *run)
+{
+    int i, err;
+    u64 t0;
+
+    for (i = 0; i < SCULL_BENCH_TRIMS; i++) {
+        err = scull_bench_fill(run);
+        if (err)
+            return err;
+        t0 = ktime_get_ns();
+        err = scull_bench_ops->trim(run->dev);
+        run->samples[i] = ktime_get_ns() - t0;
+        if (err)
+            return err;
+    }
+    scull_bench_record("trim", SCULL_BENCH_SIZE, run->samples, i);
+    return 0;
+}
+
+/*
+ * Touch every page of a shared mapping of a full device, once. With
+ * fault-around most touches find the page already mapped, which is
+ * the point: this is what a reader of the mapping pays per page.
+ */
+static int scull_bench_faults(struct scull_bench_run *run)
+{
+    unsigned long addr, i, n = SCULL_BENCH_SIZE >> PAGE_SHIFT;
+    int err = 0;
+    u64 t0;
+    char c;
+
+    addr = vm_mmap(run->filp, 0, SCULL_BENCH_SIZE, PROT_READ, MAP_SHARED, 0);
+    if (IS_ERR_VALUE(addr))
+        return (long)addr; /* a store that can't be mapped, most likely */
+    for (i = 0; i < n; i++) {
+        t0 = ktime_get_ns();
+        if (get_user(c, (char __user *)addr + (i << PAGE_SHIFT))) {
+            err = -EFAULT;
+            break;
+        }
+        run->samples[i] = ktime_get_ns() - t0;
+    }
+    vm_munmap(addr, SCULL_BENCH_SIZE);
+    if (!err)
+        scull_bench_record("mmapfault", PAGE_SIZE, run->samples, n);
+    return err;
+}
+
+static int scull_bench_suite(struct scull_bench_run *run,
+        struct scull_store *st)
+{
+    int i, err;
+
+    err = scull_bench_ops->trim(run->dev); /* -EBUSY if it's mapped */
+    for (i = 0; !err && i < ARRAY_SIZE(scull_bench_sizes); i++) {
+        size_t bsize = scull_bench_sizes[i];
+
+        err = scull_bench_rw(run, "seqwrite", WRITE, 0, bsize);
+        if (err)
+            break;
+        /* For a shared store, this counts the other devices too */
+        if (i == 0)
+            scull_bench_resident = atomic_long_read(&st->quanta) *
+                    st->quantum;
+        err = scull_bench_rw(run, "seqread", READ, 0, bsize);
+        if (!err)
+            err = scull_bench_rw(run, "randwrite", WRITE, 1, bsize);
+        if (!err)
+            err = scull_bench_rw(run, "randread", READ, 1, bsize);
+        if (!err)
+            err = scull_bench_ops->trim(run->dev);
+    }
+    if (!err)
+        err = scull_bench_fill(run);
+    if (!err) {
+        scull_bench_mmap_err = scull_bench_faults(run);
+        err = scull_bench_ops->trim(run->dev);
+    }
+    if (!err)
+        err = scull_bench_trims(run);
+    return err;
+}
+
+static int scull_bench_run(int index)
+{
+    struct scull_bench_run run;
+    struct scull_store *st;
+    unsigned long addr;
+    int err;
+
+    run.dev = scull_bench_ops->dev(index);
+    if (!run.dev)
+        return -ENODEV;
+    st = scull_bench_ops->store(run.dev);
+    run.samples = kvmalloc_array(SCULL_BENCH_SIZE / scull_bench_sizes[0],
+            sizeof(*run.samples), GFP_KERNEL);
+    if (!run.samples)
+        return -ENOMEM;
+    /* The device methods want user memory to copy to and from */
+    addr = vm_mmap(NULL, 0, SCULL_BENCH_BUF, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE, 0);
+    if (IS_ERR_VALUE(addr)) {
+        err = (long)addr;
+        goto out_samples;
+    }
+    run.ubuf = (char __user *)addr;
+    /* ... and a file whose private_data is the device, like open does */
+    run.filp = anon_inode_getfile(scull_bench_name, scull_bench_ops->fops,
+            run.dev, O_RDWR);
+    if (IS_ERR(run.filp)) {
+        err = PTR_ERR(run.filp);
+        goto out_buf;
+    }
+
+    scull_bench_nresults = 0;
+    scull_bench_index = index;
+    scull_bench_backend = st->ops->name;
+    scull_bench_resident = -1;
+    scull_bench_mmap_err = 0;
+    err = scull_bench_suite(&run, st);
+    scull_bench_quantum = st->quantum;
+    scull_bench_err = err;
+    fput(run.filp);
+out_buf:
+    vm_munmap(addr, SCULL_BENCH_BUF);
+out_samples:
+    kvfree(run.samples);
+    return err;
+}
+
+static ssize_t scull_bench_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    int index, err;
+
+    err = kstrtoint_from_user(buf, count, 0, &index);
+    if (err)
+        return err;
+    if (mutex_lock_interruptible(&scull_bench_mutex))
+        return -ERESTARTSYS;
+    err = scull_bench_run(index);
+    mutex_unlock(&scull_bench_mutex);
+    return err ? err : count;
+}
+
+static int scull_bench_show(struct seq_file *s, void *v)
+{
+    struct scull_bench_result *r;
+    int i;
+
+    mutex_lock(&scull_bench_mutex);
+    if (scull_bench_index < 0) {
+        seq_printf(s, "no results: write a device number to this file\n");
+        goto out;
+    }
+    seq_printf(s, "%s%i: backend %s, quantum %zu\n", scull_bench_ops->name,
+            scull_bench_index, scull_bench_backend, scull_bench_quantum);
+    if (scull_bench_resident >= 0)
+        seq_printf(s, "memory: %li bytes in quanta for %i of data (%li%%)\n",
+                scull_bench_resident, SCULL_BENCH_SIZE,
+                scull_bench_resident * 100 / SCULL_BENCH_SIZE);
+    if (scull_bench_mmap_err)
+        seq_printf(s, "mmapfault: not run, error %i\n", scull_bench_mmap_err);
+    seq_printf(s, "%-10s %6s %6s %10s %8s %8s %8s\n", "test", "bsize",
+            "ops", "ops/s", "p50ns", "p99ns", "maxns");
+    for (i = 0; i < scull_bench_nresults; i++) {
+        r = scull_bench_results + i;
+        seq_printf(s, "%-10s %6zu %6lu %10llu %8llu %8llu %8llu\n", r->what,
+                r->bsize, r->ops,
+                div64_u64((u64)r->ops * NSEC_PER_SEC, r->ns ? r->ns : 1),
+                r->p50, r->p99, r->max);
+    }
+    if (scull_bench_err)
+        seq_printf(s, "stopped early, error %i\n", scull_bench_err);
+out:
+    mutex_unlock(&scull_bench_mutex);
+    return 0;
+}
+
+static int scull_bench_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, scull_bench_show, NULL);
+}
+
+static struct file_operations scull_bench_proc_ops = {
+    .owner      = THIS_MODULE,
+    .open       = scull_bench_open,
+    .read       = seq_read,
+    .write      = scull_bench_write,
+    .llseek     = seq_lseek,
+    .release    = single_release
+};
+
+int scull_bench_init(const struct scull_bench_ops *ops)
+{
+    scull_bench_ops = ops;
+    snprintf(scull_bench_name, sizeof(scull_bench_name), "%sbench",
+            ops->name);
+    /* Root only: a run wipes the device */
+    scull_bench_proc = proc_create(scull_bench_name, 0600, NULL,
+            proc_ops_wrapper(&scull_bench_proc_ops, scull_bench_pops));
+    return scull_bench_proc ? 0 : -ENOMEM;
+}
+
+void scull_bench_exit(void)
+{
+    if (scull_bench_proc)
+        proc_remove(scull_bench_proc);
+    scull_bench_proc = NULL;
+}
@@ -0,0 +1,41 @@
+/*
+ * scull-bench.h -- fixed workloads against the scull* devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef SCULL_SHARED_SCULL_BENCH_H_
+#define SCULL_SHARED_SCULL_BENCH_H_
+
+struct scull_store;
+
+/*
+ * What a module tells the benchmark: its device methods, and how to
+ * get at device "index" and its store. The trim method takes the
+ * device lock itself.
+ */
+struct scull_bench_ops {
+    const char *name;                   /* "scullp": /proc/scullpbench */
+    const struct file_operations *fops; /* for mmap */
+    void *(*dev)(int index);            /* NULL past the last one */
+    struct scull_store *(*store)(void *dev);
+    int (*trim)(void *dev);
+    ssize_t (*read)(struct file *filp, char __user *buf, size_t count,
+            loff_t *f_pos);
+    ssize_t (*write)(struct file *filp, const char __user *buf,
+            size_t count, loff_t *f_pos);
+};
+
+int scull_bench_init(const struct scull_bench_ops *ops);
+void scull_bench_exit(void);
+
+#endif /* SCULL_SHARED_SCULL_BENCH_H_ */
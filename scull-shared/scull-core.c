@@ -0,0 +1,269 @@
+/*
+ * scull-core.c -- the quantum list of the scull* modules
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/topology.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "scull-core.h"
+
+/* A device with nothing in it, its quanta to come from "store" */
+void scull_core_init(struct scull_core *core, struct scull_store *store,
+        int qset)
+{
+    core->store = store;
+    core->quantum = store->quantum;
+    core->qset = qset;
+    mutex_init(&core->mutex);
+}
+
+/* Follow the list, growing it as needed; NULL if that fails */
+struct scull_qset *scull_core_follow(struct scull_core *core, int n)
+{
+    struct scull_qset *qs = &core->head;
+
+    while (n--) {
+        if (!qs->next) {
+            qs->next = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
+            if (!qs->next)
+                return NULL;
+        }
+        qs = qs->next;
+    }
+    return qs;
+}
+
+/*
+ * Empty the device, with the mutex held. The next list gets "qset"
+ * quanta per item. With a nonzero "quantum" the store, which must be
+ * the device's own then, is made to follow it now that it's empty.
+ */
+int scull_core_trim(struct scull_core *core, int qset, size_t quantum)
+{
+    struct scull_qset *next, *dptr;
+    int i;
+
+    if (core->vmas) /* don't trim: there are active mappings */
+        return -EBUSY;
+
+    for (dptr = &core->head; dptr; dptr = next) { /* iterate the list items */
+        if (dptr->data) {
+            for (i = 0; i < core->qset; i++)
+                if (dptr->data[i])
+                    scull_store_free(core->store, dptr->data[i]);
+
+            kfree(dptr->data);
+            dptr->data = NULL;
+        }
+        next = dptr->next;
+        if (dptr != &core->head) kfree(dptr); /* all of them but the first */
+    }
+
+    core->size = 0;
+    core->qset = qset;
+    core->head.next = NULL;
+    core->hint = NULL;
+    if (core->store && core->store->ops) {
+        if (quantum)
+            scull_store_resize(core->store, quantum);
+        core->quantum = core->store->quantum;
+    }
+    return 0;
+}
+
+/* Data management: read and write */
+ssize_t scull_core_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct scull_core *core = filp->private_data;
+    struct scull_qset *dptr; /* the first listitem */
+    int quantum = core->quantum;
+    int qset = core->qset;
+    int itemsize = quantum * qset; /* how many bytes in the listitem */
+    int item, s_pos, q_pos, rest;
+    ssize_t retval = 0;
+
+    if (mutex_lock_interruptible(&core->mutex))
+        return -ERESTARTSYS;
+    if (*f_pos > core->size)
+        goto out;
+    if (*f_pos + count > core->size)
+        count = core->size - *f_pos;
+
+    /* find listitem, qset index, and offset in the quantum */
+    item = (long)*f_pos / itemsize;
+    rest = (long)*f_pos % itemsize;
+    s_pos = rest / quantum;
+    q_pos = rest % quantum;
+
+    /* follow the list up to the right position */
+    dptr = scull_core_follow(core, item);
+
+    if (!dptr || !dptr->data || !dptr->data[s_pos])
+        goto out;
+
+    /* read only up to the end of this quantum */
+    if (count > quantum - q_pos)
+        count = quantum - q_pos;
+
+    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+        retval = -EFAULT;
+        goto out;
+    }
+    mutex_unlock(&core->mutex);
+
+    *f_pos += count;
+    return count;
+
+out:
+    mutex_unlock(&core->mutex);
+    return retval;
+}
+
+ssize_t scull_core_write(struct file *filp, const char __user *buf,
+                size_t count, loff_t *f_pos)
+{
+    struct scull_core *core = filp->private_data;
+    struct scull_qset *dptr;
+    int quantum = core->quantum;
+    int qset = core->qset;
+    int itemsize = quantum * qset;
+    int item, s_pos, q_pos, rest;
+    int fresh = 0; /* did we just allocate this quantum? */
+    unsigned long left;
+    ssize_t retval = -ENOMEM; /* our most likely error */
+
+    if (mutex_lock_interruptible(&core->mutex))
+        return -ERESTARTSYS;
+
+    /* find listitem, qset index and offset in the quantum */
+    item = (long)*f_pos / itemsize;
+    rest = (long)*f_pos % itemsize;
+    s_pos = rest / quantum;
+    q_pos = rest % quantum;
+
+    /* follow the list up to the right position */
+    dptr = scull_core_follow(core, item);
+    if (dptr == NULL)
+        goto out;
+    if (!dptr->data) {
+        dptr->data = kcalloc(qset, sizeof(void *), GFP_KERNEL);
+        if (!dptr->data)
+            goto out;
+    }
+    /* write only up to the end of this quantum */
+    if (count > quantum - q_pos)
+        count = quantum - q_pos;
+
+    /*
+     * Allocate a quantum from the device's store, on the writer's node.
+     * Only the bytes this write doesn't cover need clearing.
+     */
+    if (!dptr->data[s_pos]) {
+        dptr->data[s_pos] = scull_store_alloc(core->store, GFP_KERNEL,
+                numa_mem_id());
+        if (!dptr->data[s_pos])
+            goto out;
+        memset(dptr->data[s_pos], 0, q_pos);
+        memset(dptr->data[s_pos] + q_pos + count, 0, quantum - q_pos - count);
+        fresh = 1;
+    }
+
+    left = copy_from_user(dptr->data[s_pos] + q_pos, buf, count);
+    if (left) {
+        /* Don't leave stale contents where the copy fell short */
+        if (fresh)
+            memset(dptr->data[s_pos] + q_pos + count - left, 0, left);
+        retval = -EFAULT;
+        goto out;
+    }
+
+    *f_pos += count;
+
+    /* update the size */
+    if (core->size < *f_pos)
+        core->size = *f_pos;
+
+    mutex_unlock(&core->mutex);
+    return count;
+
+out:
+    mutex_unlock(&core->mutex);
+    return retval;
+}
+
+/* The "extended" operations --only seek */
+loff_t scull_core_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct scull_core *core = filp->private_data;
+    long newpos;
+
+    switch (whence) {
+    case 0: /* SEEK_SET */
+        newpos = off;
+        break;
+    case 1: /* SEEK_CUR */
+        newpos = filp->f_pos + off;
+        break;
+    case 2: /* SEEK_END */
+        newpos = core->size + off;
+        break;
+    default: /* can't happen */
+        return -EINVAL;
+    }
+
+    if (newpos < 0) return -EINVAL;
+    filp->f_pos = newpos;
+    return newpos;
+}
+
+/* The async engine asks before sleeping on our behalf */
+bool scull_core_busy(struct file *filp)
+{
+    struct scull_core *core = filp->private_data;
+
+    return mutex_is_locked(&core->mutex);
+}
+
+/*
+ * The list for a /proc dump, the last item in full, with the mutex
+ * held. Nonzero once the output has gone past "limit".
+ */
+int scull_core_show(struct seq_file *s, struct scull_core *core, int limit)
+{
+    struct scull_qset *d;
+    int j;
+
+    for (d = &core->head; d; d = d->next) { /* scan the list */
+        seq_printf(s, " item at %p, qset at %p\n", d, d->data);
+        if (s->count > limit)
+            return 1;
+        if (d->data && !d->next) /* dump only the last item */
+            for (j = 0; j < core->qset; j++) {
+                if (d->data[j])
+                    seq_printf(s, "    % 4i: %8p\n", j, d->data[j]);
+                if (s->count > limit)
+                    return 1;
+            }
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * scull-core.h -- the quantum list shared by the scull* modules
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef SCULL_SHARED_SCULL_CORE_H_
+#define SCULL_SHARED_SCULL_CORE_H_
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+
+#include "scull-backend.h"
+
+struct seq_file;
+
+/*
+ * The bare device is a variable-length region of memory, kept as a
+ * linked list of indirect blocks: "data" points to an array of "qset"
+ * pointers, each to a quantum from the device's store.
+ *
+ * scullc, scullp, scullv and sculld embed a scull_core in their device
+ * and point filp->private_data and vm_private_data at it; the list,
+ * read and write, trim and the nopage, fault-around and fadvise paths
+ * are all here (from 6.5 the nopage method does the fault-around too).
+ * What's left to the modules is init, parameters, ioctl and which store
+ * each device gets.
+ */
+struct scull_qset {
+    void **data;
+    struct scull_qset *next;    /* next listitem */
+};
+
+struct scull_core {
+    struct scull_qset head;     /* the first listitem */
+    struct scull_store *store;  /* where the quanta come from */
+    size_t quantum;             /* bytes per quantum, the store's */
+    int qset;                   /* the current array size */
+    size_t size;                /* amount of data stored here */
+    int vmas;                   /* active mappings */
+    struct scull_qset *hint;    /* where the last mmap lookup ended */
+    unsigned long hint_item;    /* ... and its number in the list */
+    struct mutex mutex;         /* mutual exclusion */
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+typedef int vm_fault_t;
+#endif
+
+/* scull-core.c */
+void scull_core_init(struct scull_core *core, struct scull_store *store,
+        int qset);
+struct scull_qset *scull_core_follow(struct scull_core *core, int n);
+int scull_core_trim(struct scull_core *core, int qset, size_t quantum);
+ssize_t scull_core_read(struct file *filp, char __user *buf, size_t count,
+        loff_t *f_pos);
+ssize_t scull_core_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *f_pos);
+loff_t scull_core_llseek(struct file *filp, loff_t off, int whence);
+bool scull_core_busy(struct file *filp);
+int scull_core_show(struct seq_file *s, struct scull_core *core, int limit);
+
+/* scull-mmap.c */
+extern const struct vm_operations_struct scull_core_vm_ops;
+void scull_core_vma_open(struct vm_area_struct *vma);
+void scull_core_vma_close(struct vm_area_struct *vma);
+void *scull_core_quantum(struct scull_core *core, unsigned long qidx);
+int scull_core_mmap(struct file *filp, struct vm_area_struct *vma);
+int scull_core_fadvise(struct file *filp, loff_t offset, loff_t len,
+        int advice);
+
+#endif /* SCULL_SHARED_SCULL_CORE_H_ */
@@ -0,0 +1,277 @@
+/*  -*- C -*-
+ * scull-mmap.c -- memory mapping for the scull* quantum lists
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/errno.h>
+#include <asm/pgtable.h>
+#include <linux/fs.h>
+#include <linux/version.h>
+#include <linux/fadvise.h>
+#include <linux/sched.h>
+#include <linux/sizes.h>
+
+#include "vm_flags_version.h"
+#include "scull-core.h"
+
+/*
+ * open and close: just keep track of how many times the device is
+ * mapped, to avoid releasing it.
+ */
+void scull_core_vma_open(struct vm_area_struct *vma)
+{
+    struct scull_core *core = vma->vm_private_data;
+    core->vmas++;
+}
+
+void scull_core_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_core *core = vma->vm_private_data;
+    core->vmas--;
+}
+
+/*
+ * Find quantum number "qidx" of the device, or NULL for a hole. Faults
+ * tend to come in ascending order, so remember where the last lookup
+ * ended up rather than walking from the head every time; the list only
+ * grows, until scull_core_trim() drops the hint. Called with the mutex
+ * held.
+ */
+void *scull_core_quantum(struct scull_core *core, unsigned long qidx)
+{
+    struct scull_qset *ptr = &core->head;
+    unsigned long item = qidx / core->qset;
+    unsigned long i = 0;
+
+    if (core->hint && core->hint_item <= item) {
+        ptr = core->hint;
+        i = core->hint_item;
+    }
+    for (; ptr && i < item; i++)
+        ptr = ptr->next;
+    if (!ptr)
+        return NULL;
+    core->hint = ptr;
+    core->hint_item = item;
+    return ptr->data ? ptr->data[qidx % core->qset] : NULL;
+}
+
+/*
+ * The page at page offset "pgoff" into the device, or NULL for a hole
+ * or beyond the end. Quanta of mappable stores are whole pages, and
+ * the store turns the one we want into a struct page. Called with the
+ * mutex held.
+ */
+static struct page *scull_core_page_at(struct scull_core *core, pgoff_t pgoff)
+{
+    unsigned long qpages = core->quantum >> PAGE_SHIFT;
+    void *pageptr;
+
+    if (pgoff >= DIV_ROUND_UP(core->size, PAGE_SIZE))
+        return NULL; /* out of range */
+    pageptr = scull_core_quantum(core, pgoff / qpages);
+    if (!pageptr)
+        return NULL;
+    return scull_store_page(core->store, pageptr, pgoff % qpages);
+}
+
+/*
+ * Map every resident page from start to end (page offsets into the
+ * file) that isn't mapped yet, in one go. Pages already there, and
+ * holes, are just skipped. Returns whether the page at "want" got
+ * mapped. Called with the mutex held.
+ */
+static int scull_core_insert(struct vm_area_struct *vma, pgoff_t start,
+        pgoff_t end, pgoff_t want)
+{
+    struct scull_core *core = vma->vm_private_data;
+    struct page *page;
+    pgoff_t pgoff;
+    int found = 0;
+
+    for (pgoff = start; pgoff <= end; pgoff++) {
+        page = scull_core_page_at(core, pgoff);
+        if (!page)
+            continue;
+        if (vm_insert_page(vma, vma->vm_start +
+                ((pgoff - vma->vm_pgoff) << PAGE_SHIFT), page) == 0 &&
+                pgoff == want)
+            found = 1;
+    }
+    return found;
+}
+
+static int scull_core_populate(struct vm_area_struct *vma, pgoff_t start,
+        pgoff_t end, pgoff_t want)
+{
+    struct scull_core *core = vma->vm_private_data;
+    int found;
+
+    mutex_lock(&core->mutex);
+    found = scull_core_insert(vma, start, end, want);
+    mutex_unlock(&core->mutex);
+    return found;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+/*
+ * From 6.5 ->map_pages is called under rcu_read_lock(), where our
+ * mutex can't be taken, so there's no fault-around method. The nopage
+ * method does the same instead: it maps the rest of the fault_around_bytes
+ * window (64KB by default) around a read fault while it has the mutex.
+ */
+#define SCULL_FAULT_AROUND (SZ_64K >> PAGE_SHIFT)
+
+static void scull_core_around(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    pgoff_t start = max(vmf->pgoff & ~(pgoff_t)(SCULL_FAULT_AROUND - 1),
+            vma->vm_pgoff);
+    pgoff_t end = min(start + SCULL_FAULT_AROUND - 1,
+            vma->vm_pgoff + vma_pages(vma) - 1);
+
+    /* the faulting page itself goes back through vmf->page */
+    if (start < vmf->pgoff)
+        scull_core_insert(vma, start, vmf->pgoff - 1, ULONG_MAX);
+    if (end > vmf->pgoff)
+        scull_core_insert(vma, vmf->pgoff + 1, end, ULONG_MAX);
+}
+#endif
+
+/*
+ * The nopage method: the core of the file. It retrieves the
+ * page required from the device and returns it to the user.
+ * The count for the page must be incremented, because it is
+ * automatically decremented at page unmap.
+ *
+ * Multipage quanta from the "pages" store are compound pages, whose
+ * counts all go to the head, and vmalloc quanta are single pages
+ * anyway, so any quantum can be mapped a page at a time.
+ */
+static vm_fault_t scull_core_vma_nopage(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct scull_core *core = vma->vm_private_data;
+    struct page *page;
+    vm_fault_t retval = VM_FAULT_SIGBUS;
+
+    mutex_lock(&core->mutex);
+    /*
+     * If the device has holes, the process receives a SIGBUS when
+     * accessing the hole.
+     */
+    page = scull_core_page_at(core, vmf->pgoff);
+    if (!page) goto out; /* hole or end-of-file */
+
+    /* got it, now increment the count */
+    get_page(page);
+    vmf->page = page;
+    retval = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    if (!(vmf->flags & FAULT_FLAG_WRITE))
+        scull_core_around(vmf);
+#endif
+out:
+    mutex_unlock(&core->mutex);
+    return retval;
+}
+
+/*
+ * Fault-around: the core offers the neighbourhood of a read fault
+ * (fault_around_bytes, 64KB by default), and we fill it all under one
+ * trip through the mutex and the list.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+/* none: see scull_core_around() */
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0)
+static void scull_core_vma_map_pages(struct vm_fault *vmf, pgoff_t start,
+        pgoff_t end)
+{
+    scull_core_populate(vmf->vma, start, end, vmf->pgoff);
+}
+#else
+static vm_fault_t scull_core_vma_map_pages(struct vm_fault *vmf,
+        pgoff_t start, pgoff_t end)
+{
+    return scull_core_populate(vmf->vma, start, end, vmf->pgoff) ?
+            VM_FAULT_NOPAGE : 0;
+}
+#endif
+
+const struct vm_operations_struct scull_core_vm_ops = {
+    .open = scull_core_vma_open,
+    .close = scull_core_vma_close,
+    .fault = scull_core_vma_nopage,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0) /* later, nopage does it */
+    .map_pages = scull_core_vma_map_pages,
+#endif
+};
+
+/*
+ * posix_fadvise(WILLNEED), and madvise(MADV_WILLNEED) which ends up
+ * here too: prefault the range in every mapping of this device the
+ * calling process has, so a scan that asked for it takes no faults.
+ */
+int scull_core_fadvise(struct file *filp, loff_t offset, loff_t len,
+        int advice)
+{
+    struct mm_struct *mm = current->mm;
+    struct vm_area_struct *vma;
+    pgoff_t start = offset >> PAGE_SHIFT;
+    pgoff_t end = len ? (offset + len - 1) >> PAGE_SHIFT : ULONG_MAX;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+    VMA_ITERATOR(vmi, mm, 0);
+#endif
+
+    if (advice != POSIX_FADV_WILLNEED || !mm)
+        return 0;
+    mmap_read_lock(mm);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,1,0)
+    for (vma = mm->mmap; vma; vma = vma->vm_next) {
+#else
+    for_each_vma(vmi, vma) {
+#endif
+        pgoff_t last = vma->vm_pgoff + vma_pages(vma) - 1;
+
+        if (vma->vm_ops != &scull_core_vm_ops ||
+                vma->vm_private_data != filp->private_data)
+            continue;
+        if (start <= last && end >= vma->vm_pgoff)
+            scull_core_populate(vma, max(start, vma->vm_pgoff),
+                    min(end, last), ULONG_MAX);
+    }
+    mmap_read_unlock(mm);
+    return 0;
+}
+
+int scull_core_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_core *core = filp->private_data;
+
+    /* Slab memory can't be handed out a page at a time */
+    if (!scull_store_mappable(core->store))
+        return -ENODEV;
+
+    /*
+     * don't do anything here: "nopage" and fault-around will set up
+     * page table entries. The latter uses vm_insert_page, which wants
+     * VM_MIXEDMAP set while we still hold the mmap lock for writing.
+     */
+    vma->vm_ops = &scull_core_vm_ops;
+    vm_flags_set_wrapper(vma, VM_MIXEDMAP);
+    vma->vm_private_data = core;
+    scull_core_vma_open(vma);
+    return 0;
+}
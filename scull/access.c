@@ -25,6 +25,10 @@
 #include <linux/tty.h>
 #include <asm/atomic.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
 #include <linux/cred.h> /* current_uid() and current_euid() */
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
@@ -72,8 +76,8 @@ static int scull_s_release(struct inode *inode, struct file *filp)
 struct file_operations scull_sngl_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =     	scull_llseek,
-	.read =       	scull_read,
-	.write =      	scull_write,
+	.read_iter =  	scull_read_iter,
+	.write_iter = 	scull_write_iter,
 	.unlocked_ioctl =      	scull_ioctl,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
@@ -127,8 +131,8 @@ static int scull_u_release(struct inode *inode , struct file *filp)
 struct file_operations scull_user_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl =      scull_ioctl,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
@@ -192,8 +196,8 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 struct file_operations scull_wusr_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl =      scull_ioctl,
 	.open =       scull_w_open,
 	.release =    scull_w_release,
@@ -204,30 +208,62 @@ struct file_operations scull_wusr_fops = {
  * involves list management, and dynamic allocation.
  */
 
+/*
+ * The clones are hashed by key, and looked up under RCU: an open only
+ * takes scull_c_lock when it has to add a clone. "users" counts the open
+ * files plus one for the hash table itself; a clone nobody has opened
+ * for scull_priv_idle seconds is taken out by a background sweep, which
+ * claims it by moving "users" from 1 to 0 so no lookup can revive it.
+ */
+static int scull_priv_idle = 60;   /* seconds, 0 to keep clones forever */
+module_param(scull_priv_idle, int, S_IRUGO);
+
 /* The clone-specific data structure includes a key field */
 struct scull_listitem {
     struct scull_dev device;
     dev_t key;
-    struct list_head list;
+    atomic_t users;
+    unsigned long last_used;    /* jiffies, at last release */
+    struct hlist_node node;     /* in scull_c_hash */
+    struct list_head reap;      /* on the sweep's list, once unhashed */
+    struct rcu_head rcu;
 };
 
-/* The list of devices, and a lock to protect it */
-static LIST_HEAD(scull_c_list);
-//static spinlock_t scull_c_lock = SPIN_LOCK_UNLOCKED;
+#define SCULL_C_HASH_BITS 6
+
+/* The table of devices, and a lock to protect changes to it */
+static DEFINE_HASHTABLE(scull_c_hash, SCULL_C_HASH_BITS);
 static DEFINE_SPINLOCK(scull_c_lock);
 
+static void scull_c_sweep(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scull_c_sweeper, scull_c_sweep);
+
 /* A placeholder scull_dev which really just holds the cdev stuff. */
 static struct scull_dev scull_c_device;
 
-/* Look for a device or create one if missing */
-static struct scull_dev *scull_c_lookfor_device(dev_t key)
+/* Find a live clone and take a reference; RCU or scull_c_lock held */
+static struct scull_listitem *scull_c_find(dev_t key)
 {
     struct scull_listitem *lptr;
 
-    list_for_each_entry(lptr, &scull_c_list, list) {
-        if (lptr->key == key)
-            return &(lptr->device);
+    hash_for_each_possible_rcu(scull_c_hash, lptr, node, key,
+            lockdep_is_held(&scull_c_lock)) {
+        if (lptr->key == key && atomic_inc_not_zero(&lptr->users))
+            return lptr;
     }
+    return NULL;
+}
+
+/* Look for a device or create one if missing */
+static struct scull_dev *scull_c_lookfor_device(dev_t key)
+{
+    struct scull_listitem *lptr, *found;
+
+    rcu_read_lock();
+    lptr = scull_c_find(key);
+    rcu_read_unlock();
+    if (lptr)
+        return &(lptr->device);
 
     /* not found */
     lptr = kmalloc(sizeof(struct scull_listitem), GFP_KERNEL);
@@ -237,16 +273,58 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
     /* initialize the device */
     memset(lptr, 0 , sizeof(struct scull_listitem));
     lptr->key = key;
+    atomic_set(&lptr->users, 2); /* the table, and this open */
     scull_trim(&(lptr->device)); /* intialize it */
-    //init_MUTEX(&(lptr->device.sem));
-    sema_init(&lptr->device.sem, 1);
+    init_rwsem(&lptr->device.rwsem);
 
-    /* place it in the list */
-    list_add(&lptr->list, &scull_c_list);
+    /* place it in the table, unless somebody beat us to it */
+    spin_lock(&scull_c_lock);
+    found = scull_c_find(key);
+    if (!found)
+        hash_add_rcu(scull_c_hash, &lptr->node, key);
+    spin_unlock(&scull_c_lock);
 
+    if (found) {
+        kfree(lptr);
+        lptr = found;
+    }
     return &(lptr->device);
 }
 
+static void scull_c_free(struct scull_listitem *lptr)
+{
+    scull_trim(&(lptr->device));
+    kfree_rcu(lptr, rcu);
+}
+
+/* Reclaim the clones that have been idle for too long */
+static void scull_c_sweep(struct work_struct *work)
+{
+    struct scull_listitem *lptr, *next;
+    struct hlist_node *tmp;
+    unsigned long idle = scull_priv_idle * HZ;
+    LIST_HEAD(victims);
+    int bkt;
+
+    spin_lock(&scull_c_lock);
+    hash_for_each_safe(scull_c_hash, bkt, tmp, lptr, node) {
+        if (atomic_read(&lptr->users) != 1 ||
+                time_before(jiffies, READ_ONCE(lptr->last_used) + idle))
+            continue;
+        if (atomic_cmpxchg(&lptr->users, 1, 0) != 1)
+            continue; /* just opened */
+        hash_del_rcu(&lptr->node);
+        list_add(&lptr->reap, &victims);
+    }
+    spin_unlock(&scull_c_lock);
+
+    /* lookups may still see them, but can't take a reference */
+    list_for_each_entry_safe(lptr, next, &victims, reap)
+        scull_c_free(lptr);
+
+    schedule_delayed_work(&scull_c_sweeper, idle);
+}
+
 static int scull_c_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev;
@@ -258,10 +336,8 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 	}
 	key = tty_devnum(current->signal->tty);
 
-	/* look for a scullc device in the list */
-	spin_lock(&scull_c_lock);
+	/* look for a scullc device in the table; this may sleep */
 	dev = scull_c_lookfor_device(key);
-	spin_unlock(&scull_c_lock);
 
 	if (!dev)
 		return -ENOMEM;
@@ -275,10 +351,15 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 
 static int scull_c_release(struct inode *inode, struct file *filp)
 {
+	struct scull_listitem *lptr = container_of(filp->private_data,
+			struct scull_listitem, device);
+
 	/*
-	 * Nothing to do, because the device is persistent.
-	 * A `real' cloned device should be freed on last close
+	 * The device outlives its last close, so that the same tty finds
+	 * its data again; the sweep frees it once it has been idle long enough.
 	 */
+	WRITE_ONCE(lptr->last_used, jiffies);
+	atomic_dec(&lptr->users);
 	return 0;
 }
 
@@ -286,8 +367,8 @@ static int scull_c_release(struct inode *inode, struct file *filp)
 struct file_operations scull_priv_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter =scull_read_iter,
+	.write_iter =    scull_write_iter,
 	.unlocked_ioctl =    scull_ioctl,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
@@ -315,8 +396,7 @@ static void scull_access_setup(dev_t devno, struct scull_adev_info *devinfo)
     /* Initialize the device structure */
     dev->quantum = scull_quantum;
     dev->qset = scull_qset;
-    //init_MUTEX(&dev->sem);
-    sema_init(&dev->sem, 1);
+    init_rwsem(&dev->rwsem);
 
     /* Do the cdev stuff. */
     cdev_init(&dev->cdev, devinfo->fops);
@@ -347,6 +427,9 @@ int scull_access_init(dev_t firstdev)
     /* Set up each device */
     for (i = 0; i < SCULL_N_ADEVS; i++)
         scull_access_setup(firstdev + i, scull_access_devs + i);
+
+    if (scull_priv_idle > 0)
+        schedule_delayed_work(&scull_c_sweeper, scull_priv_idle * HZ);
     return SCULL_N_ADEVS;
 }
 
@@ -356,8 +439,9 @@ int scull_access_init(dev_t firstdev)
  */
 void scull_access_cleanup(void)
 {
-    struct scull_listitem *lptr, *next;
-    int i;
+    struct scull_listitem *lptr;
+    struct hlist_node *tmp;
+    int i, bkt;
     /* Clea up the static devs */
     for (i = 0; i < SCULL_N_ADEVS; i++) {
         struct scull_dev *dev = scull_access_devs[i].sculldev;
@@ -366,11 +450,12 @@ void scull_access_cleanup(void)
     }
 
     /* And all the cloned devices */
-    list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
-        list_del(&lptr->list);
-        scull_trim(&(lptr->device));
-        kfree(lptr);
+    cancel_delayed_work_sync(&scull_c_sweeper);
+    hash_for_each_safe(scull_c_hash, bkt, tmp, lptr, node) {
+        hash_del_rcu(&lptr->node);
+        scull_c_free(lptr);
     }
+    rcu_barrier(); /* for the kfree_rcu()s */
 
     /* Free up our number space */
     unregister_chrdev_region(scull_a_firstdev, SCULL_N_ADEVS);
@@ -27,6 +27,9 @@
 #include <linux/fcntl.h>    /* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/uio.h>      /* struct iov_iter */
+#include <linux/ktime.h>
 
 //#include <asm/system.h>     /*cli(), *_flags */
 #include <linux/uaccess.h>    /* copy_*_user */
@@ -34,6 +37,7 @@
 #include "scull.h"          /* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
+#include "ldd_stats.h"
 
 /* Our parameters which can be set at load time */
 
@@ -42,25 +46,55 @@ int scull_minor     = 0;
 int scull_nr_devs   = SCULL_NR_DEVS; /* number of bare scull devices */
 int scull_quantum   = SCULL_QUANTUM;
 int scull_qset      = SCULL_QSET;
+int scull_index_devs = 0;            /* bitmask: devices using an xarray index */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int , S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_index_devs, int, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev *scull_devices; /* allocated in scull_init_module */
 
-/* Empty out the scull device; must be called with the device semaphore held. */
+/*
+ * Free every quantum held in the xarray index. Entries are cleared as
+ * we go, so the tree nodes are released in the same walk; drop the lock
+ * now and then so that a huge device doesn't hog the cpu.
+ */
+static void scull_trim_index(struct scull_dev *dev)
+{
+    XA_STATE(xas, &dev->index, 0);
+    void *quantum;
+    int n = 0;
+
+    xas_lock(&xas);
+    xas_for_each(&xas, quantum, ULONG_MAX) {
+        kfree(quantum);
+        xas_store(&xas, NULL);
+        if (++n % XA_CHECK_SCHED)
+            continue;
+        xas_pause(&xas);
+        xas_unlock(&xas);
+        cond_resched();
+        xas_lock(&xas);
+    }
+    xas_unlock(&xas);
+}
+
+/* Empty out the scull device; must be called with the device semaphore held for writing. */
 int scull_trim(struct scull_dev *dev)
 {
     struct scull_qset *next, *dptr;
     int qset = dev->qset; /* "dev" is not-null */
     int i;
 
+    if (dev->indexed)
+        scull_trim_index(dev);
+
     for (dptr = dev->data; dptr; dptr = next) {
         if (dptr->data) {
             for (i = 0; i < qset; i++)
@@ -72,15 +106,123 @@ int scull_trim(struct scull_dev *dev)
         kfree(dptr);
     }
     dev->size = 0;
+    WRITE_ONCE(dev->stats.quanta, 0);
     dev->quantum = scull_quantum;
     dev->qset = scull_qset;
     dev->data = NULL;
     return 0;
 }
 
+/*
+ * Take the semaphore, and if we had to wait for it, add the time to
+ * "wait". The uncontended case costs no more than before.
+ */
+static int scull_down_read(struct scull_dev *dev, atomic64_t *wait)
+{
+    u64 t0;
+
+    if (down_read_trylock(&dev->rwsem))
+        return 0;
+    t0 = ktime_get_ns();
+    if (down_read_killable(&dev->rwsem))
+        return -ERESTARTSYS;
+    atomic64_add(ktime_get_ns() - t0, wait);
+    return 0;
+}
+
+static int scull_down_write(struct scull_dev *dev, atomic64_t *wait)
+{
+    u64 t0;
+
+    if (down_write_trylock(&dev->rwsem))
+        return 0;
+    t0 = ktime_get_ns();
+    if (down_write_killable(&dev->rwsem))
+        return -ERESTARTSYS;
+    atomic64_add(ktime_get_ns() - t0, wait);
+    return 0;
+}
+
+/*
+ * Here are our sequence iteration methods. Our "position" is
+ * simply the device number.
+ */
+static void *scull_seq_start(struct seq_file *s, loff_t *pos)
+{
+    if (*pos >= scull_nr_devs)
+        return NULL;    /* No more to read */
+    return scull_devices + *pos;
+}
+
+static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+    (*pos)++;
+    if (*pos >= scull_nr_devs)
+        return NULL;
+    return scull_devices + *pos;
+}
+
+static void scull_seq_stop(struct seq_file *s, void *v)
+{
+    /* Actually, there's nothing to do here */
+}
+
+/*
+ * /proc/scullstat: one line per device, from the counters alone. It
+ * takes no lock and walks no data, so it can be polled as often as
+ * anybody likes, and seq_file picks up where it stopped.
+ */
+static int scull_stat_show(struct seq_file *s, void *v)
+{
+    struct scull_dev *dev = v;
+
+    if (dev == scull_devices)
+        seq_printf(s, "%-4s %12s %8s %14s %14s %12s %12s\n", "dev", "size",
+                "quanta", "rbytes", "wbytes", "rwait_us", "wwait_us");
+    seq_printf(s, "%-4i %12lu %8li %14lli %14lli %12lli %12lli\n",
+            (int)(dev - scull_devices), READ_ONCE(dev->size),
+            READ_ONCE(dev->stats.quanta),
+            (long long)atomic64_read(&dev->stats.rbytes),
+            (long long)atomic64_read(&dev->stats.wbytes),
+            (long long)atomic64_read(&dev->stats.rwait) / NSEC_PER_USEC,
+            (long long)atomic64_read(&dev->stats.wwait) / NSEC_PER_USEC);
+    return 0;
+}
+
+static struct seq_operations scull_stat_ops = {
+    .start  = scull_seq_start,
+    .next   = scull_seq_next,
+    .stop   = scull_seq_stop,
+    .show   = scull_stat_show
+};
+
+static int scullstat_proc_open(struct inode *inode, struct file *file)
+{
+    return seq_open(file, &scull_stat_ops);
+}
+
+static struct file_operations scullstat_proc_ops = {
+    .owner   = THIS_MODULE,
+    .open    = scullstat_proc_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = seq_release
+};
+
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /* The proc filesystem: function to read and entry */
 
+/* How many quanta an indexed device holds; the caller has the semaphore */
+static unsigned long scull_index_count(struct scull_dev *dev)
+{
+    unsigned long idx, n = 0;
+    void *q;
+
+    xa_for_each(&dev->index, idx, q)
+        n++;
+    return n;
+}
+
 int scull_read_procmem(struct seq_file *s, void *v)
 {
     int i, j;
@@ -89,10 +231,12 @@ int scull_read_procmem(struct seq_file *s, void *v)
     for (i = 0; i < scull_nr_devs && s->count <= limit; i++) {
         struct scull_dev *d = &scull_devices[i];
         struct scull_qset *qs = d->data;
-        if (down_interruptible(&d->sem))
+        if (down_read_killable(&d->rwsem))
             return -ERESTARTSYS;
                 seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
                 i, d->qset, d->quantum, d->size);
+        if (d->indexed)
+            seq_printf(s, " xarray index, %lu quanta\n", scull_index_count(d));
         for (; qs && s->count <= limit; qs = qs->next) { /* scan the list */
             seq_printf(s, " item at %p, qset at %p\n", qs, qs->data);
             if (qs->data && !qs->next) /* dump only the last item */
@@ -101,7 +245,7 @@ int scull_read_procmem(struct seq_file *s, void *v)
                         seq_printf(s, "    % 4i: %8p\n", j, qs->data[j]);
                 }
         }
-        up(&scull_devices[i].sem);
+        up_read(&scull_devices[i].rwsem);
     }
     return 0;
 }
@@ -112,40 +256,23 @@ int scull_read_procmem(struct seq_file *s, void *v)
 */
 
 /*
- * Here are our sequence iteration methods. Our "position" is
- * simply the device number.
+ * The sequence iteration methods are shared with /proc/scullstat,
+ * above.
  */
-static void *scull_seq_start(struct seq_file *s, loff_t *pos)
-{
-    if (*pos >= scull_nr_devs)
-        return NULL;    /* No more to read */
-    return scull_devices + *pos;
-}
-
-static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
-{
-    (*pos)++;
-    if (*pos >= scull_nr_devs)
-        return NULL;
-    return scull_devices + *pos;
-}
-
-static void scull_seq_stop(struct seq_file *s, void *v)
-{
-    /* Actually, there's nothing to do here */
-}
-
 static int scull_seq_show(struct seq_file *s, void *v)
 {
     struct scull_dev *dev = (struct scull_dev *)v;
     struct scull_qset *d;
     int i;
 
-    if (down_interruptible(&dev->sem))
+    if (down_read_killable(&dev->rwsem))
         return -ERESTARTSYS;
 
     seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
         (int)(dev - scull_devices), dev->qset, dev->quantum, dev->size);
+    if (dev->indexed)
+        seq_printf(s, "    xarray index, %lu quanta\n",
+                scull_index_count(dev));
 
     for (d = dev->data; d; d = d->next) { /* scan the list */
         seq_printf(s, "    item at %p, qset at %p\n", d, d->data);
@@ -155,7 +282,7 @@ static int scull_seq_show(struct seq_file *s, void *v)
                     seq_printf(s, "    % 4i: %8p\n", i, d->data[i]);
         }
     }
-    up(&dev->sem);
+    up_read(&dev->rwsem);
     return 0;
 }
 
@@ -226,19 +353,34 @@ static void scull_remove_proc(void)
 
 #endif /* end of SCULL_DEBUG */
 
+/*
+ * Module-wide counts and latencies, in debugfs as scull/stats: the same
+ * format as every other driver here, see ldd_stats.h. /proc/scullstat
+ * has the per-device numbers.
+ */
+enum { SCULL_OPENS, SCULL_READS, SCULL_WRITES, SCULL_RBYTES, SCULL_WBYTES,
+    SCULL_NCOUNTERS };
+static const char * const scull_counters[] = {
+    "opens", "reads", "writes", "read_bytes", "write_bytes"
+};
+enum { SCULL_READ_NS, SCULL_WRITE_NS, SCULL_NHISTS };
+static const char * const scull_hists[] = { "read_ns", "write_ns" };
+static struct ldd_stats scull_ldd_stats;
+
 /* Open and close */
 int scull_open(struct inode *inode, struct file *filp)
 {
     struct scull_dev *dev; /* device information */
     dev = container_of(inode->i_cdev, struct scull_dev, cdev);
     filp->private_data = dev; /* for other methods */
+    ldd_stats_inc(&scull_ldd_stats, SCULL_OPENS);
 
     /* now trim to 0 the length of the device if open is write-only */
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (down_interruptible(&dev->sem))
+        if (down_write_killable(&dev->rwsem))
             return -ERESTARTSYS;
         scull_trim(dev); /* ignore errors */
-        up(&dev->sem);
+        up_write(&dev->rwsem);
     }
     return 0;
 }
@@ -275,106 +417,218 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
     return qs;
 }
 
-/* Data management: read and write */
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Get a fresh quantum, preferably one the writer allocated before it
+ * took the semaphore (it is only usable if the quantum size held still).
+ */
+static void *scull_new_quantum(struct scull_dev *dev, struct scull_prealloc *pa)
+{
+    if (pa->n && pa->quantum == dev->quantum)
+        return pa->q[--pa->n];
+    return kmalloc(dev->quantum, GFP_KERNEL);
+}
+
+/*
+ * Find the quantum holding byte "pos". With "pa" set, anything missing
+ * on the way is allocated; otherwise NULL means there's a hole and
+ * nothing is changed, so lookups are fine with the semaphore shared.
+ * Indexed devices jump straight to the quantum, the others follow the list.
+ */
+static void *scull_quantum_at(struct scull_dev *dev, loff_t pos,
+                struct scull_prealloc *pa)
 {
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr; /* the first listitem */
     int quantum = dev->quantum, qset = dev->qset;
     int itemsize = quantum * qset; /* how many byte in the listitem */
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = 0;
+    struct scull_qset *dptr;
+    unsigned long idx;
+    int item, s_pos;
+    void *q;
+
+    if (dev->indexed) {
+        idx = (long)pos / quantum;
+        q = xa_load(&dev->index, idx);
+        if (q || !pa)
+            return q;
+        q = scull_new_quantum(dev, pa);
+        if (!q)
+            return NULL;
+        if (xa_err(xa_store(&dev->index, idx, q, GFP_KERNEL))) {
+            kfree(q);
+            return NULL;
+        }
+        WRITE_ONCE(dev->stats.quanta, dev->stats.quanta + 1);
+        return q;
+    }
 
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
-    if (*f_pos >= dev->size)
-        goto out;
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
+    /* find listitem and qset index */
+    item = (long)pos / itemsize;
+    s_pos = ((long)pos % itemsize) / quantum;
 
-    /* find listitem, qset index, and offset int the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+    if (!pa) { /* just look, don't touch */
+        for (dptr = dev->data; dptr && item; dptr = dptr->next)
+            item--;
+        if (!dptr || !dptr->data)
+            return NULL;
+        return dptr->data[s_pos];
+    }
 
-    /* follow the list up to the right position(defined elsewhere) */
+    /* follow the list up to the right position */
     dptr = scull_follow(dev, item);
+    if (dptr == NULL)
+        return NULL;
+    if (!dptr->data) {
+        dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
+        if (!dptr->data)
+            return NULL;
+        memset(dptr->data, 0 , qset * sizeof(char *));
+    }
+    if (!dptr->data[s_pos]) {
+        dptr->data[s_pos] = scull_new_quantum(dev, pa);
+        if (dptr->data[s_pos])
+            WRITE_ONCE(dev->stats.quanta, dev->stats.quanta + 1);
+    }
+    return dptr->data[s_pos];
+}
 
-    if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
-        goto out;
+/*
+ * Count the quanta a write of "count" bytes at "pos" would have to
+ * allocate, up to what a struct scull_prealloc can hold.
+ */
+static int scull_count_holes(struct scull_dev *dev, loff_t pos, size_t count)
+{
+    int quantum = dev->quantum, n = 0;
+    loff_t end = pos + count;
+
+    pos -= (long)pos % quantum;
+    for (; pos < end && n < SCULL_PREALLOC; pos += quantum)
+        if (!scull_quantum_at(dev, pos, NULL))
+            n++;
+    return n;
+}
 
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
+/*
+ * Data management: read and write. Both work on an iov_iter, so a
+ * single call (or a readv/writev) crosses as many quanta as it needs
+ * while the semaphore is taken only once. Readers share the semaphore;
+ * writers take it exclusively, but allocate the quanta they are going
+ * to fill beforehand, so readers aren't kept waiting on the allocator.
+ */
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    int quantum = dev->quantum;
+    u64 start = ldd_stats_now();
+    loff_t pos = iocb->ki_pos;
+    size_t count, chunk, copied;
+    ssize_t retval = 0;
+    int q_pos;
+    void *q;
 
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-        retval = -EFAULT;
+    if (scull_down_read(dev, &dev->stats.rwait))
+        return -ERESTARTSYS;
+    if (pos >= dev->size)
         goto out;
+    count = min_t(size_t, iov_iter_count(to), dev->size - pos);
+
+    while (count) {
+        /* offset in the quantum, and the quantum itself */
+        q_pos = (long)pos % quantum;
+        q = scull_quantum_at(dev, pos, NULL);
+        if (!q)
+            break; /* a hole ends the transfer */
+
+        /* read up to the end of this quantum, then move on */
+        chunk = min_t(size_t, count, quantum - q_pos);
+        copied = copy_to_iter(q + q_pos, chunk, to);
+        pos += copied;
+        count -= copied;
+        retval += copied;
+        if (copied < chunk) {
+            if (!retval)
+                retval = -EFAULT;
+            break;
+        }
     }
-
-    *f_pos += count;
-    retval = count;
+    iocb->ki_pos = pos;
+    if (retval > 0)
+        atomic64_add(retval, &dev->stats.rbytes);
 
 out:
-    up(&dev->sem);
+    up_read(&dev->rwsem);
+    ldd_stats_inc(&scull_ldd_stats, SCULL_READS);
+    if (retval > 0)
+        ldd_stats_add(&scull_ldd_stats, SCULL_RBYTES, retval);
+    ldd_stats_time(&scull_ldd_stats, SCULL_READ_NS, start);
     return retval;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos)
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;
-    int quantum = dev->quantum, qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    struct scull_prealloc pa = { 0 };
+    u64 start = ldd_stats_now();
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from), chunk, copied;
+    ssize_t retval = 0;
+    int quantum, q_pos, n;
+    void *q;
 
-    if (down_interruptible(&dev->sem))
+    /* see what's missing, and allocate it while nobody waits for us */
+    if (scull_down_read(dev, &dev->stats.wwait))
         return -ERESTARTSYS;
-
-    /* find listitem, qset index and offset in the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position */
-    dptr = scull_follow(dev, item);
-    if (dptr == NULL)
-        goto out;
-    if (!dptr->data) {
-        dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0 , qset * sizeof(char *));
+    pa.quantum = dev->quantum;
+    n = scull_count_holes(dev, pos, count);
+    up_read(&dev->rwsem);
+    while (pa.n < n) {
+        pa.q[pa.n] = kmalloc(pa.quantum, GFP_KERNEL);
+        if (!pa.q[pa.n])
+            break; /* try again under the lock */
+        pa.n++;
     }
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
-    }
-
-    /*write only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
 
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-        retval = -EFAULT;
-        goto out;
+    if (scull_down_write(dev, &dev->stats.wwait)) {
+        retval = -ERESTARTSYS;
+        goto out_free;
     }
+    quantum = dev->quantum;
+
+    while (count) {
+        q_pos = (long)pos % quantum;
+        q = scull_quantum_at(dev, pos, &pa);
+        if (!q) {
+            if (!retval)
+                retval = -ENOMEM;
+            break;
+        }
 
-    *f_pos += count;
-    retval = count;
+        chunk = min_t(size_t, count, quantum - q_pos);
+        copied = copy_from_iter(q + q_pos, chunk, from);
+        pos += copied;
+        count -= copied;
+        retval += copied;
+        if (copied < chunk) {
+            if (!retval)
+                retval = -EFAULT;
+            break;
+        }
+    }
+    iocb->ki_pos = pos;
 
     /* update the size */
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
-
-out:
-    up(&dev->sem);
+    if (dev->size < pos)
+        dev->size = pos;
+    if (retval > 0)
+        atomic64_add(retval, &dev->stats.wbytes);
+
+    up_write(&dev->rwsem);
+
+out_free: /* whatever we didn't use */
+    while (pa.n)
+        kfree(pa.q[--pa.n]);
+    ldd_stats_inc(&scull_ldd_stats, SCULL_WRITES);
+    if (retval > 0)
+        ldd_stats_add(&scull_ldd_stats, SCULL_WBYTES, retval);
+    ldd_stats_time(&scull_ldd_stats, SCULL_WRITE_NS, start);
     return retval;
 }
 
@@ -528,8 +782,8 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 struct file_operations scull_fops = {
     .owner =    THIS_MODULE,
     .llseek =   scull_llseek,
-    .read =     scull_read,
-    .write =    scull_write,
+    .read_iter =    scull_read_iter,
+    .write_iter =   scull_write_iter,
     .unlocked_ioctl =    scull_ioctl,
     .open =     scull_open,
     .release =  scull_release,
@@ -554,10 +808,12 @@ void scull_cleanup_module(void)
         }
         kfree(scull_devices);
     }
+    ldd_stats_exit(&scull_ldd_stats);
 
 #ifdef SCULL_DEBUG /* use proc only if debugging */
     scull_remove_proc();
 #endif
+    remove_proc_entry("scullstat", NULL);
 
     /* cleanup module is never called if registering failed */
     unregister_chrdev_region(devno, scull_nr_devs);
@@ -615,13 +871,16 @@ int scull_init_module(void)
         goto fail; /*Make this more graceful */
     }
     memset(scull_devices, 0 , scull_nr_devs * sizeof(struct scull_dev));
+    ldd_stats_init(&scull_ldd_stats, "scull", NULL, scull_counters,
+            SCULL_NCOUNTERS, scull_hists, SCULL_NHISTS);
 
     /* Initialize each device */
     for (i = 0; i < scull_nr_devs; i++) {
         scull_devices[i].quantum = scull_quantum;
         scull_devices[i].qset = scull_qset;
-        //init_MUTEX(&scull_devices[i].sem);
-        sema_init(&scull_devices[i].sem, 1);
+        scull_devices[i].indexed = (scull_index_devs >> i) & 1;
+        xa_init(&scull_devices[i].index);
+        init_rwsem(&scull_devices[i].rwsem);
         scull_setup_cdev(&scull_devices[i], i);
     }
 
@@ -633,6 +892,8 @@ int scull_init_module(void)
 #ifdef SCULL_DEBUG /* only when debugging */
     scull_create_proc();
 #endif
+    proc_create("scullstat", 0, NULL,
+            proc_ops_wrapper(&scullstat_proc_ops, scullstat_pops));
 
     return 0; /* succeed */
 
@@ -31,28 +31,70 @@
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>     /* roundup_pow_of_two() */
+#include <linux/mm.h>
+#include <linux/vmalloc.h>  /* vmalloc_user(), remap_vmalloc_range() */
 
 #include "proc_ops_version.h"
+#include "ldd_layout.h"
 #include "scull.h"
 
+/*
+ * Readers and writers each get their own cache lines: the side that
+ * sleeps on a queue and moves a pointer owns them, setup and open/close
+ * state is in front, read-mostly once the device is open.
+ */
 struct scull_pipe {
-    wait_queue_head_t inq, outq;       /* read and write queues */
     char *buffer, *end;                /* begin of buf, end of buf */
     int buffersize;                    /* used in pointer arithmetic */
-    char *rp, *wp;                     /* where to read, where to write */
+    int spsc;                          /* use ring, not rp/wp */
+    struct scull_p_ring *ring;         /* page right before "buffer" */
     int nreaders, nwriters;            /* number of openings for r/w */
     struct fasync_struct *async_queue; /* asynchronous readers */
     struct semaphore sem;              /* mutual exclusion semaphore */
-    struct cdev cdev;                  /* Char device structure */
+    /* the reader's side */
+    wait_queue_head_t inq ____cacheline_aligned_in_smp;
+    char *rp;                          /* where to read */
+    struct mutex rmutex;               /* one reader at a time, in spsc mode */
+    /* the writer's side */
+    wait_queue_head_t outq ____cacheline_aligned_in_smp;
+    char *wp;                          /* where to write */
+    struct mutex wmutex;               /* one writer at a time, in spsc mode */
+    /* char device structure, its refcount moves at every open */
+    struct cdev cdev ____cacheline_aligned_in_smp;
+};
+
+#ifdef SCULL_DEBUG
+static const struct ldd_field scull_pipe_fields[] = {
+    LDD_FIELD(struct scull_pipe, buffer,      LDD_RO),
+    LDD_FIELD(struct scull_pipe, end,         LDD_RO),
+    LDD_FIELD(struct scull_pipe, buffersize,  LDD_RO),
+    LDD_FIELD(struct scull_pipe, spsc,        LDD_RO),
+    LDD_FIELD(struct scull_pipe, ring,        LDD_RO),
+    LDD_FIELD(struct scull_pipe, nreaders,    LDD_LOCK),
+    LDD_FIELD(struct scull_pipe, nwriters,    LDD_LOCK),
+    LDD_FIELD(struct scull_pipe, async_queue, LDD_LOCK),
+    LDD_FIELD(struct scull_pipe, sem,         LDD_LOCK),
+    LDD_FIELD(struct scull_pipe, inq,         LDD_CONS),
+    LDD_FIELD(struct scull_pipe, rp,          LDD_CONS),
+    LDD_FIELD(struct scull_pipe, rmutex,      LDD_CONS),
+    LDD_FIELD(struct scull_pipe, outq,        LDD_PROD),
+    LDD_FIELD(struct scull_pipe, wp,          LDD_PROD),
+    LDD_FIELD(struct scull_pipe, wmutex,      LDD_PROD),
+    LDD_FIELD(struct scull_pipe, cdev,        LDD_SHARED),
 };
+#endif
 
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS; /* number of pipe devices */
 int scull_p_buffer = SCULL_P_BUFFER;    /* buffer size */
 dev_t scull_p_devno;                    /* Our first device number */
+static int scull_p_spsc = 0;            /* lock-free ring for 1 reader/1 writer */
 
 module_param(scull_p_nr_devs, int, 0);
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_spsc, int, 0);
 
 static struct scull_pipe *scull_p_devices;
 
@@ -69,17 +111,39 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
-	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
+	if (dev->spsc) {
+		/*
+		 * The ring can't be rewound under the feet of the other
+		 * side, so it's only set up by the first opener; the size
+		 * is a power of two to turn the wrap into a mask. It comes
+		 * from vmalloc_user() with the header page in front, so that
+		 * the whole thing can be mapped to user space.
+		 */
+		if (!dev->buffer) {
+			dev->buffersize = roundup_pow_of_two(max_t(int, scull_p_buffer,
+						PAGE_SIZE));
+			dev->ring = vmalloc_user(PAGE_SIZE + dev->buffersize);
+			if (!dev->ring) {
+				up(&dev->sem);
+				return -ENOMEM;
+			}
+			dev->ring->size = dev->buffersize;
+			dev->buffer = (char *)dev->ring + PAGE_SIZE;
+			dev->end = dev->buffer + dev->buffersize;
+		}
+	} else {
 		if (!dev->buffer) {
-			up(&dev->sem);
-			return -ENOMEM;
+			/* allocate the buffer */
+			dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
+			if (!dev->buffer) {
+				up(&dev->sem);
+				return -ENOMEM;
+			}
 		}
+		dev->buffersize = scull_p_buffer;
+		dev->end = dev->buffer + dev->buffersize;
+		dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
 	if (filp->f_mode & FMODE_READ)
@@ -103,19 +167,186 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters--;
 	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
+		if (dev->spsc)
+			vfree(dev->ring);
+		else
+			kfree(dev->buffer);
+		dev->ring = NULL;
 		dev->buffer = NULL; /* the other fields are not checked on open */
 	}
 	up(&dev->sem);
 	return 0;
 }
 
+/*
+ * The SPSC ring. "head" is only written by the writer and "tail" only by
+ * the reader; each side publishes its index with a release store after
+ * touching the data, and reads the other one with an acquire load. The
+ * indices run freely and are masked on use, so a transfer that crosses
+ * the end of the buffer is just two copies in the same call. The mutexes
+ * only keep a second reader (or writer) out; the two sides never share a
+ * lock. Either side may live in user space, working on the mmap()ed ring
+ * directly, so nothing read from the header is trusted as is.
+ */
+static unsigned int scull_p_used(struct scull_pipe *dev)
+{
+	unsigned int used = smp_load_acquire(&dev->ring->head) -
+		smp_load_acquire(&dev->ring->tail);
+
+	return min_t(unsigned int, used, dev->buffersize);
+}
+
+/*
+ * Sleep until there's data (or room), first raising the flag a user
+ * space peer checks to know that it has to kick us with SCULL_P_IOCWAKE.
+ */
+static int scull_p_wait_ring(struct scull_pipe *dev, int for_write)
+{
+	__u32 *sleeping = for_write ? &dev->ring->wsleep : &dev->ring->rsleep;
+	int ret;
+
+	WRITE_ONCE(*sleeping, 1);
+	smp_mb(); /* flag first, then look: pairs with the waker's barrier */
+	if (for_write)
+		ret = wait_event_interruptible(dev->outq,
+				scull_p_used(dev) != dev->buffersize);
+	else
+		ret = wait_event_interruptible(dev->inq, scull_p_used(dev));
+	WRITE_ONCE(*sleeping, 0);
+	return ret;
+}
+
+static ssize_t scull_p_read_spsc(struct file *filp, char __user *buf, size_t count)
+{
+	struct scull_pipe *dev = filp->private_data;
+	unsigned int used, tail, off;
+	size_t first;
+	ssize_t retval;
+
+	if (mutex_lock_interruptible(&dev->rmutex))
+		return -ERESTARTSYS;
+	while (!(used = scull_p_used(dev))) { /* empty */
+		retval = -EAGAIN;
+		if (filp->f_flags & O_NONBLOCK)
+			goto out;
+		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+		retval = -ERESTARTSYS;
+		if (scull_p_wait_ring(dev, 0))
+			goto out;
+	}
+	tail = READ_ONCE(dev->ring->tail); /* we're the only one moving it */
+	count = min_t(size_t, count, used);
+	off = tail & (dev->buffersize - 1);
+	first = min_t(size_t, count, dev->buffersize - off);
+	retval = -EFAULT;
+	if (copy_to_user(buf, dev->buffer + off, first) ||
+	    copy_to_user(buf + first, dev->buffer, count - first))
+		goto out;
+	smp_store_release(&dev->ring->tail, tail + count);
+	retval = count;
+
+out:
+	mutex_unlock(&dev->rmutex);
+	if (retval > 0 && wq_has_sleeper(&dev->outq))
+		wake_up_interruptible(&dev->outq);
+	return retval;
+}
+
+static ssize_t scull_p_write_spsc(struct file *filp, const char __user *buf,
+		size_t count)
+{
+	struct scull_pipe *dev = filp->private_data;
+	unsigned int used, head, off;
+	size_t first;
+	ssize_t retval;
+
+	if (mutex_lock_interruptible(&dev->wmutex))
+		return -ERESTARTSYS;
+	while ((used = scull_p_used(dev)) == dev->buffersize) { /* full */
+		retval = -EAGAIN;
+		if (filp->f_flags & O_NONBLOCK)
+			goto out;
+		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
+		retval = -ERESTARTSYS;
+		if (scull_p_wait_ring(dev, 1))
+			goto out;
+	}
+	head = READ_ONCE(dev->ring->head); /* we're the only one moving it */
+	count = min_t(size_t, count, dev->buffersize - used);
+	off = head & (dev->buffersize - 1);
+	first = min_t(size_t, count, dev->buffersize - off);
+	retval = -EFAULT;
+	if (copy_from_user(dev->buffer + off, buf, first) ||
+	    copy_from_user(dev->buffer, buf + first, count - first))
+		goto out;
+	smp_store_release(&dev->ring->head, head + count);
+	retval = count;
+
+out:
+	mutex_unlock(&dev->wmutex);
+	if (retval > 0) {
+		if (wq_has_sleeper(&dev->inq))
+			wake_up_interruptible(&dev->inq);
+		if (dev->async_queue)
+			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	}
+	return retval;
+}
+
+/*
+ * The ring is also available to user space: the header page at offset
+ * zero, the data right after it. remap_vmalloc_range() refuses a request
+ * bigger than what's there.
+ */
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = filp->private_data;
+
+	if (!dev->spsc)
+		return -ENODEV;
+	return remap_vmalloc_range(vma, dev->ring, vma->vm_pgoff);
+}
+
+/*
+ * Mapped users sleep and wake each other through here; anything else
+ * is left to the bare scull ioctl.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_pipe *dev = filp->private_data;
+
+	switch (cmd) {
+	case SCULL_P_IOCWAIT: /* arg: 0 to wait for data, 1 for room */
+		if (!dev->spsc)
+			return -EINVAL;
+		if (scull_p_wait_ring(dev, arg != 0))
+			return -ERESTARTSYS;
+		return 0;
+
+	case SCULL_P_IOCWAKE: /* arg: 0 wakes the reader, 1 the writer */
+		if (!dev->spsc)
+			return -EINVAL;
+		if (arg) {
+			wake_up_interruptible(&dev->outq);
+		} else {
+			wake_up_interruptible(&dev->inq);
+			if (dev->async_queue)
+				kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+		}
+		return 0;
+	}
+	return scull_ioctl(filp, cmd, arg);
+}
+
 /* Data management: read and write */
 static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
 
+	if (dev->spsc)
+		return scull_p_read_spsc(filp, buf, count);
+
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 
@@ -189,6 +420,9 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 	struct scull_pipe *dev = filp->private_data;
 	int result;
 
+	if (dev->spsc)
+		return scull_p_write_spsc(filp, buf, count);
+
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 
@@ -227,6 +461,18 @@ static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
 	struct scull_pipe *dev = filp->private_data;
 	unsigned int mask = 0;
+	unsigned int used;
+
+	if (dev->spsc) {
+		poll_wait(filp, &dev->inq,  wait);
+		poll_wait(filp, &dev->outq, wait);
+		used = scull_p_used(dev);
+		if (used)
+			mask |= POLLIN | POLLRDNORM;	/* readable */
+		if (used != dev->buffersize)
+			mask |= POLLOUT | POLLWRNORM;	/* writable */
+		return mask;
+	}
 
 	/*
 	 * The buffer is circular; it is considered full
@@ -268,7 +514,11 @@ static int scull_read_p_mem(struct seq_file *s, void *v)
 		seq_printf(s, "\nDevice %i: %p\n", i, p);
 /*		seq_printf(s, "   Queues: %p %p\n", p->inq, p->outq);*/
 		seq_printf(s, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-		seq_printf(s, "   rp %p   wp %p\n", p->rp, p->wp);
+		if (p->spsc)
+			seq_printf(s, "   head %u   tail %u\n",
+				p->ring ? p->ring->head : 0, p->ring ? p->ring->tail : 0);
+		else
+			seq_printf(s, "   rp %p   wp %p\n", p->rp, p->wp);
 		seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
 		up(&p->sem);
 	}
@@ -300,7 +550,8 @@ struct file_operations scull_pipe_fops = {
 	.read =		scull_p_read,
 	.write =	scull_p_write,
 	.poll =		scull_p_poll,
-	.unlocked_ioctl =	scull_ioctl,
+	.mmap =		scull_p_mmap,
+	.unlocked_ioctl =	scull_p_ioctl,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
@@ -345,10 +596,14 @@ int scull_p_init(dev_t firstdev)
 		init_waitqueue_head(&(scull_p_devices[i].outq));
 		//init_MUTEX(&scull_p_devices[i].sem);
 		sema_init(&scull_p_devices[i].sem, 1);
+		mutex_init(&scull_p_devices[i].rmutex);
+		mutex_init(&scull_p_devices[i].wmutex);
+		scull_p_devices[i].spsc = scull_p_spsc;
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
 #ifdef SCULL_DEBUG
 	proc_create("scullpipe", 0, NULL, proc_ops_wrapper(&scullpipe_proc_ops,scullpipe_pops));
+	LDD_LAYOUT_SHOW(struct scull_pipe, scull_pipe_fields);
 #endif
 	return scull_p_nr_devs;
 }
@@ -370,7 +625,10 @@ void scull_p_cleanup(void)
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		if (scull_p_devices[i].spsc)
+			vfree(scull_p_devices[i].ring);
+		else
+			kfree(scull_p_devices[i].buffer);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
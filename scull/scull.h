@@ -20,6 +20,7 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/types.h> /* __u32 for the shared ring header */
 
 /* Marcos to help debugging */
 
@@ -74,20 +75,83 @@
 #define SCULL_P_BUFFER 4000
 #endif
 
+/* How many quanta a writer allocates before taking the semaphore */
+#ifndef SCULL_PREALLOC
+#define SCULL_PREALLOC 16
+#endif
+
+/*
+ * A scullpipe loaded with scull_p_spsc=1 can be mmap()ed: this header
+ * fills the first page, "size" bytes of ring follow. "head" and "tail"
+ * count bytes written and read, forever, and are masked with size-1 to
+ * find the data. The producer (in the kernel or not) is the only one to
+ * move head, the consumer the only one to move tail; store them with
+ * release semantics after touching the data. A side about to sleep
+ * raises its flag, then waits with poll() or SCULL_P_IOCWAIT; after
+ * publishing, the other side does a full barrier and, if the peer's
+ * flag is up, calls SCULL_P_IOCWAKE. That's the only syscall needed.
+ */
+struct scull_p_ring {
+    __u32 head;     /* producer: bytes written */
+    __u32 tail;     /* consumer: bytes read */
+    __u32 size;     /* ring size, a power of two */
+    __u32 rsleep;   /* the consumer is going to sleep */
+    __u32 wsleep;   /* the producer is going to sleep */
+};
+
 /* Representation of scull quantum sets. */
 struct scull_qset {
     void **data;
     struct scull_qset *next;
 };
 
+/*
+ * Counters kept on the I/O path, so that /proc/scullstat never needs the
+ * semaphore. "quanta" only changes with it held for writing; the others
+ * are also bumped by readers sharing it, hence atomic. Readers and
+ * writers get a cache line each, so they don't bounce one between them.
+ */
+struct scull_stats {
+    long quanta;                /* quanta allocated */
+    atomic64_t wbytes;          /* bytes written */
+    atomic64_t wwait;           /* ns writers waited for the semaphore */
+    /* the readers' own line */
+    atomic64_t rbytes ____cacheline_aligned_in_smp;
+    atomic64_t rwait;           /* ns readers waited for the semaphore */
+};
+
+/*
+ * Laid out by who writes what, one cache line each: the configuration
+ * is read on every access and changed only by ioctl, the semaphore is
+ * dirtied by every reader and writer, the data only by writers. Load
+ * misc-modules/kdataalign.ko to see how it falls on cache lines.
+ */
 struct scull_dev {
-    struct scull_qset *data;    /* Pointer to first quantum set */
     int quantum;                /* the current quantum size */
     int qset;                   /* the current array size */
-    unsigned long size;         /* amount of data stored here */
+    int indexed;                /* flagged in scull_index_devs, see "index" */
     unsigned int access_key;    /* used by sculluid  and scullpriv */
-    struct semaphore sem;       /* mutual exclusion semaphore */
-    struct cdev cdev;           /* Char device structure */
+    /* readers share, writers exclude */
+    struct rw_semaphore rwsem ____cacheline_aligned_in_smp;
+    /* pointer to first quantum set */
+    struct scull_qset *data ____cacheline_aligned_in_smp;
+    /*
+     * Indexed devices skip the list altogether: each quantum is stored
+     * in this xarray keyed by its number (f_pos / quantum), so a seek
+     * anywhere in the device costs a tree lookup, not a list walk.
+     */
+    struct xarray index;
+    unsigned long size;         /* amount of data stored here */
+    struct scull_stats stats;   /* for /proc/scullstat */
+    /* char device structure, its refcount moves at every open */
+    struct cdev cdev ____cacheline_aligned_in_smp;
+};
+
+/* Quanta allocated ahead of a write, all of them "quantum" bytes long */
+struct scull_prealloc {
+    int quantum;
+    int n;
+    void *q[SCULL_PREALLOC];
 };
 
 /* Split minors in two parts */
@@ -99,6 +163,7 @@ extern int scull_major; /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_index_devs;
 
 extern int scull_p_buffer; /* pipe.c */
 
@@ -110,10 +175,8 @@ void    scull_access_cleanup(void);
 
 int     scull_trim(struct scull_dev *dev);
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                    loff_t *f_pos);
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 /* int     scull_ioctl(struct inode *inode, struct file *filp,
@@ -157,8 +220,10 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE    _IO(SCULL_IOC_MAGIC, 13)
 #define SCULL_P_IOCQSIZE    _IO(SCULL_IOC_MAGIC, 14)
+#define SCULL_P_IOCWAIT     _IO(SCULL_IOC_MAGIC, 15)
+#define SCULL_P_IOCWAKE     _IO(SCULL_IOC_MAGIC, 16)
 /* ..more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 16
 
 #endif /* _SCULL_H_ */
@@ -32,6 +32,7 @@
 #include <linux/uaccess.h>    /* copy_*_user */
 
 #include "scull-shared/scull-async.h"
+#include "scull-shared/scull-bench.h"
 #include "scullc.h"          /* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
@@ -48,6 +49,20 @@ module_param(scullc_devs, int, 0);
 module_param(scullc_quantum, int , 0);
 module_param(scullc_qset, int, 0);
 
+/*
+ * Give each device a cache of its own instead of sharing one: devices
+ * don't fragment each other's slabs, and each shows up in slabinfo.
+ */
+int scullc_devcache  = 0;
+module_param(scullc_devcache, int, 0);
+
+/*
+ * Where the quanta come from (see scull-backend.h). With a private
+ * store per device this may be a list, one backend per device.
+ */
+char *scullc_backend = "slab";
+module_param(scullc_backend, charp, 0);
+
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -55,8 +70,43 @@ struct scullc_dev *scullc_devices; /* allocated in scullc_init */
 int scullc_trim(struct scullc_dev *dev);
 void scullc_cleanup(void);
 
-/* declare one cache pointer: use it for all devices */
-struct kmem_cache *scullc_cache;
+/* One store for all devices, or one each (but see above) */
+static struct scull_store *scullc_stores;
+static int scullc_nstores;
+
+static int scullc_make_stores(void)
+{
+    char backend[16], name[16];
+    int i, err;
+
+    scullc_nstores = scullc_devcache ? scullc_devs : 1;
+    scullc_stores = kcalloc(scullc_nstores, sizeof(*scullc_stores),
+            GFP_KERNEL);
+    if (!scullc_stores)
+        return -ENOMEM;
+    for (i = 0; i < scullc_nstores; i++) {
+        if (scullc_devcache)
+            snprintf(name, sizeof(name), "scullc%i", i);
+        else
+            strscpy(name, "scullc", sizeof(name));
+        scull_backend_pick(scullc_backend, i, backend, sizeof(backend));
+        err = scull_store_init(scullc_stores + i, backend, name,
+                scullc_quantum);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+static void scullc_free_stores(void)
+{
+    int i;
+
+    for (i = 0; scullc_stores && i < scullc_nstores; i++)
+        scull_store_exit(scullc_stores + i);
+    kfree(scullc_stores);
+    scullc_stores = NULL;
+}
 
 #ifdef SCULLC_USE_PROC /* don't waste space if unsed */
 
@@ -66,36 +116,19 @@ struct kmem_cache *scullc_cache;
 /* FIXME: Do we need this here??  It be ugly  */
 int scullc_read_procmem(struct seq_file *s, void *v)
 {
-    int i, j, quantum, qset;
+    int i, full = 0;
     int limit = s->size - 80; /* Don't print more than this */
-    struct scullc_dev *d;
+    struct scull_core *core;
 
-    for (i = 0; i < scullc_devs; i++) {
-        d = &scullc_devices[i];
+    for (i = 0; i < scullc_devs && !full; i++) {
+        core = &scullc_devices[i].core;
 
-        if (down_interruptible(&d->sem))
+        if (mutex_lock_interruptible(&core->mutex))
             return -ERESTARTSYS;
-        qset = d->qset;
-        quantum = d->quantum;
-
-        seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
-                i, d->qset, quantum, (long)d->size);
-        for (; d; d = d->next) { /* scan the list */
-            seq_printf(s, " item at %p, qset at %p\n", d, d->data);
-            if (s->count > limit)
-                goto out;
-            if (d->data && !d->next) /* dump only the last item */
-                for (j = 0; j < qset; j++) {
-                    if (d->data[j])
-                        seq_printf(s, "    % 4i: %8p\n", j, d->data[j]);
-                    if (s->count > limit)
-                        goto out;
-                }
-        }
-        out :
-            up(&scullc_devices[i].sem);
-            if (s->count > limit)
-                break;
+        seq_printf(s, "\nDevice %i: qset %i, q %zu, sz %li\n",
+                i, core->qset, core->quantum, (long)core->size);
+        full = scull_core_show(s, core, limit);
+        mutex_unlock(&core->mutex);
     }
     return 0;
 }
@@ -124,14 +157,14 @@ int scullc_open(struct inode *inode, struct file *filp)
 
     /* now trim to 0 the length of the device if open was write-only */
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (down_interruptible(&dev->sem))
+        if (mutex_lock_interruptible(&dev->core.mutex))
             return -ERESTARTSYS;
         scullc_trim(dev); /* ignore errors */
-        up(&dev->sem);
+        mutex_unlock(&dev->core.mutex);
     }
 
-    /* and use filp->private_data to point to the device data */
-    filp->private_data = dev;
+    /* and use filp->private_data to point to the data (scull-core.c) */
+    filp->private_data = &dev->core;
 
     return 0;
 }
@@ -141,132 +174,6 @@ int scullc_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-/* Follow the list */
-struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n)
-{
-    /* Then follow the list */
-    while (n--) {
-        if (!dev->next) {
-            dev->next = kmalloc(sizeof(struct scullc_dev), GFP_KERNEL);
-            memset(dev->next, 0, sizeof(struct scullc_dev));
-        }
-        dev = dev->next;
-        continue;
-    }
-
-    return dev;
-}
-
-/* Data management: read and write */
-ssize_t scullc_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-    struct scullc_dev *dev = filp->private_data;
-    struct scullc_dev *dptr; /* the first listitem */
-    int quantum = dev->quantum;
-    int qset = dev->qset;
-    int itemsize = quantum * qset; /* how many bytes in the listitem */
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = 0;
-
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
-    if (*f_pos > dev->size)
-        goto out;
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
-
-    /* find listitem, qset index, and offset int the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position(defined elsewhere) */
-    dptr = scullc_follow(dev, item);
-
-    if (!dptr->data || !dptr->data[s_pos])
-        goto out;
-
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
-    up(&dev->sem);
-
-    *f_pos += count;
-    return count;
-
-out:
-    up(&dev->sem);
-    return retval;
-}
-
-ssize_t scullc_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos)
-{
-    struct scullc_dev *dev = filp->private_data;
-    struct scullc_dev *dptr;
-    int quantum = dev->quantum;
-    int qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = -ENOMEM; /* our most likely error */
-
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
-
-    /* find listitem, qset index and offset in the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position */
-    dptr = scullc_follow(dev, item);
-    if (dptr == NULL)
-        goto out;
-    if (!dptr->data) {
-        dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0 , qset * sizeof(char *));
-    }
-    /* Allocate a quantum using the memory cache */
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
-        memset(dptr->data[s_pos], 0, scullc_quantum);
-    }
-
-    /*write only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
-
-    *f_pos += count;
-
-    /* update the size */
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
-
-    up(&dev->sem);
-    return count;
-
-out:
-    up(&dev->sem);
-    return retval;
-}
-
 /* The ioctl() implementation */
 long scullc_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
@@ -358,37 +265,51 @@ long scullc_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return ret;
 }
 
-/* The "extended" operations --only seek */
-loff_t scullc_llseek(struct file *filp, loff_t off, int whence)
+static const struct scull_async_ops scullc_async_ops = {
+    .read =     scull_core_read,
+    .write =    scull_core_write,
+    .busy =     scull_core_busy,
+};
+
+/* The benchmark (scull-bench.c) gets at the devices through these */
+static void *scullc_bench_dev(int index)
 {
-    struct scullc_dev *dev = filp->private_data;
-    long newpos;
+    return index >= 0 && index < scullc_devs ? &scullc_devices[index].core : NULL;
+}
 
-    switch (whence) {
-    case 0: /* SEEK_SET */
-        newpos = off;
-        break;
-    case 1: /* SEEK_CUR */
-        newpos = filp->f_pos + off;
-        break;
-    case 2: /* SEEK_END */
-        newpos = dev->size + off;
-		break;
-    default: /* can't happen */
-        return -EINVAL;
-    }
+static struct scull_store *scullc_bench_store(void *core)
+{
+    return ((struct scull_core *)core)->store;
+}
 
-    if (newpos < 0) return -EINVAL;
-    filp->f_pos = newpos;
-    return newpos;
+static int scullc_bench_trim(void *data)
+{
+    struct scull_core *core = data;
+    int ret;
+
+    if (mutex_lock_interruptible(&core->mutex))
+        return -ERESTARTSYS;
+    ret = scullc_trim(container_of(core, struct scullc_dev, core));
+    mutex_unlock(&core->mutex);
+    return ret;
 }
 
+static const struct scull_bench_ops scullc_bench_ops = {
+    .name =     "scullc",
+    .fops =     &scullc_fops,
+    .dev =      scullc_bench_dev,
+    .store =    scullc_bench_store,
+    .trim =     scullc_bench_trim,
+    .read =     scull_core_read,
+    .write =    scull_core_write,
+};
+
 /* The fops */
 struct file_operations scullc_fops = {
     .owner =    THIS_MODULE,
-    .llseek =   scullc_llseek,
-    .read =     scullc_read,
-    .write =    scullc_write,
+    .llseek =   scull_core_llseek,
+    .read =     scull_core_read,
+    .write =    scull_core_write,
     .unlocked_ioctl =    scullc_ioctl,
     .open =     scullc_open,
     .release =  scullc_release,
@@ -399,31 +320,13 @@ struct file_operations scullc_fops = {
 
 int scullc_trim(struct scullc_dev *dev)
 {
-    struct scullc_dev *next, *dptr;
-    int qset = dev->qset; /* "dev" is not-null */
-    int i;
-
-    if (dev->vmas) /* don't trim: there are active mappings */
-        return -EBUSY;
-
-    for (dptr = dev; dptr; dptr = next) { /* iterate the list items */
-        if (dptr->data) {
-            for (i =0; i < qset; i++)
-                if (dptr->data[i])
-                    kmem_cache_free(scullc_cache, dptr->data[i]);
-
-            kfree(dptr->data);
-            dptr->data = NULL;
-        }
-        next = dptr->next;
-        if (dptr != dev) kfree(dptr); /* all of them buf the first */
-    }
-
-    dev->size = 0;
-    dev->qset = scullc_qset;
-    dev->quantum = scullc_quantum;
-    dev->next = NULL;
-    return 0;
+    /*
+     * The quantum may have changed by ioctl since the store was made,
+     * and the objects must be big enough: a private store can follow
+     * it now that it's empty, the shared one can't.
+     */
+    return scull_core_trim(&dev->core, scullc_qset,
+            scullc_devcache ? scullc_quantum : 0);
 }
 
 /* Set up the char_dev structure for this devices */
@@ -458,6 +361,12 @@ int scullc_init(void)
     if(result < 0) /* a negative return represent an error */
         return result;
 
+    result = scull_async_init(&scullc_async_ops);
+    if (result < 0) {
+        unregister_chrdev_region(dev, scullc_devs);
+        return result;
+    }
+
     /*
      * allocate the devices -- we can't have them static, as the number
      * can be specified at load time
@@ -469,27 +378,30 @@ int scullc_init(void)
     }
     memset(scullc_devices, 0 , scullc_devs * sizeof(struct scullc_dev));
 
+    /* The stores go first: the devices take their quantum from them */
+    result = scullc_make_stores();
+    if (result < 0)
+        goto fail_stores;
+
     /* Initialize each device */
     for (i = 0; i < scullc_devs; i++) {
-        scullc_devices[i].quantum = scullc_quantum;
-        scullc_devices[i].qset = scullc_qset;
-        sema_init(&scullc_devices[i].sem, 1);
+        scull_core_init(&scullc_devices[i].core,
+                scullc_stores + (scullc_devcache ? i : 0), scullc_qset);
         scullc_setup_cdev(scullc_devices + i, i);
     }
 
-    scullc_cache = kmem_cache_create("scullc", scullc_quantum,
-            0, SLAB_HWCACHE_ALIGN, NULL); /* no ctor/dtor */
-    if (!scullc_cache) {
-        scullc_cleanup();
-        return -ENOMEM;
-    }
-
 #ifdef SCULLC_USE_PROC /* only when available */
     proc_create("scullcmem", 0, NULL, proc_ops_wrapper(&scullc_proc_ops, scullc_pops));
 #endif
+    if (scull_bench_init(&scullc_bench_ops) < 0)
+        printk(KERN_NOTICE "scullc: no /proc/scullcbench\n");
     return 0; /* succeed */
 
+fail_stores:
+    scullc_free_stores();
+    kfree(scullc_devices);
 fail:
+    scull_async_exit();
     unregister_chrdev_region(dev, scullc_devs);
     return result;
 }
@@ -503,6 +415,7 @@ void scullc_cleanup(void)
 {
     int i;
 
+    scull_bench_exit(); /* waits for a running benchmark */
 #ifdef SCULLC_USE_PROC /* only when available */
     remove_proc_entry("scullcmem", NULL);
 #endif
@@ -511,9 +424,9 @@ void scullc_cleanup(void)
         scullc_trim(scullc_devices + i);
     }
     kfree(scullc_devices);
+    scull_async_exit(); /* no opens left, so no requests either */
 
-    if (scullc_cache)
-        kmem_cache_destroy(scullc_cache);
+    scullc_free_stores();
     /* cleanup module is never called if registering failed */
     unregister_chrdev_region(MKDEV(scullc_major, 0), scullc_devs);
 }
@@ -0,0 +1 @@
+../../scull-shared/scull-bench.c
\ No newline at end of file
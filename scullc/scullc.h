@@ -22,6 +22,8 @@
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
 #include <linux/cdev.h>
 
+#include "scull-shared/scull-core.h"
+
 /* Marcos to help debugging */
 
 #undef PDEBUG /* undef it, just in case */
@@ -49,12 +51,9 @@
 #endif
 
 /*
- * The bare device is a variable-length region of memory
- * Use a linked list of indirect blocks
- *
- * "scullc_dev->data" points to an array of pointers, each
- * pointer refers to a memory page
- * The array (quantum-set) is SCULL_QSET long.
+ * The bare device is a variable-length region of memory, a list of
+ * quantum sets kept by scull-core.c. Quanta are SCULLC_QUANTUM bytes
+ * unless told otherwise, and each set is SCULLC_QSET long.
  */
 
 #ifndef SCULLC_QUANTUM
@@ -66,13 +65,7 @@
 #endif
 
 struct scullc_dev {
-    void **data;
-    struct scullc_dev *next;    /* next listitem */
-    int vmas;                   /* active mappings */
-    int quantum;                /* the current allocation size */
-    int qset;                   /* the current array size */
-    size_t size;                /* amount of data stored here */
-    struct semaphore sem;       /* mutual exclusion semaphore */
+    struct scull_core core;     /* the data, its store and its mutex */
     struct cdev cdev;           /* Char device structure */
 };
 
@@ -87,7 +80,6 @@ extern int scullc_qset;
 
 /* Prototypes for shared functions */
 int scullc_trim(struct scullc_dev *dev);
-struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
 
 #ifdef SCULLC_DEBUG
 #define SCULLC_USE_PROC
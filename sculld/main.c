@@ -32,6 +32,7 @@
 #include <linux/uaccess.h>    /* copy_*_user */
 
 #include "scull-shared/scull-async.h"
+#include "scull-shared/scull-bench.h"
 #include "sculld.h"          /* local definitions */
 #include "access_ok_version.h"
 
@@ -46,6 +47,13 @@ module_param(sculld_major, int, 0);
 module_param(sculld_devs, int, 0);
 module_param(sculld_order, int , 0);
 module_param(sculld_qset, int, 0);
+
+/*
+ * Where the quanta come from (see scull-backend.h), one entry per
+ * device; the last one goes for the rest. mmap needs pages or vmalloc.
+ */
+char *sculld_backend = "pages";
+module_param(sculld_backend, charp, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -70,36 +78,19 @@ static struct ldd_driver sculld_driver = {
 /* FIXME: Do we need this here??  It be ugly  */
 int sculld_read_procmem(struct seq_file *s, void *v)
 {
-    int i, j, order, qset;
+    int i, full = 0;
     int limit = s->size - 80; /* Don't print more than this */
-    struct sculld_dev *d;
+    struct scull_core *core;
 
-    for (i = 0; i < sculld_devs; i++) {
-        d = &sculld_devices[i];
+    for (i = 0; i < sculld_devs && !full; i++) {
+        core = &sculld_devices[i].core;
 
-        if (mutex_lock_interruptible(&d->mutex))
+        if (mutex_lock_interruptible(&core->mutex))
             return -ERESTARTSYS;
-        qset = d->qset;
-        order = d->order;
-
         seq_printf(s, "\nDevice %i: qset %i, order %i, sz %li\n",
-                i, qset, order, (long)d->size);
-        for (; d; d = d->next) { /* scan the list */
-            seq_printf(s, " item at %p, qset at %p\n", d, d->data);
-            if (s->count > limit)
-                goto out;
-            if (d->data && !d->next) /* dump only the last item */
-                for (j = 0; j < qset; j++) {
-                    if (d->data[j])
-                        seq_printf(s, "    % 4i: %8p\n", j, d->data[j]);
-                    if (s->count > limit)
-                        goto out;
-                }
-        }
-        out :
-            mutex_unlock(&sculld_devices[i].mutex);
-            if (s->count > limit)
-                break;
+                i, core->qset, get_order(core->quantum), (long)core->size);
+        full = scull_core_show(s, core, limit);
+        mutex_unlock(&core->mutex);
     }
     return 0;
 }
@@ -128,14 +119,14 @@ int sculld_open(struct inode *inode, struct file *filp)
 
     /* now trim to 0 the length of the device if open was write-only */
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (mutex_lock_interruptible(&dev->mutex))
+        if (mutex_lock_interruptible(&dev->core.mutex))
             return -ERESTARTSYS;
         sculld_trim(dev); /* ignore errors */
-        mutex_unlock(&dev->mutex);
+        mutex_unlock(&dev->core.mutex);
     }
 
-    /* and use filp->private_data to point to the device data */
-    filp->private_data = dev;
+    /* and use filp->private_data to point to the data (scull-core.c) */
+    filp->private_data = &dev->core;
 
     return 0;
 }
@@ -145,131 +136,6 @@ int sculld_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-/* Follow the list */
-struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
-{
-    /* Then follow the list */
-    while (n--) {
-        if (!dev->next) {
-            dev->next = kmalloc(sizeof(struct sculld_dev), GFP_KERNEL);
-            memset(dev->next, 0, sizeof(struct sculld_dev));
-        }
-        dev = dev->next;
-        continue;
-    }
-
-    return dev;
-}
-
-/* Data management: read and write */
-ssize_t sculld_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-    struct sculld_dev *dev = filp->private_data;
-    struct sculld_dev *dptr; /* the first listitem */
-    int quantum = PAGE_SIZE << dev->order;
-    int qset = dev->qset;
-    int itemsize = quantum * qset; /* how many bytes in the listitem */
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = 0;
-
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
-    if (*f_pos > dev->size)
-        goto out;
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
-
-    /* find listitem, qset index, and offset int the quantum */
-    item = ((long) *f_pos) / itemsize;
-    rest = ((long) *f_pos) % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position(defined elsewhere) */
-    dptr = sculld_follow(dev, item);
-
-    if (!dptr->data || !dptr->data[s_pos])
-        goto out;
-
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
-    mutex_unlock(&dev->mutex);
-
-    *f_pos += count;
-    return count;
-
-out:
-    mutex_unlock(&dev->mutex);
-    return retval;
-}
-
-ssize_t sculld_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos)
-{
-    struct sculld_dev *dev = filp->private_data;
-    struct sculld_dev *dptr;
-    int quantum = PAGE_SIZE << dev->order;
-    int qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = -ENOMEM; /* our most likely error */
-
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
-
-    /* find listitem, qset index and offset in the quantum */
-    item = ((long) *f_pos) / itemsize;
-    rest = ((long) *f_pos) % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position */
-    dptr = sculld_follow(dev, item);
-    if (!dptr->data) {
-        dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-        if (!dptr->data)
-            goto nomem;
-        memset(dptr->data, 0 , qset * sizeof(char *));
-    }
-    /* Allocate a quantum using the memory cache */
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] =
-            (void *)__get_free_pages(GFP_KERNEL, dptr->order);
-        if (!dptr->data[s_pos])
-            goto nomem;
-        memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-    }
-
-    /*write only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-        retval = -EFAULT;
-        goto nomem;
-    }
-
-    *f_pos += count;
-
-    /* update the size */
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
-
-    mutex_unlock(&dev->mutex);
-    return count;
-
-nomem:
-    mutex_unlock(&dev->mutex);
-    return retval;
-}
-
 /* The ioctl() implementation */
 long sculld_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
@@ -361,41 +227,53 @@ long sculld_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return ret;
 }
 
-/* The "extended" operations --only seek */
-loff_t sculld_llseek(struct file *filp, loff_t off, int whence)
+static const struct scull_async_ops sculld_async_ops = {
+    .read =     scull_core_read,
+    .write =    scull_core_write,
+    .busy =     scull_core_busy,
+};
+
+/* The benchmark (scull-bench.c) gets at the devices through these */
+static void *sculld_bench_dev(int index)
+{
+    return index >= 0 && index < sculld_devs ? &sculld_devices[index].core : NULL;
+}
+
+static struct scull_store *sculld_bench_store(void *core)
 {
-    struct sculld_dev *dev = filp->private_data;
-    long newpos;
+    return ((struct scull_core *)core)->store;
+}
 
-    switch (whence) {
-    case 0: /* SEEK_SET */
-        newpos = off;
-        break;
-    case 1: /* SEEK_CUR */
-        newpos = filp->f_pos + off;
-        break;
-    case 2: /* SEEK_END */
-        newpos = dev->size + off;
-		break;
-    default: /* can't happen */
-        return -EINVAL;
-    }
+static int sculld_bench_trim(void *data)
+{
+    struct scull_core *core = data;
+    int ret;
 
-    if (newpos < 0) return -EINVAL;
-    filp->f_pos = newpos;
-    return newpos;
+    mutex_lock(&core->mutex);
+    ret = sculld_trim(container_of(core, struct sculld_dev, core));
+    mutex_unlock(&core->mutex);
+    return ret;
 }
 
-/* Mmap is avaiable. but confined in a different file */
-extern int sculld_mmap(struct file *filp, struct vm_area_struct *vma);
-/* The fops */
+static const struct scull_bench_ops sculld_bench_ops = {
+    .name =     "sculld",
+    .fops =     &sculld_fops,
+    .dev =      sculld_bench_dev,
+    .store =    sculld_bench_store,
+    .trim =     sculld_bench_trim,
+    .read =     scull_core_read,
+    .write =    scull_core_write,
+};
+
+/* The fops: all but ioctl and open come from scull-core.c */
 struct file_operations sculld_fops = {
     .owner =    THIS_MODULE,
-    .llseek =   sculld_llseek,
-    .read =     sculld_read,
-    .write =    sculld_write,
+    .llseek =   scull_core_llseek,
+    .read =     scull_core_read,
+    .write =    scull_core_write,
     .unlocked_ioctl =    sculld_ioctl,
-    .mmap =     sculld_mmap,
+    .mmap =     scull_core_mmap,
+    .fadvise =  scull_core_fadvise,
     .open =     sculld_open,
     .release =  sculld_release,
     .read_iter = scull_read_iter,
@@ -405,31 +283,8 @@ struct file_operations sculld_fops = {
 
 int sculld_trim(struct sculld_dev *dev)
 {
-    struct sculld_dev *next, *dptr;
-    int qset = dev->qset; /* "dev" is not-null */
-    int i;
-
-    if (dev->vmas) /* don't trim: there are active mappings */
-        return -EBUSY;
-
-    for (dptr = dev; dptr; dptr = next) { /* iterate the list items */
-        if (dptr->data) {
-            for (i =0; i < qset; i++)
-                if (dptr->data[i])
-                    free_pages((unsigned long)(dptr->data[i]), dptr->order);
-
-            kfree(dptr->data);
-            dptr->data = NULL;
-        }
-        next = dptr->next;
-        if (dptr != dev) kfree(dptr); /* all of them buf the first */
-    }
-
-    dev->size = 0;
-    dev->qset = sculld_qset;
-    dev->order = sculld_order;
-    dev->next = NULL;
-    return 0;
+    /* Now that it's empty, the store can follow a new order */
+    return scull_core_trim(&dev->core, sculld_qset, PAGE_SIZE << sculld_order);
 }
 
 /* Set up the char_dev structure for this devices */
@@ -454,14 +309,41 @@ static ssize_t sculld_show_dev(struct device *ddev, struct device_attribute *att
 
 static DEVICE_ATTR(dev, S_IRUGO, sculld_show_dev, NULL);
 
-static void sculld_register_dev(struct sculld_dev *dev, int index)
+static struct attribute *sculld_dev_attrs[] = {
+	&dev_attr_dev.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(sculld_dev);
+
+static int sculld_on_bus; /* did register_ldd_devices() work? */
+
+/* Ready a device for the bus; the attributes come with it, before its uevent */
+static void sculld_prepare_dev(struct sculld_dev *dev, int index)
 {
 	snprintf(dev->devname, sizeof(dev->devname), "sculld%d", index);
 	dev->ldev.name = dev->devname;
 	dev->ldev.driver = &sculld_driver;
+	dev->ldev.dev.groups = sculld_dev_groups;
 	dev_set_drvdata(&dev->ldev.dev, dev);
-	register_ldd_device(&dev->ldev);
-	device_create_file(&dev->ldev.dev, &dev_attr_dev);
+}
+
+/* All of them at once, so that udev hears about them in one burst */
+static void sculld_register_devs(void)
+{
+	struct ldd_device **ldevs;
+	int i, err;
+
+	ldevs = kmalloc_array(sculld_devs, sizeof(*ldevs), GFP_KERNEL);
+	if (!ldevs)
+		return;
+	for (i = 0; i < sculld_devs; i++)
+		ldevs[i] = &sculld_devices[i].ldev;
+	err = register_ldd_devices(ldevs, sculld_devs);
+	kfree(ldevs);
+	if (err)
+		printk(KERN_NOTICE "sculld: error %d registering devices", err);
+	else
+		sculld_on_bus = 1;
 }
 
 
@@ -487,6 +369,12 @@ int sculld_init(void)
     if(result < 0) /* a negative return represent an error */
         return result;
 
+    result = scull_async_init(&sculld_async_ops);
+    if (result < 0) {
+        unregister_chrdev_region(dev, sculld_devs);
+        return result;
+    }
+
 	/**
 	 * Register with the driver core.
 	*/
@@ -503,21 +391,41 @@ int sculld_init(void)
     }
     memset(sculld_devices, 0 , sculld_devs * sizeof(struct sculld_dev));
 
+    /* Each device gets its own store, before anybody can open it */
+    for (i = 0; i < sculld_devs; i++) {
+        char backend[16], name[16];
+
+        snprintf(name, sizeof(name), "sculld%i", i);
+        scull_backend_pick(sculld_backend, i, backend, sizeof(backend));
+        result = scull_store_init(&sculld_devices[i].store, backend, name,
+                PAGE_SIZE << sculld_order);
+        if (result < 0)
+            goto fail_stores;
+    }
+
     /* Initialize each device */
     for (i = 0; i < sculld_devs; i++) {
-        sculld_devices[i].order = sculld_order;
-        sculld_devices[i].qset = sculld_qset;
-        mutex_init(&sculld_devices[i].mutex);
+        scull_core_init(&sculld_devices[i].core, &sculld_devices[i].store,
+                sculld_qset);
         sculld_setup_cdev(sculld_devices + i, i);
-		sculld_register_dev(sculld_devices + i, i);
+		sculld_prepare_dev(sculld_devices + i, i);
     }
+    sculld_register_devs();
 
 #ifdef SCULLD_USE_PROC /* only when available */
     proc_create("sculldmem", 0, NULL, &sculld_proc_ops);
 #endif
+    if (scull_bench_init(&sculld_bench_ops) < 0)
+        printk(KERN_NOTICE "sculld: no /proc/sculldbench\n");
     return 0; /* succeed */
 
+fail_stores:
+    while (i--)
+        scull_store_exit(&sculld_devices[i].store);
+    kfree(sculld_devices);
 fail_malloc:
+	unregister_ldd_driver(&sculld_driver);
+    scull_async_exit();
     unregister_chrdev_region(dev, sculld_devs);
     return result;
 }
@@ -531,15 +439,19 @@ void sculld_cleanup(void)
 {
     int i;
 
+    scull_bench_exit(); /* waits for a running benchmark */
 #ifdef SCULLD_USE_PROC /* only when available */
     remove_proc_entry("sculldmem", NULL);
 #endif
     for (i = 0; i < sculld_devs; i++) {
-		unregister_ldd_device(&sculld_devices[i].ldev);
+		if (sculld_on_bus)
+			unregister_ldd_device(&sculld_devices[i].ldev);
         cdev_del(&sculld_devices[i].cdev);
         sculld_trim(sculld_devices + i);
+        scull_store_exit(&sculld_devices[i].store);
     }
     kfree(sculld_devices);
+    scull_async_exit(); /* no opens left, so no requests either */
     /* cleanup module is never called if registering failed */
 	unregister_ldd_driver(&sculld_driver);
     unregister_chrdev_region(MKDEV(sculld_major, 0), sculld_devs);
@@ -0,0 +1 @@
+../../scull-shared/scull-bench.h
\ No newline at end of file
@@ -17,6 +17,7 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include "../include/lddbus.h"
+#include "scull-shared/scull-core.h"
 
 /**
  * Marcos to help debugging
@@ -42,25 +43,16 @@
 #define SCULLD_DEVS 4 /* sculld0 to sculld3 */
 
 /*
- * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
- *
- * "sculld_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
- *
- * The array (quantum-set) is SCULLD_QSET long.
+ * The bare device is a variable-length region of memory, a list of
+ * quantum sets kept by scull-core.c. Each quantum is PAGE_SIZE << order
+ * bytes, and each set is SCULLD_QSET long.
  */
 #define SCULLD_ORDER    0   /* one page at a time */
 #define SCULLD_QSET      500
 
 struct sculld_dev {
-    void **data;
-    struct sculld_dev *next;    /* next listitem */
-    int vmas;                   /* active mappings */
-	int order;                  /* the current allocation order */
-	int qset;                   /* the current array size */
-	size_t size;                /* 32-bit will suffice */
-	struct mutex mutex;         /* Mutual exclusion */
+	struct scull_core core;     /* the data, and its mutex */
+	struct scull_store store;   /* where the quanta come from */
 	struct cdev cdev;
 	char devname[20];
 	struct ldd_device ldev;            
@@ -76,12 +68,12 @@ extern int sculld_major;     /* main.c */
 extern int sculld_devs;
 extern int sculld_order;
 extern int sculld_qset;
+extern char *sculld_backend;
 
 /*
  * Prototypes for shared functions
  */
 int sculld_trim(struct sculld_dev *dev);
-struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
 
 #ifdef SCULLD_DEBUG
 #  define SCULLD_USE_PROC
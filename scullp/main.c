@@ -27,10 +27,12 @@
 #include <linux/aio.h>
 #include <linux/uio.h>
 #include <linux/mutex.h>
+#include <linux/huge_mm.h>
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>    /* copy_*_user */
 
 #include "scull-shared/scull-async.h"
+#include "scull-shared/scull-bench.h"
 #include "scullp.h"          /* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
@@ -47,6 +49,13 @@ module_param(scullp_devs, int, 0);
 module_param(scullp_order, int , 0);
 module_param(scullp_qset, int, 0);
 
+/*
+ * Where the quanta come from (see scull-backend.h), one entry per
+ * device; the last one goes for the rest. mmap needs pages or vmalloc.
+ */
+char *scullp_backend = "pages";
+module_param(scullp_backend, charp, 0);
+
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -62,36 +71,19 @@ void scullp_cleanup(void);
 /* FIXME: Do we need this here??  It be ugly  */
 int scullp_read_procmem(struct seq_file *s, void *v)
 {
-    int i, j, order, qset;
+    int i, full = 0;
     int limit = s->size - 80; /* Don't print more than this */
-    struct scullp_dev *d;
+    struct scull_core *core;
 
-    for (i = 0; i < scullp_devs; i++) {
-        d = &scullp_devices[i];
+    for (i = 0; i < scullp_devs && !full; i++) {
+        core = &scullp_devices[i].core;
 
-        if (mutex_lock_interruptible(&d->mutex))
+        if (mutex_lock_interruptible(&core->mutex))
             return -ERESTARTSYS;
-        qset = d->qset;
-        order = d->order;
-
         seq_printf(s, "\nDevice %i: qset %i, order %i, sz %li\n",
-                i, qset, order, (long)d->size);
-        for (; d; d = d->next) { /* scan the list */
-            seq_printf(s, " item at %p, qset at %p\n", d, d->data);
-            if (s->count > limit)
-                goto out;
-            if (d->data && !d->next) /* dump only the last item */
-                for (j = 0; j < qset; j++) {
-                    if (d->data[j])
-                        seq_printf(s, "    % 4i: %8p\n", j, d->data[j]);
-                    if (s->count > limit)
-                        goto out;
-                }
-        }
-        out :
-            mutex_unlock(&scullp_devices[i].mutex);
-            if (s->count > limit)
-                break;
+                i, core->qset, get_order(core->quantum), (long)core->size);
+        full = scull_core_show(s, core, limit);
+        mutex_unlock(&core->mutex);
     }
     return 0;
 }
@@ -120,14 +112,14 @@ int scullp_open(struct inode *inode, struct file *filp)
 
     /* now trim to 0 the length of the device if open was write-only */
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (mutex_lock_interruptible(&dev->mutex))
+        if (mutex_lock_interruptible(&dev->core.mutex))
             return -ERESTARTSYS;
         scullp_trim(dev); /* ignore errors */
-        mutex_unlock(&dev->mutex);
+        mutex_unlock(&dev->core.mutex);
     }
 
-    /* and use filp->private_data to point to the device data */
-    filp->private_data = dev;
+    /* and use filp->private_data to point to the data (scull-core.c) */
+    filp->private_data = &dev->core;
 
     return 0;
 }
@@ -137,133 +129,6 @@ int scullp_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-/* Follow the list */
-struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
-{
-    /* Then follow the list */
-    while (n--) {
-        if (!dev->next) {
-            dev->next = kmalloc(sizeof(struct scullp_dev), GFP_KERNEL);
-            memset(dev->next, 0, sizeof(struct scullp_dev));
-        }
-        dev = dev->next;
-        continue;
-    }
-
-    return dev;
-}
-
-/* Data management: read and write */
-ssize_t scullp_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-    struct scullp_dev *dev = filp->private_data;
-    struct scullp_dev *dptr; /* the first listitem */
-    int quantum = PAGE_SIZE << dev->order;
-    int qset = dev->qset;
-    int itemsize = quantum * qset; /* how many bytes in the listitem */
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = 0;
-
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
-    if (*f_pos > dev->size)
-        goto out;
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
-
-    /* find listitem, qset index, and offset int the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position(defined elsewhere) */
-    dptr = scullp_follow(dev, item);
-
-    if (!dptr->data || !dptr->data[s_pos])
-        goto out;
-
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
-    mutex_unlock(&dev->mutex);
-
-    *f_pos += count;
-    return count;
-
-out:
-    mutex_unlock(&dev->mutex);
-    return retval;
-}
-
-ssize_t scullp_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos)
-{
-    struct scullp_dev *dev = filp->private_data;
-    struct scullp_dev *dptr;
-    int quantum = PAGE_SIZE << dev->order;
-    int qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = -ENOMEM; /* our most likely error */
-
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
-
-    /* find listitem, qset index and offset in the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position */
-    dptr = scullp_follow(dev, item);
-    if (dptr == NULL)
-        goto out;
-    if (!dptr->data) {
-        dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0 , qset * sizeof(char *));
-    }
-    /* Allocate a quantum using the memory cache */
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] =
-            (void *)__get_free_pages(GFP_KERNEL, dptr->order);
-        if (!dptr->data[s_pos])
-            goto out;
-        memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-    }
-
-    /*write only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
-
-    *f_pos += count;
-
-    /* update the size */
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
-
-    mutex_unlock(&dev->mutex);
-    return count;
-
-out:
-    mutex_unlock(&dev->mutex);
-    return retval;
-}
-
 /* The ioctl() implementation */
 long scullp_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
@@ -355,41 +220,56 @@ long scullp_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return ret;
 }
 
-/* The "extended" operations --only seek */
-loff_t scullp_llseek(struct file *filp, loff_t off, int whence)
+static const struct scull_async_ops scullp_async_ops = {
+    .read =     scull_core_read,
+    .write =    scull_core_write,
+    .busy =     scull_core_busy,
+};
+
+/* The benchmark (scull-bench.c) gets at the devices through these */
+static void *scullp_bench_dev(int index)
 {
-    struct scullp_dev *dev = filp->private_data;
-    long newpos;
+    return index >= 0 && index < scullp_devs ? &scullp_devices[index].core : NULL;
+}
 
-    switch (whence) {
-    case 0: /* SEEK_SET */
-        newpos = off;
-        break;
-    case 1: /* SEEK_CUR */
-        newpos = filp->f_pos + off;
-        break;
-    case 2: /* SEEK_END */
-        newpos = dev->size + off;
-		break;
-    default: /* can't happen */
-        return -EINVAL;
-    }
+static struct scull_store *scullp_bench_store(void *core)
+{
+    return ((struct scull_core *)core)->store;
+}
+
+static int scullp_bench_trim(void *data)
+{
+    struct scull_core *core = data;
+    int ret;
 
-    if (newpos < 0) return -EINVAL;
-    filp->f_pos = newpos;
-    return newpos;
+    mutex_lock(&core->mutex);
+    ret = scullp_trim(container_of(core, struct scullp_dev, core));
+    mutex_unlock(&core->mutex);
+    return ret;
 }
 
+static const struct scull_bench_ops scullp_bench_ops = {
+    .name =     "scullp",
+    .fops =     &scullp_fops,
+    .dev =      scullp_bench_dev,
+    .store =    scullp_bench_store,
+    .trim =     scullp_bench_trim,
+    .read =     scull_core_read,
+    .write =    scull_core_write,
+};
+
 /* Mmap is avaiable. but confined in a different file */
 extern int scullp_mmap(struct file *filp, struct vm_area_struct *vma);
 /* The fops */
 struct file_operations scullp_fops = {
     .owner =    THIS_MODULE,
-    .llseek =   scullp_llseek,
-    .read =     scullp_read,
-    .write =    scullp_write,
+    .llseek =   scull_core_llseek,
+    .read =     scull_core_read,
+    .write =    scull_core_write,
     .unlocked_ioctl =    scullp_ioctl,
     .mmap =     scullp_mmap,
+    .get_unmapped_area = thp_get_unmapped_area, /* PMD-aligned if it can */
+    .fadvise =  scull_core_fadvise,
     .open =     scullp_open,
     .release =  scullp_release,
     .read_iter = scull_read_iter,
@@ -399,31 +279,8 @@ struct file_operations scullp_fops = {
 
 int scullp_trim(struct scullp_dev *dev)
 {
-    struct scullp_dev *next, *dptr;
-    int qset = dev->qset; /* "dev" is not-null */
-    int i;
-
-    if (dev->vmas) /* don't trim: there are active mappings */
-        return -EBUSY;
-
-    for (dptr = dev; dptr; dptr = next) { /* iterate the list items */
-        if (dptr->data) {
-            for (i =0; i < qset; i++)
-                if (dptr->data[i])
-                    free_pages((unsigned long)(dptr->data[i]), dptr->order);
-
-            kfree(dptr->data);
-            dptr->data = NULL;
-        }
-        next = dptr->next;
-        if (dptr != dev) kfree(dptr); /* all of them buf the first */
-    }
-
-    dev->size = 0;
-    dev->qset = scullp_qset;
-    dev->order = scullp_order;
-    dev->next = NULL;
-    return 0;
+    /* Now that it's empty, the store can follow a new order */
+    return scull_core_trim(&dev->core, scullp_qset, PAGE_SIZE << scullp_order);
 }
 
 /* Set up the char_dev structure for this devices */
@@ -459,6 +316,12 @@ int scullp_init(void)
     if(result < 0) /* a negative return represent an error */
         return result;
 
+    result = scull_async_init(&scullp_async_ops);
+    if (result < 0) {
+        unregister_chrdev_region(dev, scullp_devs);
+        return result;
+    }
+
     /*
      * allocate the devices -- we can't have them static, as the number
      * can be specified at load time
@@ -470,20 +333,38 @@ int scullp_init(void)
     }
     memset(scullp_devices, 0 , scullp_devs * sizeof(struct scullp_dev));
 
+    /* Each device gets its own store, before anybody can open it */
+    for (i = 0; i < scullp_devs; i++) {
+        char backend[16], name[16];
+
+        snprintf(name, sizeof(name), "scullp%i", i);
+        scull_backend_pick(scullp_backend, i, backend, sizeof(backend));
+        result = scull_store_init(&scullp_devices[i].store, backend, name,
+                PAGE_SIZE << scullp_order);
+        if (result < 0)
+            goto fail_stores;
+    }
+
     /* Initialize each device */
     for (i = 0; i < scullp_devs; i++) {
-        scullp_devices[i].order = scullp_order;
-        scullp_devices[i].qset = scullp_qset;
-        mutex_init(&scullp_devices[i].mutex);
+        scull_core_init(&scullp_devices[i].core, &scullp_devices[i].store,
+                scullp_qset);
         scullp_setup_cdev(scullp_devices + i, i);
     }
 
 #ifdef SCULLP_USE_PROC /* only when available */
     proc_create("scullpmem", 0, NULL, proc_ops_wrapper(&scullp_proc_ops, scullp_pops));
 #endif
+    if (scull_bench_init(&scullp_bench_ops) < 0)
+        printk(KERN_NOTICE "scullp: no /proc/scullpbench\n");
     return 0; /* succeed */
 
+fail_stores:
+    while (i--)
+        scull_store_exit(&scullp_devices[i].store);
+    kfree(scullp_devices);
 fail:
+    scull_async_exit();
     unregister_chrdev_region(dev, scullp_devs);
     return result;
 }
@@ -497,14 +378,17 @@ void scullp_cleanup(void)
 {
     int i;
 
+    scull_bench_exit(); /* waits for a running benchmark */
 #ifdef SCULLP_USE_PROC /* only when available */
     remove_proc_entry("scullpmem", NULL);
 #endif
     for (i = 0; i < scullp_devs; i++) {
         cdev_del(&scullp_devices[i].cdev);
         scullp_trim(scullp_devices + i);
+        scull_store_exit(&scullp_devices[i].store);
     }
     kfree(scullp_devices);
+    scull_async_exit(); /* no opens left, so no requests either */
     /* cleanup module is never called if registering failed */
     unregister_chrdev_region(MKDEV(scullp_major, 0), scullp_devs);
 }
@@ -21,95 +21,133 @@
 #include <asm/pgtable.h>
 #include <linux/fs.h>
 #include <linux/version.h>
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
 
+#include "vm_flags_version.h"
 #include "scullp.h"
 
 /*
- * open and close: just keep track of how many times the device is
- * mapped, to avoid releasing it.
+ * The nopage, fault-around and fadvise paths are those of every scull
+ * quantum list, in scull-mmap.c; what's scullp's own is below.
  */
-void scullp_vma_open(struct vm_area_struct *vma)
-{
-    struct scullp_dev *dev = vma->vm_private_data;
-    dev->vmas++;
-}
-
-void scullp_vma_close(struct vm_area_struct *vma)
-{
-    struct scullp_dev *dev = vma->vm_private_data;
-    dev->vmas--;
-}
 
 /*
- * The nopage method: the core of the file. It retrieves the
- * page required from the scullp device and returns it to the
- * user. The count for the page must be incremented, because
- * it is automatically decremented at page unmap.
+ * Huge mappings. When a quantum is at least a PMD in size (order 9 on
+ * x86), each one is naturally aligned and a shared mapping can use a
+ * single PMD entry per 2MB instead of 512 PTEs. PMD entries can't
+ * carry page references the way the nopage method does, so these
+ * mappings are VM_PFNMAP throughout: the vmas count is what keeps
+ * scull_core_trim() from freeing mapped memory.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * From 6.0 the core wouldn't consider THP for a VM_PFNMAP vma at all
+ * (it's in VM_NO_KHUGEPAGED), so ->huge_fault was never called, until
+ * 6.12 let PFN mappings have huge entries. Those kernels gain nothing
+ * from VM_PFNMAP and keep the nopage path, compound pages and all.
  */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
-typedef int vm_fault_t;
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && \
+    (LINUX_VERSION_CODE < KERNEL_VERSION(6,0,0) || \
+     LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0))
+#define SCULLP_HUGE
 #endif
-static vm_fault_t scullp_vma_nopage(struct vm_fault *vmf)
+
+#ifdef SCULLP_HUGE
+static vm_fault_t scullp_vma_pfn(struct vm_fault *vmf, unsigned long addr,
+        unsigned long *pfn)
 {
-    unsigned long offset;
     struct vm_area_struct *vma = vmf->vma;
-    struct scullp_dev *ptr;
-    struct scullp_dev *dev = vma->vm_private_data;
-    struct page *page = NULL;
-    void *pageptr = NULL; /* default to "missing */
-    vm_fault_t retval = VM_FAULT_NOPAGE;
+    struct scull_core *core = vma->vm_private_data;
+    unsigned long offset = (addr - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+    int shift = PAGE_SHIFT + get_order(core->quantum);
+    void *qptr;
+
+    if (offset >= core->size)
+        return VM_FAULT_SIGBUS;
+    qptr = scull_core_quantum(core, offset >> shift);
+    if (!qptr)
+        return VM_FAULT_SIGBUS;
+    *pfn = (__pa(qptr) + (offset & ((1UL << shift) - 1))) >> PAGE_SHIFT;
+    return 0;
+}
 
-    mutex_lock(&dev->mutex);
-    offset = (unsigned long)(vmf->address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+static vm_fault_t scullp_vma_pfn_fault(struct vm_fault *vmf)
+{
+    struct scull_core *core = vmf->vma->vm_private_data;
+    unsigned long pfn;
+    vm_fault_t retval;
 
-    if (offset >= dev->size) goto out; /* out of range */
+    mutex_lock(&core->mutex);
+    retval = scullp_vma_pfn(vmf, vmf->address, &pfn);
+    if (!retval)
+        retval = vmf_insert_pfn(vmf->vma, vmf->address, pfn);
+    mutex_unlock(&core->mutex);
+    return retval;
+}
 
-	/*
-	 * Now retrieve the scullp device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
-	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
-	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-    page = virt_to_page(pageptr);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,6,0)
+static vm_fault_t scullp_vma_huge_fault(struct vm_fault *vmf,
+        enum page_entry_size pe_size)
+#else
+static vm_fault_t scullp_vma_huge_fault(struct vm_fault *vmf,
+        unsigned int order)
+#endif
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct scull_core *core = vma->vm_private_data;
+    unsigned long haddr = vmf->address & PMD_MASK;
+    unsigned long pfn;
+    vm_fault_t retval = VM_FAULT_FALLBACK;
 
-	/* got it, now increment the count */
-	get_page(page);
-    vmf->page = page;
-    retval = 0;
-out:
-	mutex_unlock(&dev->mutex);
-	return retval;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,6,0)
+    if (pe_size != PE_SIZE_PMD)
+#else
+    if (order != PMD_SHIFT - PAGE_SHIFT)
+#endif
+        return VM_FAULT_FALLBACK;
+    /* The whole PMD must be inside the vma, and file-aligned too */
+    if (haddr < vma->vm_start || haddr + PMD_SIZE > vma->vm_end ||
+            (vma->vm_pgoff & ((PMD_SIZE >> PAGE_SHIFT) - 1)) !=
+            ((vma->vm_start >> PAGE_SHIFT) & ((PMD_SIZE >> PAGE_SHIFT) - 1)))
+        return VM_FAULT_FALLBACK;
+
+    mutex_lock(&core->mutex);
+    if (scullp_vma_pfn(vmf, haddr, &pfn) == 0)
+        retval = vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn),
+                vmf->flags & FAULT_FLAG_WRITE);
+    mutex_unlock(&core->mutex);
+    return retval;
 }
 
-struct  vm_operations_struct scullp_vm_ops = {
-    .open = scullp_vma_open,
-    .close = scullp_vma_close,
-    .fault = scullp_vma_nopage,
+static const struct vm_operations_struct scullp_huge_vm_ops = {
+    .open = scull_core_vma_open,
+    .close = scull_core_vma_close,
+    .fault = scullp_vma_pfn_fault,
+    .huge_fault = scullp_vma_huge_fault,
 };
+#endif /* SCULLP_HUGE */
 
 int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-    struct inode *inode = filp->f_path.dentry->d_inode;
+    struct scull_core *core = filp->private_data;
+    int ret;
 
-    /* refuse to map it if order is not 0 */
-    if (scullp_devices[iminor(inode)].order)
-        return -ENODEV;
-
-    /* don't do anything here: "nopage" will set up page table entries */
-    vma->vm_ops = &scullp_vm_ops;
-    vma->vm_private_data = filp->private_data;
-    scullp_vma_open(vma);
+    /* A quantum list like the others, unless it can do better below */
+    ret = scull_core_mmap(filp, vma);
+    if (ret)
+        return ret;
+#ifdef SCULLP_HUGE
+    /*
+     * Copy-on-write mappings need pages of their own: those go through
+     * nopage. Anything that may share goes, read-only shared mappings
+     * too, which the kernel makes without VM_SHARED.
+     */
+    if (get_order(core->quantum) >= PMD_SHIFT - PAGE_SHIFT &&
+            !is_cow_mapping_wrapper(vma->vm_flags) &&
+            scull_store_contiguous(core->store)) {
+        vm_flags_clear_wrapper(vma, VM_MIXEDMAP);
+        vm_flags_set_wrapper(vma, VM_PFNMAP | VM_HUGEPAGE | VM_DONTEXPAND | VM_DONTDUMP);
+        vma->vm_ops = &scullp_huge_vm_ops; /* same open and close */
+    }
+#endif
     return 0;
 }
@@ -0,0 +1 @@
+../../scull-shared/scull-backend.h
\ No newline at end of file
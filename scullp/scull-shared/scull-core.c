@@ -0,0 +1 @@
+../../scull-shared/scull-core.c
\ No newline at end of file
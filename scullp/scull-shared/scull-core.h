@@ -0,0 +1 @@
+../../scull-shared/scull-core.h
\ No newline at end of file
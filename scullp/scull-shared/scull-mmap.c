@@ -0,0 +1 @@
+../../scull-shared/scull-mmap.c
\ No newline at end of file
@@ -23,6 +23,8 @@
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
 
+#include "scull-shared/scull-core.h"
+
 /* Marcos to help debugging */
 
 #undef PDEBUG /* undef it, just in case */
@@ -46,25 +48,16 @@
 #define SCULLP_DEVS 4 /* scullp0 through scull3 */
 
 /*
- * The bare device is a variable-length region of memory
- * Use a linked list of indirect blocks
- *
- * "scullp_dev->data" points to an array of pointers, each
- * pointer refers to a memory page
- * The array (quantum-set) is SCULL_QSET long.
+ * The bare device is a variable-length region of memory, a list of
+ * quantum sets kept by scull-core.c. Each quantum is a block of
+ * PAGE_SIZE << order bytes, and each set is SCULLP_QSET long.
  */
 #define SCULLP_ORDER    0 /* one page at a time */
 #define SCULLP_QSET     500
 
 struct scullp_dev {
-    void **data;
-    struct scullp_dev *next;    /* next listitem */
-    int vmas;                   /* active mappings */
-    int order;                  /* the current allocation order */
-    int qset;                   /* the current array size */
-    size_t size;                /* amount of data stored here */
-    //struct semaphore sem;       /* mutual exclusion semaphore */
-    struct mutex mutex;       /* mutual exclusion semaphore */
+    struct scull_core core;     /* the data, and its mutex */
+    struct scull_store store;   /* where the quanta come from */
     struct cdev cdev;           /* Char device structure */
 };
 
@@ -76,10 +69,10 @@ extern int scullp_major; /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
+extern char *scullp_backend;
 
 /* Prototypes for shared functions */
 int scullp_trim(struct scullp_dev *dev);
-struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 
 #ifdef SCULLP_DEBUG
 #define SCULLP_USE_PROC
@@ -28,8 +28,11 @@
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>    /* copy_*_user */
 #include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/version.h>
 
 #include "scull-shared/scull-async.h"
+#include "scull-shared/scull-bench.h"
 #include "scullv.h"          /* local definitions */
 #include "access_ok_version.h"
 #include "proc_ops_version.h"
@@ -46,6 +49,24 @@ module_param(scullv_devs, int, 0);
 module_param(scullv_order, int , 0);
 module_param(scullv_qset, int, 0);
 
+/*
+ * Where the quanta come from (see scull-backend.h), one entry per
+ * device; the last one goes for the rest. mmap needs pages or vmalloc.
+ */
+char *scullv_backend = "vmalloc";
+module_param(scullv_backend, charp, 0);
+
+/*
+ * Devices in the scullv_linear bitmask keep their data in a single
+ * vmalloc area rather than a quantum at a time. The area doubles when
+ * a write runs past its end, and mmap maps all of it at once. With
+ * scullv_huge set, the area is allocated with huge pages if possible.
+ */
+int scullv_linear = 0;
+int scullv_huge = 0;
+module_param(scullv_linear, int, 0);
+module_param(scullv_huge, int, 0);
+
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -61,36 +82,19 @@ void scullv_cleanup(void);
 /* FIXME: Do we need this here??  It be ugly  */
 int scullv_read_procmem(struct seq_file *s, void *v)
 {
-    int i, j, order, qset;
+    int i, full = 0;
     int limit = s->size - 80; /* Don't print more than this */
-    struct scullv_dev *d;
+    struct scull_core *core;
 
-    for (i = 0; i < scullv_devs; i++) {
-        d = &scullv_devices[i];
+    for (i = 0; i < scullv_devs && !full; i++) {
+        core = &scullv_devices[i].core;
 
-        if (mutex_lock_interruptible(&d->mutex))
+        if (mutex_lock_interruptible(&core->mutex))
             return -ERESTARTSYS;
-        qset = d->qset;
-        order = d->order;
-
         seq_printf(s, "\nDevice %i: qset %i, order %i, sz %li\n",
-                i, qset, order, (long)d->size);
-        for (; d; d = d->next) { /* scan the list */
-            seq_printf(s, " item at %p, qset at %p\n", d, d->data);
-            if (s->count > limit)
-                goto out;
-            if (d->data && !d->next) /* dump only the last item */
-                for (j = 0; j < qset; j++) {
-                    if (d->data[j])
-                        seq_printf(s, "    % 4i: %8p\n", j, d->data[j]);
-                    if (s->count > limit)
-                        goto out;
-                }
-        }
-        out :
-            mutex_unlock(&scullv_devices[i].mutex);
-            if (s->count > limit)
-                break;
+                i, core->qset, get_order(core->quantum), (long)core->size);
+        full = scull_core_show(s, core, limit);
+        mutex_unlock(&core->mutex);
     }
     return 0;
 }
@@ -119,14 +123,14 @@ int scullv_open(struct inode *inode, struct file *filp)
 
     /* now trim to 0 the length of the device if open was write-only */
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (mutex_lock_interruptible(&dev->mutex))
+        if (mutex_lock_interruptible(&dev->core.mutex))
             return -ERESTARTSYS;
         scullv_trim(dev); /* ignore errors */
-        mutex_unlock(&dev->mutex);
+        mutex_unlock(&dev->core.mutex);
     }
 
-    /* and use filp->private_data to point to the device data */
-    filp->private_data = dev;
+    /* and use filp->private_data to point to the data (scull-core.c) */
+    filp->private_data = &dev->core;
 
     return 0;
 }
@@ -136,127 +140,113 @@ int scullv_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-/* Follow the list */
-struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
+/* An area for a linear device: vmalloc_user() so that it can be remapped */
+static void *scullv_area_alloc(size_t size, int *huge)
 {
-    /* Then follow the list */
-    while (n--) {
-        if (!dev->next) {
-            dev->next = kmalloc(sizeof(struct scullv_dev), GFP_KERNEL);
-            memset(dev->next, 0, sizeof(struct scullv_dev));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+    void *area;
+
+    if (scullv_huge && size >= PMD_SIZE) {
+        area = vmalloc_huge(size, GFP_KERNEL | __GFP_ZERO);
+        if (area) {
+            *huge = 1;
+            return area;
         }
-        dev = dev->next;
-        continue;
     }
-
-    return dev;
+#endif
+    *huge = 0;
+    return vmalloc_user(size);
 }
 
-/* Data management: read and write */
-ssize_t scullv_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Make room for "end" bytes, moving the data to a bigger area. Called
+ * with the mutex held; the area can't move while it's mapped.
+ */
+static int scullv_area_grow(struct scullv_dev *dev, loff_t end)
 {
-    struct scullv_dev *dev = filp->private_data;
-    struct scullv_dev *dptr; /* the first listitem */
-    int quantum = PAGE_SIZE << dev->order;
-    int qset = dev->qset;
-    int itemsize = quantum * qset; /* how many bytes in the listitem */
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = 0;
-
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
-    if (*f_pos > dev->size)
-        goto out;
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
-
-    /* find listitem, qset index, and offset int the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position(defined elsewhere) */
-    dptr = scullv_follow(dev, item);
-
-    if (!dptr->data || !dptr->data[s_pos])
-        goto out;
-
-    /* read only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-        retval = -EFAULT;
-        goto out;
+    size_t size;
+    void *area;
+    int huge;
+
+    if (end <= dev->area_size)
+        return 0;
+    if (end > (1UL << (BITS_PER_LONG - 2)))
+        return -EFBIG;
+    if (dev->core.vmas)
+        return -ENOSPC;
+    size = max_t(size_t, roundup_pow_of_two(end), dev->core.quantum);
+    area = scullv_area_alloc(size, &huge);
+    if (!area)
+        return -ENOMEM;
+    if (dev->area) {
+        memcpy(area, dev->area, dev->core.size);
+        vfree(dev->area);
     }
-    mutex_unlock(&dev->mutex);
+    dev->area = area;
+    dev->area_size = size;
+    dev->area_huge = huge;
+    return 0;
+}
 
+/* Read and write for linear devices, with the mutex held */
+static ssize_t scullv_linear_read(struct scullv_dev *dev, char __user *buf,
+                size_t count, loff_t *f_pos)
+{
+    if (*f_pos >= dev->core.size)
+        return 0;
+    if (count > dev->core.size - *f_pos)
+        count = dev->core.size - *f_pos;
+    if (copy_to_user(buf, dev->area + *f_pos, count))
+        return -EFAULT;
     *f_pos += count;
     return count;
-
-out:
-    mutex_unlock(&dev->mutex);
-    return retval;
 }
 
-ssize_t scullv_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos)
+static ssize_t scullv_linear_write(struct scullv_dev *dev,
+                const char __user *buf, size_t count, loff_t *f_pos)
 {
-    struct scullv_dev *dev = filp->private_data;
-    struct scullv_dev *dptr;
-    int quantum = PAGE_SIZE << dev->order;
-    int qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = -ENOMEM; /* our most likely error */
-
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
-
-    /* find listitem, qset index and offset in the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position */
-    dptr = scullv_follow(dev, item);
-    if (!dptr->data) {
-        dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0 , qset * sizeof(char *));
-    }
-    /* Allocate a quantum using virtual addresses */
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
-        if (!dptr->data[s_pos])
-            goto out;
-        memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-    }
-
-    /*write only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
+    int err = scullv_area_grow(dev, *f_pos + count);
 
+    if (err)
+        return err;
+    if (copy_from_user(dev->area + *f_pos, buf, count))
+        return -EFAULT;
     *f_pos += count;
+    if (dev->core.size < *f_pos)
+        dev->core.size = *f_pos;
+    return count;
+}
 
-    /* update the size */
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
+/* Data management: linear devices here, the others in scull-core.c */
+ssize_t scullv_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct scull_core *core = filp->private_data;
+    struct scullv_dev *dev = container_of(core, struct scullv_dev, core);
+    ssize_t retval;
 
-    mutex_unlock(&dev->mutex);
-    return count;
+    if (!dev->linear)
+        return scull_core_read(filp, buf, count, f_pos);
+    if (mutex_lock_interruptible(&core->mutex))
+        return -ERESTARTSYS;
+    retval = scullv_linear_read(dev, buf, count, f_pos);
+    mutex_unlock(&core->mutex);
+    return retval;
+}
+
+ssize_t scullv_write(struct file *filp, const char __user *buf, size_t count,
+                    loff_t *f_pos)
+{
+    struct scull_core *core = filp->private_data;
+    struct scullv_dev *dev = container_of(core, struct scullv_dev, core);
+    ssize_t retval;
 
-out:
-    mutex_unlock(&dev->mutex);
+    if (!dev->linear)
+        return scull_core_write(filp, buf, count, f_pos);
+    if (mutex_lock_interruptible(&core->mutex))
+        return -ERESTARTSYS;
+    retval = scullv_linear_write(dev, buf, count, f_pos);
+    mutex_unlock(&core->mutex);
     return retval;
 }
 
@@ -351,41 +341,55 @@ long scullv_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return ret;
 }
 
-/* The "extended" operations */
-loff_t scullv_llseek(struct file *filp, loff_t off, int whence)
+static const struct scull_async_ops scullv_async_ops = {
+    .read =     scullv_read,
+    .write =    scullv_write,
+    .busy =     scull_core_busy,
+};
+
+/* The benchmark (scull-bench.c) gets at the devices through these */
+static void *scullv_bench_dev(int index)
 {
-    struct scullv_dev *dev = filp->private_data;
-    long newpos;
+    return index >= 0 && index < scullv_devs ? &scullv_devices[index].core : NULL;
+}
 
-    switch (whence) {
-    case 0: /* SEEK_SET */
-        newpos = off;
-        break;
-    case 1: /* SEEK_CUR */
-        newpos = filp->f_pos + off;
-        break;
-    case 2: /* SEEK_END */
-        newpos = dev->size + off;
-		break;
-    default: /* can't happen */
-        return -EINVAL;
-    }
+static struct scull_store *scullv_bench_store(void *core)
+{
+    return ((struct scull_core *)core)->store;
+}
+
+static int scullv_bench_trim(void *data)
+{
+    struct scull_core *core = data;
+    int ret;
 
-    if (newpos < 0) return -EINVAL;
-    filp->f_pos = newpos;
-    return newpos;
+    mutex_lock(&core->mutex);
+    ret = scullv_trim(container_of(core, struct scullv_dev, core));
+    mutex_unlock(&core->mutex);
+    return ret;
 }
 
+static const struct scull_bench_ops scullv_bench_ops = {
+    .name =     "scullv",
+    .fops =     &scullv_fops,
+    .dev =      scullv_bench_dev,
+    .store =    scullv_bench_store,
+    .trim =     scullv_bench_trim,
+    .read =     scullv_read,
+    .write =    scullv_write,
+};
+
 /* Mmap is avaiable. but confined in a different file */
 extern int scullv_mmap(struct file *filp, struct vm_area_struct *vma);
 /* The fops */
 struct file_operations scullv_fops = {
     .owner =    THIS_MODULE,
-    .llseek =   scullv_llseek,
+    .llseek =   scull_core_llseek,
     .read =     scullv_read,
     .write =    scullv_write,
     .unlocked_ioctl =    scullv_ioctl,
     .mmap =     scullv_mmap,
+    .fadvise =  scull_core_fadvise,
     .open =     scullv_open,
     .release =  scullv_release,
     .read_iter = scull_read_iter,
@@ -395,30 +399,15 @@ struct file_operations scullv_fops = {
 
 int scullv_trim(struct scullv_dev *dev)
 {
-    struct scullv_dev *next, *dptr;
-    int qset = dev->qset; /* "dev" is not-null */
-    int i;
-
-    if (dev->vmas) /* don't trim: there are active mappings */
-        return -EBUSY;
-
-    for (dptr = dev; dptr; dptr = next) { /* iterate the list items */
-        if (dptr->data) {
-            for (i =0; i < qset; i++)
-                if (dptr->data[i])
-                    vfree(dptr->data[i]);
-
-            kfree(dptr->data);
-            dptr->data = NULL;
-        }
-        next = dptr->next;
-        if (dptr != dev) kfree(dptr); /* all of them buf the first */
-    }
-
-    dev->size = 0;
-    dev->qset = scullv_qset;
-    dev->order = scullv_order;
-    dev->next = NULL;
+    /* Now that it's empty, the store can follow a new order */
+    int ret = scull_core_trim(&dev->core, scullv_qset,
+            PAGE_SIZE << scullv_order);
+
+    if (ret) /* there are active mappings */
+        return ret;
+    vfree(dev->area); /* linear devices */
+    dev->area = NULL;
+    dev->area_size = 0;
     return 0;
 }
 
@@ -455,6 +444,12 @@ int scullv_init(void)
     if(result < 0) /* a negative return represent an error */
         return result;
 
+    result = scull_async_init(&scullv_async_ops);
+    if (result < 0) {
+        unregister_chrdev_region(dev, scullv_devs);
+        return result;
+    }
+
     /*
      * allocate the devices -- we can't have them static, as the number
      * can be specified at load time
@@ -466,20 +461,39 @@ int scullv_init(void)
     }
     memset(scullv_devices, 0 , scullv_devs * sizeof(struct scullv_dev));
 
+    /* Each device gets its own store, before anybody can open it */
+    for (i = 0; i < scullv_devs; i++) {
+        char backend[16], name[16];
+
+        snprintf(name, sizeof(name), "scullv%i", i);
+        scull_backend_pick(scullv_backend, i, backend, sizeof(backend));
+        result = scull_store_init(&scullv_devices[i].store, backend, name,
+                PAGE_SIZE << scullv_order);
+        if (result < 0)
+            goto fail_stores;
+    }
+
     /* Initialize each device */
     for (i = 0; i < scullv_devs; i++) {
-        scullv_devices[i].order = scullv_order;
-        scullv_devices[i].qset = scullv_qset;
-        mutex_init(&scullv_devices[i].mutex);
+        scull_core_init(&scullv_devices[i].core, &scullv_devices[i].store,
+                scullv_qset);
+        scullv_devices[i].linear = (scullv_linear >> i) & 1;
         scullv_setup_cdev(scullv_devices + i, i);
     }
 
 #ifdef SCULLV_USE_PROC /* only when available */
     proc_create("scullvmem", 0, NULL, proc_ops_wrapper(&scullv_proc_ops, scullv_pops));
 #endif
+    if (scull_bench_init(&scullv_bench_ops) < 0)
+        printk(KERN_NOTICE "scullv: no /proc/scullvbench\n");
     return 0; /* succeed */
 
+fail_stores:
+    while (i--)
+        scull_store_exit(&scullv_devices[i].store);
+    kfree(scullv_devices);
 fail:
+    scull_async_exit();
     unregister_chrdev_region(dev, scullv_devs);
     return result;
 }
@@ -488,14 +502,17 @@ void scullv_cleanup(void)
 {
     int i;
 
+    scull_bench_exit(); /* waits for a running benchmark */
 #ifdef SCULLV_USE_PROC /* only when available */
     remove_proc_entry("scullvmem", NULL);
 #endif
     for (i = 0; i < scullv_devs; i++) {
         cdev_del(&scullv_devices[i].cdev);
         scullv_trim(scullv_devices + i);
+        scull_store_exit(&scullv_devices[i].store);
     }
     kfree(scullv_devices);
+    scull_async_exit(); /* no opens left, so no requests either */
     unregister_chrdev_region(MKDEV(scullv_major, 0), scullv_devs);
 }
 
@@ -21,94 +21,64 @@
 #include <asm/pgtable.h>
 #include <linux/fs.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 
+#include "vm_flags_version.h"
 #include "scullv.h"
 
 /*
- * open and close: just keep track of how many times the device is
- * mapped, to avoid releasing it.
+ * The nopage, fault-around and fadvise paths are those of every scull
+ * quantum list, in scull-mmap.c; linear devices are scullv's own.
  */
-void scullv_vma_open(struct vm_area_struct *vma)
-{
-    struct scullv_dev *dev = vma->vm_private_data;
-    dev->vmas++;
-}
 
-void scullv_vma_close(struct vm_area_struct *vma)
-{
-    struct scullv_dev *dev = vma->vm_private_data;
-    dev->vmas--;
-}
+/* Linear devices have every page mapped up front: no fault method */
+static const struct vm_operations_struct scullv_linear_vm_ops = {
+    .open = scull_core_vma_open,
+    .close = scull_core_vma_close,
+};
 
 /*
- * The nopage method: the core of the file. It retrieves the
- * page required from the scullv device and returns it to the
- * user. The count for the page must be incremented, because
- * it is automatically decremented at page unmap.
- *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * A linear device is a single vmalloc area, so the whole mapping is
+ * set up here with remap_vmalloc_range(). Huge-page areas aren't
+ * VM_USERMAP, which remap_vmalloc_range() insists on, so their pages
+ * are inserted one by one instead.
  */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
-typedef int vm_fault_t;
-#endif
-static vm_fault_t scullv_vma_nopage(struct vm_fault *vmf)
+static int scullv_linear_mmap(struct scullv_dev *dev,
+        struct vm_area_struct *vma)
 {
-    unsigned long offset;
-    struct vm_area_struct *vma = vmf->vma;
-    struct scullv_dev *ptr;
-    struct scullv_dev *dev = vma->vm_private_data;
-    struct page *page = NULL;
-    void *pageptr = NULL; /* default to "missing */
-    vm_fault_t retval = VM_FAULT_NOPAGE;
+    unsigned long off = vma->vm_pgoff << PAGE_SHIFT, addr;
+    int ret = 0;
 
-    mutex_lock(&dev->mutex);
-    offset = (unsigned long)(vmf->address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+    mutex_lock(&dev->core.mutex);
+    if (!dev->area || off + (vma->vm_end - vma->vm_start) > dev->area_size) {
+        ret = -EINVAL; /* map what's there, or write first */
+        goto out;
+    }
+    if (!dev->area_huge) {
+        ret = remap_vmalloc_range(vma, dev->area, vma->vm_pgoff);
+    } else {
+        vm_flags_set_wrapper(vma, VM_DONTEXPAND | VM_DONTDUMP);
+        for (addr = vma->vm_start; addr < vma->vm_end && !ret;
+                addr += PAGE_SIZE, off += PAGE_SIZE)
+            ret = vm_insert_page(vma, addr, vmalloc_to_page(dev->area + off));
+    }
+    if (ret)
+        goto out;
 
-    if (offset >= dev->size) goto out; /* out of range */
-
-	/*
-	 * Now retrieve the scullv device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
-	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
-	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-    /*
-     * After scullv lookup, "page" is now the address of the page
-     * needed by the current process, Since it's a vmalloc address.
-     * turn it into a struct page
-     */
-    page = vmalloc_to_page(pageptr);
-
-	/* got it, now increment the count */
-	get_page(page);
-    vmf->page = page;
-    retval = 0;
+    vma->vm_ops = &scullv_linear_vm_ops;
+    vma->vm_private_data = &dev->core;
+    scull_core_vma_open(vma);
 out:
-	mutex_unlock(&dev->mutex);
-	return retval;
+    mutex_unlock(&dev->core.mutex);
+    return ret;
 }
 
-struct  vm_operations_struct scullv_vm_ops = {
-    .open = scullv_vma_open,
-    .close = scullv_vma_close,
-    .fault = scullv_vma_nopage,
-};
-
 int scullv_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-    /* don't do anything here: "nopage" will set up page table entries */
-    vma->vm_ops = &scullv_vm_ops;
-    vma->vm_private_data = filp->private_data;
-    scullv_vma_open(vma);
-    return 0;
+    struct scull_core *core = filp->private_data;
+    struct scullv_dev *dev = container_of(core, struct scullv_dev, core);
+
+    if (dev->linear)
+        return scullv_linear_mmap(dev, vma);
+    return scull_core_mmap(filp, vma);
 }
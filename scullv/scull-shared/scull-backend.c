@@ -0,0 +1 @@
+../../scull-shared/scull-backend.c
\ No newline at end of file
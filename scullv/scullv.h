@@ -23,6 +23,8 @@
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
 
+#include "scull-shared/scull-core.h"
+
 /* Marcos to help debugging */
 
 #undef PDEBUG /* undef it, just in case */
@@ -46,24 +48,21 @@
 #define SCULLV_DEVS 4 /* scullv0 through scullv3 */
 
 /*
- * The bare device is a variable-length region of memory
- * Use a linked list of indirect blocks
- *
- * "scullv_dev->data" points to an array of pointers, each
- * pointer refers to a memory page
- * The array (quantum-set) is SCULLV_QSET long.
+ * The bare device is a variable-length region of memory, a list of
+ * quantum sets kept by scull-core.c. Each quantum is PAGE_SIZE << order
+ * bytes, and each set is SCULLV_QSET long. Linear devices use the core
+ * for its size, lock and mapping count only.
  */
 #define SCULLV_ORDER    4 /* 16 pages at a time */
 #define SCULLV_QSET     500
 
 struct scullv_dev {
-    void **data;
-    struct scullv_dev *next;    /* next listitem */
-    int vmas;                   /* active mappings */
-    int order;                  /* the current allocation oreer */
-    int qset;                   /* the current array size */
-    size_t size;                /* 32=bit will suffice */
-    struct mutex mutex;         /* mutual exclusion semaphore */
+    struct scull_core core;     /* the data, and its mutex */
+    int linear;                 /* one vmalloc area, not quanta */
+    int area_huge;              /* the area has huge pages */
+    void *area;                 /* linear devices: all the data */
+    size_t area_size;           /* allocated, a power of two */
+    struct scull_store store;   /* where the quanta come from */
     struct cdev cdev;           /* Char device structure */
 };
 
@@ -75,10 +74,12 @@ extern int scullv_major; /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern char *scullv_backend;
+extern int scullv_linear;
+extern int scullv_huge;
 
 /* Prototypes for shared functions */
 int scullv_trim(struct scullv_dev *dev);
-struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
 
 #ifdef SCULLV_DEBUG
 #define SCULLV_USE_PROC
@@ -39,9 +39,19 @@
 #include <linux/workqueue.h>
 #include <linux/poll.h>
 #include <linux/wait.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/uaccess.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
 
 #include <asm/io.h>
 
+#include "../include/ldd_stats.h"
+
 #define SHORT_NR_PORTS 8 /* use 8 ports by default */
 
 /*
@@ -79,6 +89,18 @@ module_param(tasklet, int, 0);
 static int share = 0; /* select at load time whether install a shared irq */
 module_param(share, int, 0);
 
+static int binary = 0; /* raw timestamps in per-CPU rings instead of text */
+module_param(binary, int, 0);
+
+static int ring_pages = 4; /* per CPU, in binary mode */
+module_param(ring_pages, int, 0);
+
+static int threaded = 0; /* select whether the bottom half is an irq thread */
+module_param(threaded, int, 0);
+
+static int budget = 64; /* stamps a bottom half handles in one pass */
+module_param(budget, int, 0);
+
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -103,6 +125,26 @@ static inline void short_incr_bp(volatile unsigned long *index, int delta)
     *index = (new >= (short_buffer + PAGE_SIZE)) ? short_buffer : new;
 }
 
+/*
+ * Counts and latencies in debugfs, short/stats (see ldd_stats.h): how
+ * long a burst of port I/O takes in each mode, and a bottom half run.
+ */
+enum { SHORT_READS, SHORT_WRITES, SHORT_BYTES, SHORT_IRQS, SHORT_NCOUNTERS };
+static const char * const short_counters[] = {
+    "reads", "writes", "bytes", "interrupts"
+};
+enum { SHORT_READ_NS, SHORT_WRITE_NS, SHORT_BH_NS, SHORT_NHISTS };
+static const char * const short_hists[] = { "read_ns", "write_ns", "bh_ns" };
+static struct ldd_stats short_stats;
+
+static void short_account(int op, int hist, ssize_t done, u64 start)
+{
+    ldd_stats_inc(&short_stats, op);
+    if (done > 0)
+        ldd_stats_add(&short_stats, SHORT_BYTES, done);
+    ldd_stats_time(&short_stats, hist, start);
+}
+
 /*
  * The devices with low minor numbers write/read burst of data to/from
  * specific I/O ports (by default the parallel ones).
@@ -182,7 +224,12 @@ ssize_t do_short_read(struct inode *inode, struct file *filp, char __user *buf,
 /* Version-specific methods for the fops structure. FIXME don't need anymore */
 ssize_t short_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
-    return do_short_read(file_dentry(filp)->d_inode, filp, buf, count, f_pos);
+    u64 start = ldd_stats_now();
+    ssize_t retval = do_short_read(file_dentry(filp)->d_inode, filp, buf,
+            count, f_pos);
+
+    short_account(SHORT_READS, SHORT_READ_NS, retval, start);
+    return retval;
 }
 
 ssize_t do_short_write(struct inode *inode, struct file *filp, const char __user *buf,
@@ -238,7 +285,12 @@ ssize_t do_short_write(struct inode *inode, struct file *filp, const char __user
 
 ssize_t short_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    return do_short_write(file_dentry(filp)->d_inode, filp, buf, count, f_pos);
+    u64 start = ldd_stats_now();
+    ssize_t retval = do_short_write(file_dentry(filp)->d_inode, filp, buf,
+            count, f_pos);
+
+    short_account(SHORT_WRITES, SHORT_WRITE_NS, retval, start);
+    return retval;
 }
 
 unsigned int short_poll(struct file *filp, poll_table *wait)
@@ -256,12 +308,173 @@ struct file_operations short_fops = {
 };
 
 
+/*
+ * Binary mode. Formatting text in the handler costs more than the rest
+ * of it, so instead each CPU gets a ring of raw 64-bit timestamps (ns
+ * since the epoch) which only the handler on that CPU writes. The
+ * rings can be read through the device, or mmap'd by a consumer that
+ * decodes at its leisure. The mapping is one block per CPU, each
+ * (1 + ring_pages) pages long: a page with a struct short_ring, then
+ * the stamps. The consumer advances "tail" as it goes; the handler
+ * never overwrites, it counts what didn't fit in "overruns" instead.
+ * head and tail run freely and wrap, index with (x & (size - 1)).
+ *
+ * The header is the consumer's to write, so apart from tail it only
+ * holds copies: the kernel works from its own head, overruns and size,
+ * and takes tail for no more than a ring's length behind head.
+ *
+ * Each ring has a single consumer. Readers of the device take turns
+ * under short_ring_mutex, but nothing keeps read() from a mapping's
+ * consumer: use one or the other, as two of them moving the same tail
+ * get stamps twice or not at all.
+ */
+struct short_ring {
+    u32 head;       /* next slot the handler fills */
+    u32 tail;       /* next slot the consumer reads */
+    u32 overruns;   /* stamps dropped because the ring was full */
+    u32 size;       /* slots, a power of two */
+    u32 cpu;
+};
+
+/* The kernel's side of each CPU's ring, out of the consumer's reach */
+struct short_ring_state {
+    u32 head;
+    u32 overruns;
+};
+
+static DEFINE_PER_CPU(struct short_ring_state, short_ring_state);
+static void *short_rings; /* vmalloc_user'd, so it can be mapped */
+static unsigned long short_ring_bytes;
+static u32 short_ring_size; /* slots per ring, a power of two */
+static DEFINE_MUTEX(short_ring_mutex); /* one read() consumer at a time */
+
+static inline struct short_ring *short_ring_of(int cpu)
+{
+    return short_rings + cpu * short_ring_bytes;
+}
+
+static inline u64 *short_ring_data(struct short_ring *ring)
+{
+    return (void *)ring + PAGE_SIZE;
+}
+
+/*
+ * The consumer's tail, as far as it can be believed: whatever it says,
+ * there are no more than a ring's worth of stamps between it and head.
+ */
+static u32 short_ring_tail(struct short_ring *ring, u32 head)
+{
+    u32 used = head - smp_load_acquire(&ring->tail);
+
+    return head - min(used, short_ring_size);
+}
+
+/*
+ * Record one stamp in the ring of "cpu". Each ring has a single writer:
+ * the handler on that CPU, or the bottom half (see short_tv_drain()).
+ */
+static void short_ring_put(int cpu, u64 ns)
+{
+    struct short_ring_state *st = per_cpu_ptr(&short_ring_state, cpu);
+    struct short_ring *ring = short_ring_of(cpu);
+    u32 head = st->head;
+
+    if (head - short_ring_tail(ring, head) >= short_ring_size) {
+        WRITE_ONCE(ring->overruns, ++st->overruns);
+        return;
+    }
+    short_ring_data(ring)[head & (short_ring_size - 1)] = ns;
+    /* the stamp, then the head: ours for read(), the copy for mmap */
+    smp_store_release(&st->head, head + 1);
+    smp_store_release(&ring->head, head + 1);
+}
+
+static int short_ring_pending(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct short_ring_state *st = per_cpu_ptr(&short_ring_state, cpu);
+
+        if (READ_ONCE(st->head) != READ_ONCE(short_ring_of(cpu)->tail))
+            return 1;
+    }
+    return 0;
+}
+
+/* Copy out whole stamps from every CPU's ring, as many as fit */
+static ssize_t short_ring_read(char __user *buf, size_t count)
+{
+    size_t done = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct short_ring *ring = short_ring_of(cpu);
+        u32 head = smp_load_acquire(&per_cpu_ptr(&short_ring_state,
+                cpu)->head);
+        u32 tail = short_ring_tail(ring, head);
+
+        while (head != tail && count - done >= sizeof(u64)) {
+            u32 slot = tail & (short_ring_size - 1);
+            u32 n = min3(head - tail, short_ring_size - slot,
+                    (u32)((count - done) / sizeof(u64)));
+
+            if (copy_to_user(buf + done, short_ring_data(ring) + slot,
+                    n * sizeof(u64))) {
+                smp_store_release(&ring->tail, tail);
+                return done ? done : -EFAULT;
+            }
+            tail += n;
+            done += n * sizeof(u64);
+        }
+        smp_store_release(&ring->tail, tail); /* done with the slots */
+    }
+    return done;
+}
+
+static int short_ring_init(void)
+{
+    int cpu;
+
+    ring_pages = roundup_pow_of_two(max(ring_pages, 1));
+    short_ring_bytes = (1 + ring_pages) * PAGE_SIZE;
+    short_ring_size = ring_pages * PAGE_SIZE / sizeof(u64);
+    short_rings = vmalloc_user(nr_cpu_ids * short_ring_bytes);
+    if (!short_rings)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        struct short_ring *ring = short_ring_of(cpu);
+
+        ring->size = short_ring_size;
+        ring->cpu = cpu;
+    }
+    return 0;
+}
+
 /* then, the interrupt-related device */
 ssize_t short_i_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
     int count0;
     DEFINE_WAIT(wait);
 
+    if (binary) {
+        ssize_t ret;
+
+        if (count < sizeof(u64))
+            return -EINVAL;
+        do {
+            if (!short_ring_pending() && (filp->f_flags & O_NONBLOCK))
+                return -EAGAIN;
+            if (wait_event_interruptible(short_queue, short_ring_pending()))
+                return -ERESTARTSYS;
+            if (mutex_lock_interruptible(&short_ring_mutex))
+                return -ERESTARTSYS;
+            ret = short_ring_read(buf, count);
+            mutex_unlock(&short_ring_mutex);
+        } while (!ret); /* another reader took them first */
+        return ret;
+    }
+
     while(short_head == short_tail) {
         prepare_to_wait(&short_queue, &wait, TASK_INTERRUPTIBLE);
         if (short_head == short_tail)
@@ -302,10 +515,19 @@ ssize_t short_i_write(struct file *filp, const char __user *buf, size_t count,
     return written;
 }
 
+/* Binary mode only: map the rings, headers and all (see above) */
+int short_i_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if (!short_rings)
+        return -ENODEV;
+    return remap_vmalloc_range(vma, short_rings, vma->vm_pgoff);
+}
+
 struct file_operations short_i_fops = {
     .owner = THIS_MODULE,
     .read = short_i_read,
     .write = short_i_write,
+    .mmap = short_i_mmap,
     .open = short_open,
     .release = short_release,
 };
@@ -315,6 +537,12 @@ irqreturn_t short_interrupt(int irq, void *dev_id)
     struct timespec64 tv;
     int written;
 
+    ldd_stats_inc(&short_stats, SHORT_IRQS);
+    if (binary) {
+        short_ring_put(smp_processor_id(), ktime_get_real_ns());
+        wake_up_interruptible(&short_queue); /* awake any reading process */
+        return IRQ_HANDLED;
+    }
     ktime_get_real_ts64(&tv);
 
     /* Write a 16 byte record. assume PAGE_SIZE is a multiple of 16 */
@@ -327,28 +555,102 @@ irqreturn_t short_interrupt(int irq, void *dev_id)
 }
 
 /*
- * The following two functions are equivalent to the previous one,
- * but split in top and bottom half. First, a few needed variables
+ * The following functions are equivalent to the previous one, but
+ * split in top and bottom half. The top half only takes a timestamp
+ * into tv_data, the bottom half (a tasklet, a work item or an irq
+ * thread) turns them into records. When interrupts come in bursts,
+ * one bottom half run takes care of the whole burst: how many it got
+ * each time shows in /proc/shortstats. First, a few needed variables
  */
-#define NR_TIMEVAL 512 /* length of the array of time values */
-struct timespec64 tv_data[NR_TIMEVAL];
-volatile struct timespec64 *tv_head = tv_data;
-volatile struct timespec64 *tv_tail = tv_data;
+#define NR_TIMEVAL 512 /* length of the array of time values, a power of 2 */
+u64 tv_data[NR_TIMEVAL]; /* ns since the epoch */
+unsigned int tv_head, tv_tail; /* run freely: index with & (NR_TIMEVAL - 1) */
 static struct work_struct short_wq;
-int short_wq_count = 0;
+atomic_t short_wq_count = ATOMIC_INIT(0);
+
+/* What the bottom half saw, written by it alone */
+#define SHORT_BH_HIST 8
+static struct short_bh_stats {
+    unsigned long runs;         /* bottom half invocations */
+    unsigned long irqs;         /* interrupts they covered */
+    unsigned long stamps;       /* timestamps they drained */
+    unsigned long max;          /* most interrupts in one run */
+    unsigned long passes;       /* full budgets, for the irq thread */
+    unsigned long hist[SHORT_BH_HIST]; /* runs covering 1, 2-3, 4-7... */
+} short_bh_stats;
+static unsigned long short_tv_dropped; /* top half found tv_data full */
+
+/* One stamp, in the 16-byte text format */
+static void short_text_stamp(u64 ns)
+{
+    u32 nsec, sec;
+    int written;
+
+    div_u64_rem(div_u64_rem(ns, NSEC_PER_SEC, &nsec), 100000000, &sec);
+    written = sprintf((char *)short_head, "%08u.%06lu\n", sec,
+            nsec / NSEC_PER_USEC);
+    short_incr_bp(&short_head, written);
+}
+
+/* The top halves: take the time, and count the interrupt */
+static inline void short_tv_stamp(void)
+{
+    unsigned int head = tv_head;
+
+    if (head - smp_load_acquire(&tv_tail) < NR_TIMEVAL) {
+        tv_data[head & (NR_TIMEVAL - 1)] = ktime_get_real_ns();
+        smp_store_release(&tv_head, head + 1);
+    } else {
+        short_tv_dropped++;
+    }
+    atomic_inc(&short_wq_count); /* record that an interrupt arrived */
+    ldd_stats_inc(&short_stats, SHORT_IRQS);
+}
 
 /*
- * Increment a circular buffer pointer in a way that nobody sees
- * an intermediate value.
+ * Move at most "budget" stamps from tv_data to where readers look:
+ * the text buffer or, in binary mode, the ring of CPU 0 (the bottom
+ * half is its only writer then). Returns how many were moved.
  */
-static inline void short_incr_tv(volatile struct timespec64 **tvp)
+static int short_tv_drain(int budget)
 {
-    if (*tvp == (tv_data + NR_TIMEVAL - 1))
-        *tvp = tv_data; /* wrap */
-    else
-        (*tvp)++;
+    unsigned int tail = tv_tail, head = smp_load_acquire(&tv_head);
+    int done = 0;
+
+    for (; tail != head && done < budget; tail++, done++) {
+        u64 ns = tv_data[tail & (NR_TIMEVAL - 1)];
+
+        if (binary)
+            short_ring_put(0, ns);
+        else
+            short_text_stamp(ns);
+    }
+    smp_store_release(&tv_tail, tail); /* the slots can be reused */
+    short_bh_stats.stamps += done;
+    return done;
 }
 
+/* Start of a bottom half run: how many interrupts does it cover? */
+static void short_bh_account(void)
+{
+    /* we have already been removed from the queue */
+    int savecount = atomic_xchg(&short_wq_count, 0);
+
+    if (!savecount)
+        return;
+    short_bh_stats.runs++;
+    short_bh_stats.irqs += savecount;
+    if (savecount > short_bh_stats.max)
+        short_bh_stats.max = savecount;
+    short_bh_stats.hist[min(ilog2(savecount), SHORT_BH_HIST - 1)]++;
+
+    /* First write the number of interrupts that occurred before this bh */
+    if (!binary) {
+        int written = sprintf((char *)short_head, "bh after %6i\n",
+                savecount);
+        short_incr_bp(&short_head, written);
+    }
+}
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0))
 void short_do_tasklet(unsigned long unused)
@@ -356,55 +658,85 @@ void short_do_tasklet(unsigned long unused)
 void short_do_tasklet(struct tasklet_struct *unused)
 #endif
 {
-    int savecount = short_wq_count, written;
-    short_wq_count = 0; /* we have already been removed from the queue */
+    u64 start = ldd_stats_now();
+
     /*
 	 * The bottom half reads the tv array, filled by the top half,
 	 * and prints it to the circular text buffer, which is then consumed
 	 * by reading processes
 	 */
-
-	/* First write the number of interrupts that occurred before this bh */
-    written = sprintf((char *)short_head, "bh after %6i\n", savecount);
-    short_incr_bp(&short_head, written);
-
-    /*
-	 * Then, write the time values. Write exactly 16 bytes at a time,
-	 * so it aligns with PAGE_SIZE
-	 */
-    do {
-        written = sprintf((char *)short_head, "%08u.%06lu\n",
-            (int)(tv_tail->tv_sec % 100000000), (int)tv_tail->tv_nsec / NSEC_PER_USEC);
-
-        short_incr_bp(&short_head, written);
-        short_incr_tv(&tv_tail);
-    } while(tv_tail != tv_head);
-
+    short_bh_account();
+    while (short_tv_drain(budget) == budget)
+        ;
     wake_up_interruptible(&short_queue);/* awake any reading process */
+    ldd_stats_time(&short_stats, SHORT_BH_NS, start);
 }
 
 irqreturn_t short_wq_interrupt(int irq, void *dev_id)
 {
     /* Grab the current time information. */
-    ktime_get_real_ts64((struct timespec64 *)tv_head);
-    short_incr_tv(&tv_head);
+    short_tv_stamp();
     /* Queue the bh. Don't worry about multiple enqueueing */
     schedule_work(&short_wq);
-
-    short_wq_count++; /* record that an interrupt arrived */
     return IRQ_HANDLED;
 }
 
 /* Tasklet top half */
 irqreturn_t short_tl_interrupt(int irq, void *dev_id)
 {
-    ktime_get_real_ts64((struct timespec64 *)tv_head); /* cast to stop 'volatile' warning */
-    short_incr_tv(&tv_head);
+    short_tv_stamp();
     tasklet_schedule(&short_tasklet);
-    short_wq_count++; /* record that an interrupt arrived */
     return IRQ_HANDLED;
 }
 
+/*
+ * Threaded top half: the irq core wakes our thread, or, if it is
+ * running already, has it go around once more when it's done. So a
+ * burst costs one wakeup, not one per interrupt.
+ */
+irqreturn_t short_th_interrupt(int irq, void *dev_id)
+{
+    short_tv_stamp();
+    return IRQ_WAKE_THREAD;
+}
+
+/*
+ * ... and the thread. Like a NAPI poll, it works in passes of at most
+ * "budget" stamps, letting readers and everybody else in between.
+ */
+irqreturn_t short_irq_thread(int irq, void *dev_id)
+{
+    u64 start = ldd_stats_now();
+
+    short_bh_account();
+    while (short_tv_drain(budget) == budget) {
+        short_bh_stats.passes++;
+        wake_up_interruptible(&short_queue);
+        cond_resched();
+    }
+    wake_up_interruptible(&short_queue); /* awake any reading process */
+    ldd_stats_time(&short_stats, SHORT_BH_NS, start);
+    return IRQ_HANDLED;
+}
+
+static int short_stats_show(struct seq_file *m, void *v)
+{
+    struct short_bh_stats *st = &short_bh_stats;
+    int i;
+
+    seq_printf(m, "bh runs %lu interrupts %lu stamps %lu\n", st->runs,
+            st->irqs, st->stamps);
+    seq_printf(m, "interrupts per run: avg %lu max %lu\n",
+            st->runs ? st->irqs / st->runs : 0, st->max);
+    seq_printf(m, "full passes %lu dropped %lu\n", st->passes,
+            short_tv_dropped);
+    for (i = 0; i < SHORT_BH_HIST - 1; i++)
+        seq_printf(m, "runs covering %u-%u: %lu\n", 1U << i, (2U << i) - 1,
+                st->hist[i]);
+    seq_printf(m, "runs covering %u or more: %lu\n", 1U << i, st->hist[i]);
+    return 0;
+}
+
 irqreturn_t short_sh_interrupt(int irq, void *dev_id)
 {
     int value, written;
@@ -417,8 +749,14 @@ irqreturn_t short_sh_interrupt(int irq, void *dev_id)
 
     /* clear the interrupting bit */
     outb(value & 0x7F, short_base);
+    ldd_stats_inc(&short_stats, SHORT_IRQS);
 
     /* the rest is unchanged */
+    if (binary) {
+        short_ring_put(smp_processor_id(), ktime_get_real_ns());
+        wake_up_interruptible(&short_queue); /* awake any reading process */
+        return IRQ_HANDLED;
+    }
     ktime_get_real_ts64(&tv);
     written = sprintf((char *)short_head, "%08u.%06lu\n",
             (int)(tv.tv_sec % 100000000), (int)tv.tv_nsec / NSEC_PER_USEC);
@@ -544,6 +882,10 @@ int short_init(void)
     if(major == 0) major = result; /* dynamic */
     short_buffer = __get_free_pages(GFP_KERNEL, 0); /* never fails */
     short_head = short_tail = short_buffer;
+    if (binary && short_ring_init()) {
+        printk(KERN_INFO "short: no memory for the rings, using text\n");
+        binary = 0;
+    }
 
     /*
 	 * Fill the workqueue structure, used for the bottom half handler.
@@ -551,6 +893,11 @@ int short_init(void)
 	 * (unused) argument.
 	 */
     INIT_WORK(&short_wq, (void(*)(struct work_struct *))short_do_tasklet);
+    if (budget < 1)
+        budget = 1;
+    proc_create_single("shortstats", 0, NULL, short_stats_show);
+    ldd_stats_init(&short_stats, "short", NULL, short_counters,
+            SHORT_NCOUNTERS, short_hists, SHORT_NHISTS);
 
     /*
 	 * Now we deal with the interrupt: either kernel-based
@@ -585,30 +932,27 @@ int short_init(void)
         return 0; /* the rest of the function only installs handlers */
     }
 
+    /*
+	 * Otherwise pick the handler: the plain one, or a top half for
+	 * the bottom half that has been requested
+	 */
     if (short_irq >= 0) {
-        result = request_irq(short_irq, short_interrupt, 0,
-                "short", NULL);
+        if (threaded)
+            result = request_threaded_irq(short_irq, short_th_interrupt,
+                    short_irq_thread, 0, "short-th", NULL);
+        else if ((wq + tasklet) > 0)
+            result = request_irq(short_irq,
+                    tasklet ? short_tl_interrupt : short_wq_interrupt,
+                    0, "short-bh", NULL);
+        else
+            result = request_irq(short_irq, short_interrupt, 0,
+                    "short", NULL);
         if (result) {
             printk(KERN_INFO "short: can't get assigned irq %i\n", short_irq);
             short_irq = -1;
         } else { /* actually enable it --assume this *is* a parallel port */
             outb(0x10, short_base + 2);
         }
-        return 0; /* the rest of the function only installs handlers */
-    }
-
-    /*
-	 * Ok, now change the interrupt handler if using top/bottom halves
-	 * has been requested
-	 */
-    if (short_irq >= 0 && (wq + tasklet) > 0) {
-        free_irq(short_irq, NULL);
-        result = request_irq(short_irq, tasklet ? short_tl_interrupt : short_wq_interrupt,
-                0, "short-bh", NULL);
-        if (result) {
-            printk(KERN_INFO "short-bh: can't get assigned irq %i\n", short_irq);
-            short_irq = -1;
-        }
     }
 
     return 0;
@@ -630,6 +974,8 @@ void short_cleanup(void)
     else
         flush_scheduled_work();
 
+    remove_proc_entry("shortstats", NULL);
+    ldd_stats_exit(&short_stats);
     unregister_chrdev(major, "short");
     if (use_mem) {
         iounmap((void __iomem *)short_base);
@@ -639,6 +985,7 @@ void short_cleanup(void)
         release_region(short_base, SHORT_NR_PORTS);
     }
     if(short_buffer) free_page(short_buffer);
+    vfree(short_rings);
 }
 
 module_init(short_init);
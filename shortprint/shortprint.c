@@ -28,12 +28,15 @@
 #include <linux/interrupt.h>
 #include <linux/workqueue.h>
 #include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/circ_buf.h>
 #include <linux/poll.h>
 #include <linux/semaphore.h>
 #include <asm/io.h>
 #include <asm/atomic.h>
 
 #include "shortprint.h"
+#include "../include/ldd_stats.h"
 
 #define SHORTP_NR_PORTS 3
 
@@ -62,9 +65,44 @@ static int delay = 0;
 static int shortp_delay;
 module_param(delay, int, 0);
 
+/*
+ * Burst mode: write up to "burst" bytes per work run, spinning at most
+ * "spin" microseconds for the printer to come ready between them,
+ * instead of one byte per interrupt. With "adaptive", the strobe delay
+ * follows how long the printer takes to come ready, "delay" being the
+ * least it can be.
+ */
+static int burst = 1;
+module_param(burst, int, 0);
+static int spin = 20;
+module_param(spin, int, 0);
+static int adaptive = 0;
+module_param(adaptive, int, 0);
+static unsigned long shortp_ready_ns; /* average time to ready, in ns */
+
+/* Output buffer size, in pages; rounded up to a power of two. */
+static int pages = 1;
+module_param(pages, int, 0);
+
 MODULE_AUTHOR ("Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
+/*
+ * Counts and latencies in debugfs, shortprint/stats (see ldd_stats.h):
+ * how long the printer takes to come ready, and a run of the work
+ * function.
+ */
+enum {
+    SHORTP_WRITES, SHORTP_BYTES, SHORTP_IRQS, SHORTP_TIMEOUTS,
+    SHORTP_SPIN_MISSES, SHORTP_NCOUNTERS
+};
+static const char * const shortp_counters[] = {
+    "writes", "bytes", "interrupts", "timeouts", "spin_misses"
+};
+enum { SHORTP_READY_NS, SHORTP_WORK_NS, SHORTP_NHISTS };
+static const char * const shortp_hists[] = { "ready_ns", "work_ns" };
+static struct ldd_stats shortp_stats;
+
 /*
  * Forwards.
  */
@@ -92,12 +130,15 @@ static inline void shortp_incr_bp(volatile unsigned long *index, int delta)
 
 /*
  * On the write side we have to be more careful, since we don't want to drop
- * data.  The semaphore is used to serialize write-side access to the buffer;
- * there is only one consumer, so read-side access is unregulated.  The
+ * data.  The mutex is used to serialize write-side access to the buffer,
+ * so there is one producer, moving head, and one consumer (the work
+ * function), moving tail; neither needs a lock as long as each publishes
+ * its index with a release and reads the other's with an acquire.  The
  * wait queue will be awakened when space becomes available in the buffer.
  */
-static unsigned char *shortp_out_buffer = NULL;
-static volatile unsigned char *shortp_out_head, *shortp_out_tail;
+static struct circ_buf shortp_out;
+static int shortp_out_size;     /* a power of two, for the CIRC_ macros */
+static int shortp_out_order;
 static struct mutex shortp_out_mutex;
 static DECLARE_WAIT_QUEUE_HEAD(shortp_out_queue);
 
@@ -110,31 +151,21 @@ static DECLARE_WORK(shortp_work, shortp_do_work);
 static struct workqueue_struct *shortp_workqueue;
 
 /*
- * Available space in the output buffer; should be called with the semaphore
+ * Available space in the output buffer; should be called with the mutex
  * held.  Returns contiguous space, so caller need not worry about wraps.
  */
 static inline int shortp_out_space(void)
 {
-    if (shortp_out_head >= shortp_out_tail) {
-        int space = PAGE_SIZE - (shortp_out_head - shortp_out_buffer);
-        return (shortp_out_tail == shortp_out_buffer) ? space - 1 : space;
-    } else {
-        return (shortp_out_tail - shortp_out_head) - 1;
-    }
-}
+    /* Pairs with the release of the tail in shortp_do_write() */
+    int tail = smp_load_acquire(&shortp_out.tail);
 
-static inline void shortp_incr_out_bp(volatile unsigned char **bp, int incr)
-{
-    unsigned char *new = (unsigned char *) *bp + incr;
-    if (new >= (shortp_out_buffer + PAGE_SIZE))
-        new -= PAGE_SIZE;
-    *bp = new;
+    return CIRC_SPACE_TO_END(shortp_out.head, tail, shortp_out_size);
 }
 
 /*
  * The output "process" is controlled by a spin lock; decisions on
- * shortp_output_active or manipulation of shortp_out_tail require
- * that this lock be held.
+ * shortp_output_active require that this lock be held.  Only starting
+ * and stopping output takes it, not the bytes going through.
  */
 static spinlock_t shortp_out_lock;
 volatile static int shortp_output_active;
@@ -215,7 +246,7 @@ static void shortp_wait(void)
 
 /*
  * Write the next character from the buffer.  There should *be* a next
- * character...	 The spinlock should be held when this routine is called.
+ * character...	 Only the work function may call this.
  */
 static void shortp_do_write(void)
 {
@@ -224,9 +255,10 @@ static void shortp_do_write(void)
     /* Something happened; reset the timer */
     mod_timer(&shortp_timer, jiffies + TIMEOUT);
 
-    /* Strobe a byte out to the device */
-    outb_p(*shortp_out_tail, shortp_base + SP_DATA);
-    shortp_incr_out_bp(&shortp_out_tail, 1);
+    /* Strobe a byte out to the device, and only then give up its slot */
+    outb_p(shortp_out.buf[shortp_out.tail], shortp_base + SP_DATA);
+    smp_store_release(&shortp_out.tail,
+            (shortp_out.tail + 1) & (shortp_out_size - 1));
     if (shortp_delay)
         udelay(shortp_delay);
     outb_p(cr | SP_CR_STROBE, shortp_base + SP_CONTROL);
@@ -234,6 +266,42 @@ static void shortp_do_write(void)
     if (shortp_delay)
         udelay(shortp_delay);
     outb_p(cr & ~SP_CR_STROBE, shortp_base + SP_CONTROL);
+    ldd_stats_inc(&shortp_stats, SHORTP_BYTES);
+}
+
+/*
+ * Fold one observed busy-wait into the running average (1/8 weight)
+ * and, if asked to, tune the strobe delay from it: a printer that
+ * takes long to come ready gets longer strobes.
+ */
+static void shortp_adapt(unsigned long ns)
+{
+    ldd_stats_record(&shortp_stats, SHORTP_READY_NS, ns);
+    shortp_ready_ns += ((long)ns - (long)shortp_ready_ns) / 8;
+    if (adaptive)
+        shortp_delay = clamp_t(int, shortp_ready_ns / (16 * NSEC_PER_USEC),
+                delay, SP_MAX_DELAY);
+}
+
+/*
+ * Spin a little for the printer to take the next byte. Returns false
+ * if it doesn't come ready in time: its interrupt will call us back.
+ */
+static int shortp_ready_spin(void)
+{
+    u64 t0 = ktime_get_ns(), ns = 0;
+
+    while ((inb(shortp_base + SP_STATUS) & SP_SR_BUSY) == 0) {
+        ns = ktime_get_ns() - t0;
+        if (ns > spin * NSEC_PER_USEC) {
+            shortp_adapt(ns);
+            ldd_stats_inc(&shortp_stats, SHORTP_SPIN_MISSES);
+            return 0;
+        }
+        cpu_relax();
+    }
+    shortp_adapt(ns);
+    return 1;
 }
 
 /*
@@ -246,8 +314,7 @@ static void shortp_start_output(void)
 
     /* Set up our missed interrupt timer */
     shortp_output_active = 1;
-    shortp_timer.expires = jiffies + TIMEOUT;
-    add_timer(&shortp_timer);
+    mod_timer(&shortp_timer, jiffies + TIMEOUT);
 
     /* And get the process going. */
     queue_work(shortp_workqueue, &shortp_work);
@@ -281,55 +348,89 @@ static ssize_t shortp_write(struct file *filp, const char __user *buf, size_t co
         /* Move data into the buffer. */
         if ((space + written) >  count)
             space = count - written;
-        if (copy_from_user((char *)shortp_out_head, buf, space)) {
+        if (copy_from_user(shortp_out.buf + shortp_out.head, buf, space)) {
             mutex_unlock(&shortp_out_mutex);
             return -EFAULT;
         }
-        shortp_incr_out_bp(&shortp_out_head, space);
+        /* Publish the data along with the new head */
+        smp_store_release(&shortp_out.head,
+                (shortp_out.head + space) & (shortp_out_size - 1));
         buf += space;
         written += space;
 
-        /* If no output is active, make it active */
-        spin_lock_irqsave(&shortp_out_lock, flags);
-        if (!shortp_output_active)
-            shortp_start_output();
-        spin_unlock_irqrestore(&shortp_out_lock, flags);
+        /*
+         * If no output is active, make it active.  The barrier orders
+         * the head against the flag; shortp_out_stop() does the reverse,
+         * so one of us sees what the other did.
+         */
+        smp_mb();
+        if (!shortp_output_active) {
+            spin_lock_irqsave(&shortp_out_lock, flags);
+            if (!shortp_output_active)
+                shortp_start_output();
+            spin_unlock_irqrestore(&shortp_out_lock, flags);
+        }
     }
 
 out:
     *f_pos += written;
     mutex_unlock(&shortp_out_mutex);
+    ldd_stats_inc(&shortp_stats, SHORTP_WRITES);
     return written;
 }
 
+/*
+ * The buffer looks empty: stop output, unless a writer slipped some
+ * data in meanwhile.  Returns nonzero if output is stopped.
+ */
+static int shortp_out_stop(void)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&shortp_out_lock, flags);
+    shortp_output_active = 0;
+    smp_mb(); /* the flag before the head, pairs with shortp_write() */
+    if (READ_ONCE(shortp_out.head) != shortp_out.tail) {
+        shortp_output_active = 1;
+        spin_unlock_irqrestore(&shortp_out_lock, flags);
+        return 0;
+    }
+    del_timer(&shortp_timer);
+    spin_unlock_irqrestore(&shortp_out_lock, flags);
+    wake_up_interruptible(&shortp_empty_queue);
+    return 1;
+}
+
 /*
  * The bottom-half handler.
  */
 static void shortp_do_work(struct work_struct *work)
 {
-    int written;
-    unsigned long flags;
+    u64 start = ldd_stats_now();
+    int written, n = 0;
 
     /* Wait until the devices is ready */
     shortp_wait();
 
-    spin_lock_irqsave(&shortp_out_lock, flags);
-
-    /* Have we written everything? */
-    if (shortp_out_head == shortp_out_tail) { /* empty */
-        shortp_output_active = 0;
-        wake_up_interruptible(&shortp_empty_queue);
-        del_timer(&shortp_timer);
-    } else {
+    /* Write bytes for as long as we're allowed and the printer keeps up */
+    for (;;) {
+        /* Have we written everything? Pairs with the release in shortp_write() */
+        if (smp_load_acquire(&shortp_out.head) == shortp_out.tail) {
+            if (shortp_out_stop())
+                break;
+            continue;
+        }
         /* Nope, write another byte */
         shortp_do_write();
+        if (++n >= burst || !shortp_ready_spin())
+            break;
     }
 
     /* If somebody's waiting, maybe wake them up. */
-    if (((PAGE_SIZE + shortp_out_tail - shortp_out_head) % PAGE_SIZE) > SP_MIN_SPACE) {
+    if (CIRC_SPACE(READ_ONCE(shortp_out.head), shortp_out.tail, shortp_out_size)
+            > SP_MIN_SPACE(shortp_out_size)) {
         wake_up_interruptible(&shortp_out_queue);
     }
-    spin_unlock_irqrestore(&shortp_out_lock, flags);
 
     /* Handle the "read" side operation */
     written = sprintf((char *)shortp_in_head, "%08u.%09u\n",
@@ -337,6 +438,7 @@ static void shortp_do_work(struct work_struct *work)
                 (int)(shortp_tv.tv_nsec));
     shortp_incr_bp(&shortp_in_head, written);
     wake_up_interruptible(&shortp_in_queue); /* awake any reading process */
+    ldd_stats_time(&shortp_stats, SHORTP_WORK_NS, start);
 }
 
 /*
@@ -348,6 +450,7 @@ static irqreturn_t shortp_interrupt(int irq, void *dev_id)
         return IRQ_NONE;
 
     /* Remember the time, and farm off the rest to the workqueue function */
+    ldd_stats_inc(&shortp_stats, SHORTP_IRQS);
     ktime_get_real_ts64(&shortp_tv);
     queue_work(shortp_workqueue, &shortp_work);
     return IRQ_HANDLED;
@@ -370,14 +473,14 @@ static void shortp_timeout(struct timer_list *unused)
 
     /* If the printer is still busy we just reset the timer */
     if ((status & SP_SR_BUSY) == 0 || (status & SP_SR_ACK)) {
-        shortp_timer.expires = jiffies + TIMEOUT;
-        add_timer(&shortp_timer);
+        mod_timer(&shortp_timer, jiffies + TIMEOUT);
         spin_unlock_irqrestore(&shortp_out_lock, flags);
         return;
     }
 
     /* Otherwise we must have dropped an interrupt. */
     spin_unlock_irqrestore(&shortp_out_lock, flags);
+    ldd_stats_inc(&shortp_stats, SHORTP_TIMEOUTS);
     shortp_interrupt(shortp_irq, NULL);
 }
 
@@ -424,9 +527,18 @@ static int shortp_init(void)
     shortp_in_buffer = __get_free_pages(GFP_KERNEL, 0); /* never fails */
     shortp_in_head = shortp_in_tail = shortp_in_buffer;
 
-    /* And the output buffer. */
-    shortp_out_buffer = (unsigned char *)__get_free_pages(GFP_KERNEL, 0); /* never fails */
-    shortp_out_head = shortp_out_tail = shortp_out_buffer;
+    /* And the output buffer, which can fail if it's big. */
+    shortp_out_order = get_order(max(pages, 1) * PAGE_SIZE);
+    shortp_out_size = PAGE_SIZE << shortp_out_order;
+    shortp_out.buf = (char *)__get_free_pages(GFP_KERNEL, shortp_out_order);
+    if (!shortp_out.buf) {
+        printk(KERN_INFO "shortprint: can't get %i output pages\n", 1 << shortp_out_order);
+        free_page(shortp_in_buffer);
+        unregister_chrdev(major, "shortprint");
+        release_region(shortp_base, SHORTP_NR_PORTS);
+        return -ENOMEM;
+    }
+    shortp_out.head = shortp_out.tail = 0;
     mutex_init(&shortp_out_mutex);
 
     /* And the output info */
@@ -436,6 +548,8 @@ static int shortp_init(void)
 
     /* Set up our workqueue. */
     shortp_workqueue = create_singlethread_workqueue("shortprint");
+    ldd_stats_init(&shortp_stats, "shortprint", NULL, shortp_counters,
+            SHORTP_NCOUNTERS, shortp_hists, SHORTP_NHISTS);
 
     /* If no IRQ was explicitly requested, pick a default */
     if (shortp_irq < 0)
@@ -480,11 +594,12 @@ static void shortp_cleanup(void)
         del_timer_sync(&shortp_timer);
     flush_workqueue(shortp_workqueue);
     destroy_workqueue(shortp_workqueue);
+    ldd_stats_exit(&shortp_stats);
 
     if(shortp_in_buffer)
         free_page(shortp_in_buffer);
-    if(shortp_out_buffer)
-        free_page((unsigned long)shortp_out_buffer);
+    if(shortp_out.buf)
+        free_pages((unsigned long)shortp_out.buf, shortp_out_order);
 }
 
 module_init(shortp_init);
@@ -41,6 +41,11 @@
 #define SP_CR_STROBE     0x01
 
 /*
- * Minimum space before waking up a writer.
+ * Longest strobe delay burst mode will adapt to, in microseconds.
  */
-#define SP_MIN_SPACE    PAGE_SIZE/2
\ No newline at end of file
+#define SP_MAX_DELAY    10
+
+/*
+ * Minimum space before waking up a writer, for a buffer of "size" bytes.
+ */
+#define SP_MIN_SPACE(size)  ((size)/2)
\ No newline at end of file
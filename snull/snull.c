@@ -25,6 +25,15 @@
 #include <linux/errno.h>  /* error codes */
 #include <linux/types.h>  /* size_t */
 #include <linux/interrupt.h> /* mark_bh */
+#include <linux/log2.h>
+#include <linux/prefetch.h>
+#include <linux/hrtimer.h>
+#include <linux/ethtool.h>
+#include <linux/jhash.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
+#include <linux/dma-mapping.h>
 
 #include <linux/in.h>
 #include <linux/netdevice.h>   /* struct device, and other headers */
@@ -35,9 +44,14 @@
 
 #include <linux/in6.h>
 #include <asm/checksum.h>
+#include <net/checksum.h>
+#include <net/xdp.h>
+#include <net/xdp_sock_drv.h>
 #include <linux/version.h>
 
 #include "snull.h"
+#include "../include/ldd_layout.h"
+#include "../include/ldd_stats.h"
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -56,153 +70,436 @@ module_param(timeout, int, 0);
 static int use_napi = 1;
 module_param(use_napi, int, 0);
 
+/*
+ * The NAPI weight: how many packets a poll may take before yielding.
+ */
+static int napi_weight = 2;
+module_param(napi_weight, int, 0);
+
+/*
+ * How many TX/RX queue pairs each interface has. Every pair comes with
+ * its own packet pool, receive queue, lock and NAPI context, so CPUs
+ * transmitting through different queues never meet.
+ */
+static int nr_queues = 1;
+module_param(nr_queues, int, 0);
+
+/*
+ * Hand the transmitted skb itself to the twin interface rather than
+ * copying the frame out and back in again.
+ */
+static int zero_copy = 0;
+module_param(zero_copy, int, 0);
+
 /*
  * A structure representing an in-flight packet.
  */
 struct snull_packet {
-	struct snull_packet *next;
-	struct net_device *dev;
+	struct snull_packet *next;	/* Free list link */
+	struct snull_queue *queue;	/* The pool it belongs to */
+	struct sk_buff *skb;		/* zero_copy: the frame, not data[] */
 	int	datalen;
-	u8 data[ETH_DATA_LEN];
-};
+	u8 data[ETH_FRAME_LEN];
+} ____cacheline_aligned;
 
 int pool_size = 8;
 module_param(pool_size, int, 0);
 
+/*
+ * One queue pair of an interface: transmission on TX queue "index"
+ * takes buffers from this pool, reception fills this rx_ring. The
+ * status word and interrupt enable are per queue too, as if each one
+ * had its own interrupt vector.
+ *
+ * The pool is a single array of cache-aligned packets, threaded on a
+ * free list. The receive side is a ring of descriptors filled at the
+ * tail and drained from the head, so packets come out in the order
+ * they went in. It has room for a whole pool, so it can't overflow.
+ */
+struct snull_queue {
+	/* Set up at open, by ethtool or AF_XDP, read for every packet */
+	struct net_device *dev;
+	int index;
+	struct snull_packet *packets;	/* The pool_size packets */
+	struct snull_packet **rx_ring;  /* Incoming packets */
+	unsigned int rx_mask;
+	/* Receive interrupt moderation, see snull_rx_kick() */
+	int rx_usecs, rx_frames;
+	struct xsk_buff_pool *xsk_pool;	/* Bound AF_XDP socket's, if any */
+	/* Transmit side: ndo_start_xmit, and the twin filling its rx_ring */
+	spinlock_t lock ____cacheline_aligned_in_smp;
+	int status;
+	struct snull_packet *ppool;	/* The free ones */
+	int nfree, tx_wanted;		/* Restart TX at tx_wanted free */
+	unsigned int rx_tail;
+	/* Transmitted frames, before the doorbell */
+	struct sk_buff_head tx_queued;
+	unsigned int tx_queued_pkts, tx_queued_bytes;
+	unsigned long rx_kick;		/* Twin queues to tell at the doorbell */
+	unsigned int tx_seq;		/* For the lockup simulation */
+	int tx_lockup;
+	/* Receive side: the interrupt and NAPI poll */
+	struct napi_struct napi ____cacheline_aligned_in_smp;
+	unsigned int rx_head;
+	int rx_int_enabled;
+	/* Transmitted frames, after the doorbell, for snull_tx_clean() */
+	struct sk_buff_head tx_done;
+	unsigned int tx_done_pkts, tx_done_bytes;
+	struct hrtimer coal_timer;
+	unsigned long adapt_stamp;
+	unsigned int adapt_pkts;
+	int xdp_flush;			/* Redirected during this poll */
+	struct xdp_rxq_info xdp_rxq;
+	/* This queue's share, bumped by both sides */
+	struct net_device_stats stats ____cacheline_aligned_in_smp;
+};
+
 /*
  * This structure is private to each device. It is used to pass
  * packets in and out, so there is place for a packet
  */
 
 struct snull_priv {
-	struct net_device_stats stats;
-	int status;
-	struct snull_packet *ppool;
-	struct snull_packet *rx_queue;  /* List of incoming packets */
-	int rx_int_enabled;
-	int tx_packetlen;
-	u8 *tx_packetdata;
-	struct sk_buff *skb;
-	spinlock_t lock;
 	struct net_device *dev;
-	struct napi_struct napi;
+	int rx_usecs, rx_frames;	/* As set by ethtool -C */
+	int adaptive;			/* adaptive-rx: queues pick their own */
+	struct bpf_prog __rcu *xdp_prog;
+	int nqueues;
+	struct net_device_stats stats;	/* Sum of the queues', at get_stats */
+	struct snull_queue queues[];	/* Each on its own cache lines */
 };
 
+#ifdef SNULL_DEBUG
+static const struct ldd_field snull_queue_fields[] = {
+	LDD_FIELD(struct snull_queue, dev,		LDD_RO),
+	LDD_FIELD(struct snull_queue, index,		LDD_RO),
+	LDD_FIELD(struct snull_queue, packets,		LDD_RO),
+	LDD_FIELD(struct snull_queue, rx_ring,		LDD_RO),
+	LDD_FIELD(struct snull_queue, rx_mask,		LDD_RO),
+	LDD_FIELD(struct snull_queue, rx_usecs,		LDD_RO),
+	LDD_FIELD(struct snull_queue, rx_frames,	LDD_RO),
+	LDD_FIELD(struct snull_queue, xsk_pool,		LDD_RO),
+	LDD_FIELD(struct snull_queue, lock,		LDD_LOCK),
+	LDD_FIELD(struct snull_queue, status,		LDD_PROD),
+	LDD_FIELD(struct snull_queue, ppool,		LDD_PROD),
+	LDD_FIELD(struct snull_queue, nfree,		LDD_PROD),
+	LDD_FIELD(struct snull_queue, tx_wanted,	LDD_PROD),
+	LDD_FIELD(struct snull_queue, rx_tail,		LDD_PROD),
+	LDD_FIELD(struct snull_queue, tx_queued,	LDD_PROD),
+	LDD_FIELD(struct snull_queue, tx_queued_pkts,	LDD_PROD),
+	LDD_FIELD(struct snull_queue, tx_queued_bytes,	LDD_PROD),
+	LDD_FIELD(struct snull_queue, rx_kick,		LDD_PROD),
+	LDD_FIELD(struct snull_queue, tx_seq,		LDD_PROD),
+	LDD_FIELD(struct snull_queue, tx_lockup,	LDD_PROD),
+	LDD_FIELD(struct snull_queue, napi,		LDD_CONS),
+	LDD_FIELD(struct snull_queue, rx_head,		LDD_CONS),
+	LDD_FIELD(struct snull_queue, rx_int_enabled,	LDD_CONS),
+	LDD_FIELD(struct snull_queue, tx_done,		LDD_CONS),
+	LDD_FIELD(struct snull_queue, tx_done_pkts,	LDD_CONS),
+	LDD_FIELD(struct snull_queue, tx_done_bytes,	LDD_CONS),
+	LDD_FIELD(struct snull_queue, coal_timer,	LDD_CONS),
+	LDD_FIELD(struct snull_queue, adapt_stamp,	LDD_CONS),
+	LDD_FIELD(struct snull_queue, adapt_pkts,	LDD_CONS),
+	LDD_FIELD(struct snull_queue, xdp_flush,	LDD_CONS),
+	LDD_FIELD(struct snull_queue, xdp_rxq,		LDD_RO),
+	LDD_FIELD(struct snull_queue, stats,		LDD_SHARED),
+};
+
+static const struct ldd_field snull_priv_fields[] = {
+	LDD_FIELD(struct snull_priv, dev,		LDD_RO),
+	LDD_FIELD(struct snull_priv, rx_usecs,		LDD_RO),
+	LDD_FIELD(struct snull_priv, rx_frames,		LDD_RO),
+	LDD_FIELD(struct snull_priv, adaptive,		LDD_RO),
+	LDD_FIELD(struct snull_priv, xdp_prog,		LDD_RO),
+	LDD_FIELD(struct snull_priv, nqueues,		LDD_RO),
+	LDD_FIELD(struct snull_priv, stats,		LDD_SHARED),
+};
+#endif
+
+/*
+ * Counts and latencies for both interfaces, in debugfs as snull/stats
+ * (see ldd_stats.h). Packets and bytes are in the netdev stats already;
+ * these say how the work is batched.
+ */
+enum {
+	SNULL_XMITS, SNULL_XMIT_BUSY, SNULL_INTERRUPTS, SNULL_POLLS,
+	SNULL_POLL_PACKETS, SNULL_NCOUNTERS
+};
+static const char * const snull_counters[] = {
+	"xmits", "xmit_busy", "interrupts", "polls", "poll_packets"
+};
+enum { SNULL_POLL_NS, SNULL_NHISTS };
+static const char * const snull_hists[] = { "poll_ns" };
+static struct ldd_stats snull_ldd_stats;
+
 static void (*snull_interrupt)(int, void *, struct pt_regs *);
+static int snull_hw_tx(char *buf, int len, struct snull_queue *q, u32 hash,
+		struct sk_buff *skb);
+static void snull_tx_ring(struct snull_queue *q);
+static void snull_tx_doorbell(struct snull_queue *q);
+static void snull_tx_clean(struct snull_queue *q, int budget);
 
 /*
- * Set up a device's packet pool.
+ * Thread all of a queue's packets on the free list and empty the
+ * receive ring.
  */
-void snull_setup_pool(struct net_device *dev)
+static void snull_reset_pool(struct snull_queue *q)
 {
-	struct snull_priv *priv = netdev_priv(dev);
 	int i;
-	struct snull_packet *pkt;
 
-	priv->ppool = NULL;
-	for (i = 0; i < pool_size; i++) {
-		pkt = kmalloc (sizeof (struct snull_packet), GFP_KERNEL);
-		if (pkt == NULL) {
-			printk (KERN_NOTICE "Ran out of memory allocating packet pool\n");
-			return;
-		}
-		pkt->dev = dev;
-		pkt->next = priv->ppool;
-		priv->ppool = pkt;
+	q->ppool = NULL;
+	for (i = pool_size - 1; i >= 0; i--) {
+		q->packets[i].queue = q;
+		q->packets[i].next = q->ppool;
+		q->ppool = q->packets + i;
 	}
+	q->nfree = pool_size;
+	q->tx_wanted = 1;
+	q->rx_head = q->rx_tail = 0;
 }
 
-void snull_teardown_pool(struct net_device *dev)
+/*
+ * Set up a queue's packet pool and receive ring.
+ */
+void snull_setup_pool(struct snull_queue *q)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
-    
-	while ((pkt = priv->ppool)) {
-		priv->ppool = pkt->next;
-		kfree (pkt);
-		/* FIXME - in-flight packets ? */
+	unsigned int ring = roundup_pow_of_two(pool_size);
+
+	q->packets = kcalloc(pool_size, sizeof (struct snull_packet), GFP_KERNEL);
+	q->rx_ring = kcalloc(ring, sizeof (struct snull_packet *), GFP_KERNEL);
+	if (!q->packets || !q->rx_ring) {
+		printk (KERN_NOTICE "Ran out of memory allocating packet pool\n");
+		kfree(q->packets);
+		kfree(q->rx_ring);
+		q->packets = NULL;
+		q->rx_ring = NULL;
+		q->ppool = NULL;
+		return;
 	}
+	q->rx_mask = ring - 1;
+	snull_reset_pool(q);
+}
+
+void snull_teardown_pool(struct snull_queue *q)
+{
+	int i;
+
+	/* FIXME - in-flight packets ? */
+	for (i = 0; q->packets && i < pool_size; i++)
+		kfree_skb(q->packets[i].skb);
+	__skb_queue_purge(&q->tx_queued);
+	__skb_queue_purge(&q->tx_done);
+	kfree(q->packets);
+	kfree(q->rx_ring);
+	q->packets = NULL;
+	q->rx_ring = NULL;
+	q->ppool = NULL;
 }    
 
 /*
  * Buffer/pool management.
  */
-struct snull_packet *snull_get_tx_buffer(struct net_device *dev)
+struct snull_packet *snull_get_tx_buffer(struct snull_queue *q)
 {
-	struct snull_priv *priv = netdev_priv(dev);
 	unsigned long flags;
 	struct snull_packet *pkt;
     
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->ppool;
+	spin_lock_irqsave(&q->lock, flags);
+	pkt = q->ppool;
 	if (!pkt) {
+		spin_unlock_irqrestore(&q->lock, flags);
 		printk(KERN_INFO "Out of Pool!\n");
 		return NULL;
 	}
-	priv->ppool = pkt->next;
-	if (priv->ppool == NULL) {
+	q->ppool = pkt->next;
+	q->nfree--;
+	if (q->ppool == NULL) {
 		printk (KERN_INFO "Pool empty\n");
-		netif_stop_queue(dev);
+		q->tx_wanted = 1;
+		netif_tx_stop_queue(netdev_get_tx_queue(q->dev, q->index));
 	}
-	spin_unlock_irqrestore(&priv->lock, flags);
+	spin_unlock_irqrestore(&q->lock, flags);
 	return pkt;
 }
 
+/*
+ * Make sure "n" buffers are free before we start on a packet that
+ * needs that many, or stop the queue until they are.
+ */
+static int snull_tx_reserve(struct snull_queue *q, int n)
+{
+	unsigned long flags;
+	int ret = 1;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (q->nfree < n) {
+		q->tx_wanted = n;
+		netif_tx_stop_queue(netdev_get_tx_queue(q->dev, q->index));
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	return ret;
+}
+
 
 void snull_release_buffer(struct snull_packet *pkt)
 {
 	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(pkt->dev);
+	struct snull_queue *q = pkt->queue;
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
 	
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->ppool;
-	priv->ppool = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	if (netif_queue_stopped(pkt->dev) && pkt->next == NULL)
-		netif_wake_queue(pkt->dev);
+	int wake;
+	
+	spin_lock_irqsave(&q->lock, flags);
+	pkt->next = q->ppool;
+	q->ppool = pkt;
+	wake = ++q->nfree >= q->tx_wanted;
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (netif_tx_queue_stopped(txq) && wake) {
+		netif_tx_wake_queue(txq);
+		/* An AF_XDP socket may be waiting for room too */
+		if (READ_ONCE(q->xsk_pool))
+			napi_schedule(&q->napi);
+	}
 }
 
-void snull_enqueue_buf(struct net_device *dev, struct snull_packet *pkt)
+void snull_enqueue_buf(struct snull_queue *q, struct snull_packet *pkt)
 {
 	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(dev);
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->rx_queue;  /* FIXME - misorders packets */
-	priv->rx_queue = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	spin_lock_irqsave(&q->lock, flags);
+	q->rx_ring[q->rx_tail++ & q->rx_mask] = pkt;
+	spin_unlock_irqrestore(&q->lock, flags);
 }
 
-struct snull_packet *snull_dequeue_buf(struct net_device *dev)
+/*
+ * Take up to "max" packets off the receive ring, oldest first, with
+ * a single trip through the lock. The caller holds no lock.
+ */
+static int snull_dequeue_bulk(struct snull_queue *q,
+		struct snull_packet **pkts, int max)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
 	unsigned long flags;
+	int n = 0;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->rx_queue;
-	if (pkt != NULL)
-		priv->rx_queue = pkt->next;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	return pkt;
+	spin_lock_irqsave(&q->lock, flags);
+	while (n < max && q->rx_head != q->rx_tail)
+		pkts[n++] = q->rx_ring[q->rx_head++ & q->rx_mask];
+	spin_unlock_irqrestore(&q->lock, flags);
+	return n;
+}
+
+struct snull_packet *snull_dequeue_buf(struct snull_queue *q)
+{
+	struct snull_packet *pkt;
+
+	return snull_dequeue_bulk(q, &pkt, 1) ? pkt : NULL;
 }
 
 /*
  * Enable and disable receive interrupts.
  */
-static void snull_rx_ints(struct net_device *dev, int enable)
+static void snull_rx_ints(struct snull_queue *q, int enable)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	priv->rx_int_enabled = enable;
+	q->rx_int_enabled = enable;
+}
+
+/*
+ * Receive interrupt moderation. In NAPI mode the pretend hardware
+ * holds the interrupt back until rx_frames packets are waiting or
+ * rx_usecs have passed since the first of them, whichever comes first,
+ * like ethtool -C describes it. rx_usecs of zero means no moderation.
+ * The regular handler takes a packet per interrupt, so it always gets
+ * one right away.
+ */
+static void snull_rx_raise(struct snull_queue *q)
+{
+	q->status |= SNULL_RX_INTR;
+	snull_interrupt(0, q, NULL);
+}
+
+static void snull_rx_kick(struct snull_queue *q)
+{
+	int usecs = READ_ONCE(q->rx_usecs);
+
+	if (!q->rx_int_enabled)
+		return;
+	if (!use_napi || !usecs ||
+			q->rx_tail - q->rx_head >= READ_ONCE(q->rx_frames)) {
+		hrtimer_try_to_cancel(&q->coal_timer);
+		snull_rx_raise(q);
+	} else if (!hrtimer_active(&q->coal_timer))
+		hrtimer_start(&q->coal_timer, ns_to_ktime(usecs * NSEC_PER_USEC),
+				HRTIMER_MODE_REL_SOFT);
+}
+
+static enum hrtimer_restart snull_coal_timer(struct hrtimer *timer)
+{
+	struct snull_queue *q = container_of(timer, struct snull_queue,
+			coal_timer);
+
+	if (q->rx_int_enabled && q->rx_head != q->rx_tail)
+		snull_rx_raise(q);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Adaptive moderation: every SNULL_ADAPT_MS look at the rate a queue
+ * has been receiving at. Above SNULL_ADAPT_PPS it's a bulk flow, and
+ * batching interrupts up to a full NAPI weight pays; below that the
+ * latency of waiting for company isn't worth it.
+ */
+static void snull_adapt(struct snull_queue *q, int npackets)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	unsigned long elapsed = jiffies - q->adapt_stamp;
+
+	if (!priv->adaptive)
+		return;
+	q->adapt_pkts += npackets;
+	if (elapsed < msecs_to_jiffies(SNULL_ADAPT_MS))
+		return;
+	if ((u64)q->adapt_pkts * HZ / elapsed > SNULL_ADAPT_PPS) {
+		WRITE_ONCE(q->rx_usecs, SNULL_ADAPT_USECS);
+		WRITE_ONCE(q->rx_frames, napi_weight);
+	} else {
+		WRITE_ONCE(q->rx_usecs, 0);
+		WRITE_ONCE(q->rx_frames, 1);
+	}
+	q->adapt_pkts = 0;
+	q->adapt_stamp = jiffies;
 }
 
     
+/*
+ * Register a queue's XDP receive info, with the memory model of the
+ * buffers its frames land in: our own pages, or the bound AF_XDP
+ * socket's.
+ */
+static void snull_rxq_reg(struct snull_queue *q)
+{
+	enum xdp_mem_type type = q->xsk_pool ? MEM_TYPE_XSK_BUFF_POOL :
+			MEM_TYPE_PAGE_ORDER0;
+
+	if (xdp_rxq_info_reg(&q->xdp_rxq, q->dev, q->index, q->napi.napi_id))
+		return;
+	if (xdp_rxq_info_reg_mem_model(&q->xdp_rxq, type, NULL)) {
+		xdp_rxq_info_unreg(&q->xdp_rxq);
+		return;
+	}
+	if (q->xsk_pool)
+		xsk_pool_set_rxq_info(q->xsk_pool, &q->xdp_rxq);
+}
+
 /*
  * Open and close
  */
 
 int snull_open(struct net_device *dev)
 {
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
 	/* request_region(), request_irq(), ....  (like fops->open) */
 
 	/* 
@@ -214,21 +511,37 @@ int snull_open(struct net_device *dev)
 	if (dev == snull_devs[1])
 		dev->dev_addr[ETH_ALEN-1]++; /* \0SNUL1 */
 	if (use_napi) {
-		struct snull_priv *priv = netdev_priv(dev);
-		napi_enable(&priv->napi);
+		for (i = 0; i < priv->nqueues; i++) {
+			struct snull_queue *q = &priv->queues[i];
+
+			snull_rxq_reg(q);
+			napi_enable(&q->napi);
+		}
 	}
-	netif_start_queue(dev);
+	netif_tx_start_all_queues(dev);
 	return 0;
 }
 
 int snull_release(struct net_device *dev)
 {
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
     /* release ports, irq and such -- like fops->close */
 
-	netif_stop_queue(dev); /* can't transmit any more */
+	netif_tx_stop_all_queues(dev); /* can't transmit any more */
+	for (i = 0; i < priv->nqueues; i++) {
+		hrtimer_cancel(&priv->queues[i].coal_timer);
+		/* complete whatever is still in flight, and start BQL over */
+		snull_tx_ring(&priv->queues[i]);
+		snull_tx_clean(&priv->queues[i], 0);
+		netdev_tx_reset_queue(netdev_get_tx_queue(dev, i));
+	}
 	if (use_napi) {
-		struct snull_priv *priv = netdev_priv(dev);
-		napi_disable(&priv->napi);
+		for (i = 0; i < priv->nqueues; i++) {
+			napi_disable(&priv->queues[i].napi);
+			xdp_rxq_info_unreg(&priv->queues[i].xdp_rxq);
+		}
 	}
 	return 0;
 }
@@ -258,12 +571,25 @@ int snull_config(struct net_device *dev, struct ifmap *map)
 }
 
 /*
- * Receive a packet: retrieve, encapsulate and pass over to upper levels
+ * Turn a received packet into an skb for the upper levels, or count
+ * a drop and return NULL. The packet itself is left to the caller.
  */
-void snull_rx(struct net_device *dev, struct snull_packet *pkt)
+static struct sk_buff *snull_build_skb(struct snull_queue *q,
+		struct snull_packet *pkt)
 {
 	struct sk_buff *skb;
-	struct snull_priv *priv = netdev_priv(dev);
+	struct net_device *dev = q->dev;
+
+	if (pkt->skb) {
+		/* Zero copy: the sender's skb just changes hands */
+		skb = pkt->skb;
+		pkt->skb = NULL;
+		if (__dev_forward_skb(dev, skb)) {
+			q->stats.rx_dropped++;
+			return NULL;
+		}
+		goto out;
+	}
 
 	/*
 	 * The packet has been retrieved from the transmission
@@ -273,116 +599,378 @@ void snull_rx(struct net_device *dev, struct snull_packet *pkt)
 	if (!skb) {
 		if (printk_ratelimit())
 			printk(KERN_NOTICE "snull rx: low on mem - packet dropped\n");
-		priv->stats.rx_dropped++;
-		goto out;
+		q->stats.rx_dropped++;
+		return NULL;
 	}
 	skb_reserve(skb, 2); /* align IP on 16B boundary */  
 	memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
 
-	/* Write metadata, and then pass to the receive level */
+	/* Write metadata */
 	skb->dev = dev;
 	skb->protocol = eth_type_trans(skb, dev);
-	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-	priv->stats.rx_packets++;
-	priv->stats.rx_bytes += pkt->datalen;
-	netif_rx(skb);
   out:
-	return;
+	if (skb->ip_summed != CHECKSUM_PARTIAL)
+		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+	skb_record_rx_queue(skb, q->index);
+	q->stats.rx_packets++;
+	q->stats.rx_bytes += pkt->datalen;
+	return skb;
+}
+
+/*
+ * Receive a packet: retrieve, encapsulate and pass over to upper levels
+ */
+void snull_rx(struct snull_queue *q, struct snull_packet *pkt)
+{
+	struct sk_buff *skb = snull_build_skb(q, pkt);
+
+	if (skb)
+		netif_rx(skb);
 }
     
 
+/*
+ * XDP. Our descriptors aren't pages, so with a program attached the
+ * pretend hardware copies each frame into a page of its own, with
+ * XDP_PACKET_HEADROOM in front, and the program runs on that before
+ * any skb exists. XDP_PASS builds the skb around the same page.
+ */
+
+/* No hardware flow hash here: make one up from the addresses */
+static u32 snull_frame_hash(void *data, int len)
+{
+	struct iphdr *ih = data + sizeof(struct ethhdr);
+
+	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr))
+		return 0;
+	return jhash_2words((__force u32)ih->saddr, (__force u32)ih->daddr, 0);
+}
+
+/*
+ * Send a frame out of "dev" from outside the regular xmit path, that
+ * is for XDP_TX and ndo_xdp_xmit: use this CPU's queue, and take its
+ * lock like the stack would.
+ */
+static void snull_xmit_frame(struct net_device *dev, void *data, int len)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int cpu = smp_processor_id();
+	int qi = cpu % priv->nqueues;
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, qi);
+
+	struct snull_queue *q = &priv->queues[qi];
+	unsigned long flags;
+
+	__netif_tx_lock(txq, cpu);
+	/* No skb and no BQL for these: count them and ring right away */
+	if (snull_hw_tx(data, len, q, snull_frame_hash(data, len), NULL) == 0) {
+		spin_lock_irqsave(&q->lock, flags);
+		q->stats.tx_packets++;
+		q->stats.tx_bytes += len;
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+	snull_tx_doorbell(q);
+	__netif_tx_unlock(txq);
+}
+
+static struct sk_buff *snull_xdp_rx(struct snull_queue *q,
+		struct bpf_prog *prog, struct snull_packet *pkt)
+{
+	struct net_device *dev = q->dev;
+	struct sk_buff *skb;
+	struct xdp_buff xdp;
+	struct page *page;
+	void *va;
+	u32 act;
+
+	page = dev_alloc_page();
+	if (!page) {
+		q->stats.rx_dropped++;
+		return NULL;
+	}
+	va = page_address(page);
+	memcpy(va + XDP_PACKET_HEADROOM, pkt->data, pkt->datalen);
+	xdp_init_buff(&xdp, PAGE_SIZE, &q->xdp_rxq);
+	xdp_prepare_buff(&xdp, va, XDP_PACKET_HEADROOM, pkt->datalen, false);
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch (act) {
+	case XDP_PASS:
+		skb = build_skb(va, PAGE_SIZE);
+		if (!skb)
+			break;
+		skb_reserve(skb, xdp.data - xdp.data_hard_start);
+		skb_put(skb, xdp.data_end - xdp.data);
+		skb->protocol = eth_type_trans(skb, dev);
+		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+		skb_record_rx_queue(skb, q->index);
+		q->stats.rx_packets++;
+		q->stats.rx_bytes += skb->len + ETH_HLEN;
+		return skb;
+	case XDP_TX:
+		/* Back out of this interface, which lands on the twin */
+		snull_xmit_frame(dev, xdp.data, xdp.data_end - xdp.data);
+		put_page(page);
+		q->stats.rx_packets++;
+		q->stats.rx_bytes += pkt->datalen;
+		return NULL;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(dev, &xdp, prog))
+			break;
+		q->xdp_flush = 1;
+		q->stats.rx_packets++;
+		q->stats.rx_bytes += pkt->datalen;
+		return NULL;
+	default:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,17,0)
+		bpf_warn_invalid_xdp_action(act);
+#else
+		bpf_warn_invalid_xdp_action(dev, prog, act);
+#endif
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(dev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		break;
+	}
+	put_page(page);
+	q->stats.rx_dropped++;
+	return NULL;
+}
+
+/*
+ * AF_XDP zero-copy receive, with a socket bound to the queue: the
+ * pretend hardware writes the frame straight into a buffer off the
+ * socket's fill ring, and XDP_REDIRECT to the socket hands that same
+ * buffer over. Only XDP_PASS still copies, into an skb.
+ */
+static struct sk_buff *snull_xsk_rx(struct snull_queue *q,
+		struct bpf_prog *prog, struct snull_packet *pkt)
+{
+	struct xsk_buff_pool *pool = q->xsk_pool;
+	struct net_device *dev = q->dev;
+	struct sk_buff *skb;
+	struct xdp_buff *xdp;
+	u32 act, len;
+
+	if (pkt->datalen > xsk_pool_get_rx_frame_size(pool))
+		goto drop;
+	xdp = xsk_buff_alloc(pool);
+	if (!xdp) {
+		/* Fill ring's empty: have the socket kick us once it's not */
+		if (xsk_uses_need_wakeup(pool))
+			xsk_set_rx_need_wakeup(pool);
+		goto drop;
+	}
+	if (xsk_uses_need_wakeup(pool))
+		xsk_clear_rx_need_wakeup(pool);
+	memcpy(xdp->data, pkt->data, pkt->datalen);
+	xdp->data_end = xdp->data + pkt->datalen;
+
+	act = bpf_prog_run_xdp(prog, xdp);
+	len = xdp->data_end - xdp->data;
+	switch (act) {
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(dev, xdp, prog))
+			break;
+		q->xdp_flush = 1;
+		q->stats.rx_packets++;
+		q->stats.rx_bytes += pkt->datalen;
+		return NULL;
+	case XDP_PASS:
+		skb = napi_alloc_skb(&q->napi, len);
+		if (!skb)
+			break;
+		memcpy(skb_put(skb, len), xdp->data, len);
+		xsk_buff_free(xdp);
+		skb->protocol = eth_type_trans(skb, dev);
+		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+		skb_record_rx_queue(skb, q->index);
+		q->stats.rx_packets++;
+		q->stats.rx_bytes += len;
+		return skb;
+	case XDP_TX:
+		snull_xmit_frame(dev, xdp->data, len);
+		xsk_buff_free(xdp);
+		q->stats.rx_packets++;
+		q->stats.rx_bytes += pkt->datalen;
+		return NULL;
+	default:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,17,0)
+		bpf_warn_invalid_xdp_action(act);
+#else
+		bpf_warn_invalid_xdp_action(dev, prog, act);
+#endif
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(dev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		break;
+	}
+	xsk_buff_free(xdp);
+  drop:
+	q->stats.rx_dropped++;
+	return NULL;
+}
+
+/*
+ * AF_XDP zero-copy transmit, from the poll: the pretend hardware copies
+ * each frame out of the socket's memory into one of our buffers, so it
+ * is complete as soon as the doorbell rings. We stop when our pool runs
+ * dry, and snull_release_buffer() schedules us again. Returns true if
+ * the budget ran out first, and there may be more.
+ */
+static bool snull_xsk_xmit(struct snull_queue *q, int budget)
+{
+	struct xsk_buff_pool *pool = q->xsk_pool;
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+	struct xdp_desc desc;
+	unsigned long flags;
+	int sent = 0;
+	void *data;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	/* Only we take buffers, under this lock: nfree can only grow */
+	while (sent < budget && READ_ONCE(q->nfree) &&
+			xsk_tx_peek_desc(pool, &desc)) {
+		sent++;
+		data = xsk_buff_raw_get_data(pool, desc.addr);
+		if (snull_hw_tx(data, desc.len, q, snull_frame_hash(data,
+				desc.len), NULL)) {
+			spin_lock_irqsave(&q->lock, flags);
+			q->stats.tx_dropped++;
+			spin_unlock_irqrestore(&q->lock, flags);
+			continue;
+		}
+		spin_lock_irqsave(&q->lock, flags);
+		q->stats.tx_packets++;
+		q->stats.tx_bytes += desc.len;
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+	if (sent) {
+		snull_tx_doorbell(q);
+		xsk_tx_completed(pool, sent);
+		xsk_tx_release(pool);
+	}
+	__netif_tx_unlock(txq);
+	if (xsk_uses_need_wakeup(pool))
+		xsk_set_tx_need_wakeup(pool);
+	return sent == budget;
+}
+
 /*
  * The poll implementation.
  */
 static int snull_poll(struct napi_struct * napi, int budget)
 {
-	int npackets = 0;
+	int i, n, npackets = 0;
 	struct sk_buff *skb;
-	struct snull_priv *priv = container_of(napi, struct snull_priv, napi);
-	struct net_device *dev = priv->dev;
-	struct snull_packet *pkt;
+	struct snull_queue *q = container_of(napi, struct snull_queue, napi);
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct snull_packet *pkt, *pkts[SNULL_RX_BULK];
+	struct bpf_prog *prog;
+	bool xsk_more = false;
+	u64 start = ldd_stats_now();
+
+	/* TX completions first: their skbs go back in one batch */
+	snull_tx_clean(q, budget);
+	/* Then what a bound AF_XDP socket has to send */
+	if (q->xsk_pool && budget)
+		xsk_more = snull_xsk_xmit(q, budget);
     
-	while (npackets < budget && priv->rx_queue) {
-		pkt = snull_dequeue_buf(dev);
-		skb = dev_alloc_skb(pkt->datalen + 2);
-		if (! skb) {
-			if (printk_ratelimit())
-				printk(KERN_NOTICE "snull: packet dropped\n");
-			priv->stats.rx_dropped++;
+	rcu_read_lock();
+	prog = rcu_dereference(priv->xdp_prog);
+	while (npackets < budget) {
+		n = snull_dequeue_bulk(q, pkts,
+				min(budget - npackets, SNULL_RX_BULK));
+		if (!n)
+			break;
+		for (i = 0; i < n; i++) {
+			pkt = pkts[i];
+			if (i + 1 < n)
+				prefetch(pkts[i + 1]->data);
 			npackets++;
+			if (prog && !pkt->skb && q->xsk_pool)
+				skb = snull_xsk_rx(q, prog, pkt);
+			else if (prog && !pkt->skb)
+				skb = snull_xdp_rx(q, prog, pkt);
+			else
+				skb = snull_build_skb(q, pkt);
+			if (skb)
+				napi_gro_receive(napi, skb);
 			snull_release_buffer(pkt);
-			continue;
 		}
-		skb_reserve(skb, 2); /* align IP on 16B boundary */  
-		memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
-		skb->dev = dev;
-		skb->protocol = eth_type_trans(skb, dev);
-		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-		netif_receive_skb(skb);
-		
-        /* Maintain stats */
-		npackets++;
-		priv->stats.rx_packets++;
-		priv->stats.rx_bytes += pkt->datalen;
-		snull_release_buffer(pkt);
 	}
+	if (q->xdp_flush) {
+		xdp_do_flush();
+		q->xdp_flush = 0;
+	}
+	rcu_read_unlock();
 	/* If we processed all packets, we're done; tell the kernel and reenable ints */
-	if (npackets < budget) {
+	snull_adapt(q, npackets);
+	if (npackets < budget && !xsk_more) {
 		unsigned long flags;
-		spin_lock_irqsave(&priv->lock, flags);
-		if (napi_complete_done(napi, npackets))
-			snull_rx_ints(dev, 1);
-		spin_unlock_irqrestore(&priv->lock, flags);
+		int done;
+
+		spin_lock_irqsave(&q->lock, flags);
+		done = napi_complete_done(napi, npackets);
+		if (done)
+			snull_rx_ints(q, 1);
+		spin_unlock_irqrestore(&q->lock, flags);
+		/* Anything that came in meanwhile saw interrupts off */
+		if (done && q->rx_head != q->rx_tail)
+			snull_rx_kick(q);
 	}
+	ldd_stats_inc(&snull_ldd_stats, SNULL_POLLS);
+	ldd_stats_add(&snull_ldd_stats, SNULL_POLL_PACKETS, npackets);
+	ldd_stats_time(&snull_ldd_stats, SNULL_POLL_NS, start);
 	/* We couldn't process everything. */
-	return npackets;
+	return xsk_more ? budget : npackets;
 }
 
 /*
- * The typical interrupt entry point
+ * The typical interrupt entry point. Each queue interrupts on its own,
+ * so "dev_id" is the queue.
  */
 static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 {
 	int statusword;
-	struct snull_priv *priv;
-	struct snull_packet *pkt = NULL;
+	struct snull_packet *pkt;
 	/*
 	 * As usual, check the "device" pointer to be sure it is
 	 * really interrupting.
-	 * Then assign "struct device *dev"
 	 */
-	struct net_device *dev = (struct net_device *)dev_id;
+	struct snull_queue *q = dev_id;
 	/* ... and check with hw if it's really ours */
 
 	/* paranoid */
-	if (!dev)
+	if (!q)
 		return;
+	ldd_stats_inc(&snull_ldd_stats, SNULL_INTERRUPTS);
 
-	/* Lock the device */
-	priv = netdev_priv(dev);
-	spin_lock(&priv->lock);
+	/* Lock the queue */
+	spin_lock(&q->lock);
 
 	/* retrieve statusword: real netdevices use I/O instructions */
-	statusword = priv->status;
-	priv->status = 0;
-	if (statusword & SNULL_RX_INTR) {
-		/* send it to snull_rx for handling */
-		pkt = priv->rx_queue;
-		if (pkt) {
-			priv->rx_queue = pkt->next;
-			snull_rx(dev, pkt);
-		}
-	}
-	if (statusword & SNULL_TX_INTR) {
-		/* a transmission is over: free the skb */
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		dev_kfree_skb(priv->skb);
-	}
+	statusword = q->status;
+	q->status = 0;
+
+	/* Unlock the queue, and do the work outside of it */
+	spin_unlock(&q->lock);
 
-	/* Unlock the device and we are done */
-	spin_unlock(&priv->lock);
-	if (pkt) snull_release_buffer(pkt); /* Do this outside the lock! */
+	/*
+	 * A doorbell may have queued several packets behind a single
+	 * interrupt: send them all to snull_rx for handling
+	 */
+	while ((statusword & SNULL_RX_INTR) && (pkt = snull_dequeue_buf(q))) {
+		snull_rx(q, pkt);
+		snull_release_buffer(pkt);
+	}
+	/* transmissions are over: free the skbs */
+	if (statusword & SNULL_TX_INTR)
+		snull_tx_clean(q, 0);
 	return;
 }
 
@@ -392,49 +980,43 @@ static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 static void snull_napi_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 {
 	int statusword;
-	struct snull_priv *priv;
 
 	/*
 	 * As usual, check the "device" pointer for shared handlers.
-	 * Then assign "struct device *dev"
 	 */
-	struct net_device *dev = (struct net_device *)dev_id;
+	struct snull_queue *q = dev_id;
 	/* ... and check with hw if it's really ours */
 
 	/* paranoid */
-	if (!dev)
+	if (!q)
 		return;
+	ldd_stats_inc(&snull_ldd_stats, SNULL_INTERRUPTS);
 
-	/* Lock the device */
-	priv = netdev_priv(dev);
-	spin_lock(&priv->lock);
+	/* Lock the queue */
+	spin_lock(&q->lock);
 
 	/* retrieve statusword: real netdevices use I/O instructions */
-	statusword = priv->status;
-	priv->status = 0;
-	if (statusword & SNULL_RX_INTR) {
-		snull_rx_ints(dev, 0);  /* Disable further interrupts */
-		napi_schedule(&priv->napi);
-	}
-	if (statusword & SNULL_TX_INTR) {
-        	/* a transmission is over: free the skb */
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		if (priv->skb) {
-			dev_kfree_skb(priv->skb);
-			priv->skb = NULL;
-		}
-	}
-
-	/* Unlock the device and we are done */
-	spin_unlock(&priv->lock);
+	statusword = q->status;
+	q->status = 0;
+	if (statusword & SNULL_RX_INTR)
+		snull_rx_ints(q, 0);  /* Disable further interrupts */
+	/* Transmissions are over too: the poll frees the skbs */
+	if (statusword & (SNULL_RX_INTR | SNULL_TX_INTR))
+		napi_schedule(&q->napi);
+
+	/* Unlock the queue and we are done */
+	spin_unlock(&q->lock);
 	return;
 }
 
 /*
- * Transmit a packet (low level interface)
+ * Transmit a packet (low level interface). "hash" is what our pretend
+ * hardware computed over the headers: it picks the receive queue on the
+ * other side, the way RSS does. If "skb" is not NULL, buf is its data
+ * and the skb itself travels to the other side.
  */
-static void snull_hw_tx(char *buf, int len, struct net_device *dev)
+static int snull_hw_tx(char *buf, int len, struct snull_queue *q, u32 hash,
+		struct sk_buff *skb)
 {
 	/*
 	 * This function deals with hw details. This interface loops
@@ -443,8 +1025,10 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 	 * while all other procedures are rather device-independent
 	 */
 	struct iphdr *ih;
-	struct net_device *dest;
-	struct snull_priv *priv;
+	__be32 osaddr, odaddr;
+	struct net_device *dev = q->dev, *dest;
+	struct snull_priv *dpriv;
+	struct snull_queue *dq;
 	u32 *saddr, *daddr;
 	struct snull_packet *tx_buffer;
     
@@ -452,7 +1036,33 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
 		printk("snull: Hmm... packet too short (%i octets)\n",
 				len);
-		return;
+		dev_kfree_skb_any(skb);
+		return -EINVAL;
+	}
+	/* Our buffers hold one frame: XDP may hand us more than that */
+	if (!skb && len > ETH_FRAME_LEN) {
+		if (printk_ratelimit())
+			printk(KERN_NOTICE "snull: packet too long (%i octets)\n",
+					len);
+		return -EINVAL;
+	}
+
+	/*
+	 * Copy the frame into a buffer of ours before touching it: the
+	 * rewrite below must not show in memory the sender can still see,
+	 * like an AF_XDP socket's
+	 */
+	tx_buffer = snull_get_tx_buffer(q);
+	if (!tx_buffer) {
+		printk(KERN_ERR "Out of tx buffer, len is %i\n", len);
+		dev_kfree_skb_any(skb);
+		return -ENOBUFS;
+	}
+	tx_buffer->datalen = len;
+	tx_buffer->skb = skb;
+	if (!skb) {
+		memcpy(tx_buffer->data, buf, len);
+		buf = (char *)tx_buffer->data;
 	}
 
 	if (0) { /* enable this conditional to look at the data */
@@ -469,6 +1079,8 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 	ih = (struct iphdr *)(buf+sizeof(struct ethhdr));
 	saddr = &ih->saddr;
 	daddr = &ih->daddr;
+	osaddr = ih->saddr;
+	odaddr = ih->daddr;
 
 	((u8 *)saddr)[2] ^= 1; /* change the third octet (class C) */
 	((u8 *)daddr)[2] ^= 1;
@@ -476,6 +1088,19 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 	ih->check = 0;         /* and rebuild the checksum (ip needs it) */
 	ih->check = ip_fast_csum((unsigned char *)ih,ih->ihl);
 
+	/*
+	 * A zero-copy skb may still be waiting for its TCP/UDP checksum,
+	 * which covers the addresses: fix up the pseudo-header part, or a
+	 * later segmentation would get it wrong.
+	 */
+	if (skb && skb->ip_summed == CHECKSUM_PARTIAL && !skb->csum_not_inet) {
+		__sum16 *check = (__sum16 *)(skb_checksum_start(skb) +
+				skb->csum_offset);
+
+		inet_proto_csum_replace4(check, skb, osaddr, ih->saddr, true);
+		inet_proto_csum_replace4(check, skb, odaddr, ih->daddr, true);
+	}
+
 	if (dev == snull_devs[0])
 		PDEBUGG("%08x:%05i --> %08x:%05i\n",
 				ntohl(ih->saddr),ntohs(((struct tcphdr *)(ih+1))->source),
@@ -486,48 +1111,169 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 				ntohl(ih->saddr),ntohs(((struct tcphdr *)(ih+1))->source));
 
 	/*
-	 * Ok, now the packet is ready for transmission: first simulate a
-	 * receive interrupt on the twin device, then  a
-	 * transmission-done on the transmitting device
+	 * Ok, now the packet is ready for transmission: put it in the
+	 * twin's receive ring. Its receive interrupt, and our own
+	 * transmission-done, wait for the doorbell
 	 */
 	dest = snull_devs[dev == snull_devs[0] ? 1 : 0];
-	priv = netdev_priv(dest);
-	tx_buffer = snull_get_tx_buffer(dev);
-	if (!tx_buffer) {
-		printk(KERN_ERR "Out of tx buffer, len is %i\n", len);
-		return ;
-	}
-	tx_buffer->datalen = len;
-	memcpy(tx_buffer->data, buf, len);
-	snull_enqueue_buf(dest, tx_buffer);
-	if (priv->rx_int_enabled) {
-		priv->status |= SNULL_RX_INTR;
-		snull_interrupt(0, dest, NULL);
-	}
+	dpriv = netdev_priv(dest);
+	dq = &dpriv->queues[reciprocal_scale(hash, dpriv->nqueues)];
+	snull_enqueue_buf(dq, tx_buffer);
+	q->rx_kick |= BIT(dq->index);
 
-	priv = netdev_priv(dev);
-	priv->tx_packetlen = len;
-	priv->tx_packetdata = buf;
-	priv->status |= SNULL_TX_INTR;
-	if (lockup && ((priv->stats.tx_packets + 1) % lockup) == 0) {
+	if (lockup && ++q->tx_seq % lockup == 0)
+		q->tx_lockup = 1; /* this doorbell's interrupt gets lost */
+	return 0;
+}
+
+/*
+ * The TX side works like a ring with a doorbell. snull_hw_tx() puts
+ * frames on their way, snull_tx_queued() charges them to BQL and keeps
+ * the skbs, and only the doorbell, at the end of a burst (no xmit_more)
+ * or when the queue stops, tells the twin's receive queues and raises
+ * our TX interrupt. That interrupt completes everything rung so far in
+ * one go. All of this runs under the TX queue lock.
+ */
+static void snull_tx_queued(struct snull_queue *q, struct sk_buff *skb,
+		unsigned int len, bool more)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+	unsigned long flags;
+	bool ring;
+
+	/* Charge it before the completion can possibly see it */
+	ring = __netdev_tx_sent_queue(txq, len, more);
+	spin_lock_irqsave(&q->lock, flags);
+	if (skb)
+		__skb_queue_tail(&q->tx_queued, skb);
+	q->tx_queued_pkts++;
+	q->tx_queued_bytes += len;
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (ring)
+		snull_tx_doorbell(q);
+}
+
+/* What's been queued is now the hardware's: the next completion is its */
+static void snull_tx_ring(struct snull_queue *q)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	skb_queue_splice_tail_init(&q->tx_queued, &q->tx_done);
+	q->tx_done_pkts += q->tx_queued_pkts;
+	q->tx_done_bytes += q->tx_queued_bytes;
+	q->tx_queued_pkts = q->tx_queued_bytes = 0;
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+static void snull_tx_doorbell(struct snull_queue *q)
+{
+	struct net_device *dest = snull_devs[q->dev == snull_devs[0] ? 1 : 0];
+	struct snull_priv *dpriv = netdev_priv(dest);
+	unsigned long kick = q->rx_kick;
+	int i;
+
+	snull_tx_ring(q);
+	q->rx_kick = 0;
+	for_each_set_bit(i, &kick, dpriv->nqueues)
+		snull_rx_kick(&dpriv->queues[i]);
+
+	if (q->tx_lockup) {
         	/* Simulate a dropped transmit interrupt */
-		netif_stop_queue(dev);
+		q->tx_lockup = 0;
+		q->tx_wanted = pool_size + 1; /* only the timeout restarts it */
+		netif_tx_stop_queue(netdev_get_tx_queue(q->dev, q->index));
 		PDEBUG("Simulate lockup at %ld, txp %ld\n", jiffies,
-				(unsigned long) priv->stats.tx_packets);
+				(unsigned long) q->stats.tx_packets);
+		return;
 	}
-	else
-		snull_interrupt(0, dev, NULL);
+	q->status |= SNULL_TX_INTR;
+	snull_interrupt(0, q, NULL);
 }
 
 /*
- * Transmit a packet (called by the kernel)
+ * TX completion, from the poll or the regular interrupt handler:
+ * account for everything rung so far, let BQL know, and free the skbs
+ * as a batch. napi_consume_skb() wants the NAPI budget, or 0 outside
+ * of NAPI.
  */
-int snull_tx(struct sk_buff *skb, struct net_device *dev)
+static void snull_tx_clean(struct snull_queue *q, int budget)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+	struct sk_buff_head done;
+	unsigned int pkts, bytes;
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	__skb_queue_head_init(&done);
+	spin_lock_irqsave(&q->lock, flags);
+	skb_queue_splice_init(&q->tx_done, &done);
+	pkts = q->tx_done_pkts;
+	bytes = q->tx_done_bytes;
+	q->tx_done_pkts = q->tx_done_bytes = 0;
+	q->stats.tx_packets += pkts;
+	q->stats.tx_bytes += bytes;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	while ((skb = __skb_dequeue(&done)))
+		napi_consume_skb(skb, budget);
+	netdev_tx_completed_queue(txq, pkts, bytes);
+}
+
+/*
+ * Zero-copy transmit: only the headers we rewrite need to be private
+ * to us, the payload goes across as it is. The skb is orphaned so the
+ * sending socket isn't charged for it while it sits in the other
+ * interface's receive ring.
+ */
+static netdev_tx_t snull_tx_zc(struct sk_buff *skb, struct snull_queue *q)
+{
+	/* Ethernet header plus the largest IP header */
+	unsigned int hlen = min_t(unsigned int, skb->len, ETH_HLEN + 60), len;
+	u32 hash = skb_get_hash(skb);
+
+	/* ... and the L4 checksum snull_hw_tx() may have to fix up */
+	if (skb->ip_summed == CHECKSUM_PARTIAL)
+		hlen = max_t(unsigned int, hlen, skb_checksum_start_offset(skb) +
+				skb->csum_offset + sizeof(__sum16));
+
+	if (skb_put_padto(skb, ETH_ZLEN))
+		goto out; /* freed already */
+	if (skb_ensure_writable(skb, hlen)) {
+		dev_kfree_skb_any(skb);
+		goto out;
+	}
+	skb_orphan(skb);
+	netif_trans_update(q->dev);
+
+	/* Nothing left for the TX interrupt to free, just bytes to count */
+	len = skb->len;
+	if (snull_hw_tx(skb->data, len, q, hash, skb) == 0) {
+		snull_tx_queued(q, NULL, len, netdev_xmit_more());
+		return NETDEV_TX_OK;
+	}
+out:
+	if (!netdev_xmit_more())
+		snull_tx_doorbell(q); /* for the ones before */
+	return NETDEV_TX_OK;
+}
+
+/*
+ * Copying transmit of a single frame. "more" is xmit_more: another
+ * frame follows right away, so the doorbell can wait.
+ */
+static netdev_tx_t snull_tx_copy(struct sk_buff *skb, struct snull_queue *q,
+		bool more)
 {
 	int len;
 	char *data, shortpkt[ETH_ZLEN];
-	struct snull_priv *priv = netdev_priv(dev);
-	
+
+	/* Scatter-gather skbs are copied flat: our buffers are, anyways */
+	if (skb_linearize(skb)) {
+		q->stats.tx_dropped++;
+		dev_kfree_skb_any(skb);
+		goto out;
+	}
 	data = skb->data;
 	len = skb->len;
 	if (len < ETH_ZLEN) {
@@ -536,45 +1282,110 @@ int snull_tx(struct sk_buff *skb, struct net_device *dev)
 		len = ETH_ZLEN;
 		data = shortpkt;
 	}
-	netif_trans_update(dev); /* save the timestamp */
-
-	/* Remember the skb, so we can free it at interrupt time */
-	priv->skb = skb;
+	netif_trans_update(q->dev); /* save the timestamp */
 
 	/* actual deliver of data is device-specific, and not shown here */
-	snull_hw_tx(data, len, dev);
+	if (snull_hw_tx(data, len, q, skb_get_hash(skb), NULL) == 0) {
+		/* Remember the skb, so we can free it at completion time */
+		snull_tx_queued(q, skb, len, more);
+		return NETDEV_TX_OK;
+	}
+	q->stats.tx_dropped++;
+	dev_kfree_skb_any(skb);
+out:
+	if (!more)
+		snull_tx_doorbell(q); /* for the ones before */
+	return NETDEV_TX_OK; /* Our simple device can not fail */
+}
 
-	return 0; /* Our simple device can not fail */
+/*
+ * Transmit a packet (called by the kernel). The stack already picked
+ * the queue, through XPS or its own hash.
+ *
+ * We advertise TSO and friends, so skbs up to 64KB come in here. In
+ * zero-copy mode they go across as they are; otherwise we cut them to
+ * frame-sized pieces ourselves, once per super-packet rather than once
+ * per segment at the top of the stack.
+ */
+int snull_tx(struct sk_buff *skb, struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = &priv->queues[skb_get_queue_mapping(skb)];
+	struct sk_buff *segs, *next;
+	bool more;
+
+	ldd_stats_inc(&snull_ldd_stats, SNULL_XMITS);
+	if (zero_copy)
+		return snull_tx_zc(skb, q);
+	if (!skb_is_gso(skb))
+		return snull_tx_copy(skb, q, netdev_xmit_more());
+
+	/* Every segment needs a buffer: don't start what we can't finish */
+	if (!snull_tx_reserve(q, skb_shinfo(skb)->gso_segs)) {
+		snull_tx_doorbell(q); /* or nothing will free them */
+		ldd_stats_inc(&snull_ldd_stats, SNULL_XMIT_BUSY);
+		return NETDEV_TX_BUSY;
+	}
+	more = netdev_xmit_more();
+	segs = skb_gso_segment(skb, dev->features & ~NETIF_F_GSO_MASK);
+	if (IS_ERR_OR_NULL(segs)) {
+		q->stats.tx_dropped++;
+		dev_kfree_skb_any(skb);
+		if (!more)
+			snull_tx_doorbell(q);
+		return NETDEV_TX_OK;
+	}
+	consume_skb(skb);
+	/* one doorbell for all the segments, if not later still */
+	skb_list_walk_safe(segs, skb, next) {
+		skb_mark_not_on_list(skb);
+		snull_tx_copy(skb, q, next || more);
+	}
+	return NETDEV_TX_OK;
 }
 
 /*
  * Deal with a transmit timeout.
  */
+static void snull_reset_queue(struct snull_queue *q)
+{
+    /* Simulate a transmission interrupt to get things moving */
+	snull_tx_ring(q);
+	q->status |= SNULL_TX_INTR;
+	snull_interrupt(0, q, NULL);
+	q->stats.tx_errors++;
+
+	/* Reset packet pool (FIXME - in-flight packets ?) */
+	spin_lock(&q->lock);
+	if (q->packets)
+		snull_reset_pool(q);
+	spin_unlock(&q->lock);
+
+	netif_tx_wake_queue(netdev_get_tx_queue(q->dev, q->index));
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
 void snull_tx_timeout(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
+	PDEBUG("Transmit timeout at %ld\n", jiffies);
+	/* We aren't told which queue is stuck: kick them all */
+	for (i = 0; i < priv->nqueues; i++)
+		snull_reset_queue(&priv->queues[i]);
+}
 #else
 void snull_tx_timeout(struct net_device *dev, unsigned int txqueue)
-#endif 
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	struct netdev_queue *txq = netdev_get_tx_queue(dev, 0);
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, txqueue);
 
-	PDEBUG("Transmit timeout at %ld, latency %ld\n", jiffies,
-			jiffies - txq->trans_start);
-    /* Simulate a transmission interrupt to get things moving */
-	priv->status |= SNULL_TX_INTR;
-	snull_interrupt(0, dev, NULL);
-	priv->stats.tx_errors++;
-
-	/* Reset packet pool */
-	spin_lock(&priv->lock);
-	snull_teardown_pool(dev);
-	snull_setup_pool(dev);
-	spin_unlock(&priv->lock);
-
-	netif_wake_queue(dev);
-	return;
+	PDEBUG("Transmit timeout on queue %u at %ld, latency %ld\n", txqueue,
+			jiffies, jiffies - txq->trans_start);
+	snull_reset_queue(&priv->queues[txqueue]);
 }
+#endif 
 
 /*
  * Ioctl commands 
@@ -586,12 +1397,27 @@ int snull_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 }
 
 /*
- * Return statistics to the caller
+ * Return statistics to the caller: the sum of what every queue counted
  */
 struct net_device_stats *snull_stats(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	return &priv->stats;
+	struct net_device_stats *st = &priv->stats;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < priv->nqueues; i++) {
+		struct net_device_stats *qst = &priv->queues[i].stats;
+
+		st->rx_packets += qst->rx_packets;
+		st->tx_packets += qst->tx_packets;
+		st->rx_bytes += qst->rx_bytes;
+		st->tx_bytes += qst->tx_bytes;
+		st->rx_dropped += qst->rx_dropped;
+		st->tx_errors += qst->tx_errors;
+		st->tx_dropped += qst->tx_dropped;
+	}
+	return st;
 }
 
 /*
@@ -628,22 +1454,195 @@ int snull_header(struct sk_buff *skb, struct net_device *dev,
  */
 int snull_change_mtu(struct net_device *dev, int new_mtu)
 {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(dev);
-	spinlock_t *lock = &priv->lock;
-    
 	/* check ranges */
 	if ((new_mtu < 68) || (new_mtu > 1500))
 		return -EINVAL;
 	/*
-	 * Do anything you need, and the accept the value
+	 * Do anything you need, and the accept the value; the queues
+	 * don't look at it, so there's nothing to lock against.
 	 */
-	spin_lock_irqsave(lock, flags);
-	dev->mtu = new_mtu;
-	spin_unlock_irqrestore(lock, flags);
+	WRITE_ONCE(dev->mtu, new_mtu);
 	return 0; /* success */
 }
 
+/*
+ * Interrupt coalescing, through ethtool -C
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0)
+static int snull_get_coalesce(struct net_device *dev,
+		struct ethtool_coalesce *ec)
+#else
+static int snull_get_coalesce(struct net_device *dev,
+		struct ethtool_coalesce *ec, struct kernel_ethtool_coalesce *kec,
+		struct netlink_ext_ack *extack)
+#endif
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	ec->rx_coalesce_usecs = priv->rx_usecs;
+	ec->rx_max_coalesced_frames = priv->rx_frames;
+	ec->use_adaptive_rx_coalesce = priv->adaptive;
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0)
+static int snull_set_coalesce(struct net_device *dev,
+		struct ethtool_coalesce *ec)
+#else
+static int snull_set_coalesce(struct net_device *dev,
+		struct ethtool_coalesce *ec, struct kernel_ethtool_coalesce *kec,
+		struct netlink_ext_ack *extack)
+#endif
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
+	/* A whole ring is as many frames as could ever be waiting */
+	if (ec->rx_max_coalesced_frames > pool_size ||
+			ec->rx_coalesce_usecs > USEC_PER_SEC)
+		return -EINVAL;
+	priv->rx_usecs = ec->rx_coalesce_usecs;
+	priv->rx_frames = max_t(u32, ec->rx_max_coalesced_frames, 1);
+	priv->adaptive = ec->use_adaptive_rx_coalesce;
+	for (i = 0; i < priv->nqueues; i++) {
+		WRITE_ONCE(priv->queues[i].rx_usecs, priv->rx_usecs);
+		WRITE_ONCE(priv->queues[i].rx_frames, priv->rx_frames);
+		priv->queues[i].adapt_pkts = 0;
+		priv->queues[i].adapt_stamp = jiffies;
+	}
+	return 0;
+}
+
+static const struct ethtool_ops snull_ethtool_ops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,7,0)
+	.supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+		ETHTOOL_COALESCE_RX_MAX_FRAMES | ETHTOOL_COALESCE_USE_ADAPTIVE_RX,
+#endif
+	.get_link		= ethtool_op_get_link,
+	.get_coalesce	= snull_get_coalesce,
+	.set_coalesce	= snull_set_coalesce,
+};
+
+/*
+ * XDP setup, and frames redirected to us by other devices' programs
+ */
+static int snull_xdp_setup(struct net_device *dev, struct bpf_prog *prog,
+		struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct bpf_prog *old;
+
+	if (prog && (!use_napi || zero_copy)) {
+		NL_SET_ERR_MSG_MOD(extack, "XDP needs use_napi=1 and zero_copy=0");
+		return -EOPNOTSUPP;
+	}
+	old = rtnl_dereference(priv->xdp_prog);
+	rcu_assign_pointer(priv->xdp_prog, prog);
+	if (old)
+		bpf_prog_put(old);
+	return 0;
+}
+
+/*
+ * Bind an AF_XDP socket's buffer pool to queue "qid" for zero copy, or
+ * unbind it if "pool" is NULL. The poll is stopped meanwhile, and holds
+ * on to no buffer of the pool between runs, so nothing is in flight.
+ * The core wants the pool DMA-mapped, as for any device that moves the
+ * data itself; ours only ever touches it through the CPU.
+ */
+static int snull_xsk_setup(struct net_device *dev, struct xsk_buff_pool *pool,
+		u16 qid)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	bool running = netif_running(dev);
+	int err;
+
+	if (qid >= priv->nqueues)
+		return -EINVAL;
+	if (pool && (!use_napi || zero_copy))
+		return -EOPNOTSUPP;
+	q = &priv->queues[qid];
+	if (pool && q->xsk_pool)
+		return -EBUSY;
+	if (!pool && !q->xsk_pool)
+		return 0;
+	if (pool) {
+		err = xsk_pool_dma_map(pool, &dev->dev, 0);
+		if (err)
+			return err;
+	}
+	if (running) {
+		napi_disable(&q->napi);
+		xdp_rxq_info_unreg(&q->xdp_rxq);
+	}
+	if (!pool)
+		xsk_pool_dma_unmap(q->xsk_pool, 0);
+	WRITE_ONCE(q->xsk_pool, pool);
+	if (running) {
+		snull_rxq_reg(q);
+		napi_enable(&q->napi);
+		/* Whatever the socket queued already */
+		if (pool) {
+			local_bh_disable();
+			napi_schedule(&q->napi);
+			local_bh_enable();
+		}
+	}
+	return 0;
+}
+
+static int snull_bpf(struct net_device *dev, struct netdev_bpf *bpf)
+{
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return snull_xdp_setup(dev, bpf->prog, bpf->extack);
+	case XDP_SETUP_XSK_POOL:
+		return snull_xsk_setup(dev, bpf->xsk.pool, bpf->xsk.queue_id);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int snull_xdp_xmit(struct net_device *dev, int n,
+		struct xdp_frame **frames, u32 flags)
+{
+	int i;
+
+	if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+		return -EINVAL;
+	if (!netif_running(dev))
+		return -ENETDOWN;
+	for (i = 0; i < n; i++) {
+		snull_xmit_frame(dev, frames[i]->data, frames[i]->len);
+		xdp_return_frame(frames[i]);
+	}
+	return n;
+}
+
+/*
+ * An AF_XDP socket has something to send, or refilled its fill ring:
+ * the poll does both, so this is our interrupt
+ */
+static int snull_xsk_wakeup(struct net_device *dev, u32 qid, u32 flags)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+
+	if (!netif_running(dev))
+		return -ENETDOWN;
+	if (qid >= priv->nqueues)
+		return -EINVAL;
+	q = &priv->queues[qid];
+	if (!READ_ONCE(q->xsk_pool))
+		return -ENXIO;
+	local_bh_disable();
+	if (!napi_if_scheduled_mark_missed(&q->napi))
+		napi_schedule(&q->napi);
+	local_bh_enable();
+	return 0;
+}
+
 static struct header_ops snull_header_ops = {
 	.create = snull_header,
 };
@@ -657,6 +1656,9 @@ static struct net_device_ops snull_netdev_ops = {
 	.ndo_get_stats	= snull_stats,
 	.ndo_change_mtu	= snull_change_mtu,
 	.ndo_tx_timeout	= snull_tx_timeout,
+	.ndo_bpf		= snull_bpf,
+	.ndo_xdp_xmit	= snull_xdp_xmit,
+	.ndo_xsk_wakeup	= snull_xsk_wakeup,
 };
 
 /*
@@ -666,6 +1668,7 @@ static struct net_device_ops snull_netdev_ops = {
 void snull_init(struct net_device *dev)
 {
 	struct snull_priv *priv;
+	int i;
 #if 0
     /*
 	 * Make the usual checks: check_region(), probe irq, ...  -ENODEV
@@ -682,26 +1685,55 @@ void snull_init(struct net_device *dev)
 
 	dev->netdev_ops = &snull_netdev_ops;
 	dev->header_ops = &snull_header_ops;
+	dev->ethtool_ops = &snull_ethtool_ops;
 	dev->watchdog_timeo = timeout;
 
 	/* keep the default flags, just add NOARP */
 	dev->flags           |= IFF_NOARP;
-	dev->features        |= NETIF_F_HW_CSUM;
+	dev->hw_features     |= NETIF_F_HW_CSUM | NETIF_F_SG | NETIF_F_HIGHDMA |
+				NETIF_F_GSO_SOFTWARE;
+	dev->features        |= dev->hw_features;
+	/* No bus to map for: AF_XDP pools get plain physical addresses */
+	dev->dev.coherent_dma_mask = DMA_BIT_MASK(64);
+	dev->dev.dma_mask = &dev->dev.coherent_dma_mask;
+	/* Copy mode segments on its own, a buffer per segment */
+	if (!zero_copy)
+		dev->gso_max_segs = pool_size;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+	/* See snull_xdp_setup() */
+	if (use_napi && !zero_copy)
+		dev->xdp_features = NETDEV_XDP_ACT_BASIC |
+				NETDEV_XDP_ACT_REDIRECT | NETDEV_XDP_ACT_NDO_XMIT |
+				NETDEV_XDP_ACT_XSK_ZEROCOPY;
+#endif
 
 	/*
 	 * Then, initialize the priv field. This encloses the statistics
 	 * and a few private fields.
 	 */
 	priv = netdev_priv(dev);
-	memset(priv, 0, sizeof(struct snull_priv));
-	if (use_napi) {
-		netif_napi_add(dev, &priv->napi, snull_poll, 2);
-	}
-	spin_lock_init(&priv->lock);
+	memset(priv, 0, struct_size(priv, queues, nr_queues));
 	priv->dev = dev;
-
-	snull_rx_ints(dev, 1);		/* enable receive interrupts */
-	snull_setup_pool(dev);
+	priv->nqueues = nr_queues;
+	priv->rx_frames = 1;
+	for (i = 0; i < priv->nqueues; i++) {
+		struct snull_queue *q = &priv->queues[i];
+
+		q->dev = dev;
+		q->index = i;
+		if (use_napi) {
+			netif_napi_add(dev, &q->napi, snull_poll, napi_weight);
+		}
+		spin_lock_init(&q->lock);
+		__skb_queue_head_init(&q->tx_queued);
+		__skb_queue_head_init(&q->tx_done);
+		q->rx_frames = 1;
+		hrtimer_init(&q->coal_timer, CLOCK_MONOTONIC,
+				HRTIMER_MODE_REL_SOFT);
+		q->coal_timer.function = snull_coal_timer;
+		snull_rx_ints(q, 1);		/* enable receive interrupts */
+		snull_setup_pool(q);
+	}
 }
 
 /*
@@ -714,29 +1746,49 @@ struct net_device *snull_devs[2] = {NULL};
  */
 void snull_cleanup(void)
 {
-	int i;
+	struct snull_priv *priv;
+	int i, j;
     
 	for (i = 0; i < 2;  i++) {
 		if (snull_devs[i]) {
 			unregister_netdev(snull_devs[i]);
-			snull_teardown_pool(snull_devs[i]);
+			priv = netdev_priv(snull_devs[i]);
+			for (j = 0; j < priv->nqueues; j++)
+				snull_teardown_pool(&priv->queues[j]);
 			free_netdev(snull_devs[i]);
 		}
 	}
+	ldd_stats_exit(&snull_ldd_stats);
 	return;
 }
 
 int snull_init_module(void)
 {
 	int result, i, ret = -ENOMEM;
+	size_t size;
 
 	snull_interrupt = use_napi ? snull_napi_interrupt : snull_regular_interrupt;
+	if (nr_queues < 1)
+		nr_queues = 1;
+	if (nr_queues > BITS_PER_LONG) /* see snull_tx_doorbell() */
+		nr_queues = BITS_PER_LONG;
+	if (pool_size < 1)
+		pool_size = 1;
+	if (napi_weight < 1)
+		napi_weight = 1;
+	size = struct_size((struct snull_priv *)NULL, queues, nr_queues);
+	ldd_stats_init(&snull_ldd_stats, "snull", NULL, snull_counters,
+			SNULL_NCOUNTERS, snull_hists, SNULL_NHISTS);
+#ifdef SNULL_DEBUG
+	LDD_LAYOUT_SHOW(struct snull_priv, snull_priv_fields);
+	LDD_LAYOUT_SHOW(struct snull_queue, snull_queue_fields);
+#endif
 
-	/* Allocate the devices */
-	snull_devs[0] = alloc_netdev(sizeof(struct snull_priv), "sn%d",
-			NET_NAME_UNKNOWN, snull_init);
-	snull_devs[1] = alloc_netdev(sizeof(struct snull_priv), "sn%d",
-			NET_NAME_UNKNOWN, snull_init);
+	/* Allocate the devices, with a TX and an RX queue per pair */
+	snull_devs[0] = alloc_netdev_mqs(size, "sn%d", NET_NAME_UNKNOWN,
+			snull_init, nr_queues, nr_queues);
+	snull_devs[1] = alloc_netdev_mqs(size, "sn%d", NET_NAME_UNKNOWN,
+			snull_init, nr_queues, nr_queues);
 	if (snull_devs[0] == NULL || snull_devs[1] == NULL)
 		goto out;
 
@@ -39,6 +39,14 @@
 #define SNULL_RX_INTR 0x0001
 #define SNULL_TX_INTR 0x0002
 
+/* How many packets snull_poll() takes off the receive ring at once */
+#define SNULL_RX_BULK 16
+
+/* Adaptive interrupt moderation, see snull_adapt() */
+#define SNULL_ADAPT_MS    100    /* sampling period */
+#define SNULL_ADAPT_PPS   20000  /* packets/s above which we batch */
+#define SNULL_ADAPT_USECS 50     /* rx-usecs while batching */
+
 /* Default timeout period */
 #define SNULL_TIMEOUT 5   /* In jiffies */
 
@@ -22,6 +22,8 @@
 #include <linux/serial_core.h>
 #include <linux/module.h>
 #include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 
 #define DRIVER_AUTHOR "Greg Kroah-Hartman <greg@kroah.com>"
 #define DRIVER_DESC "Tiny serial driver"
@@ -41,7 +43,26 @@ MODULE_LICENSE("GPL");
 #define TINY_SERIAL_NAME	"ttytiny"
 #define MY_NAME		TINY_SERIAL_NAME
 
-static struct timer_list *timer;
+/*
+ * The fake UART has a FIFO of "fifo" bytes each way, and an hrtimer
+ * that stands in for its interrupt.  Every tick the TX FIFO is drained
+ * into the void and "rx" bytes are received.  The tick is "tick_us", or
+ * with that 0, the time the line takes to move a FIFO's worth at the
+ * baud rate set, so throughput follows the termios settings.
+ */
+static int fifo = 256;
+module_param(fifo, int, 0);
+static int tick_us = 0;
+module_param(tick_us, int, 0);
+static int rx = 1;
+module_param(rx, int, 0);
+
+#define TINY_UARTCLK	(16 * 4000000)	/* up to 4 Mbaud */
+
+static struct uart_port tiny_port;
+static struct hrtimer timer;
+static ktime_t tiny_period;
+static char tiny_rx_buf[4096];	/* what the other end "sends" */
 
 static void tiny_stop_tx(struct uart_port *port)
 {
@@ -55,16 +76,17 @@ static void tiny_enable_ms(struct uart_port *port)
 {
 }
 
+/* Fill the TX FIFO, which drained while the timer waited; port lock held */
 static void tiny_tx_chars(struct uart_port *port)
 {
 	struct circ_buf *xmit = &port->state->xmit;
-	int count;
+	int count = port->fifosize;
 
 	if (port->x_char) {
 		pr_debug("wrote %2x", port->x_char);
 		port->icount.tx++;
 		port->x_char = 0;
-		return;
+		count--;
 	}
 
 	if (uart_circ_empty(xmit) || uart_tx_stopped(port)) {
@@ -72,14 +94,11 @@ static void tiny_tx_chars(struct uart_port *port)
 		return;
 	}
 
-	count = port->fifosize >> 1;
-	do {
-		pr_debug("wrote %2x", xmit->buf[xmit->tail]);
-		xmit->tail = (xmit->tail + 1) & (UART_XMIT_SIZE - 1);
-		port->icount.tx++;
-		if (uart_circ_empty(xmit))
-			break;
-	} while(--count > 0);
+	/* A FIFO's worth at a time, as the chip would take it */
+	count = min(count, uart_circ_chars_pending(xmit));
+	xmit->tail = (xmit->tail + count) & (UART_XMIT_SIZE - 1);
+	port->icount.tx += count;
+	pr_debug("wrote %d chars", count);
 
 	if (uart_circ_chars_pending(xmit) < WAKEUP_CHARS)
 		uart_write_wakeup(port);
@@ -88,45 +107,59 @@ static void tiny_tx_chars(struct uart_port *port)
 		tiny_stop_tx(port);
 }
 
+/*
+ * Empty the RX FIFO into the tty layer, all of it at once and with a
+ * single push, where a real driver would take it a character at a time
+ * with uart_insert_char(); port lock held.
+ */
+static void tiny_rx_chars(struct uart_port *port)
+{
+	struct tty_port *tty_port = &port->state->port;
+	int count = min_t(int, rx, port->fifosize), n;
+
+	while (count > 0) {
+		n = tty_insert_flip_string(tty_port, tiny_rx_buf,
+				min_t(int, count, sizeof(tiny_rx_buf)));
+		if (!n) {
+			port->icount.buf_overrun += count;
+			break;
+		}
+		port->icount.rx += n;
+		count -= n;
+	}
+	tty_flip_buffer_push(tty_port);
+}
+
 static void tiny_start_tx(struct uart_port *port)
 {
 }
 
-static void tiny_timer(unsigned long data)
+static enum hrtimer_restart tiny_timer(struct hrtimer *t)
 {
-	struct uart_port *port;
-	struct tty_struct *tty;
-	struct tty_port *tty_port;
+	struct uart_port *port = &tiny_port;
+	unsigned long flags;
 
-	port = (struct uart_port *)data;
-	if (!port)
-		return;
 	if (!port->state)
-		return;
-	tty = port->state->port.tty;
-	if (!tty)
-		return;
-
-	tty_port = tty->port;
-	/*
-	* add one character to the tty port
-	* this dosen't actually push the unless tty->low_latency is set
-	*/
-	tty_insert_flip_char(tty_port, TINY_DATA_CHARACTER, 0);
-
-	tty_flip_buffer_push(tty_port);
+		return HRTIMER_NORESTART;
 
-	/* resubmit the timer again */
-	timer->expires = jiffies + DELAY_TIME;
-	add_timer(timer);
+	spin_lock_irqsave(&port->lock, flags);
+	/* what came in since the last tick */
+	if (rx > 0)
+		tiny_rx_chars(port);
 
 	/* see if we have any data to transmit */
 	tiny_tx_chars(port);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	/* come back when the line has moved another FIFO's worth */
+	hrtimer_forward_now(t, READ_ONCE(tiny_period));
+	return HRTIMER_RESTART;
 }
 
+/* Our FIFO is as good as empty as soon as the buffer is */
 static unsigned int tiny_tx_empty(struct uart_port *port)
 {
-	return 0;
+	return uart_circ_empty(&port->state->xmit) ? TIOCSER_TEMT : 0;
 }
 
 static unsigned int tiny_get_mctrl(struct uart_port *port)
@@ -187,6 +220,14 @@ static void tiny_set_termios(struct uart_port *port,
 	/* set baud rate */
 	baud = uart_get_baud_rate(port, new, old, 0, port->uartclk / 16);
 	quot = uart_get_divisor(port, baud);
+	uart_update_timeout(port, cflag, baud);
+
+	/* and pace the timer by it: ten bits a character */
+	if (tick_us > 0)
+		WRITE_ONCE(tiny_period, us_to_ktime(tick_us));
+	else
+		WRITE_ONCE(tiny_period, ns_to_ktime(div_u64((u64)port->fifosize *
+				10 * NSEC_PER_SEC, baud)));
 }
 
 static int tiny_startup(struct uart_port *port)
@@ -194,21 +235,8 @@ static int tiny_startup(struct uart_port *port)
 	/* this is the first time this port is opened */
 	/* do any hardware initialization needed here */
 
-	/* create our timer and submit it */
-	if (!timer) {
-		timer = kmalloc(sizeof(*timer), GFP_KERNEL);
-		if (!timer)
-			return -ENOMEM;
-	}
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
-	timer->data = (unsigned long)port;
-	timer->function = tiny_timer;
-#else
-	timer_setup(timer, (void *)tiny_timer, (unsigned long)port);
-	timer->function = (void *)tiny_timer;
-#endif
-	timer->expires = jiffies + DELAY_TIME;
-	add_timer(timer);
+	/* start our timer; set_termios will pace it properly */
+	hrtimer_start(&timer, READ_ONCE(tiny_period), HRTIMER_MODE_REL_SOFT);
 	return 0;
 }
 
@@ -218,7 +246,7 @@ static void tiny_shutdown(struct uart_port *port)
 	/* Do any hardware specific stuff here */
 
 	/* shut down our timer */
-	del_timer(timer);
+	hrtimer_cancel(&timer);
 }
 
 static const char *tiny_type(struct uart_port *port)
@@ -265,6 +293,8 @@ static struct uart_ops tiny_ops = {
 
 static struct uart_port tiny_port = {
 	.ops = &tiny_ops,
+	.uartclk = TINY_UARTCLK,
+	.type = PORT_16550A,	/* serial_core won't start up a PORT_UNKNOWN */
 };
 
 static struct uart_driver tiny_reg = {
@@ -282,6 +312,17 @@ static int __init tiny_init(void)
 
 	printk(KERN_INFO "Tiny serial driver loaded\n");
 
+	if (fifo < 1 || fifo > UART_XMIT_SIZE) {
+		printk(KERN_INFO "tiny_serial: bad fifo size %d\n", fifo);
+		return -EINVAL;
+	}
+	tiny_port.fifosize = fifo;
+	tiny_period = tick_us > 0 ? us_to_ktime(tick_us) : ns_to_ktime(DELAY_TIME
+			* (NSEC_PER_SEC / HZ));
+	memset(tiny_rx_buf, TINY_DATA_CHARACTER, sizeof(tiny_rx_buf));
+	hrtimer_init(&timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	timer.function = tiny_timer;
+
 	result = uart_register_driver(&tiny_reg);
 	if (result)
 		return result;
@@ -27,6 +27,10 @@
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+
+#include "../include/ldd_stats.h"
 
 #define DRIVER_VERSION "v2.0"
 #define DRIVER_AUTHOR "Greg Kroah-Hartman <greg@kroah.com>"
@@ -43,11 +47,31 @@ MODULE_LICENSE("GPL");
 #define TINY_TTY_MAJOR		240	/* experimental range */
 #define TINY_TTY_MINORS		4	/* only have 4 devices */
 
+/*
+ * Generator mode, for stress testing line disciplines: with a rate set,
+ * each open port receives "rate" bytes per second, "burst" at a time,
+ * from an hrtimer.  The pattern is "t" for the old character, "seq" for
+ * a counting byte sequence a reader can check for losses, or "lines"
+ * for lines of printable characters, for canonical mode.
+ */
+static unsigned long rate = 0;		/* bytes per second; 0 for the old timer */
+module_param(rate, ulong, 0);
+static unsigned int burst = 4096;
+module_param(burst, uint, 0);
+static char *pattern = "t";
+module_param(pattern, charp, 0);
+
+#define TINY_MAX_BURSTS		8	/* most bursts to catch up per tick */
+#define TINY_LINE_LEN		64
+
 struct tiny_serial {
 	struct tty_struct 	*tty;	/* pointer to the tty for this device */
 	int 		open_count; /* number of times this port has been opened */
 	struct mutex 		mutex;	/* locks this structure */
 	struct timer_list 	timer;
+	struct hrtimer		gen_timer;	/* for generator mode */
+	ktime_t			gen_period;
+	unsigned int		gen_seq;	/* where the pattern is up to */
 
 	/* for tiocmget and tiocmset functions */
 	int 			msr;	/* MSR shadow */
@@ -59,6 +83,21 @@ struct tiny_serial {
 	struct async_icount 	icount;
 };
 
+/*
+ * Counts and latencies for all ports, in debugfs as tiny_tty/stats
+ * (see ldd_stats.h): a write, and a generator burst into the tty layer.
+ */
+enum {
+	TINY_OPENS, TINY_WRITES, TINY_TX_BYTES, TINY_RX_BYTES, TINY_OVERRUNS,
+	TINY_NCOUNTERS
+};
+static const char * const tiny_counters[] = {
+	"opens", "writes", "tx_bytes", "rx_bytes", "rx_overruns"
+};
+enum { TINY_WRITE_NS, TINY_RX_NS, TINY_NHISTS };
+static const char * const tiny_hists[] = { "write_ns", "rx_ns" };
+static struct ldd_stats tiny_stats;
+
 static struct tiny_serial *tiny_table[TINY_TTY_MINORS];
 static struct tty_port tiny_tty_port[TINY_TTY_MINORS];
 
@@ -93,6 +132,90 @@ static void tiny_timer(struct timer_list *t)
 	add_timer(&tiny->timer);
 }
 
+/* Fill "buf" with the next "len" bytes of the pattern */
+static void tiny_gen_fill(struct tiny_serial *tiny, unsigned char *buf, int len)
+{
+	unsigned int seq = tiny->gen_seq;
+	int i;
+
+	switch (pattern[0]) {
+	case 's':	/* seq */
+		for (i = 0; i < len; i++)
+			buf[i] = seq++;
+		break;
+	case 'l':	/* lines */
+		for (i = 0; i < len; i++, seq++)
+			buf[i] = (seq % TINY_LINE_LEN == TINY_LINE_LEN - 1) ?
+				'\n' : ' ' + seq % ('~' - ' ');
+		break;
+	default:
+		memset(buf, TINY_DATA_CHARACTER, len);
+		seq += len;
+	}
+	tiny->gen_seq = seq;
+}
+
+/*
+ * Hand "count" bytes to the tty layer a buffer at a time, filling the
+ * flip buffers in place.  What doesn't fit is counted as overrun.
+ */
+static void tiny_gen_rx(struct tiny_serial *tiny, struct tty_port *port,
+			size_t count)
+{
+	u64 start = ldd_stats_now();
+	unsigned char *chars;
+	int n;
+
+	while (count) {
+		n = tty_prepare_flip_string(port, &chars, count);
+		if (n <= 0) {
+			tiny->icount.buf_overrun += count;
+			ldd_stats_add(&tiny_stats, TINY_OVERRUNS, count);
+			break;
+		}
+		tiny_gen_fill(tiny, chars, n);
+		tiny->icount.rx += n;
+		ldd_stats_add(&tiny_stats, TINY_RX_BYTES, n);
+		count -= n;
+	}
+	tty_flip_buffer_push(port);
+	ldd_stats_time(&tiny_stats, TINY_RX_NS, start);
+}
+
+static enum hrtimer_restart tiny_gen_timer(struct hrtimer *t)
+{
+	struct tiny_serial *tiny = container_of(t, struct tiny_serial, gen_timer);
+	u64 ticks;
+
+	/* Send a burst for every period gone by, up to a point */
+	ticks = hrtimer_forward_now(t, tiny->gen_period);
+	tiny_gen_rx(tiny, tiny->tty->port,
+		    (size_t)burst * min_t(u64, ticks, TINY_MAX_BURSTS));
+	return HRTIMER_RESTART;
+}
+
+static void tiny_start_rx(struct tiny_serial *tiny)
+{
+	if (!rate) {
+		/* create our timer and submit it */
+		timer_setup(&tiny->timer, tiny_timer, 0);
+		tiny->timer.expires = jiffies + DELAY_TIME;
+		add_timer(&tiny->timer);
+		return;
+	}
+	tiny->gen_period = ns_to_ktime(max_t(u64, div64_u64((u64)burst *
+			NSEC_PER_SEC, rate), NSEC_PER_USEC));
+	hrtimer_start(&tiny->gen_timer, tiny->gen_period, HRTIMER_MODE_REL_SOFT);
+}
+
+static void tiny_stop_rx(struct tiny_serial *tiny)
+{
+	if (rate)
+		hrtimer_cancel(&tiny->gen_timer);
+	else
+		del_timer(&tiny->timer);
+}
+
 static int tiny_open(struct tty_struct *tty, struct file *filp)
 {
 	struct tiny_serial *tiny;
@@ -112,6 +235,10 @@ static int tiny_open(struct tty_struct *tty, struct file *filp)
 		
 		mutex_init(&tiny->mutex);
 		tiny->open_count = 0;
+		hrtimer_init(&tiny->gen_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+		tiny->gen_timer.function = tiny_gen_timer;
+		tiny->gen_seq = 0;
+		memset(&tiny->icount, 0, sizeof(tiny->icount));
 
 		tiny_table[index] = tiny;
 	}
@@ -123,14 +250,13 @@ static int tiny_open(struct tty_struct *tty, struct file *filp)
 	tiny->tty = tty;
 
 	++tiny->open_count;
+	ldd_stats_inc(&tiny_stats, TINY_OPENS);
 	if (tiny->open_count == 1) {
 		/* this is the first time this port is opened */
 		/* do any hardware initialization needed here */
 
-		/* create our timer and submit it */
-		timer_setup(&tiny->timer, tiny_timer, 0);
-		tiny->timer.expires = jiffies + DELAY_TIME;
-		add_timer(&tiny->timer);
+		/* start "receiving" data */
+		tiny_start_rx(tiny);
 	}
 
 	mutex_unlock(&tiny->mutex);
@@ -152,7 +278,7 @@ static void do_close(struct tiny_serial *tiny)
 		/* Do any hardware specific stuff here */
 
 		/* shut down our timer */
-		del_timer(&tiny->timer);
+		tiny_stop_rx(tiny);
 	}
 
 exit:
@@ -171,6 +297,7 @@ static int tiny_write(struct tty_struct *tty,
 				const unsigned char *buffer, int count)
 {
 	struct tiny_serial *tiny = tty->driver_data;
+	u64 start = ldd_stats_now();
 	int i;
 	int retval = -EINVAL;
 
@@ -190,6 +317,9 @@ static int tiny_write(struct tty_struct *tty,
 	for (i = 0; i < count; ++i)
 		pr_info("%02x ", buffer[i]);	
 	pr_info("\n");
+	ldd_stats_inc(&tiny_stats, TINY_WRITES);
+	ldd_stats_add(&tiny_stats, TINY_TX_BYTES, count);
+	ldd_stats_time(&tiny_stats, TINY_WRITE_NS, start);
 
 exit:
 	mutex_unlock(&tiny->mutex);
@@ -365,7 +495,8 @@ static int tiny_proc_show(struct seq_file *m, void *v)
 		if (tiny == NULL)
 			continue;
 
-		seq_printf(m, "%d\n", i);
+		seq_printf(m, "%d rx:%u overrun:%u\n", i,
+			   tiny->icount.rx, tiny->icount.buf_overrun);
 	}
 	return 0;
 }
@@ -506,6 +637,11 @@ static int __init tiny_init(void)
 	int retval;
 	int i, j;
 
+	if (burst == 0 || burst > 65536) {
+		pr_err("burst must be from 1 to 65536 bytes\n");
+		return -EINVAL;
+	}
+
 	/* allocate the tty driver */
 	//tiny_tty_driver = alloc_tty_driver(TINY_TTY_MINORS);
 	tiny_tty_driver = tty_alloc_driver(TINY_TTY_MINORS, TTY_DRIVER_REAL_RAW);
@@ -540,6 +676,8 @@ static int __init tiny_init(void)
 
 	for (i = 0; i < TINY_TTY_MINORS; i++)
 		tty_register_device(tiny_tty_driver, i, NULL);
+	ldd_stats_init(&tiny_stats, "tiny_tty", NULL, tiny_counters,
+			TINY_NCOUNTERS, tiny_hists, TINY_NHISTS);
 	
 	pr_info(DRIVER_DESC " " DRIVER_VERSION);
 	return retval;
@@ -564,12 +702,12 @@ static void __exit tiny_exit(void)
 			while (tiny->open_count)
 				do_close(tiny);
 
-			/* shut down our timer and free the memory */
-			del_timer(&tiny->timer);
+			/* the timer went with the last close; free the memory */
 			kfree(tiny);
 			tiny_table[i] = NULL;
 		}
 	}
+	ldd_stats_exit(&tiny_stats);
 }
 
 module_init(tiny_init);
@@ -21,6 +21,18 @@
 #include <linux/kref.h>
 #include <linux/usb.h>
 #include <linux/uaccess.h>
+#include <linux/semaphore.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+
+#include "../include/ldd_stats.h"
 
 /* Define these values to match your devices */
 #define USB_SKEL_VENDOR_ID 0xfff0
@@ -36,6 +48,41 @@ MODULE_DEVICE_TABLE(usb, skel_table);
 /* Get a minor range for your devices from the usb maintainer */
 #define USB_SKEL_MINOR_BASE 192
 
+/*
+ * Writes go out of a pool of urbs and buffers allocated at probe time:
+ * "writes_in_flight" of them, "write_size" bytes each.  A write() larger
+ * than that is a short one.
+ */
+static int writes_in_flight = 8;
+module_param(writes_in_flight, int, 0);
+static int write_size = 4 * PAGE_SIZE;
+module_param(write_size, int, 0);
+
+/*
+ * While the device is open, "reads_in_flight" bulk-in urbs of
+ * "read_size" bytes each are kept on the bus, and read() is served from
+ * the ring they fill.  With 0, each read() is a blocking usb_bulk_msg().
+ */
+static int reads_in_flight = 4;
+module_param(reads_in_flight, int, 0);
+static int read_size = 4 * PAGE_SIZE;
+module_param(read_size, int, 0);
+
+/*
+ * Transfers of "sg_threshold" bytes or more (0 for never) go straight
+ * between the user's pages and the device as one scatter-gather
+ * request, up to "sg_max" bytes at a time: no copy, and no big
+ * contiguous buffer.  Reads only take this path without read-ahead,
+ * which would otherwise get the data first.
+ */
+static int sg_threshold = 64 * 1024;
+module_param(sg_threshold, int, 0);
+static int sg_max = 4 * 1024 * 1024;
+module_param(sg_max, int, 0);
+
+/* A scatter-gather request gets as long as usb_bulk_msg() would */
+#define SKEL_SG_TIMEOUT (10 * HZ)
+
 /* Structure to hold all of our device specific stuff */
 struct usb_skel {
     struct usb_device *udev;             /* the usb device for this device */
@@ -44,15 +91,147 @@ struct usb_skel {
     size_t bulk_in_size;            /* the size of the receive buffer */
     __u8 bulk_in_endpointAddr;      /* the address of the bulk in endpoint */
     __u8 bulk_out_endpointAddr;     /* the address of the bulk out endpoint */
+    struct semaphore limit_sem;     /* counts the idle write urbs */
+    struct usb_anchor idle;         /* write urbs ready for use */
+    struct usb_anchor submitted;    /* write urbs on the bus */
+    spinlock_t err_lock;            /* protects errors */
+    int errors;                     /* the last write error, for the next call */
+    struct usb_anchor rd_parked;    /* read urbs waiting for room in the ring */
+    struct usb_anchor rd_submitted; /* read urbs on the bus */
+    struct kfifo rd_ring;           /* data read ahead */
+    size_t rd_size;                 /* bytes per read urb */
+    spinlock_t rd_lock;             /* ring producer side, rd_active, rd_error */
+    int rd_active;                  /* read urbs on the bus */
+    int rd_error;                   /* a read failed; for the next read() */
+    struct mutex rd_mutex;          /* one reader at a time */
+    struct mutex io_mutex;          /* protects open_count */
+    int open_count;
+    bool disconnected;
+    wait_queue_head_t io_wait;      /* readers and pollers */
     struct kref kref;
 };
 
 #define to_skel_dev(d) container_of(d, struct usb_skel, kref)
 static struct usb_driver skel_driver;
+
+/*
+ * Counts and latencies for all devices, in debugfs as usb-skeleton/stats
+ * (see ldd_stats.h).  A read or write is timed from the call to its
+ * return: for the read-ahead and urb pool paths that's mostly copying,
+ * for scatter-gather the whole transfer.
+ */
+enum {
+    SKEL_READS, SKEL_WRITES, SKEL_RBYTES, SKEL_WBYTES, SKEL_SG,
+    SKEL_URB_ERRORS, SKEL_NCOUNTERS
+};
+static const char * const skel_counters[] = {
+    "reads", "writes", "read_bytes", "write_bytes", "sg_transfers",
+    "urb_errors"
+};
+enum { SKEL_READ_NS, SKEL_WRITE_NS, SKEL_NHISTS };
+static const char * const skel_hists[] = { "read_ns", "write_ns" };
+static struct ldd_stats skel_stats;
+
+static void skel_account(int op, int bytes, int hist, ssize_t done, u64 start)
+{
+    ldd_stats_inc(&skel_stats, op);
+    if (done > 0)
+        ldd_stats_add(&skel_stats, bytes, done);
+    ldd_stats_time(&skel_stats, hist, start);
+}
+
+static void skel_write_bulk_callback(struct urb *urb);
+
+/* Allocate the write pool; everything in it is anchored on dev->idle */
+static int skel_alloc_writes(struct usb_skel *dev)
+{
+    struct urb *urb;
+    char *buf;
+    int i;
+
+    for (i = 0; i < writes_in_flight; i++) {
+        urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!urb)
+            return -ENOMEM;
+        buf = usb_alloc_coherent(dev->udev, write_size, GFP_KERNEL, &urb->transfer_dma);
+        if (!buf) {
+            usb_free_urb(urb);
+            return -ENOMEM;
+        }
+        usb_fill_bulk_urb(urb, dev->udev,
+                    usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+                    buf, write_size, skel_write_bulk_callback, dev);
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+        usb_anchor_urb(urb, &dev->idle);
+        usb_free_urb(urb); /* the anchor holds it now */
+        up(&dev->limit_sem);
+    }
+    return 0;
+}
+
+static void skel_free_writes(struct usb_skel *dev)
+{
+    struct urb *urb;
+
+    usb_kill_anchored_urbs(&dev->submitted);
+    while ((urb = usb_get_from_anchor(&dev->idle))) {
+        usb_free_coherent(urb->dev, write_size, urb->transfer_buffer,
+                urb->transfer_dma);
+        usb_free_urb(urb);
+    }
+}
+
+static void skel_read_bulk_callback(struct urb *urb);
+static void skel_fill_reads(struct usb_skel *dev);
+
+/* The read urbs, all parked to begin with, and the ring behind them */
+static int skel_alloc_reads(struct usb_skel *dev)
+{
+    struct urb *urb;
+    char *buf;
+    int i;
+
+    dev->rd_size = roundup(read_size, dev->bulk_in_size);
+    if (kfifo_alloc(&dev->rd_ring, 2 * reads_in_flight * dev->rd_size, GFP_KERNEL))
+        return -ENOMEM;
+    for (i = 0; i < reads_in_flight; i++) {
+        urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!urb)
+            return -ENOMEM;
+        buf = usb_alloc_coherent(dev->udev, dev->rd_size, GFP_KERNEL, &urb->transfer_dma);
+        if (!buf) {
+            usb_free_urb(urb);
+            return -ENOMEM;
+        }
+        usb_fill_bulk_urb(urb, dev->udev,
+                    usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+                    buf, dev->rd_size, skel_read_bulk_callback, dev);
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+        usb_anchor_urb(urb, &dev->rd_parked);
+        usb_free_urb(urb);
+    }
+    return 0;
+}
+
+static void skel_free_reads(struct usb_skel *dev)
+{
+    struct urb *urb;
+
+    usb_kill_anchored_urbs(&dev->rd_submitted);
+    while ((urb = usb_get_from_anchor(&dev->rd_parked))) {
+        usb_free_coherent(urb->dev, dev->rd_size, urb->transfer_buffer,
+                urb->transfer_dma);
+        usb_free_urb(urb);
+    }
+    kfifo_free(&dev->rd_ring);
+}
+
 static void skel_delete(struct kref *kref)
 {
     struct usb_skel *dev = to_skel_dev(kref);
 
+    skel_free_reads(dev);
+    skel_free_writes(dev);
     usb_put_dev(dev->udev);
     kfree(dev->bulk_in_buffer);
     kfree(dev);
@@ -83,6 +262,17 @@ static int skel_open(struct inode *inode, struct file *file)
     /* increment our usage count for the device */
     kref_get(&dev->kref);
 
+    /* the first opener starts the read-ahead */
+    mutex_lock(&dev->io_mutex);
+    if (dev->open_count++ == 0 && reads_in_flight) {
+        spin_lock_irq(&dev->rd_lock);
+        kfifo_reset(&dev->rd_ring);
+        dev->rd_error = 0;
+        skel_fill_reads(dev);
+        spin_unlock_irq(&dev->rd_lock);
+    }
+    mutex_unlock(&dev->io_mutex);
+
     /* save our object in the file's private structure */
     file->private_data = dev;
 
@@ -98,18 +288,245 @@ static int skel_release(struct inode *inode, struct file *file)
     if (dev == NULL)
         return -ENODEV;
 
+    /* and the last one stops it */
+    mutex_lock(&dev->io_mutex);
+    if (--dev->open_count == 0)
+        usb_kill_anchored_urbs(&dev->rd_submitted);
+    mutex_unlock(&dev->io_mutex);
+
     /* decrement the count on our device */
     kref_put(&dev->kref, skel_delete);
     return 0;
 }
 
-static ssize_t skel_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos)
+/*
+ * Put a read urb on the bus, or back in the parking lot if that fails;
+ * rd_lock held.
+ */
+static void skel_submit_read(struct usb_skel *dev, struct urb *urb)
+{
+    int retval;
+
+    usb_anchor_urb(urb, &dev->rd_submitted);
+    retval = usb_submit_urb(urb, GFP_ATOMIC);
+    if (retval) {
+        usb_unanchor_urb(urb);
+        usb_anchor_urb(urb, &dev->rd_parked);
+        dev->rd_error = retval;
+        return;
+    }
+    dev->rd_active++;
+}
+
+/*
+ * Is there room in the ring for one more urb's worth, on top of what
+ * those on the bus may bring?  rd_lock held.
+ */
+static int skel_read_room(struct usb_skel *dev)
+{
+    return kfifo_avail(&dev->rd_ring) >= (dev->rd_active + 1) * dev->rd_size;
+}
+
+/* Submit parked urbs while there's room for them; rd_lock held */
+static void skel_fill_reads(struct usb_skel *dev)
+{
+    struct urb *urb;
+
+    while (!dev->rd_error && !dev->disconnected && skel_read_room(dev) &&
+            (urb = usb_get_from_anchor(&dev->rd_parked))) {
+        skel_submit_read(dev, urb);
+        usb_free_urb(urb);
+    }
+}
+
+static void skel_read_bulk_callback(struct urb *urb)
+{
+    struct usb_skel *dev = urb->context;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->rd_lock, flags);
+    dev->rd_active--;
+    if (urb->status) {
+        /* sync/async unlink faults aren't errors */
+        if (!(urb->status == -ENOENT ||
+            urb->status == -ECONNRESET ||
+            urb->status == -ESHUTDOWN)) {
+            dev->rd_error = urb->status;
+            ldd_stats_inc(&skel_stats, SKEL_URB_ERRORS);
+        }
+        usb_anchor_urb(urb, &dev->rd_parked);
+    } else {
+        /* skel_read_room() made sure this fits */
+        kfifo_in(&dev->rd_ring, urb->transfer_buffer, urb->actual_length);
+        if (!dev->rd_error && !dev->disconnected && skel_read_room(dev))
+            skel_submit_read(dev, urb);
+        else
+            usb_anchor_urb(urb, &dev->rd_parked);
+    }
+    spin_unlock_irqrestore(&dev->rd_lock, flags);
+    wake_up_interruptible(&dev->io_wait);
+}
+
+/* Serve a read() from the ring, and let more urbs go if that made room */
+static ssize_t skel_read_ahead(struct usb_skel *dev, struct file *file,
+        char __user *buffer, size_t count)
+{
+    unsigned int copied;
+    int retval;
+
+    if (mutex_lock_interruptible(&dev->rd_mutex))
+        return -ERESTARTSYS;
+
+    while (kfifo_is_empty(&dev->rd_ring)) {
+        if (dev->disconnected) {
+            retval = -ENODEV;
+            goto exit;
+        }
+        /* report a failed read once, then start over */
+        spin_lock_irq(&dev->rd_lock);
+        retval = dev->rd_error;
+        dev->rd_error = 0;
+        if (retval)
+            skel_fill_reads(dev);
+        spin_unlock_irq(&dev->rd_lock);
+        if (retval) {
+            retval = (retval == -EPIPE) ? -EPIPE : -EIO;
+            goto exit;
+        }
+
+        if (file->f_flags & O_NONBLOCK) {
+            retval = -EAGAIN;
+            goto exit;
+        }
+        if (wait_event_interruptible(dev->io_wait,
+                    !kfifo_is_empty(&dev->rd_ring) ||
+                    READ_ONCE(dev->rd_error) || dev->disconnected)) {
+            retval = -ERESTARTSYS;
+            goto exit;
+        }
+    }
+
+    /* the only consumer: no lock needed against the completion handler */
+    retval = kfifo_to_user(&dev->rd_ring, buffer, count, &copied);
+    if (!retval)
+        retval = copied;
+
+    spin_lock_irq(&dev->rd_lock);
+    skel_fill_reads(dev);
+    spin_unlock_irq(&dev->rd_lock);
+
+exit:
+    mutex_unlock(&dev->rd_mutex);
+    return retval;
+}
+
+/*
+ * usb_sg_wait() submits the request and sleeps, uninterruptibly and
+ * for as long as the device takes.  It does so in a work item instead,
+ * so that the caller can give up on a signal or a timeout and cancel.
+ */
+struct skel_sg_waiter {
+    struct work_struct work;
+    struct usb_sg_request *io;
+    struct completion done;
+};
+
+static void skel_sg_wait_work(struct work_struct *work)
+{
+    struct skel_sg_waiter *w = container_of(work, struct skel_sg_waiter, work);
+
+    usb_sg_wait(w->io);
+    complete(&w->done);
+}
+
+/* Returns 0, -ETIMEDOUT or -EINTR; in both of the latter, "io" is over */
+static int skel_sg_wait(struct usb_sg_request *io)
+{
+    struct skel_sg_waiter w = { .io = io };
+    long left;
+
+    INIT_WORK_ONSTACK(&w.work, skel_sg_wait_work);
+    init_completion(&w.done);
+    queue_work(system_long_wq, &w.work);
+    left = wait_for_completion_killable_timeout(&w.done, SKEL_SG_TIMEOUT);
+    if (left <= 0) {
+        /* the urbs are unlinked, and usb_sg_wait() returns soon after */
+        usb_sg_cancel(io);
+        wait_for_completion(&w.done);
+    }
+    destroy_work_on_stack(&w.work);
+    if (left == 0)
+        return -ETIMEDOUT;
+    return left < 0 ? -EINTR : 0;
+}
+
+/*
+ * Pin the user's buffer and hand it to the device as it is.  Returns
+ * the bytes moved, which may be short if not all of it could be pinned.
+ */
+static ssize_t skel_sg_transfer(struct usb_skel *dev, unsigned int pipe,
+        char __user *ubuf, size_t count, bool in)
+{
+    unsigned long start = (unsigned long)ubuf;
+    unsigned int offset = offset_in_page(start);
+    struct usb_sg_request io;
+    struct sg_table sgt;
+    struct page **pages;
+    int npages, pinned;
+    ssize_t retval;
+
+    ldd_stats_inc(&skel_stats, SKEL_SG);
+    count = min_t(size_t, count, sg_max);
+    npages = DIV_ROUND_UP(offset + count, PAGE_SIZE);
+    pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+
+    /* the device writes the pages on a read */
+    pinned = pin_user_pages_fast(start, npages, in ? FOLL_WRITE : 0, pages);
+    if (pinned <= 0) {
+        retval = pinned ? pinned : -EFAULT;
+        goto out_free;
+    }
+    if (pinned < npages) {
+        count = pinned * PAGE_SIZE - offset;
+        npages = pinned;
+    }
+
+    retval = sg_alloc_table_from_pages(&sgt, pages, npages, offset, count, GFP_KERNEL);
+    if (retval)
+        goto out_unpin;
+    retval = usb_sg_init(&io, dev->udev, pipe, 0, sgt.sgl, sgt.orig_nents, count,
+            GFP_KERNEL);
+    if (!retval) {
+        int err = skel_sg_wait(&io);
+
+        /* what got through counts, even if something failed after */
+        retval = io.bytes ? io.bytes : err ? err : io.status;
+    }
+    sg_free_table(&sgt);
+
+out_unpin:
+    unpin_user_pages_dirty_lock(pages, npages, in);
+out_free:
+    kvfree(pages);
+    return retval;
+}
+
+static ssize_t skel_do_read(struct file *file, char __user *buffer, size_t count)
 {
     struct usb_skel *dev;
     int retval = 0;
 
     dev = (struct usb_skel *)file->private_data;
 
+    if (reads_in_flight)
+        return skel_read_ahead(dev, file, buffer, count);
+    if (sg_threshold && count >= sg_threshold)
+        return skel_sg_transfer(dev,
+                usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+                buffer, count, true);
+
     /* do a blocking bulk read to get data from the device */
     retval = usb_bulk_msg(dev->udev, usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
                             dev->bulk_in_buffer, min(dev->bulk_in_size, count),
@@ -126,84 +543,169 @@ static ssize_t skel_read(struct file *file, char __user *buffer, size_t count, l
     return retval;
 }
 
+static ssize_t skel_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos)
+{
+    u64 start = ldd_stats_now();
+    ssize_t retval = skel_do_read(file, buffer, count);
+
+    skel_account(SKEL_READS, SKEL_RBYTES, SKEL_READ_NS, retval, start);
+    return retval;
+}
+
 static void skel_write_bulk_callback(struct urb *urb)
 {
     struct usb_skel *dev = urb->context;
+    unsigned long flags;
 
     /* sync/async unlink faults aren't errors */
-    if (urb->status && 
-        !(urb->status == -ENOENT ||
-        urb->status == -ECONNRESET ||
-        urb->status == -ESHUTDOWN)) {
-        dev_dbg(&dev->interface->dev, "%s - nonzero write bulk status received: %d",
-        __FUNCTION__, urb->status);
+    if (urb->status) {
+        if (!(urb->status == -ENOENT ||
+            urb->status == -ECONNRESET ||
+            urb->status == -ESHUTDOWN)) {
+            dev_dbg(&dev->interface->dev, "%s - nonzero write bulk status received: %d",
+            __FUNCTION__, urb->status);
+            ldd_stats_inc(&skel_stats, SKEL_URB_ERRORS);
+        }
+
+        spin_lock_irqsave(&dev->err_lock, flags);
+        dev->errors = urb->status;
+        spin_unlock_irqrestore(&dev->err_lock, flags);
     }
 
-    /* free up our allocated buffer */
-    usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-            urb->transfer_buffer, urb->transfer_dma);
+    /* back to the pool; the core has already taken it off "submitted" */
+    usb_anchor_urb(urb, &dev->idle);
+    up(&dev->limit_sem);
+    wake_up_interruptible(&dev->io_wait);
 }
 
-static ssize_t skel_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos)
+/* Return, and forget, the error of an earlier write, if there was one */
+static int skel_write_error(struct usb_skel *dev)
+{
+    int retval;
+
+    spin_lock_irq(&dev->err_lock);
+    retval = dev->errors;
+    dev->errors = 0;
+    spin_unlock_irq(&dev->err_lock);
+
+    /* no need to report an unlink as an error */
+    if (retval == -ENOENT || retval == -ECONNRESET || retval == -ESHUTDOWN)
+        return 0;
+    return retval ? -EIO : 0;
+}
+
+static ssize_t skel_do_write(struct file *file, const char __user *user_buffer, size_t count)
 {
     struct usb_skel *dev;
     int retval = 0;
-    struct urb *urb = NULL;
-    char *buf = NULL;
+    struct urb *urb;
 
     dev = (struct usb_skel *)file->private_data;
 
     /* verify that we actually have some data to write */
     if (count == 0)
         goto exit;
-    
-    /* create a urb, and a buffer for it, and copy the data to the urb */
-    urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!urb) {
-        retval = -ENOMEM;
-        goto error;
+
+    /*
+     * A big one goes out from the user's pages, once what's queued
+     * ahead of it has gone.
+     */
+    if (sg_threshold && count >= sg_threshold) {
+        if (!usb_wait_anchor_empty_timeout(&dev->submitted, 10000))
+            return -ETIMEDOUT;
+        retval = skel_write_error(dev);
+        if (retval)
+            return retval;
+        return skel_sg_transfer(dev,
+                usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+                (char __user *)user_buffer, count, false);
+    }
+    count = min_t(size_t, count, write_size);
+
+    /* wait for an idle urb, which bounds the memory and the urbs in flight */
+    if (file->f_flags & O_NONBLOCK) {
+        if (down_trylock(&dev->limit_sem))
+            return -EAGAIN;
+    } else if (down_interruptible(&dev->limit_sem)) {
+        return -ERESTARTSYS;
     }
 
-    buf = usb_alloc_coherent(dev->udev, count, GFP_KERNEL, &urb->transfer_dma);
-    if (!buf) {
-        retval = -ENOMEM;
+    /* an earlier write that failed is reported here */
+    retval = skel_write_error(dev);
+    if (retval)
         goto error;
-    }
 
-    if (copy_from_user(buf, user_buffer, count)) {
+    /* the semaphore says there is one */
+    urb = usb_get_from_anchor(&dev->idle);
+    if (copy_from_user(urb->transfer_buffer, user_buffer, count)) {
         retval = -EFAULT;
-        goto error;
+        goto error_urb;
     }
-
-    /* initialize the urb properly */
-    usb_fill_bulk_urb(urb, dev->udev,
-                usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-                buf, count, skel_write_bulk_callback, dev);
-    urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    urb->transfer_buffer_length = count;
 
     /* send the data out the bulk port */
+    usb_anchor_urb(urb, &dev->submitted);
     retval = usb_submit_urb(urb, GFP_KERNEL);
     if (retval) {
         pr_err("%s - failed submitting write urb, error %d", __FUNCTION__, retval);
-		goto error;
+        usb_unanchor_urb(urb);
+        goto error_urb;
     }
 
-    /* release our reference to this urb, the USB core will eventually free it entirely */
+    /* release our reference to this urb, the anchor and the USB core have it */
     usb_free_urb(urb);
 exit:
     return count;
 
-error:
-    usb_free_coherent(dev->udev, count, buf, urb->transfer_dma);
+error_urb:
+    usb_anchor_urb(urb, &dev->idle);
     usb_free_urb(urb);
-    kfree(buf);
+error:
+    up(&dev->limit_sem);
     return retval;
 }
 
+static ssize_t skel_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos)
+{
+    u64 start = ldd_stats_now();
+    ssize_t retval = skel_do_write(file, user_buffer, count);
+
+    skel_account(SKEL_WRITES, SKEL_WBYTES, SKEL_WRITE_NS, retval, start);
+    return retval;
+}
+
+/* Wait for the writes in flight, so close() reports how they went */
+static int skel_flush(struct file *file, fl_owner_t id)
+{
+    struct usb_skel *dev = (struct usb_skel *)file->private_data;
+
+    if (!usb_wait_anchor_empty_timeout(&dev->submitted, 10000))
+        usb_kill_anchored_urbs(&dev->submitted);
+    return skel_write_error(dev);
+}
+
+static __poll_t skel_poll(struct file *file, poll_table *wait)
+{
+    struct usb_skel *dev = (struct usb_skel *)file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &dev->io_wait, wait);
+    if (dev->disconnected)
+        return EPOLLERR | EPOLLHUP;
+    if (reads_in_flight &&
+            (!kfifo_is_empty(&dev->rd_ring) || READ_ONCE(dev->rd_error)))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (!usb_anchor_empty(&dev->idle))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
 static struct file_operations skel_fops = {
     .owner      = THIS_MODULE,
     .read       = skel_read,
     .write      = skel_write,
+    .flush      = skel_flush,
+    .poll       = skel_poll,
     .open       = skel_open,
     .release    = skel_release,
 };
@@ -234,6 +736,16 @@ static int skel_probe(struct usb_interface *interface, const struct usb_device_i
         goto error;
     }
     kref_init(&dev->kref);
+    sema_init(&dev->limit_sem, 0);
+    init_usb_anchor(&dev->idle);
+    init_usb_anchor(&dev->submitted);
+    spin_lock_init(&dev->err_lock);
+    init_usb_anchor(&dev->rd_parked);
+    init_usb_anchor(&dev->rd_submitted);
+    spin_lock_init(&dev->rd_lock);
+    mutex_init(&dev->rd_mutex);
+    mutex_init(&dev->io_mutex);
+    init_waitqueue_head(&dev->io_wait);
 
     dev->udev = usb_get_dev(interface_to_usbdev(interface));
     dev->interface = interface;
@@ -274,6 +786,19 @@ static int skel_probe(struct usb_interface *interface, const struct usb_device_i
         goto error;
     }
 
+    retval = skel_alloc_writes(dev);
+    if (retval) {
+        pr_err("Could not allocate the write urbs");
+        goto error;
+    }
+    if (reads_in_flight) {
+        retval = skel_alloc_reads(dev);
+        if (retval) {
+            pr_err("Could not allocate the read urbs");
+            goto error;
+        }
+    }
+
     /* save our data pointer in this interface device */
     usb_set_intfdata(interface, dev);
     /* we can register the device now, as it is ready */
@@ -306,6 +831,14 @@ static void skel_disconnect(struct usb_interface *interface)
     /* give back our minor */
     usb_deregister_dev(interface, &skel_class);
 
+    /* and stop any transfers still going */
+    spin_lock_irq(&dev->rd_lock);
+    dev->disconnected = true;
+    spin_unlock_irq(&dev->rd_lock);
+    usb_kill_anchored_urbs(&dev->rd_submitted);
+    usb_kill_anchored_urbs(&dev->submitted);
+    wake_up_interruptible(&dev->io_wait);
+
     /* decrement our usage count */
     kref_put(&dev->kref, skel_delete);
 
@@ -323,10 +856,21 @@ static int __init usb_skel_init(void)
 {
     int result;
 
+    if (writes_in_flight < 1 || write_size < 1 || reads_in_flight < 0 ||
+            read_size < 1 || sg_threshold < 0 || sg_max < PAGE_SIZE) {
+        pr_err("bad urb counts or sizes");
+        return -EINVAL;
+    }
+
+    ldd_stats_init(&skel_stats, "usb-skeleton", NULL, skel_counters,
+            SKEL_NCOUNTERS, skel_hists, SKEL_NHISTS);
+
     /* register this dirver with the USB subsystem */
     result = usb_register(&skel_driver);
-    if (result)
+    if (result) {
         pr_err("usb_register failed. Error number %d", result);
+        ldd_stats_exit(&skel_stats);
+    }
 
     return result;
 }
@@ -335,6 +879,7 @@ static void __exit usb_skel_exit(void)
 {
     /* deregister this driver with the USB subsystem */
     usb_deregister(&skel_driver);
+    ldd_stats_exit(&skel_stats);
 }
 
 module_init(usb_skel_init);